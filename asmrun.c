@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "lex.h"
+#include "parse.h"
+#include "instruction.h"
+#include "output/output_bin.h"
+#include "emul/emul.h"
+#include "emul/emul_ff.h"
+#include "emul/emul_cycle.h"
+#include "emul/emul_dump.h"
+#include "emul/emul_stats.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Assemble and run in one go: the program is assembled into RAM and run as
+ * `emulator' would run the binary, with no file in between. With `from_parse'
+ * the decode cache is filled from the parsed instructions up front, so nothing
+ * assembled is decoded again. The final state is printed as `dump', and
+ * checked against the postconditions in `posts' if not NULL
+ */
+static int asmrun(const struct emul_engine *engine, bool stats, bool fast_forward, bool from_parse,
+	enum EMUL_DUMP dump, FILE *posts, struct label *labels, size_t labels_count,
+	struct instruction *insts, size_t insts_count)
+{
+	static uint8_t ram[65536];
+	static const uint8_t sizes[] = ISA_INST_SIZES;
+	struct emul_context ctx;
+	struct emul_cycle_info info;
+	struct instruction inst;
+	size_t bytes_used = 0;
+	uint64_t start = 0;
+	size_t pc = 0;
+	size_t i = 0;
+	int ret = 0;
+
+	if (output_bin_mem(ram, sizeof(ram), &bytes_used, labels, labels_count, insts, insts_count))
+		return 1;
+	debug("Assembled %zd bytes of program into memory\n", bytes_used);
+
+	if (emul_init(&ctx, ram, sizeof(ram), bytes_used))
+		return 1;
+
+	for (i = 0; from_parse && i < insts_count; i++) {
+		inst = insts[i];
+		if (output_resolve(labels, labels_count, &inst) || emul_predecode_parsed(&ctx, pc, &inst)) {
+			emul_free(&ctx);
+			return 1;
+		}
+		pc += sizes[inst.type];
+	}
+
+	start = emul_stats_now();
+	switch (emul_cycle_run(&ctx, engine, fast_forward, &info)) {
+		case EMUL_EXIT_HALT:
+			break;
+		case EMUL_EXIT_BUDGET:
+			fprintf(stderr, "Entered a cycle at pc 0x%x after %llu instructions (period %llu), stop.\n",
+				info.pc, (unsigned long long)info.entry, (unsigned long long)info.period);
+			ret = EMUL_CYCLE_EXIT_CODE;
+			break;
+		case EMUL_EXIT_ERROR:
+		default:
+			ret = 1;
+			break;
+	}
+
+	if (stats)
+		emul_stats_print(stderr, &ctx, emul_stats_now() - start);
+	if (stats && engine->print_stats)
+		engine->print_stats(stderr, &ctx);
+	if (fast_forward)
+		emul_ff_print_report(stderr, &ctx);
+
+	if (!ret) {
+		emul_dump(stdout, &ctx, dump);
+		if (posts && (ret = emul_check_posts(posts, stdout, &ctx)))
+			ret = ret < 0 ? 1 : EMUL_POST_EXIT_CODE;
+	}
+	emul_free(&ctx);
+	return ret;
+}
+
+void print_help(const char *argv0)
+{
+	fprintf(stderr, "Syntax: %s [-q] [-s] [-f] [-p] [-e <engine>] [-d {text|json|binary|none}] [-P <in.asm>] <in.asm>\n", argv0);
+	fprintf(stderr, "Engines (default ref): ");
+	emul_print_engines(stderr);
+}
+
+int main(int argc, char **argv)
+{
+	int error_ret = 1;
+	int ret = 0;
+	int opt = 0;
+	const char *path_in = NULL;
+	bool stats = false;
+	bool fast_forward = false;
+	bool from_parse = false;
+	enum EMUL_DUMP dump = EMUL_DUMP_TEXT;
+	bool dump_set = false;
+	const char *path_posts = NULL;
+	FILE *fposts = NULL;
+	const char *engine_name = "ref";
+	const struct emul_engine *engine = NULL;
+	FILE *fin = NULL;
+	struct token *tokens = NULL;
+	size_t tok_count = 0;
+	struct instruction *insts = NULL;
+	size_t insts_count = 0;
+	struct label *labels = NULL;
+	size_t labels_count = 0;
+	static const struct option long_opts[] = {
+		{ "engine", required_argument, NULL, 'e' },
+		{ "stats",  no_argument,       NULL, 's' },
+		{ "fast-forward", no_argument, NULL, 'f' },
+		{ "from-parse", no_argument,   NULL, 'p' },
+		{ "dump",   required_argument, NULL, 'd' },
+		{ "check-post", required_argument, NULL, 'P' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, "qe:sfpd:P:", long_opts, NULL)) != -1) {
+		switch (opt) {
+			case 'q':
+				error_ret = 0;
+				break;
+			case 'e':
+				engine_name = optarg;
+				break;
+			case 's':
+				stats = true;
+				break;
+			case 'f':
+				fast_forward = true;
+				break;
+			case 'p':
+				from_parse = true;
+				break;
+			case 'd':
+				if (emul_dump_format(optarg, &dump))
+					return 1;
+				dump_set = true;
+				break;
+			case 'P':
+				path_posts = optarg;
+				break;
+			default:
+				print_help(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		print_help(argv[0]);
+		return 1;
+	}
+	path_in = argv[optind];
+
+	if ((engine = emul_get_engine(engine_name)) == NULL) {
+		fprintf(stderr, "Unknown engine `%s'\n", engine_name);
+		print_help(argv[0]);
+		return 1;
+	}
+
+	if ((fin = fopen(path_in, "r")) == NULL) {
+		fprintf(stderr, "Error opening %s: ", path_in);
+		perror("fopen");
+		return error_ret;
+	}
+
+	if ((tokens = lex(path_in, fin, &tok_count)) == NULL)
+		return error_ret;
+	debug("Lexed.\n");
+
+	if ((ret = parse(path_in, fin, &labels, &labels_count, tokens, tok_count, &insts, &insts_count)))
+		return error_ret && ret;
+	debug("Parsed.\n");
+
+	if (path_posts && (fposts = fopen(path_posts, "r")) == NULL) {
+		fprintf(stderr, "Error opening %s: ", path_posts);
+		perror("fopen");
+		return error_ret;
+	}
+	/* the checks take the place of the dump, unless asked for both */
+	if (path_posts && !dump_set)
+		dump = EMUL_DUMP_NONE;
+
+	ret = asmrun(engine, stats, fast_forward, from_parse, dump, fposts, labels, labels_count, insts, insts_count);
+	if (fposts)
+		fclose(fposts);
+
+	parse_free(insts, insts_count, labels, labels_count);
+	lex_free(tokens, tok_count);
+	fclose(fin);
+
+	return error_ret ? ret : 0;
+}
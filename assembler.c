@@ -2,47 +2,58 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <getopt.h>
 
 #include "lex.h"
 #include "parse.h"
 #include "instruction.h"
 #include "output/output_bin.h"
+#include "output/output_map.h"
 
 //#define DEBUG
 #include "debug.h"
 
 void print_help(const char *argv0)
 {
-	fprintf(stderr, "Syntax: %s <in.asm> <out.bin>\n", argv0);
+	fprintf(stderr, "Syntax: %s [-q] [-m <out.map>] <in.asm> <out.bin>\n", argv0);
 }
 
 int main(int argc, char **argv)
 {
 	int error_ret = 1;
 	int ret = 0;
+	int opt = 0;
 	const char *path_in = NULL;
 	const char *path_out = NULL;
+	const char *path_map = NULL;
 	FILE *fin = NULL;
 	FILE *fout = NULL;
-
-	if (argc < 3) {
-		print_help(argv[0]);
-		return 1;
-	}
-
-	if (strcmp(argv[1], "-q") == 0) {
-		if (argc != 4) {
-			print_help(argv[0]);
-			return 0;
+	FILE *fmap = NULL;
+	static const struct option long_opts[] = {
+		{ "map",    required_argument, NULL, 'm' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, "qm:", long_opts, NULL)) != -1) {
+		switch (opt) {
+			case 'q':
+				error_ret = 0;
+				break;
+			case 'm':
+				path_map = optarg;
+				break;
+			default:
+				print_help(argv[0]);
+				return 1;
 		}
-		error_ret = 0;
-		path_in = argv[2];
-		path_out = argv[3];
-	} else {
-		path_in = argv[1];
-		path_out = argv[2];
 	}
 
+	if (optind != argc - 2) {
+		print_help(argv[0]);
+		return error_ret;
+	}
+	path_in = argv[optind];
+	path_out = argv[optind + 1];
 
 	if ((fin = fopen(path_in, "r")) == NULL) {
 		fprintf(stderr, "Error opening %s: ", path_in);
@@ -82,6 +93,19 @@ int main(int argc, char **argv)
 	if ((ret = output_bin(fout, labels, labels_count, insts, insts_count)))
 		return error_ret && ret;
 
+	if (path_map) {
+		if ((fmap = fopen(path_map, "w")) == NULL) {
+			fprintf(stderr, "Error opening %s: ", path_map);
+			perror("fopen");
+			return error_ret;
+		}
+		ret = output_map(fmap, labels, labels_count);
+		fclose(fmap);
+		if (ret)
+			return error_ret && ret;
+		debug("Wrote label map.\n");
+	}
+
 	parse_free(insts, insts_count, labels, labels_count);
 	lex_free(tokens, tok_count);
 	fclose(fin);
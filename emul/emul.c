@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "parse.h"
+#include "instruction.h"
+#include "input/input_bin.h"
+#include "emul/emul.h"
+#include "emul/emul_threaded.h"
+#include "emul/emul_jit.h"
+#include "emul/emul_block.h"
+#include "emul/emul_ff.h"
+#include "emul/emul_spec.h"
+#include "emul/emul_ttd.h"
+
+//#define DEBUG
+#include "debug.h"
+
+bool emul_zf(const struct emul_context *ctx)
+{
+	return ctx->flags.res == 0;
+}
+
+bool emul_cf(const struct emul_context *ctx)
+{
+	return emul_carry(&ctx->flags);
+}
+
+void emul_set_flags(struct emul_context *ctx, bool zf, bool cf)
+{
+	ctx->flags = (struct lazy_flags){ .oper = FLAGS_SET, .res = !zf, .left = cf };
+}
+
+/* Evaluate `cond', materialising only the flags it reads */
+#define ALWAYS 1
+#define NOT(a) (!(a))
+#define EITHER(a, b) ((a) || (b))
+#define ZF emul_zf(ctx)
+#define CF emul_cf(ctx)
+#define SHOULD_JUMP_CASE(name, value, jump, branch, test) \
+		case JB_##name: return test;
+int should_jump(const struct emul_context *ctx, enum JCOND cond) {
+	switch (cond) {
+		ISA_CONDS(SHOULD_JUMP_CASE)
+		default:
+			assert(0);
+	}
+}
+#undef ALWAYS
+#undef NOT
+#undef EITHER
+#undef ZF
+#undef CF
+
+static pthread_once_t decode_once = PTHREAD_ONCE_INIT;
+
+/**
+ * decode_lut_init() for programs running guests on several threads: threads
+ * calling it at the same time wait for the first of them to fill the table
+ */
+void emul_decode_init(void)
+{
+	pthread_once(&decode_once, decode_lut_init);
+}
+
+/* Run ALU operation `oper', recording it for the flags */
+static void alu(struct emul_context *ctx, uint8_t oper, uint8_t dest, uint16_t l, uint16_t r)
+{
+	uint16_t res = emul_alu(oper, l, r);
+
+	ctx->flags = (struct lazy_flags){ .left = l, .right = r, .res = res, .oper = oper };
+
+	if (dest != REG_0 && dest != REG_H) {
+		ctx->registers[dest] = res;
+	}
+}
+
+int execute_r(struct emul_context *ctx, const struct predecoded *p)
+{
+	alu(ctx, p->oper, p->dest, ctx->registers[p->left], ctx->registers[p->right]);
+	return 0;
+}
+
+int execute_i(struct emul_context *ctx, const struct predecoded *p)
+{
+	alu(ctx, p->oper, p->dest, ctx->registers[p->left], p->imm);
+	return 0;
+}
+
+int execute_jr(struct emul_context *ctx, const struct predecoded *p)
+{
+	if (should_jump(ctx, p->oper)) {
+		ctx->pc = ctx->registers[p->left];
+		ctx->counters.taken++;
+	}
+	emul_cover(ctx);
+	return 0;
+}
+
+int execute_ji(struct emul_context *ctx, const struct predecoded *p)
+{
+	if (should_jump(ctx, p->oper)) {
+		ctx->pc = p->imm;
+		ctx->counters.taken++;
+	}
+	emul_cover(ctx);
+	return 0;
+}
+
+int execute_b(struct emul_context *ctx, const struct predecoded *p)
+{
+	if (should_jump(ctx, p->oper)) {
+		ctx->pc = p->imm;
+		ctx->counters.taken++;
+	}
+	emul_cover(ctx);
+
+	return 0;
+}
+
+/**
+ * Fill the predecode slot `p' for the instruction at `pc', unpacked into `d',
+ * with `extra' the word after it. Returns non-zero if it is undecodable
+ */
+static int predecode_fill(struct predecoded *p, uint16_t pc, const struct decoded_word *d, uint16_t extra)
+{
+	switch(d->type) {
+		case INST_TYPE_R:
+			p->handler = execute_r;
+			break;
+		case INST_TYPE_NI:
+			p->handler = execute_i;
+			p->imm = d->imm;
+			break;
+		case INST_TYPE_WI:
+			p->handler = execute_i;
+			p->imm = extra;
+			break;
+		case INST_TYPE_JR:
+			p->handler = execute_jr;
+			break;
+		case INST_TYPE_JI:
+			p->handler = execute_ji;
+			p->imm = extra;
+			break;
+		case INST_TYPE_B:
+			p->handler = execute_b;
+			/* resolve the offset to a target */
+			p->imm = pc + d->imm;
+			break;
+		default:
+			return 1;
+	}
+
+	p->oper = d->oper;
+	p->dest = d->dest;
+	p->left = d->left;
+	p->right = d->right;
+	p->type = d->type;
+	p->size = d->size;
+	return 0;
+}
+
+/**
+ * Decode the instruction at `pc' into the predecode slot `p'
+ * Returns zero on success, non-zero on failure
+ */
+int emul_predecode(struct emul_context *ctx, uint16_t pc, struct predecoded *p)
+{
+	const struct decoded_word *d = decode_word(RAM_AT(ctx, pc) << 8 | RAM_AT(ctx, pc + 1));
+
+	if (predecode_fill(p, pc, d, RAM_AT(ctx, pc + 2) << 8 | RAM_AT(ctx, pc + 3))) {
+		fprintf(stderr, "Unhandled instruction '0x%x' at 0x%x (%d), stop.\n",
+			RAM_AT(ctx, pc), pc, pc);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Fill the predecode slot for `pc' straight from `inst', the instruction
+ * assembled there, with its labels resolved, rather than decoding it from RAM
+ * when first run. Returns non-zero on failure
+ */
+int emul_predecode_parsed(struct emul_context *ctx, uint16_t pc, const struct instruction *inst)
+{
+	struct decoded_word d;
+	struct predecoded *p = &ctx->cache[pc];
+	uint16_t extra = 0;
+
+	decode_parsed(&d, inst, pc);
+	if (inst->type == INST_TYPE_WI)
+		extra = inst->inst.i.imm.value;
+	else if (inst->type == INST_TYPE_JI)
+		extra = inst->inst.ji.imm.value;
+
+	memset(p, 0, sizeof(*p));
+	return predecode_fill(p, pc, &d, extra);
+}
+
+/**
+ * Write `len' bytes into emulated RAM at `offs', dropping any predecoded
+ * instructions which overlap the bytes written
+ */
+void emul_ram_write(struct emul_context *ctx, uint16_t offs, const uint8_t *buf, size_t len)
+{
+	size_t i = 0;
+	uint16_t slot = 0;
+
+	for (i = 0; i < len; i++) {
+		RAM_AT(ctx, offs + i) = buf[i];
+	}
+	ctx->ram_writes++;
+
+	emul_jit_flush(ctx);
+	emul_block_flush(ctx);
+
+	if (!ctx->cache)
+		return;
+
+	/* slots up to PREDECODE_MAX_SPAN - 1 bytes before the first byte written
+	 * may cover it */
+	for (i = 0; i < len + PREDECODE_MAX_SPAN - 1; i++) {
+		slot = offs + i - (PREDECODE_MAX_SPAN - 1);
+		memset(&ctx->cache[slot], 0, sizeof(ctx->cache[slot]));
+	}
+}
+
+int execute_single(struct emul_context *ctx)
+{
+	int ret = 0;
+	struct predecoded *p = &ctx->cache[ctx->pc];
+
+	if (!p->size && (ret = emul_predecode(ctx, ctx->pc, p)))
+		return ret;
+
+	ctx->pc += p->size;
+	ctx->counters.mix[p->type][p->oper]++;
+	return p->handler(ctx, p);
+}
+
+/**
+ * Reference engine: fetch and execute one instruction at a time
+ */
+enum EMUL_EXIT emul_run(struct emul_context *ctx, uint64_t budget)
+{
+	while (ctx->pc < ctx->ram_size && ctx->pc < ctx->bytes_used) {
+		if (!budget--)
+			return EMUL_EXIT_BUDGET;
+
+		if (execute_single(ctx))
+			return EMUL_EXIT_ERROR;
+
+		ctx->icount++;
+		debug("pc:%d\n", ctx->pc);
+	}
+
+	return EMUL_EXIT_HALT;
+}
+
+static const struct emul_engine engines[] = {
+	{ .name = "ref",      .run = emul_run          },
+	{ .name = "block",    .run = emul_run_block,   .print_stats = emul_block_print_stats },
+	{ .name = "spec",     .run = emul_run_spec     },
+#ifdef __GNUC__
+	{ .name = "threaded", .run = emul_run_threaded, .print_stats = emul_threaded_print_stats },
+#endif
+#ifdef EMUL_HAVE_JIT
+	{ .name = "jit",      .run = emul_run_jit      },
+#endif
+	{ .name = NULL },
+};
+
+/**
+ * Look up an execution engine by name. Returns NULL if there is no such
+ * engine in this build
+ */
+const struct emul_engine *emul_get_engine(const char *name)
+{
+	size_t i = 0;
+
+	for (i = 0; engines[i].name; i++)
+		if (strcmp(engines[i].name, name) == 0)
+			return &engines[i];
+
+	return NULL;
+}
+
+/* List the engines in this build, comma-separated, on one line */
+void emul_print_engines(FILE *f)
+{
+	size_t i = 0;
+
+	for (i = 0; engines[i].name; i++)
+		fprintf(f, "%s%s", i ? ", " : "", engines[i].name);
+	fputc('\n', f);
+}
+
+/**
+ * Set up `ctx' to run the program of `bytes_used' bytes at the start of `ram'
+ * Returns zero on success, non-zero on failure
+ */
+int emul_init(struct emul_context *ctx, uint8_t *ram, size_t ram_size, size_t bytes_used)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->ram = ram;
+	ctx->ram_size = ram_size;
+	ctx->bytes_used = bytes_used;
+	ctx->registers[REG_H] = ~(uint16_t)0;
+	emul_set_flags(ctx, false, false);
+	emul_decode_init();
+
+	if ((ctx->cache = calloc(PREDECODE_SLOTS, sizeof(*ctx->cache))) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	return 0;
+}
+
+void emul_free(struct emul_context *ctx)
+{
+	emul_jit_free(ctx);
+	emul_block_free(ctx);
+	emul_threaded_free(ctx);
+	emul_ff_free(ctx);
+	emul_ttd_free(ctx);
+	free(ctx->cache);
+	ctx->cache = NULL;
+}
+
+/**
+ * Count `runs' runs of the `n' instructions from `pc', whose predecode slots
+ * are filled, for engines which count blocks rather than instructions
+ */
+void emul_count_run(struct emul_context *ctx, uint16_t pc, size_t n, uint64_t runs)
+{
+	const struct predecoded *p = NULL;
+
+	if (!runs)
+		return;
+	while (n--) {
+		p = &ctx->cache[pc];
+		ctx->counters.mix[p->type][p->oper] += runs;
+		pc += p->size;
+	}
+}
+
+/* Bring ctx->counters up to date with the blocks counted so far */
+void emul_counters_sync(struct emul_context *ctx)
+{
+	emul_jit_fold_counters(ctx);
+	emul_block_fold_counters(ctx);
+}
+
+void emul_dump_registers(FILE *f, const struct emul_context *ctx)
+{
+	fprintf(f,
+		"Registers:\n"
+		"pc: 0x%x (%d)\n"
+		"$0: 0x%x (%d)\n"
+		"$1: 0x%x (%d)\n"
+		"$2: 0x%x (%d)\n"
+		"$3: 0x%x (%d)\n"
+		"$4: 0x%x (%d)\n"
+		"$5: 0x%x (%d)\n"
+		"$6: 0x%x (%d)\n"
+		"$H: 0x%x (%d)\n",
+		ctx->pc, ctx->pc,
+		ctx->registers[REG_0], ctx->registers[REG_0],
+		ctx->registers[REG_1], ctx->registers[REG_1],
+		ctx->registers[REG_2], ctx->registers[REG_2],
+		ctx->registers[REG_3], ctx->registers[REG_3],
+		ctx->registers[REG_4], ctx->registers[REG_4],
+		ctx->registers[REG_5], ctx->registers[REG_5],
+		ctx->registers[REG_6], ctx->registers[REG_6],
+		ctx->registers[REG_H], ctx->registers[REG_H]
+	);
+}
@@ -0,0 +1,199 @@
+#ifndef EMUL_H
+#define EMUL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "instruction.h"
+
+/* Macro for safe wrap-around RAM access */
+#define RAM_AT(ctx, offs) ((ctx)->ram[(offs) % (ctx)->ram_size])
+
+/* One predecode cache slot per possible 16-bit pc */
+#define PREDECODE_SLOTS (1 << 16)
+
+/* Most bytes a slot may cover: a fused n-gram of three 4-byte instructions */
+#define PREDECODE_MAX_SPAN 12
+
+struct emul_context;
+struct instruction;
+struct jit;
+struct block_cache;
+struct fusion_stats;
+struct ff_state;
+struct prof_state;
+struct ttd_state;
+
+/**
+ * Compact, already-decoded form of the instruction at a given address. Slots
+ * are filled on first execution and stay valid until the RAM underneath them
+ * is written through emul_ram_write()
+ */
+struct predecoded {
+	int (*handler)(struct emul_context*, const struct predecoded*);
+	const void *thread; /* threaded engine's handler, NULL until first used */
+	uint16_t imm;   /* immediate, or absolute target for jumps/branches */
+	uint8_t size;   /* bytes consumed, 0 if slot not yet filled */
+	uint8_t type;   /* enum INST_TYPE */
+	uint8_t oper;   /* enum OPER for ALU types, enum JCOND for J-types */
+	uint8_t dest;
+	uint8_t left;   /* also the target register of JR-type */
+	uint8_t right;
+	uint8_t count;  /* threaded engine: instructions retired by `thread' */
+	uint8_t span;   /* threaded engine: bytes covered by `thread' */
+	uint16_t fused_id; /* threaded engine: n-gram id if `count' > 1 */
+};
+
+/**
+ * Condition flags are evaluated lazily: an ALU operation only records its
+ * operation, operands and result, and zf/cf are worked out from those when a
+ * conditional jump reads them. Flags set explicitly are recorded as FLAGS_SET,
+ * with zf as (res == 0) like any other operation and cf in `left'
+ */
+#define FLAGS_SET 8
+
+struct lazy_flags {
+	uint16_t left;
+	uint16_t right;
+	uint16_t res;
+	uint8_t oper;   /* enum OPER of the last ALU operation, or FLAGS_SET */
+};
+
+/* ISA_OPERS primitives on scalars, for emul_alu() and emul_carry() */
+#define SHIFT(x, op, n) ((n) < 16 ? (x) op (n) : 0)
+#define BIT(x, n) (((x) >> (n)) & 1)
+#define BOTH(a, b) ((a) && (b))
+#define MUL_HI(a, b) ((uint32_t)(a) * (b) >> 16)
+
+/**
+ * ALU operation `oper' on 16-bit operands. Shifting by 16 or more shifts out
+ * every bit
+ */
+#define EMUL_ALU_CASE(name, value, mnemonic, result, carry) \
+		case OPER_##name: return result;
+static inline uint16_t emul_alu(uint8_t oper, uint16_t l, uint16_t r)
+{
+	switch (oper) {
+		ISA_OPERS(EMUL_ALU_CASE)
+		default:       return 0;
+	}
+}
+
+/**
+ * Carry out of the operation recorded in `f': unsigned overflow for add and
+ * mul, borrow for sub, and the last bit shifted out for shl and shr. The
+ * bitwise operations clear it
+ */
+#define EMUL_CARRY_CASE(name, value, mnemonic, result, carry) \
+		case OPER_##name: return carry;
+static inline bool emul_carry(const struct lazy_flags *f)
+{
+	uint16_t l = f->left;
+	uint16_t r = f->right;
+	uint16_t res = f->res;
+
+	switch (f->oper) {
+		ISA_OPERS(EMUL_CARRY_CASE)
+		case FLAGS_SET: return f->left;
+		default:       return false;
+	}
+}
+
+#undef SHIFT
+#undef BIT
+#undef BOTH
+#undef MUL_HI
+
+/**
+ * Mix of the instructions retired, kept by every engine as it runs: a count
+ * for each instruction type and oper (the condition, for jumps and branches),
+ * and the jumps and branches whose condition held. The block and JIT engines
+ * count whole blocks instead, and fold them in on emul_counters_sync()
+ */
+struct emul_counters {
+	uint64_t mix[INST_TYPE_COUNT][8];
+	uint64_t taken;
+};
+
+/* Entries in an edge coverage map, one for each value of a 16-bit hash */
+#define EMUL_COV_SIZE 65536
+
+/**
+ * Reasons for an engine handing control back to its caller
+ */
+enum EMUL_EXIT {
+	EMUL_EXIT_HALT,   /* fell off the end of the program or of memory */
+	EMUL_EXIT_BUDGET, /* instruction budget used up */
+	EMUL_EXIT_ERROR,  /* undecodable instruction or internal error */
+};
+
+struct emul_context {
+	uint8_t *ram;
+	size_t ram_size;
+	size_t bytes_used;
+	uint16_t pc;
+	struct lazy_flags flags;
+	uint16_t registers[REG_COUNT];
+	uint64_t icount; /* instructions retired */
+	struct emul_counters counters;
+	unsigned hart;   /* index among the harts sharing `ram' (emul_hart.c) */
+	struct predecoded *cache;
+	struct jit *jit; /* JIT engine's translations, NULL until first used */
+	struct block_cache *blocks; /* block engine's cache, likewise */
+	struct fusion_stats *fusion; /* threaded engine's fusion counters */
+	struct ff_state *ff; /* loops fast-forwarded, NULL unless enabled */
+	struct prof_state *prof; /* emulator's profile (emul_prof.c), likewise */
+	struct trace_writer *trace; /* execution trace (emul_trace.c), likewise */
+	struct ttd_state *ttd; /* checkpoints to go back to (emul_ttd.c), likewise */
+	uint64_t ram_writes; /* calls to emul_ram_write(), to tell RAM unchanged */
+	uint8_t *cov;    /* edge coverage map of EMUL_COV_SIZE, likewise */
+	uint16_t cov_prev; /* hash of the last block entered, shifted */
+};
+
+/**
+ * Count the edge from the last block entered into the one at ctx->pc, as AFL
+ * does: the map is indexed by a hash of both ends, the one before shifted so
+ * an edge and its reverse count apart. Only the reference engine's jumps and
+ * branches count edges
+ */
+static inline void emul_cover(struct emul_context *ctx)
+{
+	uint16_t here = ctx->pc * 40503u;
+
+	if (!ctx->cov)
+		return;
+	ctx->cov[here ^ ctx->cov_prev]++;
+	ctx->cov_prev = here >> 1;
+}
+
+/**
+ * An execution engine. Runs `ctx' for at most `budget' instructions, and
+ * optionally reports engine-specific counters
+ */
+struct emul_engine {
+	const char *name;
+	enum EMUL_EXIT (*run)(struct emul_context *ctx, uint64_t budget);
+	void (*print_stats)(FILE *f, const struct emul_context *ctx);
+};
+
+void emul_decode_init(void);
+int emul_init(struct emul_context *ctx, uint8_t *ram, size_t ram_size, size_t bytes_used);
+void emul_free(struct emul_context *ctx);
+void emul_ram_write(struct emul_context *ctx, uint16_t offs, const uint8_t *buf, size_t len);
+int emul_predecode(struct emul_context *ctx, uint16_t pc, struct predecoded *p);
+int emul_predecode_parsed(struct emul_context *ctx, uint16_t pc, const struct instruction *inst);
+bool emul_zf(const struct emul_context *ctx);
+bool emul_cf(const struct emul_context *ctx);
+void emul_set_flags(struct emul_context *ctx, bool zf, bool cf);
+int should_jump(const struct emul_context *ctx, enum JCOND cond);
+int execute_single(struct emul_context *ctx);
+enum EMUL_EXIT emul_run(struct emul_context *ctx, uint64_t budget);
+const struct emul_engine *emul_get_engine(const char *name);
+void emul_print_engines(FILE *f);
+void emul_count_run(struct emul_context *ctx, uint16_t pc, size_t n, uint64_t runs);
+void emul_counters_sync(struct emul_context *ctx);
+void emul_dump_registers(FILE *f, const struct emul_context *ctx);
+
+#endif /* EMUL_H */
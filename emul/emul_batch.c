@@ -0,0 +1,511 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "input/input_bin.h"
+#include "emul/emul.h"
+#include "emul/emul_cycle.h"
+#include "emul/emul_batch.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Batch engine: the same program run in many lanes at once, for sweeps over
+ * initial register values. Lanes are run EMUL_BATCH_WIDTH at a time as
+ * vectors, one instruction for all of them per step, with GCC vector
+ * extensions compiling to SSE2 (or AVX2 given -mavx2).
+ *
+ * A vector runs the instruction at the least pc of its lanes, and lanes at
+ * other pcs sit it out, masked off. Once fewer than half the lanes it started
+ * with are still together the vector is scattered back, and the lanes of the
+ * whole batch are regrouped by pc into fresh vectors. Taking the least pc
+ * first means lanes which leave a loop early wait for the rest at its exit.
+ */
+
+/* Most steps of a vector between regroupings, so lane counts fit 16 bits */
+#define VECTOR_MAX_STEPS 0xffff
+
+int emul_batch_init(struct emul_batch *b, size_t lanes, uint8_t *ram, size_t ram_size, size_t bytes_used)
+{
+	size_t i = 0;
+	int fail = 0;
+
+	memset(b, 0, sizeof(*b));
+	b->lanes = lanes;
+	b->ram = ram;
+	b->ram_size = ram_size;
+	b->bytes_used = bytes_used;
+	emul_decode_init();
+
+	fail |= (b->pc = calloc(lanes, sizeof(*b->pc))) == NULL;
+	for (i = 0; i < REG_COUNT; i++)
+		fail |= (b->registers[i] = calloc(lanes, sizeof(*b->registers[i]))) == NULL;
+	fail |= (b->left = calloc(lanes, sizeof(*b->left))) == NULL;
+	fail |= (b->right = calloc(lanes, sizeof(*b->right))) == NULL;
+	fail |= (b->res = calloc(lanes, sizeof(*b->res))) == NULL;
+	fail |= (b->oper = calloc(lanes, sizeof(*b->oper))) == NULL;
+	fail |= (b->icount = calloc(lanes, sizeof(*b->icount))) == NULL;
+	fail |= (b->stop = calloc(lanes, sizeof(*b->stop))) == NULL;
+	fail |= (b->exit = calloc(lanes, sizeof(*b->exit))) == NULL;
+	fail |= (b->live = calloc(lanes, sizeof(*b->live))) == NULL;
+	if (fail) {
+		perror("calloc");
+		emul_batch_free(b);
+		return 1;
+	}
+
+	/* as emul_init(): $H all ones, flags clear */
+	for (i = 0; i < lanes; i++) {
+		b->registers[REG_H][i] = ~(uint16_t)0;
+		b->res[i] = 1;
+		b->oper[i] = FLAGS_SET;
+		b->exit[i] = EMUL_EXIT_BUDGET;
+		b->live[i] = true;
+	}
+
+	return 0;
+}
+
+void emul_batch_free(struct emul_batch *b)
+{
+	size_t i = 0;
+
+	free(b->pc);
+	for (i = 0; i < REG_COUNT; i++)
+		free(b->registers[i]);
+	free(b->left);
+	free(b->right);
+	free(b->res);
+	free(b->oper);
+	free(b->icount);
+	free(b->stop);
+	free(b->exit);
+	free(b->live);
+	memset(b, 0, sizeof(*b));
+}
+
+void emul_batch_set_state(struct emul_batch *b, size_t lane, const struct emul_state *s)
+{
+	size_t i = 0;
+
+	b->pc[lane] = s->pc;
+	for (i = 0; i < REG_COUNT; i++)
+		b->registers[i][lane] = s->registers[i];
+	/* as emul_set_flags() */
+	b->left[lane] = s->cf;
+	b->right[lane] = 0;
+	b->res[lane] = !s->zf;
+	b->oper[lane] = FLAGS_SET;
+}
+
+/**
+ * Copy the state of `lane' into `ctx', set up by emul_init() on the same RAM,
+ * so that it can be inspected or carried on with one instance at a time
+ */
+void emul_batch_get_context(const struct emul_batch *b, size_t lane, struct emul_context *ctx)
+{
+	size_t i = 0;
+
+	ctx->pc = b->pc[lane];
+	for (i = 0; i < REG_COUNT; i++)
+		ctx->registers[i] = b->registers[i][lane];
+	ctx->flags = (struct lazy_flags){
+		.left = b->left[lane], .right = b->right[lane],
+		.res = b->res[lane], .oper = b->oper[lane],
+	};
+	ctx->icount = b->icount[lane];
+}
+
+void emul_batch_print_stats(FILE *f, const struct emul_batch *b)
+{
+	fprintf(f, "batch: %zd lanes, %llu instructions retired in %llu vector steps (%.2f lanes per step), %llu regroupings\n",
+		b->lanes, (unsigned long long)b->lane_steps, (unsigned long long)b->vector_steps,
+		b->vector_steps ? (double)b->lane_steps / b->vector_steps : 0.0,
+		(unsigned long long)b->regroups);
+}
+
+#ifdef __GNUC__
+
+/* Vectors are only passed between static functions here, so their ABI
+ * without AVX is of no concern */
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+typedef uint16_t vec __attribute__((vector_size(2 * EMUL_BATCH_WIDTH)));
+typedef int16_t vmask __attribute__((vector_size(2 * EMUL_BATCH_WIDTH)));
+typedef uint32_t vwide __attribute__((vector_size(4 * EMUL_BATCH_WIDTH)));
+
+/* Up to EMUL_BATCH_WIDTH lanes, gathered out of the batch */
+struct vector {
+	size_t lane[EMUL_BATCH_WIDTH];
+	size_t n;
+	vec pc;
+	vec registers[REG_COUNT];
+	vec left;
+	vec right;
+	vec res;
+	vec oper;
+	vec remain; /* instructions each lane may still run, 0 for unused lanes */
+};
+
+static inline vec splat(uint16_t x)
+{
+	return (vec){ 0 } + x;
+}
+
+/* `a' in lanes where `m' is set, `b' in the others */
+static inline vec blend(vmask m, vec a, vec b)
+{
+	return ((vec)m & a) | (~(vec)m & b);
+}
+
+static inline bool none(vmask m)
+{
+	uint64_t w[sizeof(m) / sizeof(uint64_t)];
+	uint64_t any = 0;
+	size_t i = 0;
+
+	memcpy(w, &m, sizeof(m));
+	for (i = 0; i < sizeof(w) / sizeof(w[0]); i++)
+		any |= w[i];
+
+	return !any;
+}
+
+static inline size_t count(vmask m)
+{
+	size_t i = 0;
+	size_t n = 0;
+
+	for (i = 0; i < EMUL_BATCH_WIDTH; i++)
+		n += m[i] != 0;
+
+	return n;
+}
+
+/* ISA_OPERS and ISA_CONDS primitives lane by lane. Shifts are masked to 0..15
+ * since every lane is worked out, whichever way its blend goes */
+#define SHIFT(x, op, n) blend((n) < 16, (x) op ((n) & 15), splat(0))
+#define BIT(x, n) ((((x) >> ((n) & 15)) & 1) != 0)
+#define BOTH(a, b) ((a) & (b))
+#define MUL_HI(a, b) __builtin_convertvector((__builtin_convertvector(a, vwide) * __builtin_convertvector(b, vwide)) >> 16, vec)
+#define ALWAYS (~(vmask){ 0 })
+#define NOT(a) (~(a))
+#define EITHER(a, b) ((a) | (b))
+#define ZF zf
+#define CF carry(v)
+
+#define ALU_CASE(name, value, mnemonic, result, carry) \
+		case OPER_##name: return result;
+static inline vec alu(uint8_t oper, vec l, vec r)
+{
+	switch (oper) {
+		ISA_OPERS(ALU_CASE)
+		default:       return splat(0);
+	}
+}
+
+/* emul_carry(), lane by lane. Each lane may have a different operation */
+#define CARRY_TERM(name, value, mnemonic, result, carry) \
+	| ((v->oper == OPER_##name) & (carry))
+static vmask carry(const struct vector *v)
+{
+	vec l = v->left;
+	vec r = v->right;
+	vec res = v->res;
+
+	return ((v->oper == FLAGS_SET) & (l != 0))
+	     ISA_OPERS(CARRY_TERM);
+}
+
+/* should_jump(), lane by lane */
+#define TAKEN_CASE(name, value, jump, branch, test) \
+		case JB_##name: return test;
+static vmask taken(const struct vector *v, enum JCOND cond)
+{
+	vmask zf = v->res == 0;
+
+	switch (cond) {
+		ISA_CONDS(TAKEN_CASE)
+		default:         return (vmask){ 0 };
+	}
+}
+
+/* The 16-bit word at `offs', wrapping around the end of RAM */
+static inline uint16_t fetch(const struct emul_batch *b, uint16_t offs)
+{
+	if (offs + 1u < b->ram_size)
+		return b->ram[offs] << 8 | b->ram[offs + 1];
+	return RAM_AT(b, offs) << 8 | RAM_AT(b, offs + 1);
+}
+
+/* Run ALU operation `d' in the `active' lanes, which are all of them if `all' */
+static inline void step_alu(struct vector *v, const struct decoded_word *d, vmask active, bool all, vec r)
+{
+	vec l = v->registers[d->left];
+	vec res = alu(d->oper, l, r);
+
+	if (all) {
+		v->left = l;
+		v->right = r;
+		v->res = res;
+		v->oper = splat(d->oper);
+		if (d->dest != REG_0 && d->dest != REG_H)
+			v->registers[d->dest] = res;
+		return;
+	}
+
+	v->left = blend(active, l, v->left);
+	v->right = blend(active, r, v->right);
+	v->res = blend(active, res, v->res);
+	v->oper = blend(active, splat(d->oper), v->oper);
+	if (d->dest != REG_0 && d->dest != REG_H)
+		v->registers[d->dest] = blend(active, res, v->registers[d->dest]);
+}
+
+/**
+ * Run the vector's lanes until they finish or drift apart. Lanes at the same
+ * pc run straight-line stretches together: the masks and the next pc are only
+ * worked out again after a jump, or on reaching a lane left waiting
+ */
+static void run_vector(struct emul_batch *b, struct vector *v)
+{
+	const struct decoded_word *d = NULL;
+	vmask runnable;
+	vmask active;
+	vmask jump;
+	size_t i = 0;
+	size_t n = 0;
+	size_t entered = 0;
+	uint16_t steps = 0;
+	uint16_t k = 0;
+	uint16_t pc = 0;
+	uint16_t next = 0;
+	uint16_t target = 0;
+	uint32_t wait = 0;
+	uint32_t end = b->bytes_used < b->ram_size ? b->bytes_used : b->ram_size;
+	bool all = false;
+	bool jumped = false;
+
+	for (;;) {
+		runnable = v->remain != 0;
+		if (end <= 0xffff)
+			runnable &= v->pc < splat(end);
+
+		/* the least pc of any lane still running goes next */
+		n = 0;
+		for (i = 0; i < EMUL_BATCH_WIDTH; i++) {
+			if (runnable[i] && (!n || v->pc[i] < pc)) {
+				pc = v->pc[i];
+				n = 1;
+			}
+		}
+		if (!n)
+			break;
+
+		active = runnable & (v->pc == pc);
+		n = count(active);
+		if (!entered)
+			entered = n;
+		else if (2 * n < entered)
+			break;
+		all = n == EMUL_BATCH_WIDTH;
+
+		/* run until the first lane left waiting, or the least budget */
+		wait = end;
+		steps = VECTOR_MAX_STEPS;
+		for (i = 0; i < EMUL_BATCH_WIDTH; i++) {
+			if (active[i] && v->remain[i] < steps)
+				steps = v->remain[i];
+			else if (!active[i] && runnable[i] && v->pc[i] < wait)
+				wait = v->pc[i];
+		}
+
+		k = 0;
+		jumped = false;
+		do {
+			d = decode_word(fetch(b, pc));
+			next = pc + d->size;
+			k++;
+			switch (d->type) {
+				case INST_TYPE_R:
+					step_alu(v, d, active, all, v->registers[d->right]);
+					break;
+				case INST_TYPE_NI:
+					step_alu(v, d, active, all, splat(d->imm));
+					break;
+				case INST_TYPE_WI:
+					step_alu(v, d, active, all, splat(fetch(b, pc + 2)));
+					break;
+				case INST_TYPE_JR:
+					jump = active & taken(v, d->oper);
+					v->pc = blend(jump, v->registers[d->left], blend(active, splat(next), v->pc));
+					jumped = true;
+					break;
+				case INST_TYPE_JI:
+				case INST_TYPE_B:
+					/* the stretch goes on while the lanes all go the same way */
+					jump = active & taken(v, d->oper);
+					target = d->type == INST_TYPE_JI ? fetch(b, pc + 2) : pc + d->imm;
+					if (none(jump ^ active)) {
+						next = target;
+					} else if (!none(jump)) {
+						v->pc = blend(jump, splat(target), blend(active, splat(next), v->pc));
+						jumped = true;
+					}
+					break;
+			}
+			pc = next;
+		} while (!jumped && k < steps && pc < wait);
+
+		if (!jumped)
+			v->pc = blend(active, splat(pc), v->pc);
+		v->remain -= (vec)active & splat(k);
+		b->vector_steps += k;
+	}
+}
+
+/* Gather the lanes of `v' out of the batch, run them, and scatter them back */
+static void run_lanes(struct emul_batch *b, struct vector *v)
+{
+	size_t i = 0;
+	size_t j = 0;
+	size_t lane = 0;
+	uint64_t left = 0;
+	vec budget = splat(0);
+
+	memset(&v->pc, 0, sizeof(*v) - offsetof(struct vector, pc));
+	for (i = 0; i < v->n; i++) {
+		lane = v->lane[i];
+		v->pc[i] = b->pc[lane];
+		for (j = 0; j < REG_COUNT; j++)
+			v->registers[j][i] = b->registers[j][lane];
+		v->left[i] = b->left[lane];
+		v->right[i] = b->right[lane];
+		v->res[i] = b->res[lane];
+		v->oper[i] = b->oper[lane];
+		left = b->stop[lane] - b->icount[lane];
+		v->remain[i] = left < VECTOR_MAX_STEPS ? left : VECTOR_MAX_STEPS;
+	}
+	budget = v->remain;
+	b->regroups++;
+
+	run_vector(b, v);
+
+	for (i = 0; i < v->n; i++) {
+		lane = v->lane[i];
+		b->pc[lane] = v->pc[i];
+		for (j = 0; j < REG_COUNT; j++)
+			b->registers[j][lane] = v->registers[j][i];
+		b->left[lane] = v->left[i];
+		b->right[lane] = v->right[i];
+		b->res[lane] = v->res[i];
+		b->oper[lane] = v->oper[i];
+		b->icount[lane] += (uint16_t)(budget[i] - v->remain[i]);
+		b->lane_steps += (uint16_t)(budget[i] - v->remain[i]);
+	}
+}
+
+/**
+ * Run each live lane for `budget' more instructions, or until it halts. A
+ * halted lane is no longer live, and its exit says why. Returns true while
+ * any lane is still live
+ */
+bool emul_batch_run(struct emul_batch *b, uint64_t budget)
+{
+	struct vector v;
+	size_t lane = 0;
+	size_t live = 0;
+	uint16_t pc = 0;
+	bool found = false;
+
+	for (lane = 0; lane < b->lanes; lane++)
+		b->stop[lane] = b->icount[lane] + budget;
+
+	for (;;) {
+		/* the least pc of any lane with budget left, halting any lanes which
+		 * have fallen off the end of the program */
+		found = false;
+		for (lane = 0; lane < b->lanes; lane++) {
+			if (!b->live[lane])
+				continue;
+			if (b->pc[lane] >= b->ram_size || b->pc[lane] >= b->bytes_used) {
+				b->exit[lane] = EMUL_EXIT_HALT;
+				b->live[lane] = false;
+				continue;
+			}
+			if (b->icount[lane] == b->stop[lane])
+				continue;
+			if (!found || b->pc[lane] < pc) {
+				pc = b->pc[lane];
+				found = true;
+			}
+		}
+		if (!found)
+			break;
+
+		/* regroup every lane there into vectors */
+		v.n = 0;
+		for (lane = 0; lane < b->lanes; lane++) {
+			if (!b->live[lane] || b->icount[lane] == b->stop[lane] || b->pc[lane] != pc)
+				continue;
+			v.lane[v.n++] = lane;
+			if (v.n == EMUL_BATCH_WIDTH) {
+				run_lanes(b, &v);
+				v.n = 0;
+			}
+		}
+		if (v.n)
+			run_lanes(b, &v);
+	}
+
+	for (lane = 0; lane < b->lanes; lane++)
+		live += b->live[lane];
+
+	return live != 0;
+}
+
+#else /* !__GNUC__ */
+
+/* One lane at a time through the reference engine */
+bool emul_batch_run(struct emul_batch *b, uint64_t budget)
+{
+	struct emul_context ctx;
+	size_t lane = 0;
+	size_t i = 0;
+	size_t live = 0;
+	uint64_t start = 0;
+
+	if (emul_init(&ctx, b->ram, b->ram_size, b->bytes_used))
+		return false;
+
+	for (lane = 0; lane < b->lanes; lane++) {
+		if (!b->live[lane])
+			continue;
+
+		emul_batch_get_context(b, lane, &ctx);
+		start = ctx.icount;
+		b->exit[lane] = emul_run(&ctx, budget);
+		b->live[lane] = b->exit[lane] == EMUL_EXIT_BUDGET;
+		live += b->live[lane];
+
+		b->pc[lane] = ctx.pc;
+		for (i = 0; i < REG_COUNT; i++)
+			b->registers[i][lane] = ctx.registers[i];
+		b->left[lane] = ctx.flags.left;
+		b->right[lane] = ctx.flags.right;
+		b->res[lane] = ctx.flags.res;
+		b->oper[lane] = ctx.flags.oper;
+		b->icount[lane] = ctx.icount;
+		b->lane_steps += ctx.icount - start;
+		b->vector_steps += ctx.icount - start;
+	}
+
+	emul_free(&ctx);
+	return live != 0;
+}
+
+#endif /* __GNUC__ */
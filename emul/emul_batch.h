@@ -0,0 +1,46 @@
+#ifndef EMUL_BATCH_H
+#define EMUL_BATCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emul/emul.h"
+#include "emul/emul_cycle.h"
+
+/* Lanes per vector: 16 lanes of 16 bits make one AVX2 register */
+#define EMUL_BATCH_WIDTH 16
+
+/**
+ * Many instances of the same program, one per lane, kept as structure of
+ * arrays: element `lane' of each array belongs to that lane. RAM is shared,
+ * as no instruction can write it
+ */
+struct emul_batch {
+	size_t lanes;
+	uint8_t *ram;
+	size_t ram_size;
+	size_t bytes_used;
+	uint16_t *pc;
+	uint16_t *registers[REG_COUNT];
+	uint16_t *left;    /* lazy flags, as in struct lazy_flags */
+	uint16_t *right;
+	uint16_t *res;
+	uint16_t *oper;
+	uint64_t *icount;  /* instructions retired */
+	uint64_t *stop;    /* icount at which emul_batch_run() leaves the lane */
+	uint8_t *exit;     /* enum EMUL_EXIT, EMUL_EXIT_BUDGET while running */
+	bool *live;        /* lane still to be run */
+	uint64_t vector_steps;  /* instructions issued for a vector of lanes */
+	uint64_t lane_steps;    /* instructions retired, over all lanes */
+	uint64_t regroups;      /* vectors of lanes gathered */
+};
+
+int emul_batch_init(struct emul_batch *b, size_t lanes, uint8_t *ram, size_t ram_size, size_t bytes_used);
+void emul_batch_free(struct emul_batch *b);
+void emul_batch_set_state(struct emul_batch *b, size_t lane, const struct emul_state *s);
+void emul_batch_get_context(const struct emul_batch *b, size_t lane, struct emul_context *ctx);
+bool emul_batch_run(struct emul_batch *b, uint64_t budget);
+void emul_batch_print_stats(FILE *f, const struct emul_batch *b);
+
+#endif /* EMUL_BATCH_H */
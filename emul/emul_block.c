@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "emul/emul.h"
+#include "emul/emul_block.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Guest basic blocks are translated once into arrays of micro-ops and cached
+ * by entry pc. A block ends at a JI/JR/B instruction, at the end of the
+ * program, or after BLOCK_MAX_UOPS instructions. Each block links to the
+ * blocks it has been seen to continue into, so a hot path runs from block to
+ * block without a lookup or a per-instruction bounds check.
+ */
+
+#define BLOCK_MAX_UOPS 64
+
+enum UOP {
+	/* ALU micro-ops are OPER_* with a register right hand side ... */
+	UOP_ALU_R = 0,
+	/* ... or OPER_* + UOP_ALU_I with an immediate right hand side */
+	UOP_ALU_I = 8,
+	UOP_JUMP_REG = 16, /* jump to register `left' if condition `right' holds */
+	UOP_JUMP_IMM,      /* jump to `imm' if condition `right' holds */
+	UOP_NONE,          /* block ended without a jump */
+};
+
+struct uop {
+	uint8_t op;    /* enum UOP */
+	uint8_t dest;
+	uint8_t left;  /* also the target register of UOP_JUMP_REG */
+	uint8_t right; /* also the enum JCOND of a jump */
+	uint16_t imm;
+};
+
+struct block {
+	uint16_t pc;          /* entry pc */
+	uint16_t next_pc;     /* pc after the block, if its final jump isn't taken */
+	uint16_t n;           /* guest instructions in the block */
+	uint64_t runs;        /* times run whole, not yet in ctx->counters */
+	uint64_t jumped;      /* of those, times the final jump was taken */
+	struct block *taken;  /* successor when the final jump is taken */
+	struct block *fallthrough;
+	struct uop ops[];     /* n ALU micro-ops, then one jump (or UOP_NONE) */
+};
+
+struct block_cache {
+	struct block **at;    /* blocks indexed by entry pc */
+	uint64_t hits;        /* block found by lookup */
+	uint64_t misses;      /* block translated */
+	uint64_t chained;     /* block reached by following a link */
+};
+
+static struct block *translate(struct emul_context *ctx, uint16_t pc, size_t end)
+{
+	struct uop ops[BLOCK_MAX_UOPS + 1];
+	struct block *b = NULL;
+	struct predecoded *p = NULL;
+	struct uop *u = NULL;
+	uint16_t entry = pc;
+	size_t n = 0;
+	int done = 0;
+
+	while (!done) {
+		p = &ctx->cache[pc];
+		if (!p->size && emul_predecode(ctx, pc, p))
+			return NULL;
+
+		u = &ops[n++];
+		u->dest = p->dest;
+		u->left = p->left;
+		u->right = p->right;
+		u->imm = p->imm;
+
+		switch (p->type) {
+			case INST_TYPE_R:
+				u->op = UOP_ALU_R + p->oper;
+				break;
+			case INST_TYPE_NI:
+			case INST_TYPE_WI:
+				u->op = UOP_ALU_I + p->oper;
+				break;
+			case INST_TYPE_JR:
+				u->op = UOP_JUMP_REG;
+				u->right = p->oper;
+				done = 1;
+				break;
+			case INST_TYPE_JI:
+			case INST_TYPE_B:
+				u->op = UOP_JUMP_IMM;
+				u->right = p->oper;
+				done = 1;
+				break;
+			default:
+				fprintf(stderr, "Unhandled instruction type %d at 0x%x, stop.\n", p->type, pc);
+				return NULL;
+		}
+		pc += p->size;
+
+		if (!done && (pc >= end || n >= BLOCK_MAX_UOPS)) {
+			ops[n] = (struct uop){ .op = UOP_NONE };
+			done = 1;
+		}
+	}
+
+	/* the trailing UOP_NONE is not a guest instruction */
+	if ((b = calloc(1, sizeof(*b) + (n + 1) * sizeof(*b->ops))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	b->pc = entry;
+	b->next_pc = pc;
+	b->n = n;
+	memcpy(b->ops, ops, (n + 1) * sizeof(*b->ops));
+
+	debug("block: 0x%x, %zd insts\n", entry, n);
+	return b;
+}
+
+static struct block *lookup(struct emul_context *ctx, struct block_cache *bc, uint16_t pc, size_t end)
+{
+	struct block *b = bc->at[pc];
+
+	if (b) {
+		bc->hits++;
+		return b;
+	}
+
+	bc->misses++;
+	if ((b = translate(ctx, pc, end)) == NULL)
+		return NULL;
+	return bc->at[pc] = b;
+}
+
+/* Each operation with a constant `op', so emul_alu() folds down to it */
+#define ALU_R_CASE(name, value, mnemonic, result, carry) \
+	case UOP_ALU_R + OPER_##name: r = regs[u->right]; res = emul_alu(OPER_##name, l, r); break;
+#define ALU_I_CASE(name, value, mnemonic, result, carry) \
+	case UOP_ALU_I + OPER_##name: r = u->imm; res = emul_alu(OPER_##name, l, r); break;
+
+/**
+ * Run every micro-op of `b'. Returns non-zero if the final jump was taken,
+ * with the target in *target
+ */
+static int run_block(struct emul_context *ctx, const struct block *b, uint16_t *target)
+{
+	uint16_t *regs = ctx->registers;
+	const struct uop *u = b->ops;
+	uint16_t l = 0;
+	uint16_t r = 0;
+	uint16_t res = 0;
+
+	for (; u->op < UOP_JUMP_REG; u++) {
+		l = regs[u->left];
+		switch (u->op) {
+			ISA_OPERS(ALU_R_CASE)
+			ISA_OPERS(ALU_I_CASE)
+		}
+		if (u->dest != REG_0 && u->dest != REG_H)
+			regs[u->dest] = res;
+	}
+
+	/* only the last ALU micro-op's flags can be read */
+	if (u != b->ops)
+		ctx->flags = (struct lazy_flags){ .left = l, .right = r, .res = res, .oper = u[-1].op % UOP_ALU_I };
+
+	switch (u->op) {
+		case UOP_JUMP_REG:
+			*target = regs[u->left];
+			return should_jump(ctx, u->right);
+		case UOP_JUMP_IMM:
+			*target = u->imm;
+			return should_jump(ctx, u->right);
+		case UOP_NONE:
+		default:
+			return 0;
+	}
+}
+
+/**
+ * Block engine: run cached micro-op blocks, following links between them
+ */
+enum EMUL_EXIT emul_run_block(struct emul_context *ctx, uint64_t budget)
+{
+	struct block_cache *bc = ctx->blocks;
+	struct block *b = NULL;
+	struct block **link = NULL;
+	uint64_t left = budget;
+	uint16_t target = 0;
+	size_t end = ctx->bytes_used < ctx->ram_size ? ctx->bytes_used : ctx->ram_size;
+	enum EMUL_EXIT ret = EMUL_EXIT_HALT;
+
+	if (!bc) {
+		if ((bc = calloc(1, sizeof(*bc))) == NULL
+		    || (bc->at = calloc(PREDECODE_SLOTS, sizeof(*bc->at))) == NULL) {
+			perror("calloc");
+			free(bc);
+			return EMUL_EXIT_ERROR;
+		}
+		ctx->blocks = bc;
+	}
+
+	if (ctx->pc >= end)
+		return EMUL_EXIT_HALT;
+
+	if ((b = lookup(ctx, bc, ctx->pc, end)) == NULL)
+		return EMUL_EXIT_ERROR;
+
+	for (;;) {
+		if (left < b->n) {
+			/* finish off the budget one instruction at a time */
+			ctx->icount += budget - left;
+			return emul_run(ctx, left);
+		}
+		left -= b->n;
+		b->runs++;
+
+		if (run_block(ctx, b, &target)) {
+			ctx->pc = target;
+			link = &b->taken;
+			b->jumped++;
+		} else {
+			ctx->pc = b->next_pc;
+			link = &b->fallthrough;
+		}
+
+		if (*link && (*link)->pc == ctx->pc) {
+			bc->chained++;
+			b = *link;
+			continue;
+		}
+
+		if (ctx->pc >= end) {
+			ret = EMUL_EXIT_HALT;
+			break;
+		}
+
+		if ((b = lookup(ctx, bc, ctx->pc, end)) == NULL) {
+			ret = EMUL_EXIT_ERROR;
+			break;
+		}
+		*link = b;
+	}
+
+	ctx->icount += budget - left;
+	return ret;
+}
+
+void emul_block_print_stats(FILE *f, const struct emul_context *ctx)
+{
+	const struct block_cache *bc = ctx->blocks;
+
+	if (!bc)
+		return;
+
+	fprintf(f,
+		"block cache hits: %llu\n"
+		"block cache misses: %llu\n"
+		"block links followed: %llu\n",
+		(unsigned long long)bc->hits,
+		(unsigned long long)bc->misses,
+		(unsigned long long)bc->chained);
+}
+
+/* Add the runs of every cached block to ctx->counters */
+void emul_block_fold_counters(struct emul_context *ctx)
+{
+	struct block_cache *bc = ctx->blocks;
+	struct block *b = NULL;
+	size_t i = 0;
+
+	if (!bc)
+		return;
+
+	for (i = 0; i < PREDECODE_SLOTS; i++) {
+		if ((b = bc->at[i]) == NULL)
+			continue;
+		emul_count_run(ctx, b->pc, b->n, b->runs);
+		ctx->counters.taken += b->jumped;
+		b->runs = b->jumped = 0;
+	}
+}
+
+/**
+ * Throw away every cached block, e.g. because guest RAM has changed
+ */
+void emul_block_flush(struct emul_context *ctx)
+{
+	struct block_cache *bc = ctx->blocks;
+	size_t i = 0;
+
+	if (!bc)
+		return;
+
+	emul_block_fold_counters(ctx);
+	for (i = 0; i < PREDECODE_SLOTS; i++) {
+		free(bc->at[i]);
+		bc->at[i] = NULL;
+	}
+}
+
+void emul_block_free(struct emul_context *ctx)
+{
+	if (!ctx->blocks)
+		return;
+
+	emul_block_flush(ctx);
+	free(ctx->blocks->at);
+	free(ctx->blocks);
+	ctx->blocks = NULL;
+}
@@ -0,0 +1,14 @@
+#ifndef EMUL_BLOCK_H
+#define EMUL_BLOCK_H
+
+#include <stdio.h>
+
+#include "emul/emul.h"
+
+enum EMUL_EXIT emul_run_block(struct emul_context *ctx, uint64_t budget);
+void emul_block_print_stats(FILE *f, const struct emul_context *ctx);
+void emul_block_fold_counters(struct emul_context *ctx);
+void emul_block_flush(struct emul_context *ctx);
+void emul_block_free(struct emul_context *ctx);
+
+#endif /* EMUL_BLOCK_H */
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "emul/emul.h"
+#include "emul/emul_ff.h"
+#include "emul/emul_cycle.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Non-termination detection. The machine state is tiny and RAM is read-only,
+ * so a guest which never halts must eventually repeat a state exactly, and
+ * from then on go round the same cycle forever.
+ *
+ * Checking every instruction would cost as much as running it, so the driver
+ * runs the engine in slices of EMUL_CYCLE_SLICE instructions and looks the
+ * state after each one up in a window: a table of EMUL_CYCLE_SLICE states in
+ * a row, stepped through one instruction at a time. Comparing states a whole
+ * slice apart would only find a cycle of period p after lcm(p, slice)
+ * instructions; but any p instructions on from the window, one of the checks
+ * lands exactly p after one of its states. Windows are taken at the start,
+ * then 1, 2, 4 and so on slices from it, so once one lies in the cycle and is
+ * further from the next than p, a repeat is found: within a few times the
+ * instructions before the cycle plus its period.
+ *
+ * Fast-forward skips over loops, whose states the windows never see, so each
+ * skip starts them again from where it left off. A cycle which takes in such
+ * a loop is found instead by Brent's algorithm over the states left by each
+ * skip, as the same ones come round again.
+ *
+ * Once a repeat is found, emul_cycle_locate() replays the program to find
+ * where the cycle starts and how long it really is.
+ */
+
+void emul_get_state(const struct emul_context *ctx, struct emul_state *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->pc = ctx->pc;
+	memcpy(s->registers, ctx->registers, sizeof(s->registers));
+	s->zf = emul_zf(ctx);
+	s->cf = emul_cf(ctx);
+}
+
+void emul_set_state(struct emul_context *ctx, const struct emul_state *s)
+{
+	ctx->pc = s->pc;
+	memcpy(ctx->registers, s->registers, sizeof(ctx->registers));
+	emul_set_flags(ctx, s->zf, s->cf);
+}
+
+static bool same_state(const struct emul_state *a, const struct emul_state *b)
+{
+	return a->pc == b->pc && a->zf == b->zf && a->cf == b->cf
+	    && memcmp(a->registers, b->registers, sizeof(a->registers)) == 0;
+}
+
+static bool in_state(const struct emul_context *ctx, const struct emul_state *s)
+{
+	struct emul_state now;
+
+	emul_get_state(ctx, &now);
+	return same_state(&now, s);
+}
+
+static size_t hash_state(const struct emul_state *s)
+{
+	uint32_t h = 2166136261u;
+	size_t i = 0;
+
+	h = (h ^ s->pc) * 16777619u;
+	for (i = 0; i < REG_COUNT; i++)
+		h = (h ^ s->registers[i]) * 16777619u;
+	h = (h ^ (s->zf | s->cf << 1)) * 16777619u;
+	return h & (EMUL_CYCLE_TABLE - 1);
+}
+
+/* The slot holding `s' in the window, or the empty one it would go in */
+static struct emul_cycle_seen *find(struct emul_cycle *c, const struct emul_state *s)
+{
+	size_t i = hash_state(s);
+
+	while (c->seen[i].at && !same_state(&c->seen[i].state, s))
+		i = (i + 1) & (EMUL_CYCLE_TABLE - 1);
+	return &c->seen[i];
+}
+
+/* Begin a window at the state `s', `at' instructions from the start */
+static void open_window(struct emul_cycle *c, const struct emul_state *s, uint64_t at)
+{
+	struct emul_cycle_seen *slot = NULL;
+
+	memset(c->seen, 0, EMUL_CYCLE_TABLE * sizeof(*c->seen));
+	c->window = at;
+	c->recorded = 1;
+	c->next = at + 1;
+	c->checked = at;
+	slot = find(c, s);
+	slot->state = *s;
+	/* stored one on, so a slot at zero is empty */
+	slot->at = at + 1;
+}
+
+/* Returns non-zero if out of memory */
+int emul_cycle_init(struct emul_cycle *c, const struct emul_context *ctx)
+{
+	memset(c, 0, sizeof(*c));
+	if ((c->seen = malloc(EMUL_CYCLE_TABLE * sizeof(*c->seen))) == NULL) {
+		perror("malloc");
+		return 1;
+	}
+
+	emul_get_state(ctx, &c->origin);
+	c->origin_icount = ctx->icount;
+	emul_cycle_restart(c, ctx);
+	return 0;
+}
+
+/**
+ * Start again from `ctx', forgetting every state seen: for when it has been
+ * moved on other than by running it, as by fast-forward
+ */
+void emul_cycle_restart(struct emul_cycle *c, const struct emul_context *ctx)
+{
+	emul_get_state(ctx, &c->start);
+	c->start_icount = ctx->icount;
+	c->period = 0;
+	open_window(c, &c->start, 0);
+}
+
+void emul_cycle_free(struct emul_cycle *c)
+{
+	free(c->seen);
+	c->seen = NULL;
+}
+
+/* Instructions to run before the next emul_cycle_check() */
+uint64_t emul_cycle_due(const struct emul_cycle *c, const struct emul_context *ctx)
+{
+	return c->next - (ctx->icount - c->start_icount);
+}
+
+/**
+ * Feed the state to the detector, once it has run the instructions due.
+ * Returns true once it repeats a state seen before
+ */
+bool emul_cycle_check(struct emul_cycle *c, const struct emul_context *ctx)
+{
+	struct emul_state now;
+	struct emul_cycle_seen *slot = NULL;
+	uint64_t at = ctx->icount - c->start_icount;
+
+	if (at != c->next)
+		return false;
+	c->checked = at;
+
+	emul_get_state(ctx, &now);
+	slot = find(c, &now);
+	if (slot->at) {
+		c->period = at - (slot->at - 1);
+		return true;
+	}
+
+	/* still stepping through the window */
+	if (c->recorded < EMUL_CYCLE_SLICE) {
+		slot->state = now;
+		slot->at = at + 1;
+		c->recorded++;
+		c->next = at + 1;
+		return false;
+	}
+
+	/* checks fall on multiples of the slice, so one lands on each window */
+	if (at >= 2 * c->window && at >= EMUL_CYCLE_SLICE)
+		open_window(c, &now, at);
+	else
+		c->next = at + EMUL_CYCLE_SLICE;
+	return false;
+}
+
+/**
+ * Feed the state fast-forward has just left `ctx' in to the detector, and take
+ * the windows from there. Returns true once it repeats a state left before
+ */
+static bool landed(struct emul_cycle *c, const struct emul_context *ctx)
+{
+	struct emul_state now;
+
+	c->skipped = true;
+	emul_get_state(ctx, &now);
+	if (c->power && same_state(&now, &c->landing)) {
+		c->period = ctx->icount - c->landing_icount;
+		return true;
+	}
+
+	if (c->lam == c->power) {
+		c->landing = now;
+		c->landing_icount = ctx->icount;
+		c->power = c->power ? 2 * c->power : 1;
+		c->lam = 0;
+	}
+	c->lam++;
+	emul_cycle_restart(c, ctx);
+	return false;
+}
+
+/* Run exactly `n' instructions of `engine', fast-forwarding if `ff' */
+static int advance(struct emul_context *ctx, const struct emul_engine *engine, uint64_t n, bool ff)
+{
+	uint64_t start = ctx->icount;
+	enum EMUL_EXIT ret = ff ? emul_run_ff(ctx, engine, n) : engine->run(ctx, n);
+
+	return ret != EMUL_EXIT_BUDGET || ctx->icount - start != n;
+}
+
+/**
+ * After emul_cycle_check() has found a repeat in `ctx', work out where the
+ * cycle is entered and its period. Returns non-zero on error
+ */
+int emul_cycle_locate(const struct emul_cycle *c, const struct emul_context *ctx,
+	const struct emul_engine *engine, struct emul_cycle_info *info)
+{
+	struct emul_context a;
+	struct emul_context b;
+	struct emul_state here;
+	struct emul_state sa;
+	struct emul_state sb;
+	uint64_t period = c->period;
+	uint64_t rest = 0;
+	uint64_t p = 0;
+	uint64_t entry = 0;
+	uint64_t stride = 0;
+	bool ff = c->skipped;
+	int ret = 1;
+
+	if (emul_init(&a, ctx->ram, ctx->ram_size, ctx->bytes_used))
+		return 1;
+	if (emul_init(&b, ctx->ram, ctx->ram_size, ctx->bytes_used)) {
+		emul_free(&a);
+		return 1;
+	}
+
+	/* `period' is some multiple of the real period, so divide out each of
+	 * its prime factors for as long as the state still repeats */
+	emul_get_state(ctx, &here);
+	for (p = 2, rest = period; rest > 1; p++) {
+		if (p * p > rest)
+			p = rest;
+		if (rest % p)
+			continue;
+		while (rest % p == 0)
+			rest /= p;
+		while (period % p == 0) {
+			emul_set_state(&a, &here);
+			if (advance(&a, engine, period / p, ff))
+				goto out;
+			if (!in_state(&a, &here))
+				break;
+			period /= p;
+		}
+	}
+
+	/* walk from the origin alongside a copy one period ahead until the two
+	 * meet, in strides doubling from a slice, then back over the last stride
+	 * in halves to the first instruction at which they do; fast-forwarding
+	 * as the run did, that is as quick as the run however long the way in */
+	emul_set_state(&a, &c->origin);
+	emul_set_state(&b, &c->origin);
+	if (advance(&b, engine, period, ff))
+		goto out;
+
+	emul_get_state(&b, &sb);
+	if (!in_state(&a, &sb)) {
+		for (stride = EMUL_CYCLE_SLICE; ; stride *= 2) {
+			emul_get_state(&a, &sa);
+			emul_get_state(&b, &sb);
+			if (advance(&a, engine, stride, ff) || advance(&b, engine, stride, ff))
+				goto out;
+			emul_get_state(&b, &here);
+			if (in_state(&a, &here))
+				break;
+			entry += stride;
+		}
+
+		/* apart at `entry', together `stride' on */
+		for (stride /= 2; stride; stride /= 2) {
+			emul_set_state(&a, &sa);
+			emul_set_state(&b, &sb);
+			if (advance(&a, engine, stride, ff) || advance(&b, engine, stride, ff))
+				goto out;
+			emul_get_state(&b, &here);
+			if (!in_state(&a, &here)) {
+				entry += stride;
+				emul_get_state(&a, &sa);
+				emul_get_state(&b, &sb);
+			}
+		}
+
+		emul_set_state(&a, &sa);
+		if (advance(&a, engine, 1, false))
+			goto out;
+		entry++;
+	}
+
+	info->pc = a.pc;
+	info->entry = c->origin_icount + entry;
+	info->period = period;
+	debug("cycle: pc 0x%x, entry %llu, period %llu\n", a.pc,
+		(unsigned long long)entry, (unsigned long long)period);
+	ret = 0;
+out:
+	emul_free(&a);
+	emul_free(&b);
+	return ret;
+}
+
+/**
+ * Run `ctx' on to the detector's next check, or for `n' instructions if fewer,
+ * and check it there. Every driver runs its guests through this, so they all
+ * check at the same points. Returns EMUL_CYCLE_FOUND with `info' describing
+ * the cycle once in one, or EMUL_CYCLE_RUNNING if there is more to run
+ */
+enum EMUL_CYCLE_STOP emul_cycle_step(struct emul_context *ctx, struct emul_cycle *c,
+	const struct emul_engine *engine, bool fast_forward, uint64_t n, struct emul_cycle_info *info)
+{
+	enum EMUL_EXIT status = EMUL_EXIT_BUDGET;
+	uint64_t start = ctx->icount;
+	uint64_t slice = emul_cycle_due(c, ctx);
+	bool skipped = false;
+	bool found = false;
+
+	if (slice > n)
+		slice = n;
+
+	/* fast-forward only from a check, and never on to a loop's head past the
+	 * next, so that in a cycle the same states come round again */
+	if (fast_forward && ctx->icount - c->start_icount == c->checked) {
+		status = emul_ff_skip(ctx, n, slice, &skipped);
+		if (status == EMUL_EXIT_BUDGET && skipped)
+			found = landed(c, ctx);
+		else
+			slice -= ctx->icount - start;
+	}
+	if (status == EMUL_EXIT_BUDGET && !skipped && slice)
+		status = engine->run(ctx, slice);
+
+	if (status == EMUL_EXIT_HALT)
+		return EMUL_CYCLE_HALTED;
+	if (status == EMUL_EXIT_ERROR)
+		return EMUL_CYCLE_FAILED;
+	if (!found && (skipped || !emul_cycle_check(c, ctx)))
+		return EMUL_CYCLE_RUNNING;
+	return emul_cycle_locate(c, ctx, engine, info) ? EMUL_CYCLE_LOST : EMUL_CYCLE_FOUND;
+}
+
+/**
+ * Run `ctx' until it halts or goes round in circles. Returns EMUL_EXIT_HALT
+ * once halted, or EMUL_EXIT_BUDGET with `info' describing the cycle it can
+ * never leave
+ */
+enum EMUL_EXIT emul_cycle_run(struct emul_context *ctx, const struct emul_engine *engine, bool fast_forward,
+	struct emul_cycle_info *info)
+{
+	enum EMUL_CYCLE_STOP stop = EMUL_CYCLE_RUNNING;
+	struct emul_cycle cycle;
+
+	if (emul_cycle_init(&cycle, ctx))
+		return EMUL_EXIT_ERROR;
+	while ((stop = emul_cycle_step(ctx, &cycle, engine, fast_forward, UINT64_MAX, info)) == EMUL_CYCLE_RUNNING)
+		;
+	emul_cycle_free(&cycle);
+
+	switch (stop) {
+		case EMUL_CYCLE_HALTED:
+			return EMUL_EXIT_HALT;
+		case EMUL_CYCLE_FOUND:
+			return EMUL_EXIT_BUDGET;
+		default:
+			return EMUL_EXIT_ERROR;
+	}
+}
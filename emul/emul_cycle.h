@@ -0,0 +1,89 @@
+#ifndef EMUL_CYCLE_H
+#define EMUL_CYCLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emul/emul.h"
+
+/* Instructions between checks, and states in a window; see emul_cycle.c */
+#define EMUL_CYCLE_SLICE 4096
+
+/* Slots in the table of a window's states: twice as many, a power of two */
+#define EMUL_CYCLE_TABLE (2 * EMUL_CYCLE_SLICE)
+
+/* Exit code of the tools for a guest which can never halt */
+#define EMUL_CYCLE_EXIT_CODE 2
+
+/**
+ * Everything an instruction can depend on or change. There are no stores, so
+ * RAM never takes part
+ */
+struct emul_state {
+	uint16_t pc;
+	uint16_t registers[REG_COUNT];
+	bool zf;
+	bool cf;
+};
+
+/* A state recorded in a window, and instructions from the start to it */
+struct emul_cycle_seen {
+	struct emul_state state;
+	uint64_t at;
+};
+
+/**
+ * Cycle detection: windows of EMUL_CYCLE_SLICE consecutive states, each
+ * twice as far from the start as the last, against which the state is
+ * checked every EMUL_CYCLE_SLICE instructions
+ */
+struct emul_cycle {
+	struct emul_state origin;   /* state before the first instruction */
+	uint64_t origin_icount;     /* instructions retired before that */
+	struct emul_state start;    /* state the windows are taken from */
+	uint64_t start_icount;
+	struct emul_cycle_seen *seen; /* the window, EMUL_CYCLE_TABLE slots */
+	uint64_t window;            /* instructions from the start to the window */
+	uint64_t recorded;          /* states of it recorded so far */
+	uint64_t next;              /* instructions from the start to the next check */
+	uint64_t checked;           /* instructions from the start to the last one */
+	uint64_t period;            /* once found, a multiple of the period */
+	/* Brent's algorithm over the states fast-forward leaves behind, each of
+	 * which starts the windows again */
+	bool skipped;
+	struct emul_state landing;
+	uint64_t landing_icount;
+	uint64_t power;
+	uint64_t lam;
+};
+
+struct emul_cycle_info {
+	uint16_t pc;      /* first pc of the cycle */
+	uint64_t entry;   /* instructions retired before entering it */
+	uint64_t period;  /* instructions per trip around it */
+};
+
+/* Where emul_cycle_step() stopped */
+enum EMUL_CYCLE_STOP {
+	EMUL_CYCLE_RUNNING, /* no cycle yet, and more to run */
+	EMUL_CYCLE_HALTED,
+	EMUL_CYCLE_FOUND,   /* can never halt, see the emul_cycle_info */
+	EMUL_CYCLE_FAILED,  /* undecodable instruction */
+	EMUL_CYCLE_LOST,    /* in a cycle, but it could not be located */
+};
+
+void emul_get_state(const struct emul_context *ctx, struct emul_state *s);
+void emul_set_state(struct emul_context *ctx, const struct emul_state *s);
+int emul_cycle_init(struct emul_cycle *c, const struct emul_context *ctx);
+void emul_cycle_restart(struct emul_cycle *c, const struct emul_context *ctx);
+void emul_cycle_free(struct emul_cycle *c);
+uint64_t emul_cycle_due(const struct emul_cycle *c, const struct emul_context *ctx);
+bool emul_cycle_check(struct emul_cycle *c, const struct emul_context *ctx);
+int emul_cycle_locate(const struct emul_cycle *c, const struct emul_context *ctx,
+	const struct emul_engine *engine, struct emul_cycle_info *info);
+enum EMUL_CYCLE_STOP emul_cycle_step(struct emul_context *ctx, struct emul_cycle *c,
+	const struct emul_engine *engine, bool fast_forward, uint64_t n, struct emul_cycle_info *info);
+enum EMUL_EXIT emul_cycle_run(struct emul_context *ctx, const struct emul_engine *engine, bool fast_forward,
+	struct emul_cycle_info *info);
+
+#endif /* EMUL_CYCLE_H */
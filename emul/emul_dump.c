@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "util.h"
+#include "emul/emul.h"
+#include "emul/emul_dump.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Machine-readable states, and postconditions checked without leaving the
+ * emulator.
+ *
+ * The binary dump is the magic "TOYD", then big-endian pc and $0 to $H (16
+ * bits each), the flags (8 bits: zf in bit 0, cf in bit 1) and the number of
+ * instructions retired (64 bits).
+ */
+
+static const struct {
+	const char *name;
+	enum EMUL_DUMP format;
+} formats[] = {
+	{ "none",   EMUL_DUMP_NONE   },
+	{ "text",   EMUL_DUMP_TEXT   },
+	{ "json",   EMUL_DUMP_JSON   },
+	{ "binary", EMUL_DUMP_BINARY },
+	{ NULL },
+};
+
+/* Look up a dump format by name. Returns non-zero if there is none */
+int emul_dump_format(const char *name, enum EMUL_DUMP *format)
+{
+	size_t i = 0;
+
+	for (i = 0; formats[i].name; i++) {
+		if (strcmp(formats[i].name, name) == 0) {
+			*format = formats[i].format;
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "Unknown dump format `%s'\n", name);
+	return 1;
+}
+
+/* The pc and registers of `ctx', as members of a JSON object */
+void emul_json_state(FILE *f, const struct emul_context *ctx)
+{
+	size_t r = 0;
+
+	fprintf(f, "\"pc\": %d, \"registers\": [", ctx->pc);
+	for (r = 0; r < REG_COUNT; r++)
+		fprintf(f, "%s%d", r ? ", " : "", ctx->registers[r]);
+	fputc(']', f);
+}
+
+void emul_dump(FILE *f, const struct emul_context *ctx, enum EMUL_DUMP format)
+{
+	uint8_t buf[EMUL_DUMP_BINARY_SIZE];
+	uint8_t *p = buf;
+	size_t r = 0;
+
+	switch (format) {
+		case EMUL_DUMP_TEXT:
+			emul_dump_registers(f, ctx);
+			break;
+		case EMUL_DUMP_JSON:
+			fputc('{', f);
+			emul_json_state(f, ctx);
+			fprintf(f, ", \"zf\": %s, \"cf\": %s, \"instructions\": %llu}\n",
+				emul_zf(ctx) ? "true" : "false", emul_cf(ctx) ? "true" : "false",
+				(unsigned long long)ctx->icount);
+			break;
+		case EMUL_DUMP_BINARY:
+			memcpy(p, "TOYD", 4);
+			p = put_be(p + 4, ctx->pc, 2);
+			for (r = 0; r < REG_COUNT; r++)
+				p = put_be(p, ctx->registers[r], 2);
+			p = put_be(p, emul_zf(ctx) | emul_cf(ctx) << 1, 1);
+			put_be(p, ctx->icount, 8);
+			fwrite(buf, 1, sizeof(buf), f);
+			break;
+		case EMUL_DUMP_NONE:
+		default:
+			break;
+	}
+}
+
+/**
+ * Check `ctx' against the postconditions in the source `src': lines of the
+ * form `; POST <reg> = <value>'. Writes `PASS <reg>' or `FAIL <reg> expect
+ * <value> got <value>' to `out' for each. Returns the number which fail, or
+ * -1 if one is malformed
+ */
+int emul_check_posts(FILE *src, FILE *out, const struct emul_context *ctx)
+{
+	char line[256];
+	char reg_name[8];
+	char *p = NULL;
+	char *end = NULL;
+	size_t lineno = 0;
+	enum REG reg = REG_0;
+	unsigned long expect = 0;
+	int n = 0;
+	int failed = 0;
+
+	while (fgets(line, sizeof(line), src)) {
+		lineno++;
+		p = line + strspn(line, " \t");
+		if (*p != ';')
+			continue;
+		p += 1 + strspn(p + 1, " \t");
+		if (strncmp(p, "POST", 4) || !strchr(" \t", p[4]))
+			continue;
+
+		p += 4 + strspn(p + 4, " \t");
+		n = strcspn(p, " \t=");
+		if (n >= (int)sizeof(reg_name))
+			goto bad;
+		memcpy(reg_name, p, n);
+		reg_name[n] = '\0';
+		p += n + strspn(p + n, " \t");
+		if (get_reg_from_asm(reg_name, &reg) || *p != '=')
+			goto bad;
+		p++;
+		expect = strtoul(p, &end, 0);
+		if (end == p || !strchr(" \t\r\n", *end))
+			goto bad;
+
+		if (ctx->registers[reg] == expect) {
+			fprintf(out, "PASS %s\n", reg_name);
+		} else {
+			fprintf(out, "FAIL %s expect 0x%lx got 0x%x\n", reg_name, expect, ctx->registers[reg]);
+			failed++;
+		}
+	}
+
+	return failed;
+
+bad:
+	fprintf(stderr, "Malformed postcondition on line %zd\n", lineno);
+	return -1;
+}
@@ -0,0 +1,26 @@
+#ifndef EMUL_DUMP_H
+#define EMUL_DUMP_H
+
+#include <stdio.h>
+
+#include "emul/emul.h"
+
+/* Formats for the state of a guest once it has stopped */
+enum EMUL_DUMP {
+	EMUL_DUMP_NONE,
+	EMUL_DUMP_TEXT,   /* emul_dump_registers(), for people */
+	EMUL_DUMP_JSON,   /* one object on one line */
+	EMUL_DUMP_BINARY, /* EMUL_DUMP_BINARY_SIZE bytes, see emul_dump.c */
+};
+
+#define EMUL_DUMP_BINARY_SIZE (4 + 2 + 2 * REG_COUNT + 1 + 8)
+
+/* Exit code of the tools for a guest failing emul_check_posts() */
+#define EMUL_POST_EXIT_CODE 3
+
+int emul_dump_format(const char *name, enum EMUL_DUMP *format);
+void emul_dump(FILE *f, const struct emul_context *ctx, enum EMUL_DUMP format);
+void emul_json_state(FILE *f, const struct emul_context *ctx);
+int emul_check_posts(FILE *src, FILE *out, const struct emul_context *ctx);
+
+#endif /* EMUL_DUMP_H */
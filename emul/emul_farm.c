@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "emul/emul.h"
+#include "emul/emul_cycle.h"
+#include "emul/emul_farm.h"
+#include "emul/emul_manifest.h"
+#include "emul/emul_dump.h"
+#include "input/input_bin.h"
+
+#ifdef EMUL_HAVE_FARM
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Emulation farm: run every program listed in a manifest (emul_manifest.c),
+ * spread over a pool of threads, writing one line of JSON per program as each
+ * finishes. Priorities are for the scheduler, and ignored here.
+ *
+ * Each worker starts with an even share of the jobs in its own deque, taking
+ * them from the back. A worker whose deque runs dry steals the front half of
+ * another's, so a few long jobs don't leave the other threads idle.
+ *
+ * Guests cannot write memory, so programs are not copied: a program's image
+ * is its file mapped copy-on-write into 64K of zero pages, and jobs running
+ * the same file at the same time share one mapping. A file is known by its
+ * device, inode, size and modification time, so sharing costs one fstat().
+ */
+
+#define FARM_RAM_SIZE 65536
+
+struct image {
+	uint8_t *ram;      /* FARM_RAM_SIZE bytes, mapped read-only */
+	size_t size;       /* bytes of program at the start of `ram' */
+	dev_t dev;         /* the file it was mapped from */
+	ino_t ino;
+	struct timespec mtime;
+	size_t users;      /* jobs running it */
+	struct image *next;
+};
+
+/* Jobs [head, tail) of the manifest, not yet started */
+struct deque {
+	pthread_mutex_t lock;
+	size_t head;
+	size_t tail;
+};
+
+struct farm {
+	struct emul_job *jobs;
+	size_t n_jobs;
+	struct deque *deques;
+	unsigned workers;
+	const struct emul_engine *engine;
+	bool fast_forward;
+	FILE *out;
+	pthread_mutex_t images_lock;
+	struct image *images; /* in use by a running job */
+	bool failed;
+};
+
+struct worker {
+	struct farm *farm;
+	unsigned id;
+	pthread_t thread;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Whether `i' was mapped from the file `st' describes, as it is now */
+static bool image_is(const struct image *i, const struct stat *st)
+{
+	return i->dev == st->st_dev && i->ino == st->st_ino && i->size == (size_t)st->st_size
+	    && i->mtime.tv_sec == st->st_mtim.tv_sec && i->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* The running image of the file `st' describes, with a user added, or NULL.
+ * Called with images_lock held */
+static struct image *image_find(struct farm *f, const struct stat *st)
+{
+	struct image *i = NULL;
+
+	for (i = f->images; i; i = i->next) {
+		if (image_is(i, st)) {
+			i->users++;
+			return i;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Map the program at `path', or share the mapping of a running job with the
+ * same file. Returns NULL with `error' set on failure
+ */
+static struct image *image_get(struct farm *f, const char *path, const char **error)
+{
+	int fd = -1;
+	struct stat st;
+	uint8_t *ram = MAP_FAILED;
+	struct image *i = NULL;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st)) {
+		*error = strerror(errno);
+		goto fail;
+	}
+	if (st.st_size > FARM_RAM_SIZE) {
+		*error = "program larger than memory";
+		goto fail;
+	}
+
+	pthread_mutex_lock(&f->images_lock);
+	i = image_find(f, &st);
+	pthread_mutex_unlock(&f->images_lock);
+	if (i) {
+		close(fd);
+		return i;
+	}
+
+	/* the file over zero pages, both copy-on-write */
+	ram = mmap(NULL, FARM_RAM_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ram == MAP_FAILED ||
+	    (st.st_size && mmap(ram, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+		*error = strerror(errno);
+		goto fail;
+	}
+	close(fd);
+	fd = -1;
+
+	/* another job may have mapped it meanwhile */
+	pthread_mutex_lock(&f->images_lock);
+	if ((i = image_find(f, &st)) != NULL) {
+		pthread_mutex_unlock(&f->images_lock);
+		munmap(ram, FARM_RAM_SIZE);
+		return i;
+	}
+	if ((i = calloc(1, sizeof(*i))) == NULL) {
+		pthread_mutex_unlock(&f->images_lock);
+		*error = strerror(errno);
+		goto fail;
+	}
+	i->ram = ram;
+	i->size = st.st_size;
+	i->dev = st.st_dev;
+	i->ino = st.st_ino;
+	i->mtime = st.st_mtim;
+	i->users = 1;
+	i->next = f->images;
+	f->images = i;
+	pthread_mutex_unlock(&f->images_lock);
+	return i;
+
+fail:
+	if (ram != MAP_FAILED)
+		munmap(ram, FARM_RAM_SIZE);
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+static void image_put(struct farm *f, struct image *image)
+{
+	struct image **i = NULL;
+
+	pthread_mutex_lock(&f->images_lock);
+	if (--image->users) {
+		pthread_mutex_unlock(&f->images_lock);
+		return;
+	}
+	for (i = &f->images; *i != image; i = &(*i)->next)
+		;
+	*i = image->next;
+	pthread_mutex_unlock(&f->images_lock);
+
+	munmap(image->ram, FARM_RAM_SIZE);
+	free(image);
+}
+
+/* Run job `index' and write its result */
+static void run_job(struct farm *f, size_t index)
+{
+	const struct emul_job *j = &f->jobs[index];
+	const char *status = "error";
+	const char *error = NULL;
+	struct image *image = NULL;
+	struct emul_context ctx;
+	struct emul_cycle cycle;
+	struct emul_cycle_info info;
+	enum EMUL_CYCLE_STOP stop = EMUL_CYCLE_RUNNING;
+	double start = now();
+	uint64_t n = 0;
+	bool cycled = false;
+
+	memset(&ctx, 0, sizeof(ctx));
+	memset(&cycle, 0, sizeof(cycle));
+	if ((image = image_get(f, j->path, &error)) == NULL)
+		goto report;
+	if (emul_init(&ctx, image->ram, FARM_RAM_SIZE, image->size)) {
+		error = "out of memory";
+		goto report;
+	}
+
+	/* as emulator_run(), within the budget and the time allowed */
+	if (emul_cycle_init(&cycle, &ctx)) {
+		error = "out of memory";
+		goto report;
+	}
+	for (;;) {
+		n = UINT64_MAX;
+		if (j->budget)
+			n = j->budget - ctx.icount;
+		if (!n) {
+			status = "budget";
+			break;
+		}
+
+		stop = emul_cycle_step(&ctx, &cycle, f->engine, f->fast_forward, n, &info);
+		if (stop == EMUL_CYCLE_HALTED) {
+			status = "halt";
+			break;
+		}
+		if (stop == EMUL_CYCLE_FAILED) {
+			error = "undecodable instruction";
+			break;
+		}
+		if (stop == EMUL_CYCLE_LOST) {
+			error = "cannot locate cycle";
+			break;
+		}
+		if (stop == EMUL_CYCLE_FOUND) {
+			status = "cycle";
+			cycled = true;
+			break;
+		}
+		if (j->timeout && now() - start > j->timeout) {
+			status = "timeout";
+			break;
+		}
+	}
+
+report:
+	flockfile(f->out);
+	fprintf(f->out, "{\"job\": %zd, \"program\": ", index);
+	emul_json_string(f->out, j->path);
+	fprintf(f->out, ", \"status\": \"%s\"", status);
+	if (error) {
+		fprintf(f->out, ", \"error\": ");
+		emul_json_string(f->out, error);
+		f->failed = true;
+	}
+	fprintf(f->out, ", \"instructions\": %llu, \"seconds\": %.6f",
+		(unsigned long long)ctx.icount, now() - start);
+	if (ctx.ram) {
+		fputs(", ", f->out);
+		emul_json_state(f->out, &ctx);
+	}
+	if (cycled)
+		fprintf(f->out, ", \"cycle\": {\"pc\": %d, \"entry\": %llu, \"period\": %llu}",
+			info.pc, (unsigned long long)info.entry, (unsigned long long)info.period);
+	fputs("}\n", f->out);
+	funlockfile(f->out);
+
+	if (ctx.ram)
+		emul_free(&ctx);
+	emul_cycle_free(&cycle);
+	if (image)
+		image_put(f, image);
+}
+
+/* Take a job from the back of worker `id''s deque. Returns false if empty */
+static bool take(struct farm *f, unsigned id, size_t *job)
+{
+	struct deque *d = &f->deques[id];
+	bool ok = false;
+
+	pthread_mutex_lock(&d->lock);
+	if ((ok = d->head < d->tail))
+		*job = --d->tail;
+	pthread_mutex_unlock(&d->lock);
+
+	return ok;
+}
+
+/**
+ * Move the front half of another worker's jobs into worker `id''s empty
+ * deque. Returns false once there are none left anywhere
+ */
+static bool steal(struct farm *f, unsigned id)
+{
+	struct deque *victim = NULL;
+	size_t head = 0;
+	size_t n = 0;
+	unsigned k = 0;
+
+	for (k = 1; k < f->workers; k++) {
+		victim = &f->deques[(id + k) % f->workers];
+		pthread_mutex_lock(&victim->lock);
+		head = victim->head;
+		n = (victim->tail - victim->head + 1) / 2;
+		victim->head += n;
+		pthread_mutex_unlock(&victim->lock);
+		if (!n)
+			continue;
+
+		pthread_mutex_lock(&f->deques[id].lock);
+		f->deques[id].head = head;
+		f->deques[id].tail = head + n;
+		pthread_mutex_unlock(&f->deques[id].lock);
+		return true;
+	}
+
+	return false;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	size_t job = 0;
+
+	do {
+		while (take(w->farm, w->id, &job))
+			run_job(w->farm, job);
+	} while (steal(w->farm, w->id));
+
+	return NULL;
+}
+
+/**
+ * Run every job of `manifest' with `engine' on `workers' threads, or one per
+ * CPU if zero, writing results to `out'. Returns non-zero if the manifest is
+ * malformed or any job fails to run
+ */
+int emul_farm(FILE *manifest, FILE *out, const struct emul_engine *engine, bool fast_forward, unsigned workers)
+{
+	struct farm f;
+	struct worker *w = NULL;
+	unsigned i = 0;
+	unsigned started = 0;
+	int ret = 1;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	memset(&f, 0, sizeof(f));
+	f.engine = engine;
+	f.fast_forward = fast_forward;
+	f.out = out;
+	f.workers = workers ? workers : cpus > 0 ? cpus : 1;
+	pthread_mutex_init(&f.images_lock, NULL);
+
+	if (emul_manifest_read(manifest, &f.jobs, &f.n_jobs))
+		goto out;
+	if (f.workers > f.n_jobs)
+		f.workers = f.n_jobs ? f.n_jobs : 1;
+
+	if ((f.deques = calloc(f.workers, sizeof(*f.deques))) == NULL ||
+	    (w = calloc(f.workers, sizeof(*w))) == NULL) {
+		perror("calloc");
+		goto out;
+	}
+
+	/* shared by every thread, so filled before any start */
+	emul_decode_init();
+
+	for (i = 0; i < f.workers; i++) {
+		pthread_mutex_init(&f.deques[i].lock, NULL);
+		f.deques[i].head = f.n_jobs * i / f.workers;
+		f.deques[i].tail = f.n_jobs * (i + 1) / f.workers;
+	}
+	for (started = 0; started < f.workers; started++) {
+		w[started].farm = &f;
+		w[started].id = started;
+		if ((errno = pthread_create(&w[started].thread, NULL, worker_main, &w[started]))) {
+			/* the threads already started steal the others' jobs */
+			perror("pthread_create");
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(w[i].thread, NULL);
+	if (!started)
+		goto out;
+
+	fflush(out);
+	ret = f.failed;
+
+out:
+	emul_manifest_free(f.jobs, f.n_jobs);
+	free(f.deques);
+	free(w);
+	return ret;
+}
+
+#else /* !EMUL_HAVE_FARM */
+
+int emul_farm(FILE *manifest, FILE *out, const struct emul_engine *engine, bool fast_forward, unsigned workers)
+{
+	(void)manifest;
+	(void)out;
+	(void)engine;
+	(void)fast_forward;
+	(void)workers;
+
+	fprintf(stderr, "No emulation farm in this build\n");
+	return 1;
+}
+
+#endif /* EMUL_HAVE_FARM */
@@ -0,0 +1,16 @@
+#ifndef EMUL_FARM_H
+#define EMUL_FARM_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "emul/emul.h"
+
+/* Run programs in threads, with images shared through mmap(2) */
+#if defined(__unix__)
+#define EMUL_HAVE_FARM
+#endif
+
+int emul_farm(FILE *manifest, FILE *out, const struct emul_engine *engine, bool fast_forward, unsigned workers);
+
+#endif /* EMUL_FARM_H */
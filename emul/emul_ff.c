@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "instruction.h"
+#include "emul/emul.h"
+#include "emul/emul_ff.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Closed-form fast-forward of counted loops.
+ *
+ * The engine runs in slices of FF_SLICE instructions. Whenever a slice, or
+ * the run before, ends inside a loop of the form
+ *
+ *   head:  <straight-line ALU operations>
+ *          jnz/bnz head
+ *
+ * the loop is stepped to its head and its body is executed symbolically. If
+ * every register it writes ends each iteration either as its own start value
+ * plus a constant, or as a constant, and the branch tests such a register plus
+ * a constant, then the number of iterations left can be solved for and all but
+ * the last of them applied at once. The last iteration is left for the engine
+ * to run, so the final flags and pc come out exactly as if every iteration had
+ * been stepped through.
+ *
+ * The cycle detector calls emul_ff_skip() instead, which skips all the way
+ * to the end of a loop however many of its slices that spans.
+ */
+
+#define FF_SLICE 4096
+#define FF_MAX_BODY 64
+
+/* Symbolic value: a constant, or a register's value at the start of the
+ * iteration plus a constant */
+enum SYM_KIND {
+	SYM_CONST,
+	SYM_REG,
+	SYM_UNKNOWN,
+};
+
+struct sym {
+	uint8_t kind; /* enum SYM_KIND */
+	uint8_t reg;
+	uint16_t v;
+};
+
+struct ff_loop {
+	uint16_t head;
+	uint16_t branch;
+	uint64_t len;              /* instructions per iteration, branch included */
+	struct sym regs[REG_COUNT]; /* register values at the end of an iteration */
+	struct sym test;           /* value the branch tests for zero */
+};
+
+struct ff_report {
+	uint16_t head;
+	uint16_t branch;
+	uint64_t times;      /* entries to the loop, however many skips each took */
+	uint64_t iterations;
+	uint64_t ends;       /* icount at which the latest entry falls through */
+};
+
+struct ff_state {
+	struct ff_report *loops;
+	size_t loops_count;
+};
+
+static const struct predecoded *slot(struct emul_context *ctx, uint16_t pc)
+{
+	struct predecoded *p = &ctx->cache[pc];
+
+	if (!p->size && emul_predecode(ctx, pc, p))
+		return NULL;
+	return p;
+}
+
+static bool is_alu(const struct predecoded *p)
+{
+	return p->type == INST_TYPE_R || p->type == INST_TYPE_NI || p->type == INST_TYPE_WI;
+}
+
+static struct sym sym_alu(uint8_t oper, struct sym l, struct sym r)
+{
+	struct sym res = { .kind = SYM_UNKNOWN };
+
+	if (l.kind == SYM_CONST && r.kind == SYM_CONST) {
+		res.kind = SYM_CONST;
+		res.v = emul_alu(oper, l.v, r.v);
+	} else if (oper == OPER_ADD && l.kind == SYM_REG && r.kind == SYM_CONST) {
+		res = l;
+		res.v += r.v;
+	} else if (oper == OPER_ADD && l.kind == SYM_CONST && r.kind == SYM_REG) {
+		res = r;
+		res.v += l.v;
+	} else if (oper == OPER_SUB && l.kind == SYM_REG && r.kind == SYM_CONST) {
+		res = l;
+		res.v -= r.v;
+	}
+
+	return res;
+}
+
+/**
+ * Find the loop around `pc' and work out the effect of one iteration of it on
+ * the current register values. Returns non-zero if there is no loop, or it is
+ * not one which can be fast-forwarded
+ */
+static int analyse(struct emul_context *ctx, uint16_t pc, size_t end, struct ff_loop *loop)
+{
+	const struct predecoded *p = NULL;
+	struct sym regs[REG_COUNT];
+	struct sym res = { .kind = SYM_UNKNOWN };
+	bool written[REG_COUNT] = { false };
+	uint32_t at = pc;
+	size_t i = 0;
+	size_t n = 0;
+
+	/* the branch closing the loop is the first jump at or after pc */
+	for (n = 0; ; n++) {
+		if (n >= FF_MAX_BODY || at >= end || (p = slot(ctx, at)) == NULL)
+			return 1;
+		if (!is_alu(p))
+			break;
+		at += p->size;
+	}
+	if ((p->type != INST_TYPE_B && p->type != INST_TYPE_JI)
+	    || p->oper != JB_NZERO || p->imm > pc)
+		return 1;
+	loop->head = p->imm;
+	loop->branch = at;
+
+	/* which registers the body writes, checking it is straight-line code */
+	for (at = loop->head, n = 0; at < loop->branch; at += p->size, n++) {
+		if (n >= FF_MAX_BODY || (p = slot(ctx, at)) == NULL || !is_alu(p))
+			return 1;
+		written[p->dest] = true;
+	}
+	/* and that it lines up with the branch, not running over it */
+	if (at != loop->branch)
+		return 1;
+	loop->len = n + 1;
+
+	/* registers the body does not write are constant for the whole loop */
+	for (i = 0; i < REG_COUNT; i++) {
+		if (written[i] && i != REG_0 && i != REG_H)
+			regs[i] = (struct sym){ .kind = SYM_REG, .reg = i };
+		else
+			regs[i] = (struct sym){ .kind = SYM_CONST, .v = ctx->registers[i] };
+	}
+
+	for (at = loop->head; at < loop->branch; at += p->size) {
+		p = &ctx->cache[at];
+		res = sym_alu(p->oper, regs[p->left],
+			p->type == INST_TYPE_R ? regs[p->right] : (struct sym){ .kind = SYM_CONST, .v = p->imm });
+		if (p->dest != REG_0 && p->dest != REG_H)
+			regs[p->dest] = res;
+	}
+
+	/* each register must end up as a constant or stepping by one */
+	for (i = 0; i < REG_COUNT; i++) {
+		if (regs[i].kind == SYM_UNKNOWN)
+			return 1;
+		if (regs[i].kind == SYM_REG && regs[i].reg != i)
+			return 1;
+		loop->regs[i] = regs[i];
+	}
+
+	/* and the branch must test a register which steps */
+	if (res.kind != SYM_REG || regs[res.reg].kind != SYM_REG)
+		return 1;
+	loop->test = res;
+
+	return 0;
+}
+
+/**
+ * Iterations until the loop exits, counting the one which falls through, or 0
+ * if it never does. In iteration k the branch tests start + k * step, modulo
+ * 2^16, for the smallest k at which that is zero
+ */
+static uint64_t trip_count(uint16_t start, uint16_t step)
+{
+	uint32_t target = (uint16_t)-start;
+	uint32_t mod = 1 << 16;
+	uint32_t inv = 1;
+	int i = 0;
+
+	if (!step)
+		return start ? 0 : 1;
+
+	/* step = 2^n * odd: solvable only if 2^n divides the target */
+	while (!(step & 1)) {
+		if (target & 1)
+			return 0;
+		step >>= 1;
+		target >>= 1;
+		mod >>= 1;
+	}
+
+	/* inverse of the odd part by Newton's iteration, exact to 2^16 bits */
+	for (i = 0; i < 4; i++)
+		inv *= 2 - step * inv;
+
+	return ((target * inv) & (mod - 1)) + 1;
+}
+
+/**
+ * Count `skipped' iterations of `loop' skipped from its head at `at', in an
+ * entry to it which falls through at `ends'
+ */
+static void record(struct emul_context *ctx, const struct ff_loop *loop, uint64_t skipped, uint64_t at,
+	uint64_t ends)
+{
+	struct ff_state *ff = ctx->ff;
+	struct ff_report *r = NULL;
+	size_t i = 0;
+
+	for (i = 0; i < ff->loops_count; i++)
+		if (ff->loops[i].head == loop->head && ff->loops[i].branch == loop->branch)
+			break;
+
+	if (i == ff->loops_count) {
+		if ((r = realloc(ff->loops, (i + 1) * sizeof(*r))) == NULL) {
+			perror("realloc");
+			return;
+		}
+		ff->loops = r;
+		ff->loops[i] = (struct ff_report){ .head = loop->head, .branch = loop->branch };
+		ff->loops_count++;
+	}
+
+	/* another skip of an entry already counted, cut short by the budget */
+	if (at >= ff->loops[i].ends)
+		ff->loops[i].times++;
+	ff->loops[i].ends = ends;
+	ff->loops[i].iterations += skipped;
+}
+
+/**
+ * If the pc is inside a loop which can be fast-forwarded, step to its head,
+ * within `reach' instructions, and skip all but the last of its remaining
+ * iterations, within `budget'. Sets `skipped' if it skips any
+ */
+static enum EMUL_EXIT fast_forward(struct emul_context *ctx, uint64_t budget, uint64_t reach, bool *skipped)
+{
+	struct ff_loop loop;
+	struct ff_loop again;
+	size_t end = ctx->bytes_used < ctx->ram_size ? ctx->bytes_used : ctx->ram_size;
+	uint64_t trips = 0;
+	uint64_t skip = 0;
+	uint64_t at = 0;
+	uint64_t start = ctx->icount;
+	enum EMUL_EXIT ret = EMUL_EXIT_BUDGET;
+	size_t i = 0;
+
+	if (analyse(ctx, ctx->pc, end, &loop))
+		return EMUL_EXIT_BUDGET;
+
+	/* the analysis holds from the start of an iteration */
+	*skipped = false;
+	if (reach > budget)
+		reach = budget;
+	while (ctx->pc != loop.head) {
+		if (ctx->pc < loop.head || ctx->pc > loop.branch || ctx->icount - start >= reach)
+			return EMUL_EXIT_BUDGET;
+		if ((ret = emul_run(ctx, 1)) != EMUL_EXIT_BUDGET)
+			return ret;
+	}
+	budget -= ctx->icount - start;
+
+	/* from the head, on the registers as they are now, the same loop must
+	 * come out, or the closed form could start mid-iteration or on another */
+	if (analyse(ctx, ctx->pc, end, &again) || again.head != ctx->pc || again.head != loop.head ||
+	    again.branch != loop.branch)
+		return EMUL_EXIT_BUDGET;
+	loop = again;
+
+	trips = trip_count(ctx->registers[loop.test.reg] + loop.test.v, loop.regs[loop.test.reg].v);
+	skip = trips ? trips - 1 : 0;
+	if (skip > budget / loop.len)
+		skip = budget / loop.len;
+	if (skip < 2)
+		return EMUL_EXIT_BUDGET;
+	at = ctx->icount;
+
+	/* the last skipped iteration is run for real, to leave its flags behind */
+	for (i = 0; i < REG_COUNT; i++) {
+		if (loop.regs[i].kind == SYM_CONST)
+			ctx->registers[i] = loop.regs[i].v;
+		else
+			ctx->registers[i] += (skip - 1) * loop.regs[i].v;
+	}
+	ctx->icount += (skip - 1) * loop.len;
+	/* each iteration skipped ran the body once, and took the branch back */
+	emul_count_run(ctx, loop.head, loop.len, skip - 1);
+	ctx->counters.taken += skip - 1;
+
+	debug("fast-forward: 0x%x-0x%x, %llu iterations\n", loop.head, loop.branch, (unsigned long long)skip);
+	record(ctx, &loop, skip, at, trips ? at + trips * loop.len : UINT64_MAX);
+	*skipped = true;
+	return emul_run(ctx, loop.len);
+}
+
+/* The fast-forward state of `ctx', made on first use */
+static int ff_state(struct emul_context *ctx)
+{
+	if (!ctx->ff && (ctx->ff = calloc(1, sizeof(*ctx->ff))) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * If the pc is inside a loop which can be fast-forwarded, within `reach'
+ * instructions of its head, skip it, leaving `ctx' where it falls through or
+ * `budget' runs out. Sets `skipped' if so; if not, the pc may still have moved
+ * on to the head
+ */
+enum EMUL_EXIT emul_ff_skip(struct emul_context *ctx, uint64_t budget, uint64_t reach, bool *skipped)
+{
+	*skipped = false;
+	if (ff_state(ctx))
+		return EMUL_EXIT_ERROR;
+	return fast_forward(ctx, budget, reach, skipped);
+}
+
+/**
+ * Run `engine' on `ctx' for at most `budget' instructions, fast-forwarding
+ * through counted loops
+ */
+enum EMUL_EXIT emul_run_ff(struct emul_context *ctx, const struct emul_engine *engine, uint64_t budget)
+{
+	enum EMUL_EXIT ret = EMUL_EXIT_BUDGET;
+	uint64_t start = ctx->icount;
+	uint64_t used = 0;
+	bool skipped = false;
+
+	if (ff_state(ctx))
+		return EMUL_EXIT_ERROR;
+
+	/* a caller may ask for less than a slice at a time, so look for a loop
+	 * where the last call left off before running the engine, as well as
+	 * after each slice */
+	for (;;) {
+		used = ctx->icount - start;
+		if (used < budget && (ret = fast_forward(ctx, budget - used, budget - used, &skipped)) != EMUL_EXIT_BUDGET)
+			return ret;
+
+		used = ctx->icount - start;
+		if (used >= budget)
+			return EMUL_EXIT_BUDGET;
+		ret = engine->run(ctx, budget - used < FF_SLICE ? budget - used : FF_SLICE);
+		if (ret != EMUL_EXIT_BUDGET)
+			return ret;
+	}
+}
+
+void emul_ff_print_report(FILE *f, const struct emul_context *ctx)
+{
+	const struct ff_state *ff = ctx->ff;
+	size_t i = 0;
+
+	if (!ff)
+		return;
+
+	for (i = 0; i < ff->loops_count; i++)
+		fprintf(f, "fast-forwarded loop 0x%04x-0x%04x: %llu times, %llu iterations skipped\n",
+			ff->loops[i].head, ff->loops[i].branch,
+			(unsigned long long)ff->loops[i].times,
+			(unsigned long long)ff->loops[i].iterations);
+}
+
+void emul_ff_free(struct emul_context *ctx)
+{
+	if (!ctx->ff)
+		return;
+
+	free(ctx->ff->loops);
+	free(ctx->ff);
+	ctx->ff = NULL;
+}
@@ -0,0 +1,15 @@
+#ifndef EMUL_FF_H
+#define EMUL_FF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emul/emul.h"
+
+enum EMUL_EXIT emul_ff_skip(struct emul_context *ctx, uint64_t budget, uint64_t reach, bool *skipped);
+enum EMUL_EXIT emul_run_ff(struct emul_context *ctx, const struct emul_engine *engine, uint64_t budget);
+void emul_ff_print_report(FILE *f, const struct emul_context *ctx);
+void emul_ff_free(struct emul_context *ctx);
+
+#endif /* EMUL_FF_H */
@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "instruction.h"
+#include "emul/emul.h"
+#include "emul/emul_snap.h"
+#include "emul/emul_stats.h"
+#include "emul/emul_fuzz.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Coverage-guided fuzzing of a guest, in process: each run starts the program
+ * over in the same context with mutated initial registers and image bytes, and
+ * an input is kept if its run takes an edge, or an edge a number of times,
+ * never seen before. Mutations are AFL's havoc stage in small: bit flips,
+ * interesting values and small sums, a few stacked at a time, on an input
+ * picked in turn from those kept.
+ *
+ * A run halting is an ordinary one, a run out of budget is a hang and a run
+ * stopped by an error a crash. Each input kept, and each hang or crash taking
+ * edges no other has, is saved in the output directory as a snapshot of the
+ * guest about to start, to be run again with `emulator --restore'.
+ */
+
+enum FUZZ_KIND {
+	FUZZ_QUEUE,
+	FUZZ_HANG,
+	FUZZ_CRASH,
+	FUZZ_KINDS,
+};
+
+static const char *const kind_names[] = { "queue", "hang", "crash" };
+
+struct fuzz_input {
+	uint16_t registers[REG_COUNT];
+	uint8_t *bytes; /* the image bytes being mutated */
+};
+
+struct fuzz {
+	struct emul_context ctx;
+	size_t from;
+	size_t len;
+	const char *dir;
+	uint64_t seed;
+	struct fuzz_input *queue;
+	size_t queued;
+	size_t queue_size;
+	uint8_t trace[EMUL_COV_SIZE];
+	uint8_t virgin[FUZZ_KINDS][EMUL_COV_SIZE]; /* bits of buckets not yet hit */
+};
+
+static const uint16_t interesting16[] = { 0, 1, 2, 16, 32, 64, 0x7f, 0x80, 0xff, 0x100, 0x7fff, 0x8000, 0xffff };
+static const uint8_t interesting8[] = { 0, 1, 16, 32, 64, 0x7f, 0x80, 0xff };
+
+static uint64_t fuzz_rand(struct fuzz *fz, uint64_t limit)
+{
+	fz->seed ^= fz->seed << 13;
+	fz->seed ^= fz->seed >> 7;
+	fz->seed ^= fz->seed << 17;
+	return fz->seed % limit;
+}
+
+/* The bucket of a hit count, one bit each as AFL has them */
+static uint8_t bucket(uint8_t count)
+{
+	if (count < 3)
+		return count;
+	if (count < 4)
+		return 4;
+	if (count < 8)
+		return 8;
+	if (count < 16)
+		return 16;
+	if (count < 32)
+		return 32;
+	if (count < 128)
+		return 64;
+	return 128;
+}
+
+/**
+ * Clear the buckets hit in `trace' from `virgin'. Returns non-zero if any were
+ * still set there
+ */
+static int new_bits(uint8_t *virgin, const uint8_t *trace)
+{
+	uint64_t word = 0;
+	uint8_t b = 0;
+	size_t i = 0;
+	size_t j = 0;
+	int ret = 0;
+
+	for (i = 0; i < EMUL_COV_SIZE; i += sizeof(word)) {
+		memcpy(&word, trace + i, sizeof(word));
+		if (!word)
+			continue;
+		for (j = i; j < i + sizeof(word); j++) {
+			b = bucket(trace[j]);
+			if (virgin[j] & b) {
+				virgin[j] &= ~b;
+				ret = 1;
+			}
+		}
+	}
+	return ret;
+}
+
+/* Apply up to EMUL_FUZZ_STACK mutations to `in' */
+static void mutate(struct fuzz *fz, struct fuzz_input *in)
+{
+	uint64_t n = 1 + fuzz_rand(fz, EMUL_FUZZ_STACK);
+	uint16_t *reg = NULL;
+	uint8_t *byte = NULL;
+	uint16_t delta = 0;
+
+	while (n--) {
+		/* $0 and $H are fixed */
+		reg = &in->registers[REG_1 + fuzz_rand(fz, REG_H - REG_1)];
+		byte = fz->len ? &in->bytes[fuzz_rand(fz, fz->len)] : NULL;
+		delta = 1 + fuzz_rand(fz, 35);
+
+		switch (fuzz_rand(fz, byte ? 7 : 3)) {
+			case 0:
+				*reg ^= 1 << fuzz_rand(fz, 16);
+				break;
+			case 1:
+				*reg = interesting16[fuzz_rand(fz, sizeof(interesting16) / sizeof(*interesting16))];
+				break;
+			case 2:
+				*reg += fuzz_rand(fz, 2) ? delta : -delta;
+				break;
+			case 3:
+				*byte ^= 1 << fuzz_rand(fz, 8);
+				break;
+			case 4:
+				*byte = fuzz_rand(fz, 256);
+				break;
+			case 5:
+				*byte = interesting8[fuzz_rand(fz, sizeof(interesting8))];
+				break;
+			case 6:
+				*byte += fuzz_rand(fz, 2) ? delta : -delta;
+				break;
+		}
+	}
+}
+
+/* Set the guest up to start on `in' */
+static void fuzz_load(struct fuzz *fz, const struct fuzz_input *in)
+{
+	struct emul_context *ctx = &fz->ctx;
+
+	emul_ram_write(ctx, fz->from, in->bytes, fz->len);
+	ctx->pc = 0;
+	memcpy(ctx->registers, in->registers, sizeof(ctx->registers));
+	emul_set_flags(ctx, false, false);
+	ctx->icount = 0;
+	ctx->cov_prev = 0;
+}
+
+/* Save `in' to the output directory as the `id'th of `kind' */
+static int fuzz_save(struct fuzz *fz, const struct fuzz_input *in, enum FUZZ_KIND kind, uint64_t id)
+{
+	struct emul_snapshot snap;
+	char path[4096];
+	FILE *f = NULL;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s-%06llu.snap", fz->dir, kind_names[kind], (unsigned long long)id);
+	fuzz_load(fz, in);
+	if (emul_snapshot_take(&snap, &fz->ctx))
+		return 1;
+	if ((f = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "Error opening %s: ", path);
+		perror("fopen");
+		ret = 1;
+	} else {
+		ret = emul_snapshot_save(&snap, f);
+		fclose(f);
+	}
+	emul_snapshot_free(&snap);
+	return ret;
+}
+
+/* Keep a copy of `in' to mutate further. Returns non-zero on failure */
+static int fuzz_keep(struct fuzz *fz, const struct fuzz_input *in)
+{
+	struct fuzz_input *queue = NULL;
+	struct fuzz_input *kept = NULL;
+
+	if (fz->queued == fz->queue_size) {
+		if ((queue = realloc(fz->queue, 2 * (fz->queue_size + 16) * sizeof(*queue))) == NULL) {
+			perror("realloc");
+			return 1;
+		}
+		fz->queue = queue;
+		fz->queue_size = 2 * (fz->queue_size + 16);
+	}
+	kept = &fz->queue[fz->queued];
+	memcpy(kept->registers, in->registers, sizeof(kept->registers));
+	if ((kept->bytes = malloc(fz->len + 1)) == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	memcpy(kept->bytes, in->bytes, fz->len);
+	fz->queued++;
+	return 0;
+}
+
+/* Run `in', and keep or save it as it merits. Returns non-zero on failure */
+static int fuzz_one(struct fuzz *fz, const struct fuzz_input *in, struct emul_fuzz_stats *stats)
+{
+	enum FUZZ_KIND kind = FUZZ_QUEUE;
+
+	fuzz_load(fz, in);
+	memset(fz->trace, 0, sizeof(fz->trace));
+	switch (emul_run(&fz->ctx, EMUL_FUZZ_BUDGET)) {
+		case EMUL_EXIT_HALT:
+			kind = FUZZ_QUEUE;
+			break;
+		case EMUL_EXIT_BUDGET:
+			kind = FUZZ_HANG;
+			break;
+		case EMUL_EXIT_ERROR:
+		default:
+			kind = FUZZ_CRASH;
+			break;
+	}
+	stats->execs++;
+
+	if (!new_bits(fz->virgin[kind], fz->trace))
+		return 0;
+	switch (kind) {
+		case FUZZ_QUEUE:
+			debug("fuzz: input %llu reaches new edges\n", (unsigned long long)stats->queued);
+			if (fuzz_keep(fz, in))
+				return 1;
+			return fuzz_save(fz, in, kind, stats->queued++);
+		case FUZZ_HANG:
+			return fuzz_save(fz, in, kind, stats->hangs++);
+		case FUZZ_CRASH:
+		default:
+			return fuzz_save(fz, in, kind, stats->crashes++);
+	}
+}
+
+/**
+ * Fuzz the program of `bytes_used' bytes in `ram' for `execs' runs, mutating
+ * its initial registers and the image bytes from `from' up to `to', and saving
+ * what it finds in `dir'. Returns non-zero on failure
+ */
+int emul_fuzz(uint8_t *ram, size_t ram_size, size_t bytes_used, size_t from, size_t to, uint64_t execs,
+	const char *dir, struct emul_fuzz_stats *stats)
+{
+	struct fuzz *fz = NULL;
+	struct fuzz_input cur = { .bytes = NULL };
+	uint64_t start = emul_stats_now();
+	size_t i = 0;
+	int ret = 1;
+
+	memset(stats, 0, sizeof(*stats));
+	if (from > to || to > ram_size) {
+		fprintf(stderr, "Bytes to mutate must be a range within RAM\n");
+		return 1;
+	}
+	if (mkdir(dir, 0777) && errno != EEXIST) {
+		fprintf(stderr, "Error creating %s: ", dir);
+		perror("mkdir");
+		return 1;
+	}
+	if ((fz = calloc(1, sizeof(*fz))) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	if (emul_init(&fz->ctx, ram, ram_size, bytes_used)) {
+		free(fz);
+		return 1;
+	}
+	fz->from = from;
+	fz->len = to - from;
+	fz->dir = dir;
+	fz->seed = 0x9e3779b97f4a7c15ull;
+	fz->ctx.cov = fz->trace;
+	memset(fz->virgin, 0xff, sizeof(fz->virgin));
+	if ((cur.bytes = malloc(fz->len + 1)) == NULL) {
+		perror("malloc");
+		goto out;
+	}
+
+	/* the program as it is is the first input */
+	memcpy(cur.registers, fz->ctx.registers, sizeof(cur.registers));
+	memcpy(cur.bytes, ram + from, fz->len);
+	if (fuzz_one(fz, &cur, stats))
+		goto out;
+	if (!fz->queued && fuzz_keep(fz, &cur))
+		goto out;
+
+	for (i = 0; stats->execs < execs; i = (i + 1) % fz->queued) {
+		memcpy(cur.registers, fz->queue[i].registers, sizeof(cur.registers));
+		memcpy(cur.bytes, fz->queue[i].bytes, fz->len);
+		mutate(fz, &cur);
+		if (fuzz_one(fz, &cur, stats))
+			goto out;
+	}
+
+	for (i = 0; i < EMUL_COV_SIZE; i++)
+		stats->edges += fz->virgin[FUZZ_QUEUE][i] != 0xff;
+	ret = 0;
+
+out:
+	stats->ns = emul_stats_now() - start;
+	/* leave the program as it was: the first input kept. With none kept,
+	 * only the program itself was ever written */
+	if (fz->queued)
+		emul_ram_write(&fz->ctx, from, fz->queue[0].bytes, fz->len);
+	for (i = 0; i < fz->queued; i++)
+		free(fz->queue[i].bytes);
+	free(fz->queue);
+	free(cur.bytes);
+	emul_free(&fz->ctx);
+	free(fz);
+	return ret;
+}
+
+void emul_fuzz_print_stats(FILE *f, const struct emul_fuzz_stats *stats)
+{
+	fprintf(f,
+		"executions: %llu\n"
+		"executions per second: %.0f\n"
+		"edges: %llu\n"
+		"inputs kept: %llu\n"
+		"unique hangs: %llu\n"
+		"unique crashes: %llu\n",
+		(unsigned long long)stats->execs,
+		stats->ns ? stats->execs * 1e9 / stats->ns : 0.0,
+		(unsigned long long)stats->edges,
+		(unsigned long long)stats->queued,
+		(unsigned long long)stats->hangs,
+		(unsigned long long)stats->crashes);
+}
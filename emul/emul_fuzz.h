@@ -0,0 +1,28 @@
+#ifndef EMUL_FUZZ_H
+#define EMUL_FUZZ_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "emul/emul.h"
+
+/* Instructions a run may take before it counts as a hang */
+#define EMUL_FUZZ_BUDGET 100000
+
+/* Most mutations stacked on each run's input */
+#define EMUL_FUZZ_STACK 8
+
+struct emul_fuzz_stats {
+	uint64_t execs;
+	uint64_t queued;  /* inputs kept for reaching new edges */
+	uint64_t hangs;   /* unique, by the edges they took */
+	uint64_t crashes; /* likewise */
+	uint64_t edges;   /* map entries ever hit */
+	uint64_t ns;      /* host time */
+};
+
+int emul_fuzz(uint8_t *ram, size_t ram_size, size_t bytes_used, size_t from, size_t to, uint64_t execs,
+	const char *dir, struct emul_fuzz_stats *stats);
+void emul_fuzz_print_stats(FILE *f, const struct emul_fuzz_stats *stats);
+
+#endif /* EMUL_FUZZ_H */
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "emul/emul.h"
+#include "emul/emul_cycle.h"
+#include "emul/emul_hart.h"
+#include "input/input_bin.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Multi-hart emulation: several guest cores running the same RAM, each on a
+ * host thread of its own. Every hart starts at pc 0 with its index in
+ * EMUL_HART_ID_REG, so firmware can tell the cores apart.
+ *
+ * Memory model: guests only ever load from RAM, and RAM changes only through
+ * emul_harts_ram_write(), which may only be called at a sync point, while every
+ * hart is stopped. So all harts see the same contents of RAM between any two
+ * sync points, and loads are trivially sequentially consistent. The threads
+ * share nothing else while running: each hart has its own registers, flags,
+ * decode cache and engine state, and never takes a lock.
+ *
+ * Harts meet only at sync points. Running freely there is just the one at
+ * the end, when every hart has stopped. In lockstep, each hart runs exactly
+ * `lockstep' instructions (fewer if it stops) between sync points, so the
+ * global instruction count at each is the same on every run, and so is the
+ * state of every hart at the moment the sync callback sees it.
+ */
+
+int emul_harts_init(struct emul_harts *h, unsigned n, uint8_t *ram, size_t ram_size, size_t bytes_used)
+{
+	unsigned i = 0;
+
+	memset(h, 0, sizeof(*h));
+	if (!n || (h->hart = calloc(n, sizeof(*h->hart))) == NULL) {
+		fprintf(stderr, "No memory for %u harts\n", n);
+		return 1;
+	}
+
+	for (h->n = 0; h->n < n; h->n++) {
+		if (emul_init(&h->hart[h->n].ctx, ram, ram_size, bytes_used)) {
+			emul_harts_free(h);
+			return 1;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		h->hart[i].harts = h;
+		h->hart[i].ctx.hart = i;
+		h->hart[i].ctx.registers[EMUL_HART_ID_REG] = i;
+		if (emul_cycle_init(&h->hart[i].cycle, &h->hart[i].ctx)) {
+			emul_harts_free(h);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void emul_harts_free(struct emul_harts *h)
+{
+	unsigned i = 0;
+
+	for (i = 0; i < h->n; i++) {
+		emul_free(&h->hart[i].ctx);
+		emul_cycle_free(&h->hart[i].cycle);
+	}
+	free(h->hart);
+	h->hart = NULL;
+	h->n = 0;
+}
+
+/**
+ * Write to the RAM shared by every hart, flushing what each has decoded from
+ * it. Only at a sync point, or while not running
+ */
+void emul_harts_ram_write(struct emul_harts *h, uint16_t offs, const uint8_t *buf, size_t len)
+{
+	unsigned i = 0;
+
+	/* the same bytes every time, but each hart flushes its own caches */
+	for (i = 0; i < h->n; i++)
+		emul_ram_write(&h->hart[i].ctx, offs, buf, len);
+}
+
+/* Run hart `t' for up to `n' instructions, or until it stops */
+static void run_hart(struct emul_harts *h, struct emul_hart *t, uint64_t n)
+{
+	uint64_t start = 0;
+
+	while (n && t->state == EMUL_HART_RUNNING) {
+		start = t->ctx.icount;
+		switch (emul_cycle_step(&t->ctx, &t->cycle, h->engine, h->fast_forward, n, &t->info)) {
+			case EMUL_CYCLE_RUNNING:
+				break;
+			case EMUL_CYCLE_HALTED:
+				t->state = EMUL_HART_HALTED;
+				break;
+			case EMUL_CYCLE_FOUND:
+				t->state = EMUL_HART_CYCLED;
+				break;
+			case EMUL_CYCLE_FAILED:
+			case EMUL_CYCLE_LOST:
+				t->state = EMUL_HART_FAILED;
+				break;
+		}
+		n -= t->ctx.icount - start;
+	}
+}
+
+/* At a sync point: every hart is stopped */
+static void sync_point(struct emul_harts *h)
+{
+	unsigned i = 0;
+
+	h->rounds++;
+	h->icount = 0;
+	h->done = true;
+	for (i = 0; i < h->n; i++) {
+		h->icount += h->hart[i].ctx.icount;
+		h->done &= h->hart[i].state != EMUL_HART_RUNNING;
+	}
+	debug("sync point %llu: %llu instructions\n", (unsigned long long)h->rounds, (unsigned long long)h->icount);
+
+	if (h->sync)
+		h->sync(h, h->sync_arg);
+}
+
+/* Instructions each hart runs between sync points */
+static uint64_t round_length(const struct emul_harts *h)
+{
+	return h->lockstep ? h->lockstep : UINT64_MAX;
+}
+
+#ifdef EMUL_HAVE_HARTS
+
+static void *hart_main(void *arg)
+{
+	struct emul_hart *t = arg;
+	struct emul_harts *h = t->harts;
+
+	/* the barrier needs every thread, so none runs unless all have started */
+	pthread_mutex_lock(&h->lock);
+	while (!h->start)
+		pthread_cond_wait(&h->started, &h->lock);
+	pthread_mutex_unlock(&h->lock);
+	if (h->start < 0)
+		return NULL;
+
+	do {
+		run_hart(h, t, round_length(h));
+		if (pthread_barrier_wait(&h->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+			sync_point(h);
+		/* wait for the sync point to be over */
+		pthread_barrier_wait(&h->barrier);
+	} while (!h->done);
+
+	return NULL;
+}
+
+/**
+ * Run every hart on a thread of its own until all have stopped, in lockstep
+ * if `lockstep' is non-zero. Returns non-zero if the threads cannot be started
+ */
+int emul_harts_run(struct emul_harts *h, const struct emul_engine *engine, bool fast_forward, uint64_t lockstep)
+{
+	unsigned i = 0;
+	unsigned n = 0;
+
+	h->engine = engine;
+	h->fast_forward = fast_forward;
+	h->lockstep = lockstep;
+
+	/* shared by every thread, so filled before any start */
+	emul_decode_init();
+
+	if ((errno = pthread_barrier_init(&h->barrier, NULL, h->n))) {
+		perror("pthread_barrier_init");
+		return 1;
+	}
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->started, NULL);
+	h->start = 0;
+
+	for (n = 0; n < h->n; n++) {
+		if ((errno = pthread_create(&h->hart[n].thread, NULL, hart_main, &h->hart[n]))) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	pthread_mutex_lock(&h->lock);
+	h->start = n == h->n ? 1 : -1;
+	pthread_cond_broadcast(&h->started);
+	pthread_mutex_unlock(&h->lock);
+
+	for (i = 0; i < n; i++)
+		pthread_join(h->hart[i].thread, NULL);
+	pthread_cond_destroy(&h->started);
+	pthread_mutex_destroy(&h->lock);
+	pthread_barrier_destroy(&h->barrier);
+
+	return h->start < 0;
+}
+
+#else /* !EMUL_HAVE_HARTS */
+
+int emul_harts_run(struct emul_harts *h, const struct emul_engine *engine, bool fast_forward, uint64_t lockstep)
+{
+	unsigned i = 0;
+
+	h->engine = engine;
+	h->fast_forward = fast_forward;
+	h->lockstep = lockstep;
+
+	do {
+		for (i = 0; i < h->n; i++)
+			run_hart(h, &h->hart[i], round_length(h));
+		sync_point(h);
+	} while (!h->done);
+
+	return 0;
+}
+
+#endif /* EMUL_HAVE_HARTS */
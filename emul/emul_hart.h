@@ -0,0 +1,69 @@
+#ifndef EMUL_HART_H
+#define EMUL_HART_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emul/emul.h"
+#include "emul/emul_cycle.h"
+
+/* One host thread per hart; elsewhere harts take turns on the calling thread */
+#if defined(__unix__)
+#define EMUL_HAVE_HARTS
+#include <pthread.h>
+#endif
+
+/* Register holding a hart's index when it starts, like an argument */
+#define EMUL_HART_ID_REG REG_1
+
+enum EMUL_HART {
+	EMUL_HART_RUNNING,
+	EMUL_HART_HALTED,
+	EMUL_HART_CYCLED, /* can never halt, see `info' */
+	EMUL_HART_FAILED,
+};
+
+struct emul_harts;
+
+struct emul_hart {
+	struct emul_context ctx;
+	struct emul_cycle cycle;
+	struct emul_cycle_info info;
+	enum EMUL_HART state;
+	struct emul_harts *harts;
+#ifdef EMUL_HAVE_HARTS
+	pthread_t thread;
+#endif
+};
+
+/**
+ * Guest cores sharing one RAM. Each hart has a context of its own, so runs
+ * without touching another's state; see emul_hart.c for the memory model
+ */
+struct emul_harts {
+	struct emul_hart *hart;
+	unsigned n;
+	const struct emul_engine *engine;
+	bool fast_forward;
+	uint64_t lockstep;  /* instructions per hart between sync points, 0 to run freely */
+	uint64_t rounds;    /* sync points passed */
+	uint64_t icount;    /* instructions retired by all harts, as of the last sync point */
+	bool done;          /* no hart is running */
+	/* called at every sync point, with every hart stopped */
+	void (*sync)(struct emul_harts *h, void *arg);
+	void *sync_arg;
+#ifdef EMUL_HAVE_HARTS
+	pthread_barrier_t barrier;
+	pthread_mutex_t lock;
+	pthread_cond_t started;
+	int start;          /* 1 once every thread has started, -1 if one could not */
+#endif
+};
+
+int emul_harts_init(struct emul_harts *h, unsigned n, uint8_t *ram, size_t ram_size, size_t bytes_used);
+void emul_harts_free(struct emul_harts *h);
+int emul_harts_run(struct emul_harts *h, const struct emul_engine *engine, bool fast_forward, uint64_t lockstep);
+void emul_harts_ram_write(struct emul_harts *h, uint16_t offs, const uint8_t *buf, size_t len);
+
+#endif /* EMUL_HART_H */
@@ -0,0 +1,843 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "emul/emul.h"
+#include "emul/emul_jit.h"
+
+//#define DEBUG
+#include "debug.h"
+
+#ifdef EMUL_HAVE_JIT
+
+#include <sys/mman.h>
+
+/**
+ * Guest basic blocks are translated into x86-64 code. While inside translated
+ * code, the guest machine lives entirely in host registers:
+ *
+ *   $0..$H  r8d..r15d (zero-extended 16-bit values)
+ *   zf      ebx (the last ALU result, zf is set when it is zero)
+ *   cf      ebp (0 or 1)
+ *   budget  rsi (instructions left, signed)
+ *   ctx     rdi
+ *
+ * rax, rcx and rdx are scratch. Every block starts by charging its length
+ * against the budget and counting the run, and ends in one or more exit
+ * slots. Within a block only the last ALU operation can have its flags read,
+ * so it is the only one which updates ebx and ebp. An exit slot with a known
+ * successor pc starts with a jmp which is re-pointed directly at the
+ * successor's code once that has been translated, chaining the two blocks.
+ *
+ * The code buffer is never writable and executable at once: it is made
+ * writable to translate or chain, and executable again to run.
+ */
+
+#define JIT_CODE_SIZE (4 << 20)
+#define JIT_BLOCK_MAX_INSTS 64
+/* generous upper bound on the code emitted for one block */
+#define JIT_BLOCK_MAX_BYTES (JIT_BLOCK_MAX_INSTS * 32 + 256)
+
+enum HOST_REG {
+	RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+	R8 = 8, R9, R10, R11, R12, R13, R14, R15
+};
+
+#define HOST_REG(guest) (R8 + (guest))
+#define REG_ZF RBX
+#define REG_CF RBP
+
+/* x86 condition codes, as used by jcc and setcc */
+enum HOST_CC {
+	CC_C  = 0x2,
+	CC_Z  = 0x4,
+	CC_NZ = 0x5,
+	CC_A  = 0x7,
+	CC_L  = 0xC,
+};
+
+/* /digit opcode extensions of the 0x81 (ALU r/m32, imm32) group */
+enum ALU_EXT {
+	ALU_EXT_ADD = 0,
+	ALU_EXT_OR  = 1,
+	ALU_EXT_AND = 4,
+	ALU_EXT_SUB = 5,
+	ALU_EXT_XOR = 6,
+	ALU_EXT_CMP = 7,
+};
+
+/* /digit opcode extensions of the 0xC1/0xD3 (shift r/m32) group */
+enum SHIFT_EXT {
+	SHIFT_EXT_SHL = 4,
+	SHIFT_EXT_SHR = 5,
+};
+
+typedef int64_t (*jit_entry)(struct emul_context *ctx, int64_t budget, const void *code);
+
+struct jit {
+	uint8_t *code;        /* mapping of JIT_CODE_SIZE bytes */
+	bool writable;        /* `code' is writable rather than executable */
+	size_t used;          /* bytes of `code' holding translations */
+	size_t trampolines;   /* bytes at the start of `code' for entry/exit */
+	jit_entry entry;
+	uint8_t *exit;        /* common exit path back into C */
+	uint8_t *last_exit;   /* chainable exit slot taken on the last exit */
+	uint8_t **blocks;     /* translated code, indexed by guest pc */
+	uint16_t *block_len;  /* guest instructions in each translated block */
+	uint64_t *runs;       /* times each block ran, not yet in ctx->counters */
+	uint64_t *jumped;     /* of those, times its final jump was taken */
+};
+
+/**
+ * Machine code emission
+ */
+static void emit8(uint8_t **b, uint8_t x)
+{
+	*(*b)++ = x;
+}
+
+static void emit32(uint8_t **b, uint32_t x)
+{
+	memcpy(*b, &x, sizeof(x));
+	*b += sizeof(x);
+}
+
+static void emit64(uint8_t **b, uint64_t x)
+{
+	memcpy(*b, &x, sizeof(x));
+	*b += sizeof(x);
+}
+
+/* REX prefix, emitted only when needed (or forced for spl/bpl/sil/dil) */
+static void emit_rex(uint8_t **b, int w, int reg, int rm, int force)
+{
+	uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+	if (rex != 0x40 || force)
+		emit8(b, rex);
+}
+
+static void emit_modrm(uint8_t **b, int mod, int reg, int rm)
+{
+	emit8(b, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* <op> r/m32, r32 for a one-byte opcode, register direct */
+static void emit_rr(uint8_t **b, uint8_t op, int rm, int reg)
+{
+	emit_rex(b, 0, reg, rm, 0);
+	emit8(b, op);
+	emit_modrm(b, 3, reg, rm);
+}
+
+/* <op> r/m32, imm32 in the 0x81 group, register direct */
+static void emit_ri(uint8_t **b, int w, enum ALU_EXT ext, int rm, uint32_t imm)
+{
+	emit_rex(b, w, 0, rm, 0);
+	emit8(b, 0x81);
+	emit_modrm(b, 3, ext, rm);
+	emit32(b, imm);
+}
+
+/* <op> reg, [rdi + disp32] (or [rdi + disp32], reg) with a 0x0F-less opcode */
+static void emit_ctx_mem(uint8_t **b, int prefix16, int force_rex, const uint8_t *op, size_t op_len, int reg, int32_t disp)
+{
+	if (prefix16)
+		emit8(b, 0x66);
+	emit_rex(b, 0, reg, RDI, force_rex);
+	while (op_len--)
+		emit8(b, *op++);
+	emit_modrm(b, 2, reg, RDI);
+	emit32(b, disp);
+}
+
+static void emit_mov_ri(uint8_t **b, int reg, uint32_t imm)
+{
+	emit_rex(b, 0, 0, reg, 0);
+	emit8(b, 0xB8 + (reg & 7));
+	emit32(b, imm);
+}
+
+static void emit_push(uint8_t **b, int reg)
+{
+	emit_rex(b, 0, 0, reg, 0);
+	emit8(b, 0x50 + (reg & 7));
+}
+
+static void emit_pop(uint8_t **b, int reg)
+{
+	emit_rex(b, 0, 0, reg, 0);
+	emit8(b, 0x58 + (reg & 7));
+}
+
+/* inc qword [counter], through rax */
+static void emit_count(uint8_t **b, uint64_t *counter)
+{
+	emit8(b, 0x48);
+	emit8(b, 0xB8);
+	emit64(b, (uint64_t)(uintptr_t)counter);
+	emit8(b, 0x48);
+	emit8(b, 0xFF);
+	emit_modrm(b, 0, 0, RAX);
+}
+
+/* jmp rel32 to `target', returning the address of the rel32 field */
+static uint8_t *emit_jmp(uint8_t **b, const uint8_t *target)
+{
+	uint8_t *rel = NULL;
+	emit8(b, 0xE9);
+	rel = *b;
+	emit32(b, target - (rel + 4));
+	return rel;
+}
+
+static uint8_t *emit_jcc(uint8_t **b, enum HOST_CC cc, const uint8_t *target)
+{
+	uint8_t *rel = NULL;
+	emit8(b, 0x0F);
+	emit8(b, 0x80 | cc);
+	rel = *b;
+	emit32(b, target - (rel + 4));
+	return rel;
+}
+
+/* Point an already-emitted rel32 field at `target' */
+static void patch_rel32(uint8_t *rel, const uint8_t *target)
+{
+	int32_t disp = target - (rel + 4);
+	memcpy(rel, &disp, sizeof(disp));
+}
+
+/**
+ * Entry trampoline: jit_entry(ctx, budget, code). Loads the guest machine
+ * into host registers and jumps to `code'
+ */
+static void emit_entry(uint8_t **b)
+{
+	static const uint8_t movzx16[] = { 0x0F, 0xB7 };
+	int i = 0;
+
+	emit_push(b, RBX);
+	emit_push(b, RBP);
+	emit_push(b, R12);
+	emit_push(b, R13);
+	emit_push(b, R14);
+	emit_push(b, R15);
+
+	for (i = 0; i < REG_COUNT; i++)
+		emit_ctx_mem(b, 0, 0, movzx16, sizeof(movzx16), HOST_REG(i),
+			offsetof(struct emul_context, registers) + i * sizeof(uint16_t));
+	/* the C driver hands over the flags as FLAGS_SET */
+	emit_ctx_mem(b, 0, 0, movzx16, sizeof(movzx16), REG_ZF, offsetof(struct emul_context, flags.res));
+	emit_ctx_mem(b, 0, 0, movzx16, sizeof(movzx16), REG_CF, offsetof(struct emul_context, flags.left));
+
+	/* jmp rdx */
+	emit8(b, 0xFF);
+	emit_modrm(b, 3, 4, RDX);
+}
+
+/**
+ * Common exit path. Expects the next guest pc in eax and the chainable exit
+ * slot taken (or NULL) in rcx. Stores the guest machine back into ctx and
+ * returns the remaining budget
+ */
+static void emit_exit(uint8_t **b, struct jit *jit)
+{
+	static const uint8_t mov_store16[] = { 0x89 };
+	static const uint8_t mov_store8_imm[] = { 0xC6 };
+	int i = 0;
+
+	for (i = 0; i < REG_COUNT; i++)
+		emit_ctx_mem(b, 1, 0, mov_store16, sizeof(mov_store16), HOST_REG(i),
+			offsetof(struct emul_context, registers) + i * sizeof(uint16_t));
+	emit_ctx_mem(b, 1, 0, mov_store16, sizeof(mov_store16), REG_ZF, offsetof(struct emul_context, flags.res));
+	emit_ctx_mem(b, 1, 0, mov_store16, sizeof(mov_store16), REG_CF, offsetof(struct emul_context, flags.left));
+	emit_ctx_mem(b, 0, 0, mov_store8_imm, sizeof(mov_store8_imm), 0, offsetof(struct emul_context, flags.oper));
+	emit8(b, FLAGS_SET);
+	emit_ctx_mem(b, 1, 0, mov_store16, sizeof(mov_store16), RAX, offsetof(struct emul_context, pc));
+
+	/* mov rdx, &jit->last_exit; mov [rdx], rcx */
+	emit8(b, 0x48);
+	emit8(b, 0xBA);
+	emit64(b, (uint64_t)(uintptr_t)&jit->last_exit);
+	emit8(b, 0x48);
+	emit8(b, 0x89);
+	emit_modrm(b, 0, RCX, RDX);
+
+	/* mov rax, rsi */
+	emit8(b, 0x48);
+	emit8(b, 0x89);
+	emit_modrm(b, 3, RSI, RAX);
+
+	emit_pop(b, R15);
+	emit_pop(b, R14);
+	emit_pop(b, R13);
+	emit_pop(b, R12);
+	emit_pop(b, RBP);
+	emit_pop(b, RBX);
+	emit8(b, 0xC3);
+}
+
+/**
+ * Exit to guest pc `target'. Until chained, the leading jmp falls through to
+ * code handing `target' back to the C driver along with the slot's address:
+ *
+ *   +0  jmp  +5             (re-pointed at target's block once chained)
+ *   +5  mov  eax, target
+ *   +10 lea  rcx, [slot]
+ *   +17 jmp  exit
+ */
+static void emit_exit_slot(uint8_t **b, struct jit *jit, uint16_t target)
+{
+	uint8_t *slot = *b;
+
+	emit_jmp(b, slot + 5);
+	emit_mov_ri(b, RAX, target);
+	/* lea rcx, [rip + disp32] */
+	emit8(b, 0x48);
+	emit8(b, 0x8D);
+	emit_modrm(b, 0, RCX, 5);
+	emit32(b, slot - (*b + 4));
+	emit_jmp(b, jit->exit);
+}
+
+/* Exit to the C driver with the guest pc already in eax, unchained */
+static void emit_exit_unchained(uint8_t **b, struct jit *jit)
+{
+	emit_rr(b, 0x31, RCX, RCX);
+	emit_jmp(b, jit->exit);
+}
+
+/**
+ * Jump to the guest pc in eax, going directly to its translation if there is
+ * one already
+ */
+static void emit_dynamic_jump(uint8_t **b, struct jit *jit)
+{
+	uint8_t *miss = NULL;
+
+	/* mov rcx, jit->blocks */
+	emit8(b, 0x48);
+	emit8(b, 0xB9);
+	emit64(b, (uint64_t)(uintptr_t)jit->blocks);
+	/* mov rdx, [rcx + rax * 8] */
+	emit8(b, 0x48);
+	emit8(b, 0x8B);
+	emit_modrm(b, 0, RDX, 4);
+	emit8(b, (3 << 6) | (RAX << 3) | RCX);
+	/* test rdx, rdx; jz miss */
+	emit8(b, 0x48);
+	emit8(b, 0x85);
+	emit_modrm(b, 3, RDX, RDX);
+	emit8(b, 0x74);
+	miss = *b;
+	emit8(b, 0);
+	/* jmp rdx */
+	emit8(b, 0xFF);
+	emit_modrm(b, 3, 4, RDX);
+	*miss = *b - (miss + 1);
+	emit_exit_unchained(b, jit);
+}
+
+/* <shift> r32, imm8 */
+static void emit_shift_ri(uint8_t **b, enum SHIFT_EXT ext, int rm, uint8_t n)
+{
+	emit_rex(b, 0, 0, rm, 0);
+	emit8(b, 0xC1);
+	emit_modrm(b, 3, ext, rm);
+	emit8(b, n);
+}
+
+/* movzx reg, ax */
+static void emit_movzx_ax(uint8_t **b, int reg)
+{
+	emit_rex(b, 0, reg, RAX, 0);
+	emit8(b, 0x0F);
+	emit8(b, 0xB7);
+	emit_modrm(b, 3, reg, RAX);
+}
+
+/* cf = bit `bit' of eax */
+static void emit_cf_from_bit(uint8_t **b, int bit)
+{
+	emit_rr(b, 0x89, REG_CF, RAX);
+	if (bit)
+		emit_shift_ri(b, SHIFT_EXT_SHR, REG_CF, bit);
+	emit_ri(b, 0, ALU_EXT_AND, REG_CF, 1);
+}
+
+/* eax = 0 if the count in ecx is over 16, as everything has been shifted out */
+static void emit_clamp_shift(uint8_t **b)
+{
+	/* xor edx, edx; cmp ecx, 16; cmova eax, edx */
+	emit_rr(b, 0x31, RDX, RDX);
+	emit_ri(b, 0, ALU_EXT_CMP, RCX, 16);
+	emit8(b, 0x0F);
+	emit8(b, 0x40 | CC_A);
+	emit_modrm(b, 3, RAX, RDX);
+}
+
+/**
+ * Shift eax by the register or immediate count of `p', setting cf to the last
+ * bit shifted out if `flags'
+ */
+static void emit_shift(uint8_t **b, const struct predecoded *p, int flags)
+{
+	enum SHIFT_EXT ext = p->oper == OPER_SHL ? SHIFT_EXT_SHL : SHIFT_EXT_SHR;
+	uint16_t n = p->imm;
+
+	if (p->type != INST_TYPE_R) {
+		if (n == 0 || n > 16) {
+			if (n)
+				emit_rr(b, 0x31, RAX, RAX);
+			if (flags)
+				emit_rr(b, 0x31, REG_CF, REG_CF);
+		} else if (ext == SHIFT_EXT_SHL) {
+			emit_shift_ri(b, ext, RAX, n);
+			if (flags)
+				emit_cf_from_bit(b, 16);
+		} else {
+			if (flags)
+				emit_cf_from_bit(b, n - 1);
+			emit_shift_ri(b, ext, RAX, n);
+		}
+		return;
+	}
+
+	/* mov ecx, right */
+	emit_rr(b, 0x89, RCX, HOST_REG(p->right));
+
+	if (ext == SHIFT_EXT_SHR && flags) {
+		/* shift l << 1 instead, so the last bit out ends up in bit 0 */
+		emit_rr(b, 0x01, RAX, RAX);
+	}
+	/* <shift> eax, cl */
+	emit8(b, 0xD3);
+	emit_modrm(b, 3, ext, RAX);
+	emit_clamp_shift(b);
+
+	if (!flags)
+		return;
+	if (ext == SHIFT_EXT_SHL) {
+		emit_cf_from_bit(b, 16);
+	} else {
+		emit_cf_from_bit(b, 0);
+		emit_shift_ri(b, SHIFT_EXT_SHR, RAX, 1);
+	}
+}
+
+/**
+ * Guest ALU operation: compute into eax and write it back to the destination
+ * unless that is $0 or $H. If `flags', also leave the result in ebx and the
+ * carry in ebp
+ */
+static void emit_alu(uint8_t **b, const struct predecoded *p, int flags)
+{
+	static const uint8_t rr_ops[] = {
+		[OPER_ADD] = 0x01, [OPER_SUB] = 0x29, [OPER_AND] = 0x21,
+		[OPER_OR]  = 0x09, [OPER_XOR] = 0x31,
+	};
+	static const enum ALU_EXT ri_ops[] = {
+		[OPER_ADD] = ALU_EXT_ADD, [OPER_SUB] = ALU_EXT_SUB, [OPER_AND] = ALU_EXT_AND,
+		[OPER_OR]  = ALU_EXT_OR,  [OPER_XOR] = ALU_EXT_XOR,
+	};
+	int is_r = (p->type == INST_TYPE_R);
+	int right = HOST_REG(p->right);
+
+	/* mov eax, left */
+	emit_rr(b, 0x89, RAX, HOST_REG(p->left));
+
+	/* operands are zero-extended 16-bit values, so the 32-bit result holds
+	 * the carry out of bit 15 */
+	switch (p->oper) {
+		case OPER_ADD:
+		case OPER_SUB:
+		case OPER_AND:
+		case OPER_OR:
+		case OPER_XOR:
+			if (is_r)
+				emit_rr(b, rr_ops[p->oper], RAX, right);
+			else
+				emit_ri(b, 0, ri_ops[p->oper], RAX, p->imm);
+			if (!flags)
+				break;
+			if (p->oper == OPER_ADD) {
+				emit_cf_from_bit(b, 16);
+			} else if (p->oper == OPER_SUB) {
+				/* borrow leaves the result negative */
+				emit_rr(b, 0x89, REG_CF, RAX);
+				emit_shift_ri(b, SHIFT_EXT_SHR, REG_CF, 31);
+			} else {
+				emit_rr(b, 0x31, REG_CF, REG_CF);
+			}
+			break;
+		case OPER_MUL:
+			if (is_r) {
+				/* imul eax, right */
+				emit_rex(b, 0, RAX, right, 0);
+				emit8(b, 0x0F);
+				emit8(b, 0xAF);
+				emit_modrm(b, 3, RAX, right);
+			} else {
+				/* imul eax, eax, imm32 */
+				emit8(b, 0x69);
+				emit_modrm(b, 3, RAX, RAX);
+				emit32(b, p->imm);
+			}
+			if (flags) {
+				/* xor ebp, ebp; cmp eax, 0xffff; seta bpl */
+				emit_rr(b, 0x31, REG_CF, REG_CF);
+				emit_ri(b, 0, ALU_EXT_CMP, RAX, 0xffff);
+				emit_rex(b, 0, 0, REG_CF, 1);
+				emit8(b, 0x0F);
+				emit8(b, 0x90 | CC_A);
+				emit_modrm(b, 3, 0, REG_CF);
+			}
+			break;
+		case OPER_SHL:
+		case OPER_SHR:
+			emit_shift(b, p, flags);
+			break;
+	}
+
+	if (flags)
+		emit_movzx_ax(b, REG_ZF);
+
+	if (p->dest != REG_0 && p->dest != REG_H)
+		emit_movzx_ax(b, HOST_REG(p->dest));
+}
+
+/**
+ * Evaluate a jump condition into the host flags. Returns the host condition
+ * code under which the jump is taken
+ */
+static enum HOST_CC emit_cond(uint8_t **b, enum JCOND cond)
+{
+	switch (cond) {
+		case JB_ZERO:
+			emit_rr(b, 0x85, REG_ZF, REG_ZF);
+			return CC_Z;
+		case JB_NZERO:
+			emit_rr(b, 0x85, REG_ZF, REG_ZF);
+			return CC_NZ;
+		case JB_CARRY:
+			emit_rr(b, 0x85, REG_CF, REG_CF);
+			return CC_NZ;
+		case JB_NCARRY:
+			emit_rr(b, 0x85, REG_CF, REG_CF);
+			return CC_Z;
+		case JB_CARRYZ:
+		case JB_NCARRYZ:
+		default:
+			/* xor eax, eax; test ebx, ebx; setz al; or eax, ebp */
+			emit_rr(b, 0x31, RAX, RAX);
+			emit_rr(b, 0x85, REG_ZF, REG_ZF);
+			emit8(b, 0x0F);
+			emit8(b, 0x90 | CC_Z);
+			emit_modrm(b, 3, 0, RAX);
+			emit_rr(b, 0x09, RAX, REG_CF);
+			return cond == JB_CARRYZ ? CC_NZ : CC_Z;
+	}
+}
+
+/**
+ * End of block jump/branch. `next' is the pc of the following instruction,
+ * and `entry' the block's
+ */
+static void emit_jump(uint8_t **b, struct jit *jit, const struct predecoded *p, uint16_t next, uint16_t entry)
+{
+	uint8_t *taken = NULL;
+	enum HOST_CC cc = CC_Z;
+
+	if (p->oper == JB_NEVER) {
+		emit_exit_slot(b, jit, next);
+		return;
+	}
+
+	if (p->oper != JB_UNCOND) {
+		cc = emit_cond(b, p->oper);
+		taken = emit_jcc(b, cc, *b);
+		emit_exit_slot(b, jit, next);
+		patch_rel32(taken, *b);
+	}
+	emit_count(b, &jit->jumped[entry]);
+
+	if (p->type == INST_TYPE_JR) {
+		/* mov eax, reg */
+		emit_rr(b, 0x89, RAX, HOST_REG(p->left));
+		emit_dynamic_jump(b, jit);
+	} else {
+		emit_exit_slot(b, jit, p->imm);
+	}
+}
+
+/**
+ * Translate the guest basic block starting at `pc'. Returns its code, or NULL
+ * if an instruction in it could not be decoded
+ */
+static uint8_t *translate(struct emul_context *ctx, struct jit *jit, uint16_t pc, size_t end)
+{
+	uint8_t *start = NULL;
+	uint8_t *b = NULL;
+	uint8_t *charge = NULL;
+	uint8_t *starved = NULL;
+	struct predecoded *p = NULL;
+	struct predecoded *q = NULL;
+	uint16_t entry = pc;
+	uint16_t next = 0;
+	uint32_t n = 0;
+	int done = 0;
+	int last = 0;
+
+	if (JIT_CODE_SIZE - jit->used < JIT_BLOCK_MAX_BYTES) {
+		debug("JIT code buffer full, flushing\n");
+		emul_jit_flush(ctx);
+	}
+	start = b = jit->code + jit->used;
+
+	/* sub rsi, n; jl starved. n is filled in at the end */
+	emit_ri(&b, 1, ALU_EXT_SUB, RSI, 0);
+	charge = b - 4;
+	starved = emit_jcc(&b, CC_L, b);
+	emit_count(&b, &jit->runs[entry]);
+
+	while (!done) {
+		p = &ctx->cache[pc];
+		if (!p->size && emul_predecode(ctx, pc, p))
+			return NULL;
+		next = pc + p->size;
+		n++;
+
+		switch (p->type) {
+			case INST_TYPE_R:
+			case INST_TYPE_NI:
+			case INST_TYPE_WI:
+				done = (next >= end || n >= JIT_BLOCK_MAX_INSTS);
+				q = &ctx->cache[next];
+				last = done || (!q->size && emul_predecode(ctx, next, q))
+				    || q->type == INST_TYPE_JR || q->type == INST_TYPE_JI || q->type == INST_TYPE_B;
+				emit_alu(&b, p, last);
+				if (done)
+					emit_exit_slot(&b, jit, next);
+				break;
+			case INST_TYPE_JR:
+			case INST_TYPE_JI:
+			case INST_TYPE_B:
+				emit_jump(&b, jit, p, next, entry);
+				done = 1;
+				break;
+			default:
+				fprintf(stderr, "Unhandled instruction type %d at 0x%x, stop.\n", p->type, pc);
+				return NULL;
+		}
+		pc = next;
+	}
+
+	/* not enough budget left for the whole block: refund it and stop */
+	patch_rel32(starved, b);
+	emit_ri(&b, 1, ALU_EXT_ADD, RSI, n);
+	emit_mov_ri(&b, RAX, entry);
+	emit_exit_unchained(&b, jit);
+
+	memcpy(charge, &n, sizeof(n));
+	jit->used = b - jit->code;
+	jit->blocks[entry] = start;
+	jit->block_len[entry] = n;
+	debug("JIT: block 0x%x, %u insts, %zd bytes\n", entry, n, (size_t)(b - start));
+	return start;
+}
+
+/* Make the code buffer writable, to translate or chain, or executable, to
+ * run. Returns non-zero on failure */
+static int jit_protect(struct jit *jit, bool writable)
+{
+	if (jit->writable == writable)
+		return 0;
+	if (mprotect(jit->code, JIT_CODE_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC)) {
+		perror("mprotect");
+		return 1;
+	}
+	jit->writable = writable;
+	return 0;
+}
+
+static struct jit *jit_create(void)
+{
+	struct jit *jit = NULL;
+	uint8_t *b = NULL;
+
+	if ((jit = calloc(1, sizeof(*jit))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	jit->blocks = calloc(PREDECODE_SLOTS, sizeof(*jit->blocks));
+	jit->block_len = calloc(PREDECODE_SLOTS, sizeof(*jit->block_len));
+	jit->runs = calloc(PREDECODE_SLOTS, sizeof(*jit->runs));
+	jit->jumped = calloc(PREDECODE_SLOTS, sizeof(*jit->jumped));
+	if (!jit->blocks || !jit->block_len || !jit->runs || !jit->jumped) {
+		perror("calloc");
+		goto fail;
+	}
+
+	jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED) {
+		perror("mmap");
+		jit->code = NULL;
+		goto fail;
+	}
+	jit->writable = true;
+
+	b = jit->code;
+	jit->entry = (jit_entry)(uintptr_t)b;
+	emit_entry(&b);
+	jit->exit = b;
+	emit_exit(&b, jit);
+	jit->used = jit->trampolines = b - jit->code;
+	return jit;
+
+fail:
+	free(jit->blocks);
+	free(jit->block_len);
+	free(jit->runs);
+	free(jit->jumped);
+	free(jit);
+	return NULL;
+}
+
+/* Add the runs of every translated block to ctx->counters */
+void emul_jit_fold_counters(struct emul_context *ctx)
+{
+	struct jit *jit = ctx->jit;
+	size_t i = 0;
+
+	if (!jit)
+		return;
+
+	for (i = 0; i < PREDECODE_SLOTS; i++) {
+		if (!jit->blocks[i])
+			continue;
+		emul_count_run(ctx, i, jit->block_len[i], jit->runs[i]);
+		ctx->counters.taken += jit->jumped[i];
+		jit->runs[i] = jit->jumped[i] = 0;
+	}
+}
+
+/**
+ * Throw away every translation, e.g. because guest RAM has changed
+ */
+void emul_jit_flush(struct emul_context *ctx)
+{
+	struct jit *jit = ctx->jit;
+
+	if (!jit)
+		return;
+
+	emul_jit_fold_counters(ctx);
+	memset(jit->blocks, 0, PREDECODE_SLOTS * sizeof(*jit->blocks));
+	memset(jit->block_len, 0, PREDECODE_SLOTS * sizeof(*jit->block_len));
+	jit->used = jit->trampolines;
+	jit->last_exit = NULL;
+}
+
+void emul_jit_free(struct emul_context *ctx)
+{
+	struct jit *jit = ctx->jit;
+
+	if (!jit)
+		return;
+
+	munmap(jit->code, JIT_CODE_SIZE);
+	free(jit->blocks);
+	free(jit->block_len);
+	free(jit->runs);
+	free(jit->jumped);
+	free(jit);
+	ctx->jit = NULL;
+}
+
+/**
+ * JIT engine: run translated basic blocks, returning to C only when a block
+ * exits to a pc which has no translation yet or has not been chained to
+ */
+enum EMUL_EXIT emul_run_jit(struct emul_context *ctx, uint64_t budget)
+{
+	struct jit *jit = NULL;
+	uint8_t *code = NULL;
+	int64_t start = budget > INT64_MAX ? INT64_MAX : (int64_t)budget;
+	int64_t left = start;
+	size_t end = ctx->bytes_used < ctx->ram_size ? ctx->bytes_used : ctx->ram_size;
+	enum EMUL_EXIT ret = EMUL_EXIT_HALT;
+
+	if (!ctx->jit && (ctx->jit = jit_create()) == NULL)
+		return EMUL_EXIT_ERROR;
+	jit = ctx->jit;
+	jit->last_exit = NULL;
+
+	while (ctx->pc < end) {
+		if (!left) {
+			ret = EMUL_EXIT_BUDGET;
+			break;
+		}
+
+		if ((code = jit->blocks[ctx->pc]) == NULL) {
+			if (jit_protect(jit, true) || (code = translate(ctx, jit, ctx->pc, end)) == NULL) {
+				ret = EMUL_EXIT_ERROR;
+				break;
+			}
+		}
+
+		if (left < jit->block_len[ctx->pc]) {
+			/* finish off the budget one instruction at a time */
+			ctx->icount += start - left;
+			return emul_run(ctx, left);
+		}
+
+		if (jit->last_exit) {
+			if (jit_protect(jit, true)) {
+				ret = EMUL_EXIT_ERROR;
+				break;
+			}
+			patch_rel32(jit->last_exit + 1, code);
+		}
+		if (jit_protect(jit, false)) {
+			ret = EMUL_EXIT_ERROR;
+			break;
+		}
+
+		emul_set_flags(ctx, emul_zf(ctx), emul_cf(ctx));
+		left = jit->entry(ctx, left, code);
+	}
+
+	ctx->icount += start - left;
+	return ret;
+}
+
+#else /* EMUL_HAVE_JIT */
+
+enum EMUL_EXIT emul_run_jit(struct emul_context *ctx, uint64_t budget)
+{
+	(void)ctx;
+	(void)budget;
+	fprintf(stderr, "JIT engine not available on this host\n");
+	return EMUL_EXIT_ERROR;
+}
+
+void emul_jit_fold_counters(struct emul_context *ctx)
+{
+	(void)ctx;
+}
+
+void emul_jit_flush(struct emul_context *ctx)
+{
+	(void)ctx;
+}
+
+void emul_jit_free(struct emul_context *ctx)
+{
+	(void)ctx;
+}
+
+#endif /* EMUL_HAVE_JIT */
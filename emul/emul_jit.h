@@ -0,0 +1,16 @@
+#ifndef EMUL_JIT_H
+#define EMUL_JIT_H
+
+#include "emul/emul.h"
+
+/* The JIT emits x86-64 machine code into anonymous executable mappings */
+#if defined(__x86_64__) && defined(__unix__)
+#define EMUL_HAVE_JIT
+#endif
+
+enum EMUL_EXIT emul_run_jit(struct emul_context *ctx, uint64_t budget);
+void emul_jit_fold_counters(struct emul_context *ctx);
+void emul_jit_flush(struct emul_context *ctx);
+void emul_jit_free(struct emul_context *ctx);
+
+#endif /* EMUL_JIT_H */
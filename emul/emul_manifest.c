@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "emul/emul.h"
+#include "emul/emul_manifest.h"
+
+/**
+ * Manifests list programs to run, one per line: a path followed by any of
+ *   budget=<instructions>  stop after this many instructions
+ *   timeout=<seconds>      stop after this long
+ *   priority=<n>           take n times the share of a priority 1 program
+ * Blank lines and lines starting with # are skipped.
+ *
+ * Results are written back as JSON, one object per line.
+ */
+
+/* Parse `p' of the form key=value into `j'. Returns non-zero if malformed */
+static int read_option(struct emul_job *j, const char *p)
+{
+	const char *value = strchr(p, '=');
+	char *end = NULL;
+	unsigned long priority = 0;
+
+	if (!value++)
+		return 1;
+
+	errno = 0;
+	if (strncmp(p, "budget=", 7) == 0) {
+		j->budget = strtoull(value, &end, 0);
+	} else if (strncmp(p, "timeout=", 8) == 0) {
+		j->timeout = strtod(value, &end);
+	} else if (strncmp(p, "priority=", 9) == 0) {
+		priority = strtoul(value, &end, 0);
+		if (!priority || priority > 0xffff)
+			return 1;
+		j->priority = priority;
+	} else {
+		return 1;
+	}
+
+	return errno || end == value || *end;
+}
+
+/**
+ * Read the jobs of manifest `f' into `*jobs', to be freed with
+ * emul_manifest_free(). Returns non-zero on a malformed manifest
+ */
+int emul_manifest_read(FILE *f, struct emul_job **jobs, size_t *n_jobs)
+{
+	char line[4096];
+	char *p = NULL;
+	size_t alloc = 0;
+	size_t lineno = 0;
+	struct emul_job *j = NULL;
+	struct emul_job *old = NULL;
+
+	*jobs = NULL;
+	*n_jobs = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if ((p = strtok(line, " \t\r\n")) == NULL || *p == '#')
+			continue;
+
+		if (*n_jobs == alloc) {
+			alloc = alloc ? 2 * alloc : 256;
+			old = *jobs;
+			if ((*jobs = realloc(*jobs, alloc * sizeof(**jobs))) == NULL) {
+				*jobs = old;
+				perror("realloc");
+				return 1;
+			}
+		}
+		j = &(*jobs)[*n_jobs];
+		memset(j, 0, sizeof(*j));
+		j->priority = 1;
+		if ((j->path = strdup(p)) == NULL) {
+			perror("strdup");
+			return 1;
+		}
+		++*n_jobs;
+
+		while ((p = strtok(NULL, " \t\r\n")) != NULL) {
+			if (read_option(j, p)) {
+				fprintf(stderr, "Manifest line %zd: bad option `%s'\n", lineno, p);
+				return 1;
+			}
+		}
+	}
+
+	if (ferror(f)) {
+		perror("fgets");
+		return 1;
+	}
+	return 0;
+}
+
+void emul_manifest_free(struct emul_job *jobs, size_t n_jobs)
+{
+	size_t i = 0;
+
+	for (i = 0; i < n_jobs; i++)
+		free(jobs[i].path);
+	free(jobs);
+}
+
+void emul_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
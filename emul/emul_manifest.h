@@ -0,0 +1,24 @@
+#ifndef EMUL_MANIFEST_H
+#define EMUL_MANIFEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "emul/emul.h"
+
+/**
+ * One program of a manifest, as run by the farm (emul_farm.c) and the
+ * scheduler (emul_sched.c)
+ */
+struct emul_job {
+	char *path;
+	uint64_t budget;    /* instructions, 0 for no limit */
+	double timeout;     /* seconds, 0 for no limit */
+	unsigned priority;  /* scheduler's share of the core, 1 by default */
+};
+
+int emul_manifest_read(FILE *f, struct emul_job **jobs, size_t *n_jobs);
+void emul_manifest_free(struct emul_job *jobs, size_t n_jobs);
+void emul_json_string(FILE *f, const char *s);
+
+#endif /* EMUL_MANIFEST_H */
@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "parse.h"
+#include "input/input_bin.h"
+#include "output/output_asm.h"
+#include "emul/emul.h"
+#include "emul/emul_prof.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Guest profiler: counts of the instructions run at each pc, kept alongside
+ * the context and reported per label, per basic block and per instruction.
+ *
+ * Exact counts step the reference engine an instruction at a time. Sampled
+ * counts let the guest's own engine run about `interval' instructions at a go
+ * and charge all of them to the instruction it stopped at, so they cost next
+ * to nothing but only show where the time goes over long runs. The distance
+ * between samples is jittered, or a loop whose length divides the interval
+ * would be sampled at the same instruction every time.
+ *
+ * Profiling is an engine of its own, emul_prof_engine, wrapping the one doing
+ * the work, so whatever runs an engine (cycle detection included) can run it
+ * profiled.
+ */
+
+struct prof_state {
+	const struct emul_engine *engine; /* engine doing the running */
+	uint64_t interval; /* mean instructions per sample, 1 for exact counts */
+	uint64_t last;     /* icount at the last sample */
+	uint64_t next;     /* icount at which to take the next sample */
+	uint64_t seed;     /* xorshift state for the jitter */
+	uint64_t counts[PREDECODE_SLOTS];
+};
+
+/* Counts charged to the instruction at one pc, for sorting */
+struct hot_pc {
+	uint16_t pc;
+	uint64_t count;
+};
+
+/* Schedule the next sample between half and one and a half intervals away */
+static void prof_schedule(struct prof_state *prof)
+{
+	prof->seed ^= prof->seed << 13;
+	prof->seed ^= prof->seed >> 7;
+	prof->seed ^= prof->seed << 17;
+	prof->last = prof->next;
+	prof->next += prof->interval / 2 + 1 + prof->seed % prof->interval;
+}
+
+static enum EMUL_EXIT prof_run_exact(struct emul_context *ctx, uint64_t budget)
+{
+	struct prof_state *prof = ctx->prof;
+	enum EMUL_EXIT ret = EMUL_EXIT_BUDGET;
+	uint64_t icount = 0;
+	uint64_t used = 0;
+	uint16_t pc = 0;
+
+	for (used = 0; used < budget; used++) {
+		pc = ctx->pc;
+		icount = ctx->icount;
+		ret = emul_run(ctx, 1);
+		if (ctx->icount != icount)
+			prof->counts[pc]++;
+		if (ret != EMUL_EXIT_BUDGET)
+			return ret;
+	}
+
+	return EMUL_EXIT_BUDGET;
+}
+
+static enum EMUL_EXIT prof_run(struct emul_context *ctx, uint64_t budget)
+{
+	struct prof_state *prof = ctx->prof;
+	enum EMUL_EXIT ret = EMUL_EXIT_BUDGET;
+	uint64_t start = ctx->icount;
+	uint64_t used = 0;
+	uint64_t n = 0;
+
+	/* contexts the profile is not kept for, such as emul_cycle_locate()'s
+	 * copies, just run */
+	if (!prof)
+		return emul_run(ctx, budget);
+	if (prof->interval == 1)
+		return prof_run_exact(ctx, budget);
+
+	for (;;) {
+		used = ctx->icount - start;
+		if (used >= budget)
+			return EMUL_EXIT_BUDGET;
+		n = prof->next - ctx->icount;
+		ret = prof->engine->run(ctx, budget - used < n ? budget - used : n);
+		if (ret != EMUL_EXIT_BUDGET)
+			return ret;
+		if (ctx->icount == prof->next) {
+			prof->counts[ctx->pc] += prof->next - prof->last;
+			prof_schedule(prof);
+		}
+	}
+}
+
+static void prof_print_stats(FILE *f, const struct emul_context *ctx)
+{
+	if (ctx->prof && ctx->prof->engine->print_stats)
+		ctx->prof->engine->print_stats(f, ctx);
+}
+
+const struct emul_engine emul_prof_engine = {
+	.name = "prof",
+	.run = prof_run,
+	.print_stats = prof_print_stats,
+};
+
+/**
+ * Keep a profile of `ctx' from here on, run by emul_prof_engine with `engine'
+ * doing the work: exact counts if `interval' is 1, or else one sample every
+ * `interval' instructions. Returns non-zero on failure
+ */
+int emul_prof_enable(struct emul_context *ctx, const struct emul_engine *engine, uint64_t interval)
+{
+	if (!interval) {
+		fprintf(stderr, "Profile interval must be at least 1\n");
+		return 1;
+	}
+	if ((ctx->prof = calloc(1, sizeof(*ctx->prof))) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	ctx->prof->engine = engine;
+	ctx->prof->interval = interval;
+	ctx->prof->next = ctx->icount;
+	ctx->prof->seed = 0x9e3779b97f4a7c15ull;
+	prof_schedule(ctx->prof);
+	return 0;
+}
+
+void emul_prof_free(struct emul_context *ctx)
+{
+	free(ctx->prof);
+	ctx->prof = NULL;
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+	const struct emul_symbol *l = a;
+	const struct emul_symbol *r = b;
+
+	if (l->addr != r->addr)
+		return l->addr < r->addr ? -1 : 1;
+	return strcmp(l->name, r->name);
+}
+
+/**
+ * Read a label map of `<address> <label>' lines, as written by
+ * `assembler --map'. Blank lines and lines starting with `#' are skipped.
+ * Returns non-zero on failure
+ */
+int emul_symbols_load(FILE *f, struct emul_symbols *s)
+{
+	char line[256];
+	char *p = NULL;
+	char *end = NULL;
+	size_t alloc = 0;
+	size_t lineno = 0;
+	unsigned long addr = 0;
+	struct emul_symbol *old = NULL;
+
+	memset(s, 0, sizeof(*s));
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		p = line + strspn(line, " \t\r\n");
+		if (!*p || *p == '#')
+			continue;
+
+		addr = strtoul(p, &end, 0);
+		p = end + strspn(end, " \t");
+		end = p + strcspn(p, " \t\r\n");
+		if (p == end || addr > 0xffff) {
+			fprintf(stderr, "Label map line %zd: expected an address and a label\n", lineno);
+			goto fail;
+		}
+		*end = '\0';
+
+		if (s->count == alloc) {
+			alloc = alloc ? 2 * alloc : 64;
+			old = s->syms;
+			if ((s->syms = realloc(s->syms, alloc * sizeof(*s->syms))) == NULL) {
+				s->syms = old;
+				perror("realloc");
+				goto fail;
+			}
+		}
+		s->syms[s->count].addr = addr;
+		if ((s->syms[s->count].name = strdup(p)) == NULL) {
+			perror("strdup");
+			goto fail;
+		}
+		s->count++;
+	}
+
+	qsort(s->syms, s->count, sizeof(*s->syms), compare_symbols);
+	return 0;
+fail:
+	emul_symbols_free(s);
+	return 1;
+}
+
+void emul_symbols_free(struct emul_symbols *s)
+{
+	size_t i = 0;
+
+	for (i = 0; i < s->count; i++)
+		free(s->syms[i].name);
+	free(s->syms);
+	memset(s, 0, sizeof(*s));
+}
+
+/* Index of the last label at or before `pc', or s->count if there is none */
+static size_t symbol_at(const struct emul_symbols *s, uint16_t pc)
+{
+	size_t lo = 0;
+	size_t hi = s->count;
+	size_t mid = 0;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (s->syms[mid].addr <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo ? lo - 1 : s->count;
+}
+
+static const char *symbol_name(const struct emul_symbols *s, size_t i)
+{
+	return i < s->count ? s->syms[i].name : "[unknown]";
+}
+
+/**
+ * Fill `block' with the entry pc of the basic block each pc belongs to. Blocks
+ * start at pc 0, at every label, at the target of every JI and B, and after
+ * every jump or branch. A JR to an address which is no label lands part way
+ * into a block, and is counted with it
+ */
+static int find_blocks(const struct emul_context *ctx, const struct emul_symbols *s, uint16_t *block)
+{
+	const struct decoded_word *d = NULL;
+	uint8_t *leader = NULL;
+	size_t pc = 0;
+	size_t size = 0;
+	size_t i = 0;
+
+	if ((leader = calloc(PREDECODE_SLOTS, 1)) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	emul_decode_init();
+	leader[0] = 1;
+	for (i = 0; i < s->count; i++)
+		leader[s->syms[i].addr] = 1;
+	for (pc = 0; pc < ctx->bytes_used; pc += size) {
+		d = decode_word(RAM_AT(ctx, pc) << 8 | RAM_AT(ctx, pc + 1));
+		size = d->size ? d->size : 2;
+		switch (d->type) {
+			case INST_TYPE_JI:
+				leader[(uint16_t)(RAM_AT(ctx, pc + 2) << 8 | RAM_AT(ctx, pc + 3))] = 1;
+				break;
+			case INST_TYPE_B:
+				leader[(uint16_t)(pc + d->imm)] = 1;
+				break;
+			case INST_TYPE_JR:
+				break;
+			default:
+				continue;
+		}
+		leader[(uint16_t)(pc + size)] = 1;
+	}
+
+	for (pc = 0; pc < PREDECODE_SLOTS; pc++)
+		block[pc] = leader[pc] ? pc : block[pc - 1];
+
+	free(leader);
+	return 0;
+}
+
+/**
+ * Write the profile as folded stacks, `<label>;<block> <count>' lines which
+ * flamegraph tools take as they are: one frame per label, and under it one
+ * per basic block, named by its entry pc
+ */
+void emul_prof_folded(FILE *f, const struct emul_context *ctx, const struct emul_symbols *s)
+{
+	const struct prof_state *prof = ctx->prof;
+	uint16_t *block = NULL;
+	uint64_t count = 0;
+	size_t pc = 0;
+
+	if (!prof)
+		return;
+	if ((block = malloc(PREDECODE_SLOTS * sizeof(*block))) == NULL) {
+		perror("malloc");
+		return;
+	}
+	if (find_blocks(ctx, s, block)) {
+		free(block);
+		return;
+	}
+
+	/* blocks are runs of pcs, so each is summed in one pass */
+	for (pc = 0; pc < PREDECODE_SLOTS; pc++) {
+		count += prof->counts[pc];
+		if (pc + 1 < PREDECODE_SLOTS && block[pc + 1] == block[pc])
+			continue;
+		if (count)
+			fprintf(f, "%s;0x%04x %llu\n", symbol_name(s, symbol_at(s, block[pc])), block[pc],
+				(unsigned long long)count);
+		count = 0;
+	}
+
+	free(block);
+}
+
+static int compare_hot(const void *a, const void *b)
+{
+	const struct hot_pc *l = a;
+	const struct hot_pc *r = b;
+
+	if (l->count != r->count)
+		return l->count > r->count ? -1 : 1;
+	return l->pc < r->pc ? -1 : l->pc > r->pc;
+}
+
+static void print_hot(FILE *f, const struct hot_pc *h, uint64_t total)
+{
+	fprintf(f, "%12llu %5.1f%%  ", (unsigned long long)h->count, 100.0 * h->count / total);
+}
+
+/**
+ * Print where the time went, for people: the instructions counted in each
+ * label, then the EMUL_PROF_HOT hottest instructions, disassembled
+ */
+void emul_prof_hot(FILE *f, const struct emul_context *ctx, const struct emul_symbols *s)
+{
+	const struct prof_state *prof = ctx->prof;
+	struct hot_pc *hot = NULL;
+	struct hot_pc *labels = NULL;
+	struct instruction inst;
+	char where[64];
+	uint64_t total = 0;
+	size_t n = 0;
+	size_t pc = 0;
+	size_t sym = 0;
+	size_t i = 0;
+
+	if (!prof)
+		return;
+	if ((hot = calloc(PREDECODE_SLOTS, sizeof(*hot))) == NULL ||
+	    (labels = calloc(s->count + 1, sizeof(*labels))) == NULL) {
+		perror("calloc");
+		free(hot);
+		return;
+	}
+
+	for (pc = 0; pc < PREDECODE_SLOTS; pc++) {
+		if (!prof->counts[pc])
+			continue;
+		hot[n].pc = pc;
+		hot[n++].count = prof->counts[pc];
+		labels[symbol_at(s, pc)].count += prof->counts[pc];
+		total += prof->counts[pc];
+	}
+	for (i = 0; i <= s->count; i++)
+		labels[i].pc = i;
+
+	if (prof->interval == 1)
+		fprintf(f, "profile: %llu instructions, exact\n", (unsigned long long)total);
+	else
+		fprintf(f, "profile: %llu instructions, sampled about every %llu\n",
+			(unsigned long long)total, (unsigned long long)prof->interval);
+	if (!total)
+		goto out;
+
+	/* label indices stand in for pcs, so ties keep the order of the map */
+	qsort(labels, s->count + 1, sizeof(*labels), compare_hot);
+	fprintf(f, "labels:\n");
+	for (i = 0; i <= s->count && labels[i].count; i++) {
+		print_hot(f, &labels[i], total);
+		fprintf(f, "%s\n", symbol_name(s, labels[i].pc));
+	}
+
+	qsort(hot, n, sizeof(*hot), compare_hot);
+	fprintf(f, "hot spots:\n");
+	for (i = 0; i < n && i < EMUL_PROF_HOT; i++) {
+		pc = hot[i].pc;
+		if ((sym = symbol_at(s, pc)) < s->count && s->syms[sym].addr != pc)
+			snprintf(where, sizeof(where), "0x%04zx  %s+0x%zx", pc, s->syms[sym].name, pc - s->syms[sym].addr);
+		else
+			snprintf(where, sizeof(where), "0x%04zx  %s", pc, symbol_name(s, sym));
+		print_hot(f, &hot[i], total);
+		fprintf(f, "%-28s  ", where);
+		disasm_single(&inst, pc, RAM_AT(ctx, pc) << 8 | RAM_AT(ctx, pc + 1),
+			RAM_AT(ctx, pc + 2) << 8 | RAM_AT(ctx, pc + 3));
+		emit_single(f, &inst);
+	}
+
+out:
+	free(hot);
+	free(labels);
+}
@@ -0,0 +1,32 @@
+#ifndef EMUL_PROF_H
+#define EMUL_PROF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "emul/emul.h"
+
+/* Instructions in the hot-spot listing */
+#define EMUL_PROF_HOT 20
+
+/* A label at an address, as written by `assembler --map' */
+struct emul_symbol {
+	uint16_t addr;
+	char *name;
+};
+
+struct emul_symbols {
+	struct emul_symbol *syms; /* sorted by address */
+	size_t count;
+};
+
+extern const struct emul_engine emul_prof_engine;
+
+int emul_prof_enable(struct emul_context *ctx, const struct emul_engine *engine, uint64_t interval);
+void emul_prof_free(struct emul_context *ctx);
+int emul_symbols_load(FILE *f, struct emul_symbols *s);
+void emul_symbols_free(struct emul_symbols *s);
+void emul_prof_folded(FILE *f, const struct emul_context *ctx, const struct emul_symbols *s);
+void emul_prof_hot(FILE *f, const struct emul_context *ctx, const struct emul_symbols *s);
+
+#endif /* EMUL_PROF_H */
@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "emul/emul.h"
+#include "emul/emul_cycle.h"
+#include "emul/emul_manifest.h"
+#include "emul/emul_dump.h"
+#include "emul/emul_sched.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Scheduler: many guests listed in a manifest (emul_manifest.c) sharing one
+ * thread. Every engine already stops after an exact budget and keeps all of
+ * its state in the emul_context, so a guest yields by returning from its
+ * engine after a quantum, and switching guests is just running another
+ * context; nothing is saved or restored.
+ *
+ * Guests are picked by stride scheduling. Each has a pass, advanced by a
+ * stride inversely proportional to its priority after every quantum it runs,
+ * and the runnable guest with the least pass goes next. A guest of priority 2
+ * so runs twice as often as one of priority 1, and no guest waits more than a
+ * bounded number of quanta.
+ *
+ * For tuning the quantum, each guest's result reports its latency (the time
+ * from the end of one of its quanta to the start of the next) and its speed.
+ */
+
+/* Stride of a priority 1 guest */
+#define STRIDE_ONE (1 << 16)
+
+#define GUEST_RAM_SIZE 65536
+
+struct guest {
+	const struct emul_job *job;
+	struct emul_context ctx;
+	struct emul_cycle cycle;
+	struct emul_cycle_info info;
+	uint8_t *ram;
+	const char *status;   /* why it stopped, NULL while runnable */
+	const char *error;
+	uint64_t pass;
+	uint64_t stride;
+	uint64_t slices;      /* quanta run */
+	double ready;         /* when its last quantum ended */
+	double wait;          /* total latency */
+	double wait_max;
+	double run_time;      /* seconds spent running */
+};
+
+struct sched {
+	struct guest *guests;
+	size_t n_guests;
+	size_t *heap;         /* runnable guests, by least pass then index */
+	size_t n_heap;
+	const struct emul_engine *engine;
+	bool fast_forward;
+	uint64_t quantum;
+	uint64_t switches;
+	FILE *out;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool before(const struct sched *s, size_t a, size_t b)
+{
+	const struct guest *ga = &s->guests[a];
+	const struct guest *gb = &s->guests[b];
+
+	return ga->pass < gb->pass || (ga->pass == gb->pass && a < b);
+}
+
+static void heap_push(struct sched *s, size_t g)
+{
+	size_t i = s->n_heap++;
+	size_t parent = 0;
+
+	while (i && before(s, g, s->heap[parent = (i - 1) / 2])) {
+		s->heap[i] = s->heap[parent];
+		i = parent;
+	}
+	s->heap[i] = g;
+}
+
+static size_t heap_pop(struct sched *s)
+{
+	size_t top = s->heap[0];
+	size_t last = s->heap[--s->n_heap];
+	size_t i = 0;
+	size_t child = 0;
+
+	while ((child = 2 * i + 1) < s->n_heap) {
+		if (child + 1 < s->n_heap && before(s, s->heap[child + 1], s->heap[child]))
+			child++;
+		if (!before(s, s->heap[child], last))
+			break;
+		s->heap[i] = s->heap[child];
+		i = child;
+	}
+	s->heap[i] = last;
+
+	return top;
+}
+
+/* Load the program of `g' into its own RAM. Returns non-zero on failure */
+static int load(struct guest *g)
+{
+	FILE *f = NULL;
+	size_t bytes_used = 0;
+	size_t nread = 0;
+
+	if ((g->ram = calloc(1, GUEST_RAM_SIZE)) == NULL || (f = fopen(g->job->path, "r")) == NULL) {
+		g->error = strerror(errno);
+		return 1;
+	}
+	while ((nread = fread(g->ram + bytes_used, 1, GUEST_RAM_SIZE - bytes_used, f)))
+		bytes_used += nread;
+	if (ferror(f) || fgetc(f) != EOF) {
+		g->error = ferror(f) ? strerror(errno) : "program larger than memory";
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+
+	if (emul_init(&g->ctx, g->ram, GUEST_RAM_SIZE, bytes_used)) {
+		g->error = "out of memory";
+		return 1;
+	}
+	if (emul_cycle_init(&g->cycle, &g->ctx)) {
+		g->error = "out of memory";
+		return 1;
+	}
+	return 0;
+}
+
+/* Run `g' for a quantum, or until it stops */
+static void run_quantum(struct sched *s, struct guest *g)
+{
+	const struct emul_job *j = g->job;
+	uint64_t left = s->quantum;
+	uint64_t n = 0;
+	uint64_t start = 0;
+
+	while (left) {
+		n = left;
+		if (j->budget && j->budget - g->ctx.icount < n)
+			n = j->budget - g->ctx.icount;
+		if (!n)
+			break;
+
+		start = g->ctx.icount;
+		switch (emul_cycle_step(&g->ctx, &g->cycle, s->engine, s->fast_forward, n, &g->info)) {
+			case EMUL_CYCLE_RUNNING:
+				break;
+			case EMUL_CYCLE_HALTED:
+				g->status = "halt";
+				return;
+			case EMUL_CYCLE_FOUND:
+				g->status = "cycle";
+				return;
+			case EMUL_CYCLE_FAILED:
+				g->status = "error";
+				g->error = "undecodable instruction";
+				return;
+			case EMUL_CYCLE_LOST:
+				g->status = "error";
+				g->error = "cannot locate cycle";
+				return;
+		}
+		left -= g->ctx.icount - start;
+	}
+
+	if (j->budget && g->ctx.icount >= j->budget)
+		g->status = "budget";
+}
+
+static void report(struct sched *s, size_t index)
+{
+	struct guest *g = &s->guests[index];
+	FILE *f = s->out;
+
+	fprintf(f, "{\"guest\": %zd, \"program\": ", index);
+	emul_json_string(f, g->job->path);
+	fprintf(f, ", \"status\": \"%s\"", g->status);
+	if (g->error) {
+		fprintf(f, ", \"error\": ");
+		emul_json_string(f, g->error);
+	}
+	fprintf(f, ", \"priority\": %u, \"instructions\": %llu, \"slices\": %llu, \"seconds\": %.6f",
+		g->job->priority, (unsigned long long)g->ctx.icount, (unsigned long long)g->slices, g->run_time);
+	fprintf(f, ", \"latency_us\": {\"mean\": %.1f, \"max\": %.1f}, \"mips\": %.2f",
+		g->slices ? 1e6 * g->wait / g->slices : 0.0, 1e6 * g->wait_max,
+		g->run_time ? g->ctx.icount / g->run_time / 1e6 : 0.0);
+	if (g->ctx.ram) {
+		fputs(", ", f);
+		emul_json_state(f, &g->ctx);
+	}
+	if (!strcmp(g->status, "cycle"))
+		fprintf(f, ", \"cycle\": {\"pc\": %d, \"entry\": %llu, \"period\": %llu}",
+			g->info.pc, (unsigned long long)g->info.entry, (unsigned long long)g->info.period);
+	fputs("}\n", f);
+}
+
+/**
+ * Run every guest of `manifest' on this thread, a `quantum' of instructions
+ * at a time, writing each one's result to `out' as it stops. Returns non-zero
+ * if the manifest is malformed or any guest fails to run
+ */
+int emul_sched(FILE *manifest, FILE *out, const struct emul_engine *engine, bool fast_forward,
+	uint64_t quantum, bool stats)
+{
+	struct sched s;
+	struct emul_job *jobs = NULL;
+	struct guest *g = NULL;
+	size_t i = 0;
+	uint64_t total = 0;
+	double start = 0;
+	double t = 0;
+	double busy = 0;
+	int ret = 1;
+
+	memset(&s, 0, sizeof(s));
+	s.engine = engine;
+	s.fast_forward = fast_forward;
+	s.quantum = quantum ? quantum : EMUL_SCHED_QUANTUM;
+	s.out = out;
+
+	if (emul_manifest_read(manifest, &jobs, &s.n_guests))
+		goto out;
+	if ((s.guests = calloc(s.n_guests, sizeof(*s.guests))) == NULL ||
+	    (s.heap = calloc(s.n_guests, sizeof(*s.heap))) == NULL) {
+		perror("calloc");
+		goto out;
+	}
+
+	ret = 0;
+	start = now();
+	for (i = 0; i < s.n_guests; i++) {
+		g = &s.guests[i];
+		g->job = &jobs[i];
+		g->stride = STRIDE_ONE / g->job->priority;
+		g->ready = start;
+		if (load(g)) {
+			g->status = "error";
+			report(&s, i);
+			ret = 1;
+			continue;
+		}
+		heap_push(&s, i);
+	}
+
+	while (s.n_heap) {
+		i = heap_pop(&s);
+		g = &s.guests[i];
+
+		t = now();
+		g->wait += t - g->ready;
+		if (t - g->ready > g->wait_max)
+			g->wait_max = t - g->ready;
+
+		run_quantum(&s, g);
+		g->slices++;
+		s.switches++;
+
+		g->ready = now();
+		g->run_time += g->ready - t;
+		busy += g->ready - t;
+		if (!g->status && g->job->timeout && g->run_time > g->job->timeout)
+			g->status = "timeout";
+
+		if (g->status) {
+			ret |= g->error != NULL;
+			report(&s, i);
+			continue;
+		}
+		g->pass += g->stride;
+		heap_push(&s, i);
+	}
+
+	if (stats) {
+		t = now() - start;
+		for (i = 0; i < s.n_guests; i++)
+			total += s.guests[i].ctx.icount;
+		fprintf(stderr, "sched: %zd guests, %llu quanta of %llu, %.2f MIPS, %.1f%% of the time in guests\n",
+			s.n_guests, (unsigned long long)s.switches, (unsigned long long)s.quantum,
+			t ? total / t / 1e6 : 0.0, t ? 100 * busy / t : 0.0);
+	}
+	fflush(out);
+
+out:
+	for (i = 0; s.guests && i < s.n_guests; i++) {
+		if (s.guests[i].ctx.ram)
+			emul_free(&s.guests[i].ctx);
+		emul_cycle_free(&s.guests[i].cycle);
+		free(s.guests[i].ram);
+	}
+	free(s.guests);
+	free(s.heap);
+	emul_manifest_free(jobs, s.n_guests);
+	return ret;
+}
@@ -0,0 +1,16 @@
+#ifndef EMUL_SCHED_H
+#define EMUL_SCHED_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emul/emul.h"
+
+/* Default instructions a guest runs before yielding the core */
+#define EMUL_SCHED_QUANTUM 1024
+
+int emul_sched(FILE *manifest, FILE *out, const struct emul_engine *engine, bool fast_forward,
+	uint64_t quantum, bool stats);
+
+#endif /* EMUL_SCHED_H */
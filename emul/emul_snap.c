@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+#include "emul/emul.h"
+#include "emul/emul_snap.h"
+
+#ifdef EMUL_HAVE_COW
+#include <sys/mman.h>
+#endif
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Snapshots: a guest stopped at any instruction count, to be restored into a
+ * context later, saved to a file, or forked into any number of new contexts
+ * which all carry on from the same point.
+ *
+ * Where mmap(2) is available a snapshot's RAM lives in an unlinked temporary
+ * file, mapped read-only. A fork maps the same file privately: its pages are
+ * shared with the snapshot and every other fork until it writes one through
+ * emul_ram_write(), so forking costs neither a copy of RAM nor its memory.
+ * Elsewhere each fork gets its own copy.
+ *
+ * A saved snapshot is the magic "TOYSNAP1", then big-endian pc, $0 to $H, the
+ * flags' left, right and result (16 bits each) and operation (8 bits), the
+ * instruction count (64 bits), the RAM size and bytes used (32 bits each),
+ * and last the contents of RAM.
+ */
+
+#define SNAP_MAGIC "TOYSNAP1"
+#define SNAP_MAGIC_LEN 8
+#define SNAP_HEADER_LEN (SNAP_MAGIC_LEN + EMUL_STATE_LEN + 8 + 4 + 4)
+
+/* Give `s' a copy of `ram' */
+static int set_ram(struct emul_snapshot *s, const uint8_t *ram)
+{
+#ifdef EMUL_HAVE_COW
+	void *p = MAP_FAILED;
+
+	if ((s->backing = tmpfile()) == NULL) {
+		perror("tmpfile");
+		return 1;
+	}
+	if (fwrite(ram, 1, s->ram_size, s->backing) != s->ram_size || fflush(s->backing)) {
+		perror("fwrite");
+		goto fail;
+	}
+	if ((p = mmap(NULL, s->ram_size, PROT_READ, MAP_SHARED, fileno(s->backing), 0)) == MAP_FAILED) {
+		perror("mmap");
+		goto fail;
+	}
+	s->ram = p;
+	return 0;
+
+fail:
+	fclose(s->backing);
+	s->backing = NULL;
+	return 1;
+#else
+	uint8_t *p = NULL;
+
+	if ((p = malloc(s->ram_size)) == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	memcpy(p, ram, s->ram_size);
+	s->ram = p;
+	return 0;
+#endif
+}
+
+/* Snapshot `ctx' into `s'. Returns non-zero on failure */
+int emul_snapshot_take(struct emul_snapshot *s, const struct emul_context *ctx)
+{
+	memset(s, 0, sizeof(*s));
+	s->pc = ctx->pc;
+	memcpy(s->registers, ctx->registers, sizeof(s->registers));
+	s->flags = ctx->flags;
+	s->icount = ctx->icount;
+	s->ram_size = ctx->ram_size;
+	s->bytes_used = ctx->bytes_used;
+
+	return set_ram(s, ctx->ram);
+}
+
+void emul_snapshot_free(struct emul_snapshot *s)
+{
+	if (!s->ram)
+		return;
+#ifdef EMUL_HAVE_COW
+	munmap((void *)s->ram, s->ram_size);
+	fclose(s->backing);
+	s->backing = NULL;
+#else
+	free((void *)s->ram);
+#endif
+	s->ram = NULL;
+}
+
+/* Write pc, `registers' and `flags' at `p'. Returns the byte after them */
+uint8_t *emul_state_put(uint8_t *p, uint16_t pc, const uint16_t *registers, const struct lazy_flags *flags)
+{
+	enum REG reg = REG_0;
+
+	p = put_be(p, pc, 2);
+	for (reg = REG_0; reg < REG_COUNT; reg++)
+		p = put_be(p, registers[reg], 2);
+	p = put_be(p, flags->left, 2);
+	p = put_be(p, flags->right, 2);
+	p = put_be(p, flags->res, 2);
+	return put_be(p, flags->oper, 1);
+}
+
+/* Inverse of emul_state_put() */
+const uint8_t *emul_state_get(const uint8_t *p, uint16_t *pc, uint16_t *registers, struct lazy_flags *flags)
+{
+	uint64_t val = 0;
+	enum REG reg = REG_0;
+
+	p = get_be(p, &val, 2);
+	*pc = val;
+	for (reg = REG_0; reg < REG_COUNT; reg++) {
+		p = get_be(p, &val, 2);
+		registers[reg] = val;
+	}
+	p = get_be(p, &val, 2);
+	flags->left = val;
+	p = get_be(p, &val, 2);
+	flags->right = val;
+	p = get_be(p, &val, 2);
+	flags->res = val;
+	p = get_be(p, &val, 1);
+	flags->oper = val;
+	return p;
+}
+
+/* Write `s' to `f'. Returns non-zero on failure */
+int emul_snapshot_save(const struct emul_snapshot *s, FILE *f)
+{
+	uint8_t header[SNAP_HEADER_LEN];
+	uint8_t *p = header;
+
+	memcpy(p, SNAP_MAGIC, SNAP_MAGIC_LEN);
+	p = emul_state_put(p + SNAP_MAGIC_LEN, s->pc, s->registers, &s->flags);
+	p = put_be(p, s->icount, 8);
+	p = put_be(p, s->ram_size, 4);
+	put_be(p, s->bytes_used, 4);
+
+	if (fwrite(header, 1, sizeof(header), f) != sizeof(header) ||
+	    fwrite(s->ram, 1, s->ram_size, f) != s->ram_size || fflush(f)) {
+		perror("fwrite");
+		return 1;
+	}
+	return 0;
+}
+
+/* Read a snapshot written by emul_snapshot_save() from `f' into `s' */
+int emul_snapshot_load(struct emul_snapshot *s, FILE *f)
+{
+	uint8_t header[SNAP_HEADER_LEN];
+	const uint8_t *p = header;
+	uint8_t *ram = NULL;
+	uint64_t val = 0;
+	int ret = 1;
+
+	memset(s, 0, sizeof(*s));
+	if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(p, SNAP_MAGIC, SNAP_MAGIC_LEN)) {
+		fprintf(stderr, "Not a snapshot\n");
+		return 1;
+	}
+	p = emul_state_get(p + SNAP_MAGIC_LEN, &s->pc, s->registers, &s->flags);
+	p = get_be(p, &s->icount, 8);
+	p = get_be(p, &val, 4);
+	s->ram_size = val;
+	get_be(p, &val, 4);
+	s->bytes_used = val;
+
+	if (!s->ram_size || s->bytes_used > s->ram_size || s->flags.oper > FLAGS_SET) {
+		fprintf(stderr, "Corrupt snapshot\n");
+		return 1;
+	}
+	if ((ram = malloc(s->ram_size)) == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	if (fread(ram, 1, s->ram_size, f) != s->ram_size) {
+		fprintf(stderr, "Truncated snapshot\n");
+		goto out;
+	}
+	ret = set_ram(s, ram);
+
+out:
+	free(ram);
+	return ret;
+}
+
+static void set_context(const struct emul_snapshot *s, struct emul_context *ctx)
+{
+	ctx->pc = s->pc;
+	memcpy(ctx->registers, s->registers, sizeof(ctx->registers));
+	ctx->flags = s->flags;
+	ctx->icount = s->icount;
+}
+
+/**
+ * Put `ctx' back in the state of `s'. Its RAM must be the same size, and is
+ * only written, flushing what was decoded from it, if it has changed
+ */
+int emul_snapshot_restore(const struct emul_snapshot *s, struct emul_context *ctx)
+{
+	if (ctx->ram_size != s->ram_size) {
+		fprintf(stderr, "Snapshot of %zd bytes of RAM, not %zd\n", s->ram_size, ctx->ram_size);
+		return 1;
+	}
+	if (memcmp(ctx->ram, s->ram, s->ram_size))
+		emul_ram_write(ctx, 0, s->ram, s->ram_size);
+	ctx->bytes_used = s->bytes_used;
+	set_context(s, ctx);
+
+	return 0;
+}
+
+/**
+ * Start a new context `ctx' from `s', with its own copy-on-write view of the
+ * snapshot's RAM. Free it with emul_snapshot_fork_free()
+ */
+int emul_snapshot_fork(const struct emul_snapshot *s, struct emul_context *ctx)
+{
+	uint8_t *ram = NULL;
+
+#ifdef EMUL_HAVE_COW
+	ram = mmap(NULL, s->ram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(s->backing), 0);
+	if (ram == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+#else
+	if ((ram = malloc(s->ram_size)) == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	memcpy(ram, s->ram, s->ram_size);
+#endif
+
+	if (emul_init(ctx, ram, s->ram_size, s->bytes_used)) {
+		ctx->ram = ram;
+		emul_snapshot_fork_free(ctx);
+		return 1;
+	}
+	set_context(s, ctx);
+	debug("Forked at pc 0x%x after %llu instructions\n", s->pc, (unsigned long long)s->icount);
+
+	return 0;
+}
+
+void emul_snapshot_fork_free(struct emul_context *ctx)
+{
+	emul_free(ctx);
+#ifdef EMUL_HAVE_COW
+	munmap(ctx->ram, ctx->ram_size);
+#else
+	free(ctx->ram);
+#endif
+	ctx->ram = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef EMUL_SNAP_H
+#define EMUL_SNAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "emul/emul.h"
+
+/* Forks map a snapshot's RAM copy-on-write through mmap(2) */
+#if defined(__unix__)
+#define EMUL_HAVE_COW
+#endif
+
+/**
+ * Everything needed to carry on running a guest from where it was: its
+ * registers, flags, instruction count and RAM
+ */
+struct emul_snapshot {
+	uint16_t pc;
+	uint16_t registers[REG_COUNT];
+	struct lazy_flags flags;
+	uint64_t icount;
+	size_t ram_size;
+	size_t bytes_used;
+	const uint8_t *ram;  /* read-only, shared by every fork */
+	FILE *backing;       /* file under `ram', NULL if not mapped */
+};
+
+/**
+ * The guest state of a saved snapshot, after its magic: big-endian pc, $0 to
+ * $H and the flags. Trace frames hold it too
+ */
+#define EMUL_STATE_LEN (2 * (1 + REG_COUNT + 3) + 1)
+
+uint8_t *emul_state_put(uint8_t *p, uint16_t pc, const uint16_t *registers, const struct lazy_flags *flags);
+const uint8_t *emul_state_get(const uint8_t *p, uint16_t *pc, uint16_t *registers, struct lazy_flags *flags);
+
+int emul_snapshot_take(struct emul_snapshot *s, const struct emul_context *ctx);
+void emul_snapshot_free(struct emul_snapshot *s);
+int emul_snapshot_save(const struct emul_snapshot *s, FILE *f);
+int emul_snapshot_load(struct emul_snapshot *s, FILE *f);
+int emul_snapshot_restore(const struct emul_snapshot *s, struct emul_context *ctx);
+int emul_snapshot_fork(const struct emul_snapshot *s, struct emul_context *ctx);
+void emul_snapshot_fork_free(struct emul_context *ctx);
+
+#endif /* EMUL_SNAP_H */
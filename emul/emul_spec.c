@@ -0,0 +1,30 @@
+#include <stdint.h>
+
+#include "instruction.h"
+#include "emul/emul.h"
+#include "emul/emul_spec.h"
+
+/**
+ * Specialised engine: fetch the raw instruction word and call the handler
+ * generated for exactly that word. There is no decoding at run time, and so
+ * no predecode cache either
+ */
+enum EMUL_EXIT emul_run_spec(struct emul_context *ctx, uint64_t budget)
+{
+	size_t end = ctx->bytes_used < ctx->ram_size ? ctx->bytes_used : ctx->ram_size;
+	uint64_t n = 0;
+	uint16_t word = 0;
+
+	for (n = 0; ctx->pc < end; n++) {
+		if (n == budget) {
+			ctx->icount += n;
+			return EMUL_EXIT_BUDGET;
+		}
+
+		word = emul_spec_fetch(ctx, ctx->pc);
+		emul_spec_handlers[word](ctx, word);
+	}
+
+	ctx->icount += n;
+	return EMUL_EXIT_HALT;
+}
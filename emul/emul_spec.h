@@ -0,0 +1,26 @@
+#ifndef EMUL_SPEC_H
+#define EMUL_SPEC_H
+
+#include "emul/emul.h"
+
+/**
+ * Handler for one 16-bit instruction word, specialised to everything encoded
+ * in it but its immediate or offset, which it reads from `word'. Executes the
+ * instruction at ctx->pc and moves the pc on
+ */
+typedef void (*emul_spec_handler)(struct emul_context *ctx, uint16_t word);
+
+/* Big-endian word at `offs', without a division unless it wraps round RAM */
+static inline uint16_t emul_spec_fetch(const struct emul_context *ctx, size_t offs)
+{
+	if (offs + 1 < ctx->ram_size)
+		return ctx->ram[offs] << 8 | ctx->ram[offs + 1];
+	return RAM_AT(ctx, offs) << 8 | RAM_AT(ctx, offs + 1);
+}
+
+/* Generated into emul/emul_spec_table.c by emul/gen_spec */
+extern const emul_spec_handler emul_spec_handlers[1 << 16];
+
+enum EMUL_EXIT emul_run_spec(struct emul_context *ctx, uint64_t budget);
+
+#endif /* EMUL_SPEC_H */
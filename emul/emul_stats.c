@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "instruction.h"
+#include "util.h"
+#include "emul/emul.h"
+#include "emul/emul_stats.h"
+
+/**
+ * The instruction mix kept in ctx->counters, for people. Every engine keeps it
+ * as it goes, so it costs nothing to print but the walk over the block and JIT
+ * caches folding in what they counted per block.
+ */
+
+static const char *const type_names[] = ISA_INST_NAMES;
+
+/* Host time in nanoseconds, for timing a run */
+uint64_t emul_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int is_jump(enum INST_TYPE type)
+{
+	return type == INST_TYPE_JR || type == INST_TYPE_JI || type == INST_TYPE_B;
+}
+
+/**
+ * Print the counters of `ctx', which took `ns' nanoseconds of host time to
+ * run, or 0 if not timed
+ */
+void emul_stats_print(FILE *f, struct emul_context *ctx, uint64_t ns)
+{
+	const struct emul_counters *c = &ctx->counters;
+	uint64_t by_type = 0;
+	uint64_t by_oper[8] = { 0 };
+	uint64_t jumps = 0;
+	int type = 0;
+	int oper = 0;
+
+	emul_counters_sync(ctx);
+
+	fprintf(f, "instructions retired: %llu\n", (unsigned long long)ctx->icount);
+	for (type = 0; type < INST_TYPE_COUNT; type++) {
+		for (oper = 0, by_type = 0; oper < 8; oper++) {
+			by_type += c->mix[type][oper];
+			if (is_jump(type))
+				jumps += c->mix[type][oper];
+			else
+				by_oper[oper] += c->mix[type][oper];
+		}
+		fprintf(f, "%s-type: %llu\n", type_names[type], (unsigned long long)by_type);
+	}
+	for (oper = 0; oper < 8; oper++)
+		fprintf(f, "%s: %llu\n", get_asm_from_oper(oper), (unsigned long long)by_oper[oper]);
+	fprintf(f, "jumps taken: %llu\n", (unsigned long long)c->taken);
+	fprintf(f, "jumps not taken: %llu\n", (unsigned long long)(jumps - c->taken));
+
+	if (!ns)
+		return;
+	fprintf(f, "host time: %.3f ms\n", ns / 1e6);
+	if (ctx->icount)
+		fprintf(f, "host ns per instruction: %.2f\n", (double)ns / ctx->icount);
+	fprintf(f, "MIPS: %.2f\n", ctx->icount * 1e3 / ns);
+}
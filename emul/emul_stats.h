@@ -0,0 +1,12 @@
+#ifndef EMUL_STATS_H
+#define EMUL_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "emul/emul.h"
+
+uint64_t emul_stats_now(void);
+void emul_stats_print(FILE *f, struct emul_context *ctx, uint64_t ns);
+
+#endif /* EMUL_STATS_H */
@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "instruction.h"
+#include "util.h"
+#include "emul/emul.h"
+#include "emul/emul_threaded.h"
+
+/**
+ * Fusion statistics, indexed by n-gram id. ALU operations are numbered
+ * 0-15 (OPER_*, plus 8 for an immediate right hand side) and direct jumps
+ * 0-15 (JCOND_*, plus 8 for B-type)
+ */
+#define FUSED_ALU_BRANCH_ID(a, j)         ((a) * 16 + (j))
+#define FUSED_LDI_ALU_ID(a)               (256 + (a))
+#define FUSED_ALU_ALU_BRANCH_ID(a, b, j)  (272 + ((a) * 16 + (b)) * 16 + (j))
+#define FUSED_IDS                         (272 + 16 * 16 * 16)
+
+struct fusion_stats {
+	uint64_t sites[FUSED_IDS]; /* slots fused into this n-gram */
+	uint64_t runs[FUSED_IDS];  /* executions of those slots */
+};
+
+static int alu_id(const struct predecoded *p)
+{
+	return (p->type != INST_TYPE_R) * 8 + p->oper;
+}
+
+static int jump_id(const struct predecoded *p)
+{
+	return (p->type == INST_TYPE_B) * 8 + p->oper;
+}
+
+static void print_alu(FILE *f, int id)
+{
+	fprintf(f, "%s%s", get_asm_from_oper(id % 8), id >= 8 ? "i" : "");
+}
+
+static void print_jump(FILE *f, int id)
+{
+	fputs(id >= 8 ? get_asm_from_b(id % 8) : get_asm_from_j(id % 8), f);
+}
+
+static void print_ngram(FILE *f, int id)
+{
+	if (id < FUSED_LDI_ALU_ID(0)) {
+		print_alu(f, id / 16);
+		fputc('+', f);
+		print_jump(f, id % 16);
+	} else if (id < FUSED_ALU_ALU_BRANCH_ID(0, 0, 0)) {
+		fputs("ldi+", f);
+		print_alu(f, id - FUSED_LDI_ALU_ID(0));
+	} else {
+		id -= FUSED_ALU_ALU_BRANCH_ID(0, 0, 0);
+		print_alu(f, id / 256);
+		fputc('+', f);
+		print_alu(f, id / 16 % 16);
+		fputc('+', f);
+		print_jump(f, id % 16);
+	}
+}
+
+void emul_threaded_print_stats(FILE *f, const struct emul_context *ctx)
+{
+	const struct fusion_stats *fs = ctx->fusion;
+	int id = 0;
+
+	if (!fs)
+		return;
+
+	for (id = 0; id < FUSED_IDS; id++) {
+		if (!fs->sites[id])
+			continue;
+		fprintf(f, "fused ");
+		print_ngram(f, id);
+		fprintf(f, ": %llu sites, %llu runs\n",
+			(unsigned long long)fs->sites[id],
+			(unsigned long long)fs->runs[id]);
+	}
+}
+
+void emul_threaded_free(struct emul_context *ctx)
+{
+	free(ctx->fusion);
+	ctx->fusion = NULL;
+}
+
+#ifdef __GNUC__
+/* Labels as values and computed goto are both GNU extensions. This engine is
+ * only built by compilers which have them */
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+/* Fetch the next instruction and jump straight to its handler. The threaded
+ * handler is stashed in the predecode slot the first time it is executed.
+ * A fused slot retires `count' instructions at once, so it only runs whole
+ * if the budget covers all of them */
+#define DISPATCH()                                 \
+	do {                                           \
+		if (pc >= end) {                           \
+			ret = EMUL_EXIT_HALT;                  \
+			goto out;                              \
+		}                                          \
+		p = &cache[pc];                            \
+		if (!p->thread)                            \
+			goto decode;                           \
+		if (left < p->count)                       \
+			goto starved;                          \
+		left -= p->count;                          \
+		pc += p->span;                             \
+		goto *p->thread;                           \
+	} while (0)
+
+/* Run ALU operation `op' of slot `q', recording it for the flags */
+#define ALU(q, op, rhs)                            \
+	do {                                           \
+		fl.left = regs[(q)->left];                 \
+		fl.right = (rhs);                          \
+		fl.oper = (op);                            \
+		fl.res = emul_alu(op, fl.left, fl.right);  \
+		if ((q)->dest != REG_0 && (q)->dest != REG_H) \
+			regs[(q)->dest] = fl.res;              \
+	} while (0)
+
+#define RHS_r(q) regs[(q)->right]
+#define RHS_i(q) (q)->imm
+
+/* For each condition, the (zf | cf << 1) flag states under which it holds:
+ * its test worked out on all four states at once, a bit each */
+#define ALWAYS 0xf
+#define NOT(a) (0xf & ~(a))
+#define EITHER(a, b) ((a) | (b))
+#define ZF 0xa
+#define CF 0xc
+#define COND_MASK(name, value, jump, branch, test) \
+	[JB_##name] = test,
+static const uint8_t cond_masks[] = {
+	ISA_CONDS(COND_MASK)
+};
+#undef ALWAYS
+#undef NOT
+#undef EITHER
+#undef ZF
+#undef CF
+
+/* Flags, materialised from the last ALU operation only where they are read */
+#define ZF (fl.res == 0)
+#define CF emul_carry(&fl)
+#define ALWAYS 1
+#define NOT(a) (!(a))
+#define EITHER(a, b) ((a) || (b))
+
+/* Count the instruction in slot `q' in the mix */
+#define COUNT(q) mix[(q)->type][(q)->oper]++
+
+/* Handlers for one ALU operation, with register and immediate right hand
+ * operands */
+#define ALU_HANDLERS(name, op)                     \
+	r_##name:                                      \
+		COUNT(p);                                  \
+		ALU(p, op, RHS_r(p));                      \
+		DISPATCH();                                \
+	i_##name:                                      \
+		COUNT(p);                                  \
+		ALU(p, op, RHS_i(p));                      \
+		DISPATCH();
+
+/* Handlers for one jump/branch condition, for each of the J-type forms */
+#define COND_HANDLERS(name, test)                  \
+	jr_##name:                                     \
+		COUNT(p);                                  \
+		if (test) {                                \
+			pc = regs[p->left];                    \
+			taken++;                               \
+		}                                          \
+		DISPATCH();                                \
+	ji_##name:                                     \
+		COUNT(p);                                  \
+		if (test) {                                \
+			pc = p->imm;                           \
+			taken++;                               \
+		}                                          \
+		DISPATCH();                                \
+	b_##name:                                      \
+		COUNT(p);                                  \
+		if (test) {                                \
+			pc = p->imm;                           \
+			taken++;                               \
+		}                                          \
+		DISPATCH();
+
+/* Take the direct jump in slot `q' if its condition holds. cf is only worked
+ * out for the conditions which read it */
+#define BRANCH(q)                                  \
+	do {                                           \
+		COUNT(q);                                  \
+		if ((cond_masks[(q)->oper] >> (ZF | ((q)->oper >= JB_CARRY && CF) << 1)) & 1) { \
+			pc = (q)->imm;                         \
+			taken++;                               \
+		}                                          \
+	} while (0)
+
+/**
+ * Fused handlers for one ALU operation `form' (r or i):
+ *  - ab_: the operation, then a direct jump on its result. The _body label is
+ *    shared with the triple, which has already counted the run
+ *  - la_: `ldi' (addi from $0) into a register, then the operation
+ *  - aab_: the operation, then an ALU operation and jump as ab_
+ * Only the last ALU operation of an n-gram needs recording for the flags
+ */
+#define FUSED_HANDLERS(name, op, form)             \
+	ab_##form##_##name:                            \
+		runs[p->fused_id]++;                       \
+	ab_##form##_##name##_body:                     \
+		COUNT(p);                                  \
+		ALU(p, op, RHS_##form(p));                 \
+		p += p->size;                              \
+		BRANCH(p);                                 \
+		DISPATCH();                                \
+	la_##form##_##name:                            \
+		runs[p->fused_id]++;                       \
+		COUNT(p);                                  \
+		if (p->dest != REG_0 && p->dest != REG_H)  \
+			regs[p->dest] = regs[p->left] + p->imm; \
+		p += p->size;                              \
+		COUNT(p);                                  \
+		ALU(p, op, RHS_##form(p));                 \
+		DISPATCH();                                \
+	aab_##form##_##name:                           \
+		runs[p->fused_id]++;                       \
+		COUNT(p);                                  \
+		res = emul_alu(op, regs[p->left], RHS_##form(p)); \
+		if (p->dest != REG_0 && p->dest != REG_H)  \
+			regs[p->dest] = res;                   \
+		p += p->size;                              \
+		goto *opers[p->oper].ab_body[p->type != INST_TYPE_R];
+
+/* Every handler of one ALU operation, for a register right hand side and
+ * for an immediate one */
+#define OPER_THREADS(name, value, mnemonic, result, carry) \
+	[OPER_##name] = { \
+		.alu     = { &&r_##name, &&i_##name }, \
+		.ab      = { &&ab_r_##name, &&ab_i_##name }, \
+		.ab_body = { &&ab_r_##name##_body, &&ab_i_##name##_body }, \
+		.la      = { &&la_r_##name, &&la_i_##name }, \
+		.aab     = { &&aab_r_##name, &&aab_i_##name }, \
+	},
+
+struct oper_threads {
+	const void *alu[2];
+	const void *ab[2];
+	const void *ab_body[2];
+	const void *la[2];
+	const void *aab[2];
+};
+
+/* Every handler of one condition */
+#define COND_THREADS(name, value, jump, branch, test) \
+	[JB_##name] = { .jr = &&jr_##name, .ji = &&ji_##name, .b = &&b_##name },
+
+struct cond_threads {
+	const void *jr;
+	const void *ji;
+	const void *b;
+};
+
+#define OPER_HANDLERS(name, value, mnemonic, result, carry) \
+	ALU_HANDLERS(name, OPER_##name) \
+	FUSED_HANDLERS(name, OPER_##name, r) \
+	FUSED_HANDLERS(name, OPER_##name, i)
+
+#define COND_ROW_HANDLERS(name, value, jump, branch, test) \
+	COND_HANDLERS(name, test)
+
+static bool is_alu(const struct predecoded *p)
+{
+	return p->type == INST_TYPE_R || p->type == INST_TYPE_NI || p->type == INST_TYPE_WI;
+}
+
+static bool is_direct_jump(const struct predecoded *p)
+{
+	return p->type == INST_TYPE_JI || p->type == INST_TYPE_B;
+}
+
+static bool is_ldi(const struct predecoded *p)
+{
+	return (p->type == INST_TYPE_NI || p->type == INST_TYPE_WI)
+	    && p->oper == OPER_ADD && p->left == REG_0;
+}
+
+/**
+ * Predecoded slot of the instruction following the one in `p' at `pc', or
+ * NULL if that is past the end of the program
+ */
+static struct predecoded *next_slot(struct emul_context *ctx, struct predecoded *p, uint16_t pc, size_t end)
+{
+	size_t next = (size_t)pc + p->size;
+	struct predecoded *q = NULL;
+
+	if (next >= end || next >= PREDECODE_SLOTS)
+		return NULL;
+
+	q = &ctx->cache[next];
+	if (!q->size && emul_predecode(ctx, next, q))
+		return NULL;
+	return q;
+}
+
+/**
+ * Direct-threaded engine: every (type, oper) and (type, cond) pair has its own
+ * handler, and each handler jumps directly to the next instruction's handler
+ * rather than returning to a central loop.
+ *
+ * At decode time, common idioms (an ALU operation and the branch on its
+ * result, `ldi' and an ALU operation, and an ALU operation in front of either)
+ * are fused into a single handler which retires the whole n-gram with one
+ * dispatch. The slots of the later instructions are left as they are, so
+ * jumping into the middle of a fused n-gram still works
+ */
+enum EMUL_EXIT emul_run_threaded(struct emul_context *ctx, uint64_t budget)
+{
+	static const struct oper_threads opers[] = { ISA_OPERS(OPER_THREADS) };
+	static const struct cond_threads conds[] = { ISA_CONDS(COND_THREADS) };
+
+	enum EMUL_EXIT ret = EMUL_EXIT_HALT;
+	struct predecoded *cache = ctx->cache;
+	struct predecoded *p = NULL;
+	struct predecoded *q = NULL;
+	struct predecoded *r = NULL;
+	uint64_t *runs = NULL;
+	uint64_t (*mix)[8] = ctx->counters.mix;
+	uint64_t taken = 0;
+	uint16_t *regs = ctx->registers;
+	uint16_t pc = ctx->pc;
+	uint16_t res = 0;
+	struct lazy_flags fl = ctx->flags;
+	uint64_t left = budget;
+	size_t end = ctx->bytes_used < ctx->ram_size ? ctx->bytes_used : ctx->ram_size;
+
+	if (!ctx->fusion && (ctx->fusion = calloc(1, sizeof(*ctx->fusion))) == NULL) {
+		perror("calloc");
+		return EMUL_EXIT_ERROR;
+	}
+	runs = ctx->fusion->runs;
+
+	DISPATCH();
+
+decode:
+	if (!p->size && emul_predecode(ctx, pc, p)) {
+		ret = EMUL_EXIT_ERROR;
+		goto out;
+	}
+	p->count = 1;
+	p->span = p->size;
+	switch (p->type) {
+		case INST_TYPE_R:  p->thread = opers[p->oper].alu[0]; break;
+		case INST_TYPE_NI:
+		case INST_TYPE_WI: p->thread = opers[p->oper].alu[1]; break;
+		case INST_TYPE_JR: p->thread = conds[p->oper].jr;     break;
+		case INST_TYPE_JI: p->thread = conds[p->oper].ji;     break;
+		case INST_TYPE_B:  p->thread = conds[p->oper].b;      break;
+		default:
+			fprintf(stderr, "Unhandled instruction type %d at 0x%x, stop.\n", p->type, pc);
+			ret = EMUL_EXIT_ERROR;
+			goto out;
+	}
+
+	/* longest match first: alu+alu+jump, then alu+jump and ldi+alu */
+	if (is_alu(p) && (q = next_slot(ctx, p, pc, end)) != NULL) {
+		r = is_alu(q) ? next_slot(ctx, q, pc + p->size, end) : NULL;
+		if (r && is_direct_jump(r)) {
+			p->thread = opers[p->oper].aab[p->type != INST_TYPE_R];
+			p->fused_id = FUSED_ALU_ALU_BRANCH_ID(alu_id(p), alu_id(q), jump_id(r));
+			p->count = 3;
+			p->span = p->size + q->size + r->size;
+		} else if (is_direct_jump(q)) {
+			p->thread = opers[p->oper].ab[p->type != INST_TYPE_R];
+			p->fused_id = FUSED_ALU_BRANCH_ID(alu_id(p), jump_id(q));
+			p->count = 2;
+			p->span = p->size + q->size;
+		} else if (is_ldi(p) && is_alu(q)) {
+			p->thread = opers[q->oper].la[q->type != INST_TYPE_R];
+			p->fused_id = FUSED_LDI_ALU_ID(alu_id(q));
+			p->count = 2;
+			p->span = p->size + q->size;
+		}
+		if (p->count > 1)
+			ctx->fusion->sites[p->fused_id]++;
+	}
+	DISPATCH();
+
+starved:
+	/* too little budget left for the whole fused n-gram: finish off one
+	 * instruction at a time */
+	ctx->pc = pc;
+	ctx->flags = fl;
+	ctx->icount += budget - left;
+	ctx->counters.taken += taken;
+	return emul_run(ctx, left);
+
+	ISA_OPERS(OPER_HANDLERS)
+	ISA_CONDS(COND_ROW_HANDLERS)
+
+out:
+	ctx->pc = pc;
+	ctx->flags = fl;
+	ctx->icount += budget - left;
+	ctx->counters.taken += taken;
+	return ret;
+}
+
+#endif /* __GNUC__ */
@@ -0,0 +1,10 @@
+#ifndef EMUL_THREADED_H
+#define EMUL_THREADED_H
+
+#include "emul/emul.h"
+
+enum EMUL_EXIT emul_run_threaded(struct emul_context *ctx, uint64_t budget);
+void emul_threaded_print_stats(FILE *f, const struct emul_context *ctx);
+void emul_threaded_free(struct emul_context *ctx);
+
+#endif /* EMUL_THREADED_H */
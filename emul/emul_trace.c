@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "instruction.h"
+#include "util.h"
+#include "emul/emul.h"
+#include "emul/emul_snap.h"
+#include "emul/emul_trace.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Execution traces: every instruction a guest runs, in a few bits each, to be
+ * replayed or searched afterwards without the guest.
+ *
+ * With no loads or stores in the ISA, a guest's registers follow from where it
+ * started and the path it took, so a trace records only the jumps whose
+ * outcome cannot be read off the program. A conditional jump or branch taken
+ * is a record of the instructions run since the last record, as a varint; a
+ * jump to a register taken adds its target, as a zigzag varint delta from the
+ * jump. Not taken is the lack of a record, and jumps which are always or never
+ * taken to a fixed target are not recorded at all.
+ *
+ * A trace is the magic "TOYTRAC1", then the big-endian chunk size, RAM size and
+ * bytes used (32 bits each) and the program. Then come the chunks, each of
+ * EMUL_TRACE_CHUNK bytes: a frame of the guest's state where it starts (as in
+ * a snapshot: the instruction count, pc, $0 to $H and the flags) and records up
+ * to a zero byte. Last come the index, the instruction count at the start of
+ * each chunk (64 bits each), the frame the trace ended at, the number of
+ * chunks (64 bits) and the magic again. A chunk is started at most every
+ * EMUL_TRACE_SPAN instructions, so any instruction is reached by running from
+ * the frame of the last chunk starting before it.
+ *
+ * The guest fills chunks in place in a ring, and a thread of the trace's own
+ * writes them out, the two handing chunks over through a pair of atomic
+ * counters alone. The guest only waits on the disk if it falls the whole ring
+ * behind. Tracing is an engine of its own, emul_trace_engine, stepping the
+ * reference engine an instruction at a time.
+ */
+
+#define TRACE_MAGIC "TOYTRAC1"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_HEADER_LEN (TRACE_MAGIC_LEN + 4 + 4 + 4)
+#define TRACE_TRAILER_LEN (8 + TRACE_MAGIC_LEN)
+#define FRAME_LEN (8 + EMUL_STATE_LEN)
+
+/* Longest record: a run of instructions and a target delta */
+#define RECORD_MAX (10 + 3)
+
+struct trace_writer {
+	FILE *f;
+	pthread_t thread;
+	uint8_t (*ring)[EMUL_TRACE_CHUNK];
+	atomic_size_t head;   /* chunks filled by the guest */
+	atomic_size_t tail;   /* chunks written out */
+	atomic_bool done;     /* no more chunks to come */
+	atomic_bool failed;   /* a write failed, so the rest are dropped */
+	uint8_t *p;           /* where the next record goes */
+	uint8_t *end;         /* end of the chunk being filled */
+	uint64_t base;        /* icount at the start of the chunk */
+	uint64_t last;        /* icount at the last record, or `base' */
+	uint64_t *index;      /* icount at the start of each chunk */
+	size_t chunks;
+	size_t index_size;
+};
+
+static uint8_t *put_varint(uint8_t *p, uint64_t val)
+{
+	for (; val >= 0x80; val >>= 7)
+		*p++ = 0x80 | (val & 0x7f);
+	*p++ = val;
+	return p;
+}
+
+/* Read a varint at `*p', which must end before `end'. Returns non-zero if not */
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *val)
+{
+	int shift = 0;
+
+	for (*val = 0; *p < end && shift < 64; shift += 7) {
+		*val |= (uint64_t)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80))
+			return 0;
+	}
+	return 1;
+}
+
+static uint16_t zigzag(uint16_t delta)
+{
+	return (uint16_t)(delta << 1) ^ (uint16_t)-(delta >> 15);
+}
+
+static uint16_t unzigzag(uint64_t val)
+{
+	return (uint16_t)(val >> 1) ^ (uint16_t)-(val & 1);
+}
+
+static void frame_of(struct emul_trace_frame *frame, const struct emul_context *ctx)
+{
+	frame->icount = ctx->icount;
+	frame->pc = ctx->pc;
+	memcpy(frame->registers, ctx->registers, sizeof(frame->registers));
+	frame->flags = ctx->flags;
+}
+
+static uint8_t *put_frame(uint8_t *p, const struct emul_trace_frame *frame)
+{
+	p = put_be(p, frame->icount, 8);
+	return emul_state_put(p, frame->pc, frame->registers, &frame->flags);
+}
+
+static const uint8_t *get_frame(const uint8_t *p, struct emul_trace_frame *frame)
+{
+	p = get_be(p, &frame->icount, 8);
+	return emul_state_get(p, &frame->pc, frame->registers, &frame->flags);
+}
+
+/**
+ * Whether the outcome of `p' is recorded: a jump which may or may not be
+ * taken, or which goes where a register says
+ */
+static bool recorded(const struct predecoded *p)
+{
+	switch (p->type) {
+		case INST_TYPE_JR:
+			return p->oper != JB_NEVER;
+		case INST_TYPE_JI:
+		case INST_TYPE_B:
+			return p->oper != JB_UNCOND && p->oper != JB_NEVER;
+		default:
+			return false;
+	}
+}
+
+/* Write out chunks as the guest fills them, until told there are no more */
+static void *writer_main(void *arg)
+{
+	struct trace_writer *w = arg;
+	const struct timespec nap = { .tv_nsec = 100000 };
+	size_t tail = 0;
+	bool done = false;
+
+	for (;;) {
+		done = atomic_load_explicit(&w->done, memory_order_acquire);
+		if (tail == atomic_load_explicit(&w->head, memory_order_acquire)) {
+			if (done)
+				return NULL;
+			nanosleep(&nap, NULL);
+			continue;
+		}
+		if (!atomic_load_explicit(&w->failed, memory_order_relaxed) &&
+		    fwrite(w->ring[tail % EMUL_TRACE_RING], 1, EMUL_TRACE_CHUNK, w->f) != EMUL_TRACE_CHUNK) {
+			perror("fwrite");
+			atomic_store_explicit(&w->failed, true, memory_order_relaxed);
+		}
+		atomic_store_explicit(&w->tail, ++tail, memory_order_release);
+	}
+}
+
+/* Start a chunk at the guest as it is now, once there is room in the ring */
+static int start_chunk(struct trace_writer *w, const struct emul_context *ctx)
+{
+	size_t head = atomic_load_explicit(&w->head, memory_order_relaxed);
+	struct emul_trace_frame frame;
+	uint64_t *index = NULL;
+
+	if (w->chunks == w->index_size) {
+		if ((index = realloc(w->index, 2 * (w->index_size + 32) * sizeof(*index))) == NULL) {
+			perror("realloc");
+			return 1;
+		}
+		w->index = index;
+		w->index_size = 2 * (w->index_size + 32);
+	}
+	while (head - atomic_load_explicit(&w->tail, memory_order_acquire) == EMUL_TRACE_RING)
+		sched_yield();
+
+	frame_of(&frame, ctx);
+	w->index[w->chunks++] = ctx->icount;
+	w->base = w->last = ctx->icount;
+	w->p = put_frame(w->ring[head % EMUL_TRACE_RING], &frame);
+	w->end = w->ring[head % EMUL_TRACE_RING] + EMUL_TRACE_CHUNK;
+	return 0;
+}
+
+/* Hand the chunk being filled to the writer thread */
+static void end_chunk(struct trace_writer *w)
+{
+	size_t head = atomic_load_explicit(&w->head, memory_order_relaxed);
+
+	memset(w->p, 0, w->end - w->p);
+	atomic_store_explicit(&w->head, head + 1, memory_order_release);
+}
+
+static enum EMUL_EXIT trace_run(struct emul_context *ctx, uint64_t budget)
+{
+	struct trace_writer *w = ctx->trace;
+	const struct predecoded *p = NULL;
+	uint16_t pc = 0;
+
+	/* contexts the trace is not kept for, such as emul_cycle_locate()'s
+	 * copies, just run */
+	if (!w)
+		return emul_run(ctx, budget);
+
+	while (ctx->pc < ctx->ram_size && ctx->pc < ctx->bytes_used) {
+		if (!budget--)
+			return EMUL_EXIT_BUDGET;
+
+		/* room for a record and the zero ending the chunk */
+		if (w->end - w->p <= RECORD_MAX || ctx->icount - w->base >= EMUL_TRACE_SPAN) {
+			end_chunk(w);
+			if (start_chunk(w, ctx))
+				return EMUL_EXIT_ERROR;
+		}
+
+		pc = ctx->pc;
+		if (execute_single(ctx))
+			return EMUL_EXIT_ERROR;
+		ctx->icount++;
+
+		p = &ctx->cache[pc];
+		if (ctx->pc != (uint16_t)(pc + p->size) && recorded(p)) {
+			w->p = put_varint(w->p, ctx->icount - w->last);
+			if (p->type == INST_TYPE_JR)
+				w->p = put_varint(w->p, zigzag(ctx->pc - pc));
+			w->last = ctx->icount;
+		}
+	}
+
+	return EMUL_EXIT_HALT;
+}
+
+const struct emul_engine emul_trace_engine = {
+	.name = "trace",
+	.run = trace_run,
+};
+
+/**
+ * Trace `ctx' into `f' from here on, run by emul_trace_engine, until
+ * emul_trace_finish(). Returns non-zero on failure
+ */
+int emul_trace_enable(struct emul_context *ctx, FILE *f)
+{
+	uint8_t header[TRACE_HEADER_LEN];
+	size_t used = ctx->bytes_used < ctx->ram_size ? ctx->bytes_used : ctx->ram_size;
+	struct trace_writer *w = NULL;
+
+	memcpy(header, TRACE_MAGIC, TRACE_MAGIC_LEN);
+	put_be(put_be(put_be(header + TRACE_MAGIC_LEN, EMUL_TRACE_CHUNK, 4), ctx->ram_size, 4), used, 4);
+	if (fwrite(header, 1, sizeof(header), f) != sizeof(header) || fwrite(ctx->ram, 1, used, f) != used) {
+		perror("fwrite");
+		return 1;
+	}
+
+	if ((w = calloc(1, sizeof(*w))) == NULL || (w->ring = malloc(EMUL_TRACE_RING * sizeof(*w->ring))) == NULL) {
+		perror("malloc");
+		goto fail;
+	}
+	w->f = f;
+	atomic_init(&w->head, 0);
+	atomic_init(&w->tail, 0);
+	atomic_init(&w->done, false);
+	atomic_init(&w->failed, false);
+	if (start_chunk(w, ctx))
+		goto fail;
+	if ((errno = pthread_create(&w->thread, NULL, writer_main, w))) {
+		perror("pthread_create");
+		goto fail;
+	}
+
+	ctx->trace = w;
+	return 0;
+
+fail:
+	if (w) {
+		free(w->index);
+		free(w->ring);
+	}
+	free(w);
+	return 1;
+}
+
+/**
+ * End the trace of `ctx', if one is kept, at the guest as it is now. Returns
+ * non-zero if any of it could not be written
+ */
+int emul_trace_finish(struct emul_context *ctx)
+{
+	struct trace_writer *w = ctx->trace;
+	struct emul_trace_frame frame;
+	uint8_t *buf = NULL;
+	uint8_t *p = NULL;
+	size_t len = 0;
+	size_t i = 0;
+	int ret = 0;
+
+	if (!w)
+		return 0;
+
+	end_chunk(w);
+	atomic_store_explicit(&w->done, true, memory_order_release);
+	pthread_join(w->thread, NULL);
+	ret = atomic_load_explicit(&w->failed, memory_order_relaxed);
+
+	len = 8 * w->chunks + FRAME_LEN + TRACE_TRAILER_LEN;
+	if (!ret && (buf = malloc(len)) == NULL) {
+		perror("malloc");
+		ret = 1;
+	}
+	if (!ret) {
+		for (i = 0, p = buf; i < w->chunks; i++)
+			p = put_be(p, w->index[i], 8);
+		frame_of(&frame, ctx);
+		p = put_be(put_frame(p, &frame), w->chunks, 8);
+		memcpy(p, TRACE_MAGIC, TRACE_MAGIC_LEN);
+		if (fwrite(buf, 1, len, w->f) != len || fflush(w->f)) {
+			perror("fwrite");
+			ret = 1;
+		}
+	}
+
+	debug("Traced %zu chunks\n", w->chunks);
+	free(buf);
+	free(w->index);
+	free(w->ring);
+	free(w);
+	ctx->trace = NULL;
+	return ret;
+}
+
+/* Read a trace written by emul_trace_enable() from `f' into `t' */
+int emul_trace_open(struct emul_trace *t, FILE *f)
+{
+	uint8_t buf[TRACE_HEADER_LEN > FRAME_LEN ? TRACE_HEADER_LEN : FRAME_LEN];
+	const uint8_t *p = NULL;
+	uint64_t val = 0;
+	size_t i = 0;
+
+	memset(t, 0, sizeof(*t));
+	t->f = f;
+	if (fread(buf, 1, TRACE_HEADER_LEN, f) != TRACE_HEADER_LEN || memcmp(buf, TRACE_MAGIC, TRACE_MAGIC_LEN)) {
+		fprintf(stderr, "Not a trace\n");
+		return 1;
+	}
+	p = get_be(buf + TRACE_MAGIC_LEN, &val, 4);
+	t->chunk_size = val;
+	p = get_be(p, &val, 4);
+	t->ram_size = val;
+	get_be(p, &val, 4);
+	t->bytes_used = val;
+	if (t->chunk_size <= FRAME_LEN || !t->ram_size || t->bytes_used > t->ram_size) {
+		fprintf(stderr, "Corrupt trace\n");
+		return 1;
+	}
+	if ((t->ram = calloc(1, t->ram_size)) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	if (fread(t->ram, 1, t->bytes_used, f) != t->bytes_used)
+		goto truncated;
+	t->first_chunk = ftell(f);
+
+	if (fseek(f, -TRACE_TRAILER_LEN, SEEK_END) || fread(buf, 1, TRACE_TRAILER_LEN, f) != TRACE_TRAILER_LEN ||
+	    memcmp(buf + 8, TRACE_MAGIC, TRACE_MAGIC_LEN))
+		goto truncated;
+	get_be(buf, &val, 8);
+	t->chunks = val;
+	if ((t->index = calloc(t->chunks, sizeof(*t->index))) == NULL) {
+		perror("calloc");
+		goto fail;
+	}
+	if (fseek(f, t->first_chunk + (long)(t->chunks * t->chunk_size), SEEK_SET))
+		goto truncated;
+	for (i = 0; i < t->chunks; i++) {
+		if (fread(buf, 1, 8, f) != 8)
+			goto truncated;
+		get_be(buf, &t->index[i], 8);
+		if (i && t->index[i] < t->index[i - 1]) {
+			fprintf(stderr, "Corrupt trace\n");
+			goto fail;
+		}
+	}
+	if (fread(buf, 1, FRAME_LEN, f) != FRAME_LEN)
+		goto truncated;
+	get_frame(buf, &t->end);
+	if (!t->chunks || t->end.icount < t->index[t->chunks - 1]) {
+		fprintf(stderr, "Corrupt trace\n");
+		goto fail;
+	}
+	return 0;
+
+truncated:
+	fprintf(stderr, "Truncated trace\n");
+fail:
+	emul_trace_free(t);
+	return 1;
+}
+
+void emul_trace_free(struct emul_trace *t)
+{
+	free(t->ram);
+	free(t->index);
+	t->ram = NULL;
+	t->index = NULL;
+}
+
+/* Read chunk `k' of `t', `len' bytes of it, into `buf', and its frame */
+static int read_chunk(const struct emul_trace *t, size_t k, uint8_t *buf, size_t len,
+	struct emul_trace_frame *frame)
+{
+	if (fseek(t->f, t->first_chunk + (long)(k * t->chunk_size), SEEK_SET) || fread(buf, 1, len, t->f) != len) {
+		fprintf(stderr, "Truncated trace\n");
+		return 1;
+	}
+	get_frame(buf, frame);
+	if (frame->icount != t->index[k]) {
+		fprintf(stderr, "Corrupt trace\n");
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Follow the path recorded in `t' from end to end, writing every jump taken to
+ * `out' as the instructions run before it, where it was and where it went.
+ * Returns non-zero if the trace does not hold together
+ */
+int emul_trace_replay(const struct emul_trace *t, FILE *out)
+{
+	struct emul_context ctx; /* for decoding the program */
+	struct emul_trace_frame frame;
+	struct predecoded *inst = NULL;
+	uint8_t *buf = NULL;
+	const uint8_t *p = NULL;
+	const uint8_t *end = NULL;
+	uint64_t icount = 0;
+	uint64_t stop = 0;
+	uint64_t run = 0;
+	uint64_t n = 0;
+	uint64_t val = 0;
+	uint16_t pc = 0;
+	uint16_t to = 0;
+	size_t k = 0;
+	int ret = 1;
+
+	if (emul_init(&ctx, t->ram, t->ram_size, t->bytes_used))
+		return 1;
+	if ((buf = malloc(t->chunk_size)) == NULL) {
+		perror("malloc");
+		goto out;
+	}
+
+	for (k = 0; k < t->chunks; k++) {
+		if (read_chunk(t, k, buf, t->chunk_size, &frame))
+			goto out;
+		if (k && frame.pc != pc)
+			goto diverged;
+		pc = frame.pc;
+		n = 0;
+		stop = k + 1 < t->chunks ? t->index[k + 1] : t->end.icount;
+		p = buf + FRAME_LEN;
+		end = buf + t->chunk_size;
+		if (get_varint(&p, end, &run))
+			goto corrupt;
+
+		for (icount = frame.icount; icount < stop; icount++) {
+			if (pc >= t->bytes_used)
+				goto diverged;
+			inst = &ctx.cache[pc];
+			if (!inst->size && emul_predecode(&ctx, pc, inst))
+				goto out;
+
+			to = pc + inst->size;
+			if (run && ++n == run) {
+				if (!recorded(inst))
+					goto corrupt;
+				to = inst->imm;
+				if (inst->type == INST_TYPE_JR) {
+					if (get_varint(&p, end, &val))
+						goto corrupt;
+					to = pc + unzigzag(val);
+				}
+				if (get_varint(&p, end, &run))
+					goto corrupt;
+				n = 0;
+			} else if ((inst->type == INST_TYPE_JI || inst->type == INST_TYPE_B) && inst->oper == JB_UNCOND) {
+				to = inst->imm;
+			}
+
+			if (to != (uint16_t)(pc + inst->size))
+				fprintf(out, "%llu 0x%04x 0x%04x\n", (unsigned long long)icount, pc, to);
+			pc = to;
+		}
+		if (run)
+			goto corrupt;
+	}
+	if (pc != t->end.pc)
+		goto diverged;
+
+	ret = 0;
+	goto out;
+
+diverged:
+	fprintf(stderr, "Trace diverges from its frames at instruction %llu\n", (unsigned long long)icount);
+	goto out;
+corrupt:
+	fprintf(stderr, "Corrupt trace in chunk %zu\n", k);
+out:
+	free(buf);
+	emul_free(&ctx);
+	return ret;
+}
+
+/**
+ * Set up `ctx' as the guest was after `icount' instructions, running it from
+ * the last frame before. Returns non-zero if the trace does not reach that far
+ */
+int emul_trace_seek(const struct emul_trace *t, uint64_t icount, struct emul_context *ctx)
+{
+	struct emul_trace_frame frame;
+	uint8_t buf[FRAME_LEN];
+	size_t lo = 0;
+	size_t hi = t->chunks;
+	size_t mid = 0;
+
+	if (icount < t->index[0] || icount > t->end.icount) {
+		fprintf(stderr, "Instruction %llu is not in the trace, of %llu to %llu\n", (unsigned long long)icount,
+			(unsigned long long)t->index[0], (unsigned long long)t->end.icount);
+		return 1;
+	}
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (t->index[mid] <= icount)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	if (read_chunk(t, lo, buf, sizeof(buf), &frame))
+		return 1;
+
+	if (emul_init(ctx, t->ram, t->ram_size, t->bytes_used))
+		return 1;
+	ctx->pc = frame.pc;
+	memcpy(ctx->registers, frame.registers, sizeof(ctx->registers));
+	ctx->flags = frame.flags;
+	ctx->icount = frame.icount;
+	if (emul_run(ctx, icount - frame.icount) == EMUL_EXIT_ERROR || ctx->icount != icount) {
+		fprintf(stderr, "Trace diverges from its frames at instruction %llu\n", (unsigned long long)ctx->icount);
+		emul_free(ctx);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef EMUL_TRACE_H
+#define EMUL_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "emul/emul.h"
+
+/* Bytes per chunk of a trace, and most instructions covered by one chunk */
+#define EMUL_TRACE_CHUNK 8192
+#define EMUL_TRACE_SPAN 65536
+
+/* Chunks filled and waiting to be written out */
+#define EMUL_TRACE_RING 16
+
+/* The state of the guest at some instruction, starting each chunk */
+struct emul_trace_frame {
+	uint64_t icount;
+	uint16_t pc;
+	uint16_t registers[REG_COUNT];
+	struct lazy_flags flags;
+};
+
+/* A trace opened for reading */
+struct emul_trace {
+	FILE *f;
+	uint8_t *ram;       /* the program, in RAM of its own */
+	size_t ram_size;
+	size_t bytes_used;
+	size_t chunk_size;
+	long first_chunk;   /* file offset of the first chunk */
+	uint64_t *index;    /* instruction count at the start of each chunk */
+	size_t chunks;
+	struct emul_trace_frame end; /* the guest when the trace ended */
+};
+
+extern const struct emul_engine emul_trace_engine;
+
+int emul_trace_enable(struct emul_context *ctx, FILE *f);
+int emul_trace_finish(struct emul_context *ctx);
+int emul_trace_open(struct emul_trace *t, FILE *f);
+void emul_trace_free(struct emul_trace *t);
+int emul_trace_replay(const struct emul_trace *t, FILE *out);
+int emul_trace_seek(const struct emul_trace *t, uint64_t icount, struct emul_context *ctx);
+
+#endif /* EMUL_TRACE_H */
@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "emul/emul.h"
+#include "emul/emul_ttd.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Time travel: checkpoints of the guest taken every `interval' instructions as
+ * it runs, so that it can be taken back to any instruction since recording
+ * started by restoring the last checkpoint before it and running forward
+ * again. Going back drops the checkpoints after the instruction gone back to;
+ * running on from there takes them again.
+ *
+ * A checkpoint holds the registers, flags and pc, and RAM as pages shared with
+ * the checkpoint before it wherever they are the same. The guest cannot store,
+ * so RAM only changes through emul_ram_write(), and while it has not been
+ * called since the last checkpoint every page is shared without looking.
+ *
+ * At most `max' checkpoints are kept. Past that one is thinned out, the one
+ * whose removal leaves the smallest gap for its age, so the gaps grow in
+ * proportion to how far back they are: recent history is close at hand, and
+ * the rest is still there at the cost of a longer run forward. The first
+ * checkpoint, where recording started, is never thinned.
+ *
+ * Like profiling, recording is an engine of its own, emul_ttd_engine, wrapping
+ * the one doing the work.
+ */
+
+struct ttd_page {
+	unsigned refs; /* checkpoints sharing the page */
+	uint8_t bytes[EMUL_TTD_PAGE];
+};
+
+struct checkpoint {
+	uint64_t icount;
+	uint16_t pc;
+	uint16_t registers[REG_COUNT];
+	struct lazy_flags flags;
+	uint64_t ram_writes; /* ctx->ram_writes when RAM was last saved */
+	struct ttd_page **pages;
+};
+
+struct ttd_state {
+	const struct emul_engine *engine; /* engine doing the running */
+	uint64_t interval; /* instructions between checkpoints */
+	uint64_t next;     /* icount at which to take the next one */
+	size_t max;        /* most checkpoints kept */
+	size_t count;
+	size_t npages;     /* pages in RAM */
+	struct checkpoint *cps; /* `max' + 1, oldest first */
+	uint64_t taken;    /* checkpoints taken, thinned or not */
+	uint64_t pages;    /* pages kept, shared or not */
+	uint64_t replayed; /* instructions run again going back */
+};
+
+static size_t page_len(const struct emul_context *ctx, size_t i)
+{
+	size_t left = ctx->ram_size - i * EMUL_TTD_PAGE;
+
+	return left < EMUL_TTD_PAGE ? left : EMUL_TTD_PAGE;
+}
+
+static void page_put(struct ttd_state *t, struct ttd_page *page)
+{
+	if (page && !--page->refs) {
+		free(page);
+		t->pages--;
+	}
+}
+
+/**
+ * Point the pages of `cp' at RAM as it is, sharing the pages of `prev' which
+ * are the same, and copying the rest. `prev' may be `cp' itself, to bring it
+ * up to date. Returns non-zero on failure
+ */
+static int save_pages(struct emul_context *ctx, struct checkpoint *cp, const struct checkpoint *prev)
+{
+	struct ttd_state *t = ctx->ttd;
+	struct ttd_page *page = NULL;
+	size_t off = 0;
+	size_t i = 0;
+
+	for (i = 0; i < t->npages; i++) {
+		off = i * EMUL_TTD_PAGE;
+		if (prev && (prev->ram_writes == ctx->ram_writes ||
+		             !memcmp(prev->pages[i]->bytes, ctx->ram + off, page_len(ctx, i)))) {
+			page = prev->pages[i];
+			page->refs++;
+		} else {
+			if ((page = malloc(sizeof(*page))) == NULL) {
+				perror("malloc");
+				return 1;
+			}
+			memcpy(page->bytes, ctx->ram + off, page_len(ctx, i));
+			page->refs = 1;
+			t->pages++;
+		}
+		page_put(t, cp->pages[i]);
+		cp->pages[i] = page;
+	}
+
+	cp->ram_writes = ctx->ram_writes;
+	return 0;
+}
+
+static void checkpoint_free(struct ttd_state *t, struct checkpoint *cp)
+{
+	size_t i = 0;
+
+	for (i = 0; i < t->npages; i++)
+		page_put(t, cp->pages[i]);
+	free(cp->pages);
+	cp->pages = NULL;
+}
+
+/* Drop checkpoint `i' */
+static void drop(struct ttd_state *t, size_t i)
+{
+	checkpoint_free(t, &t->cps[i]);
+	memmove(&t->cps[i], &t->cps[i + 1], (t->count - i - 1) * sizeof(*t->cps));
+	t->count--;
+}
+
+/* Drop the checkpoints after instruction `icount' */
+static void drop_after(struct ttd_state *t, uint64_t icount)
+{
+	while (t->count && t->cps[t->count - 1].icount > icount)
+		drop(t, t->count - 1);
+}
+
+/**
+ * Drop the checkpoint between the first and the last whose removal leaves the
+ * smallest gap for its age at `now'
+ */
+static void thin(struct ttd_state *t, uint64_t now)
+{
+	double score = 0;
+	double best = 0;
+	size_t victim = 0;
+	size_t i = 0;
+
+	for (i = 1; i + 1 < t->count; i++) {
+		score = (double)(t->cps[i + 1].icount - t->cps[i - 1].icount) / (now - t->cps[i].icount);
+		if (!victim || score < best) {
+			best = score;
+			victim = i;
+		}
+	}
+	debug("ttd: thinning checkpoint at %llu\n", (unsigned long long)t->cps[victim].icount);
+	drop(t, victim);
+}
+
+/* Take a checkpoint of `ctx' as it is. Returns non-zero on failure */
+static int take(struct emul_context *ctx)
+{
+	struct ttd_state *t = ctx->ttd;
+	struct checkpoint *cp = &t->cps[t->count];
+
+	memset(cp, 0, sizeof(*cp));
+	if ((cp->pages = calloc(t->npages, sizeof(*cp->pages))) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	if (save_pages(ctx, cp, t->count ? &t->cps[t->count - 1] : NULL)) {
+		checkpoint_free(t, cp);
+		return 1;
+	}
+	cp->icount = ctx->icount;
+	cp->pc = ctx->pc;
+	memcpy(cp->registers, ctx->registers, sizeof(cp->registers));
+	cp->flags = ctx->flags;
+
+	t->count++;
+	t->taken++;
+	if (t->count > t->max)
+		thin(t, ctx->icount);
+	t->next = ctx->icount + t->interval;
+	return 0;
+}
+
+/* Put `ctx' back as it was at `cp', writing only the pages which differ */
+static void restore(struct emul_context *ctx, const struct checkpoint *cp)
+{
+	struct ttd_state *t = ctx->ttd;
+	size_t off = 0;
+	size_t i = 0;
+
+	/* RAM is as it was unless written since */
+	for (i = 0; i < t->npages && cp->ram_writes != ctx->ram_writes; i++) {
+		off = i * EMUL_TTD_PAGE;
+		if (memcmp(ctx->ram + off, cp->pages[i]->bytes, page_len(ctx, i)))
+			emul_ram_write(ctx, off, cp->pages[i]->bytes, page_len(ctx, i));
+	}
+	ctx->icount = cp->icount;
+	ctx->pc = cp->pc;
+	memcpy(ctx->registers, cp->registers, sizeof(ctx->registers));
+	ctx->flags = cp->flags;
+}
+
+/* The last checkpoint at or before instruction `icount' */
+static size_t checkpoint_at(const struct ttd_state *t, uint64_t icount)
+{
+	size_t i = t->count - 1;
+
+	while (i && t->cps[i].icount > icount)
+		i--;
+	return i;
+}
+
+static enum EMUL_EXIT ttd_run(struct emul_context *ctx, uint64_t budget)
+{
+	struct ttd_state *t = ctx->ttd;
+	enum EMUL_EXIT ret = EMUL_EXIT_BUDGET;
+	uint64_t start = ctx->icount;
+	uint64_t used = 0;
+	uint64_t n = 0;
+
+	/* contexts no history is kept for, such as emul_cycle_locate()'s copies,
+	 * just run */
+	if (!t)
+		return emul_run(ctx, budget);
+
+	for (;;) {
+		if (ctx->icount >= t->next && take(ctx))
+			return EMUL_EXIT_ERROR;
+		used = ctx->icount - start;
+		if (used >= budget)
+			return EMUL_EXIT_BUDGET;
+		n = t->next - ctx->icount;
+		ret = t->engine->run(ctx, budget - used < n ? budget - used : n);
+		if (ret != EMUL_EXIT_BUDGET)
+			return ret;
+	}
+}
+
+static void ttd_print_stats(FILE *f, const struct emul_context *ctx)
+{
+	const struct ttd_state *t = ctx->ttd;
+
+	if (!t)
+		return;
+	fprintf(f,
+		"checkpoints kept: %zu\n"
+		"checkpoints taken: %llu\n"
+		"pages kept: %llu (%llu bytes)\n"
+		"instructions replayed: %llu\n",
+		t->count,
+		(unsigned long long)t->taken,
+		(unsigned long long)t->pages,
+		(unsigned long long)t->pages * EMUL_TTD_PAGE,
+		(unsigned long long)t->replayed);
+	if (t->engine->print_stats)
+		t->engine->print_stats(f, ctx);
+}
+
+const struct emul_engine emul_ttd_engine = {
+	.name = "ttd",
+	.run = ttd_run,
+	.print_stats = ttd_print_stats,
+};
+
+/**
+ * Record the history of `ctx' from here on, run by emul_ttd_engine with
+ * `engine' doing the work, keeping at most `max' checkpoints taken every
+ * `interval' instructions. Returns non-zero on failure
+ */
+int emul_ttd_enable(struct emul_context *ctx, const struct emul_engine *engine, uint64_t interval, size_t max)
+{
+	struct ttd_state *t = NULL;
+
+	if (!interval || max < 2) {
+		fprintf(stderr, "Checkpoints must be at least 1 instruction apart, and at least 2 kept\n");
+		return 1;
+	}
+	if ((t = calloc(1, sizeof(*t))) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	if ((t->cps = calloc(max + 1, sizeof(*t->cps))) == NULL) {
+		perror("calloc");
+		free(t);
+		return 1;
+	}
+	t->engine = engine;
+	t->interval = interval;
+	t->max = max;
+	t->npages = (ctx->ram_size + EMUL_TTD_PAGE - 1) / EMUL_TTD_PAGE;
+
+	ctx->ttd = t;
+	if (take(ctx)) {
+		emul_ttd_free(ctx);
+		return 1;
+	}
+	return 0;
+}
+
+void emul_ttd_free(struct emul_context *ctx)
+{
+	struct ttd_state *t = ctx->ttd;
+
+	if (!t)
+		return;
+	while (t->count)
+		drop(t, t->count - 1);
+	free(t->cps);
+	free(t);
+	ctx->ttd = NULL;
+}
+
+/**
+ * Note a change made to the guest from outside, so that going back to the
+ * instruction it was made at, if there is a checkpoint there, does not undo
+ * it. Returns non-zero on failure
+ */
+int emul_ttd_changed(struct emul_context *ctx)
+{
+	struct ttd_state *t = ctx->ttd;
+	struct checkpoint *cp = NULL;
+
+	if (!t || t->cps[t->count - 1].icount != ctx->icount)
+		return 0;
+
+	cp = &t->cps[t->count - 1];
+	cp->pc = ctx->pc;
+	memcpy(cp->registers, ctx->registers, sizeof(cp->registers));
+	cp->flags = ctx->flags;
+	return cp->ram_writes != ctx->ram_writes && save_pages(ctx, cp, cp);
+}
+
+/* The earliest instruction `ctx' can be taken back to */
+uint64_t emul_ttd_earliest(const struct emul_context *ctx)
+{
+	return ctx->ttd ? ctx->ttd->cps[0].icount : ctx->icount;
+}
+
+/**
+ * Take `ctx' back to how it was when `icount' instructions had been retired.
+ * Returns non-zero if that is not in its history
+ */
+int emul_ttd_goto(struct emul_context *ctx, uint64_t icount)
+{
+	struct ttd_state *t = ctx->ttd;
+
+	if (!t || icount > ctx->icount || icount < t->cps[0].icount)
+		return 1;
+	if (icount == ctx->icount)
+		return 0;
+
+	restore(ctx, &t->cps[checkpoint_at(t, icount)]);
+	drop_after(t, icount);
+	t->next = t->cps[t->count - 1].icount + t->interval;
+	t->replayed += icount - ctx->icount;
+	return t->engine->run(ctx, icount - ctx->icount) == EMUL_EXIT_ERROR || ctx->icount != icount;
+}
+
+/**
+ * Take `ctx' back to the last state before this one for which `stop' returns
+ * non-zero. Returns 1 there, or 0 if there was none, having gone back to the
+ * earliest instruction in the history, or -1 on failure
+ */
+int emul_ttd_reverse(struct emul_context *ctx, emul_ttd_stop stop, void *arg)
+{
+	struct ttd_state *t = ctx->ttd;
+	uint64_t limit = ctx->icount;
+	uint64_t found = 0;
+	bool hit = false;
+	size_t i = 0;
+
+	if (!t)
+		return -1;
+
+	/* from each checkpoint back in turn, step up to the one after it */
+	for (i = t->count; i-- > 0 && !hit; ) {
+		if (t->cps[i].icount == limit)
+			continue;
+		restore(ctx, &t->cps[i]);
+		t->replayed += limit - ctx->icount;
+		while (ctx->icount < limit) {
+			if (stop(ctx, arg)) {
+				found = ctx->icount;
+				hit = true;
+			}
+			/* the last may be the one which halted */
+			if (emul_run(ctx, 1) != EMUL_EXIT_BUDGET && ctx->icount < limit)
+				return -1;
+		}
+		limit = t->cps[i].icount;
+	}
+
+	if (emul_ttd_goto(ctx, hit ? found : t->cps[0].icount))
+		return -1;
+	return hit;
+}
+
+/**
+ * Stop for emul_ttd_reverse() where the register in the struct emul_ttd_watch
+ * at `arg' does not have its value: going back to just before the instruction
+ * which last set it
+ */
+bool emul_ttd_reg_differs(const struct emul_context *ctx, void *arg)
+{
+	const struct emul_ttd_watch *w = arg;
+
+	return ctx->registers[w->reg] != w->value;
+}
@@ -0,0 +1,37 @@
+#ifndef EMUL_TTD_H
+#define EMUL_TTD_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emul/emul.h"
+
+/* Instructions between checkpoints, and most checkpoints kept, by default */
+#define EMUL_TTD_INTERVAL 100000
+#define EMUL_TTD_CHECKPOINTS 64
+
+/* Bytes of RAM in a page, the unit checkpoints share */
+#define EMUL_TTD_PAGE 4096
+
+/* Where emul_ttd_reverse() stops: non-zero for a state of interest */
+typedef bool (*emul_ttd_stop)(const struct emul_context *ctx, void *arg);
+
+/* A register and its value, for emul_ttd_reg_differs() */
+struct emul_ttd_watch {
+	unsigned reg;
+	uint16_t value;
+};
+
+extern const struct emul_engine emul_ttd_engine;
+
+int emul_ttd_enable(struct emul_context *ctx, const struct emul_engine *engine, uint64_t interval, size_t max);
+void emul_ttd_free(struct emul_context *ctx);
+int emul_ttd_changed(struct emul_context *ctx);
+uint64_t emul_ttd_earliest(const struct emul_context *ctx);
+int emul_ttd_goto(struct emul_context *ctx, uint64_t icount);
+int emul_ttd_reverse(struct emul_context *ctx, emul_ttd_stop stop, void *arg);
+bool emul_ttd_reg_differs(const struct emul_context *ctx, void *arg);
+
+#endif /* EMUL_TTD_H */
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "parse.h"
+#include "util.h"
+#include "input/input_bin.h"
+
+/**
+ * Generator for emul/emul_spec_table.c: one handler for every distinct
+ * behaviour of a 16-bit instruction word, with its registers, operation and
+ * condition baked in, and a table of 65536 of them indexed by the raw word.
+ *
+ * Immediates, narrow and wide, and branch offsets are left for the handler to
+ * read from the word, or the word after it, at run time: baking them in as
+ * well would multiply the handlers more than fivefold, and the build time
+ * with them, for a mask and a shift saved.
+ *
+ * Words are decoded with disasm_single(), so the handlers cannot disagree with
+ * the disassembler. Words which differ only in bits an encoding ignores share
+ * a handler.
+ */
+
+/* ISA_OPERS and ISA_CONDS as C for the handlers, which read the flags through
+ * their own ZF and CF */
+#define SHIFT(x, op, n) ((n) < 16 ? (x) op (n) : 0)
+#define BIT(x, n) (((x) >> (n)) & 1)
+#define BOTH(a, b) ((a) && (b))
+#define MUL_HI(a, b) ((uint32_t)(a) * (b) >> 16)
+#define ALWAYS 1
+#define NOT(a) !(a)
+#define EITHER(a, b) (a) || (b)
+#define ZF ZF
+#define CF CF
+
+/* Each ALU operation on `l' and `r' */
+#define C_RESULT(name, value, mnemonic, result, carry) \
+	[OPER_##name] = ISA_STR(result),
+static const char *c_results[] = {
+	ISA_OPERS(C_RESULT)
+};
+
+#define C_COND(name, value, jump, branch, test) \
+	[JB_##name] = ISA_STR(test),
+static const char *c_conds[] = {
+	ISA_CONDS(C_COND)
+};
+
+/* Bits of the first word which each format reads, from the ISA table */
+#define USED_FIELD(member, field, kind, shift, width) | ISA_BITS(shift, width)
+#define USED_FORMAT(name, member, size, mask, match, syntax, fields) \
+	case INST_TYPE_##name: \
+		return (mask) fields;
+
+static uint16_t used_bits(enum INST_TYPE type)
+{
+	switch (type) {
+		ISA_FORMATS(USED_FORMAT, USED_FIELD, ISA_IGNORE, USED_FIELD)
+		default:
+			return 0xffff;
+	}
+}
+
+/**
+ * Clear the bits of `word' which make no difference to its handler, giving
+ * the word whose handler it shares: bits its format ignores, a narrow
+ * immediate or branch offset, which the handler reads for itself, a
+ * destination of $H (results written to $0 or $H are both dropped), and the
+ * register target of a jump which is never taken
+ */
+static uint16_t canonical(uint16_t word, const struct instruction *i)
+{
+	word &= used_bits(i->type);
+
+	switch (i->type) {
+		case INST_TYPE_NI:
+			word &= ~MASK_NI_IMM(0x1f);
+			/* fall through */
+		case INST_TYPE_R:
+		case INST_TYPE_WI:
+			if (GET_REG_DEST(word) == REG_H)
+				word &= ~MASK_REG_DEST(0x7);
+			break;
+		case INST_TYPE_JR:
+			if (i->inst.jr.cond == JB_NEVER)
+				word &= ~MASK_JUMP_REGISTER(0x7);
+			break;
+		case INST_TYPE_B:
+			word &= ~MASK_B_OFFSET(0x3ff);
+			break;
+		default:
+			break;
+	}
+
+	return word;
+}
+
+static void emit_alu(FILE *f, enum INST_TYPE type, enum OPER oper, enum REG dest, enum REG left, const char *right,
+	size_t size)
+{
+	fprintf(f, "\tctx->counters.mix[%d][%d]++;\n", type, oper);
+	if (type != INST_TYPE_NI)
+		fprintf(f, "\t(void)word;\n");
+	fprintf(f, "\tuint16_t l = ctx->registers[%d];\n", left);
+	fprintf(f, "\tuint16_t r = %s;\n", right);
+	fprintf(f, "\tuint16_t res = %s;\n", c_results[oper]);
+	fprintf(f, "\tctx->flags = (struct lazy_flags){ .left = l, .right = r, .res = res, .oper = %d };\n", oper);
+	if (dest != REG_0 && dest != REG_H)
+		fprintf(f, "\tctx->registers[%d] = res;\n", dest);
+	else
+		fprintf(f, "\t(void)res;\n");
+	fprintf(f, "\tctx->pc += %zd;\n", size);
+}
+
+/**
+ * Jump or branch to `target', a format taking `arg', if condition `cond' holds,
+ * and on to the next instruction `size' bytes on if not
+ */
+static void emit_jump(FILE *f, enum INST_TYPE type, enum JCOND cond, const char *target, unsigned arg, size_t size)
+{
+	fprintf(f, "\tctx->counters.mix[%d][%d]++;\n", type, cond);
+	if (type != INST_TYPE_B)
+		fprintf(f, "\t(void)word;\n");
+	fprintf(f, "\tif (%s) {\n", c_conds[cond]);
+	fprintf(f, "\t\tctx->pc = ");
+	fprintf(f, target, arg);
+	fprintf(f, ";\n\t\tctx->counters.taken++;\n");
+	fprintf(f, "\t} else {\n");
+	fprintf(f, "\t\tctx->pc += %zd;\n", size);
+	fprintf(f, "\t}\n");
+}
+
+static void emit_handler(FILE *f, uint16_t word, const struct instruction *i)
+{
+	char right[32];
+
+	switch (i->type) {
+		case INST_TYPE_R:
+			fprintf(f, "/* %s %s, %s, %s */\n",
+				get_asm_from_oper(i->inst.r.oper), get_asm_from_reg(i->inst.r.dest),
+				get_asm_from_reg(i->inst.r.left), get_asm_from_reg(i->inst.r.right));
+			break;
+		case INST_TYPE_NI:
+			fprintf(f, "/* %si %s, %s, <imm5> */\n",
+				get_asm_from_oper(i->inst.i.oper), get_asm_from_reg(i->inst.i.dest),
+				get_asm_from_reg(i->inst.i.left));
+			break;
+		case INST_TYPE_WI:
+			fprintf(f, "/* %si %s, %s, <imm16> */\n",
+				get_asm_from_oper(i->inst.i.oper), get_asm_from_reg(i->inst.i.dest),
+				get_asm_from_reg(i->inst.i.left));
+			break;
+		case INST_TYPE_JR:
+			fprintf(f, "/* %s %s */\n", get_asm_from_j(i->inst.jr.cond), get_asm_from_reg(i->inst.jr.reg));
+			break;
+		case INST_TYPE_JI:
+			fprintf(f, "/* %s <imm16> */\n", get_asm_from_j(i->inst.ji.cond));
+			break;
+		case INST_TYPE_B:
+			fprintf(f, "/* %s <offset> */\n", get_asm_from_b(i->inst.b.cond));
+			break;
+		default:
+			break;
+	}
+
+	fprintf(f, "static void h_%04x(struct emul_context *ctx, uint16_t word)\n{\n", word);
+	switch (i->type) {
+		case INST_TYPE_R:
+			snprintf(right, sizeof(right), "ctx->registers[%d]", i->inst.r.right);
+			emit_alu(f, i->type, i->inst.r.oper, i->inst.r.dest, i->inst.r.left, right, RTYPE_SIZE_BYTES);
+			break;
+		case INST_TYPE_NI:
+			emit_alu(f, i->type, i->inst.i.oper, i->inst.i.dest, i->inst.i.left, "IMM5", NITYPE_SIZE_BYTES);
+			break;
+		case INST_TYPE_WI:
+			emit_alu(f, i->type, i->inst.i.oper, i->inst.i.dest, i->inst.i.left, "IMM16", WITYPE_SIZE_BYTES);
+			break;
+		case INST_TYPE_JR:
+			emit_jump(f, i->type, i->inst.jr.cond, "ctx->registers[%d]", i->inst.jr.reg, JRTYPE_SIZE_BYTES);
+			break;
+		case INST_TYPE_JI:
+			emit_jump(f, i->type, i->inst.ji.cond, "IMM16", 0, JITYPE_SIZE_BYTES);
+			break;
+		case INST_TYPE_B:
+			emit_jump(f, i->type, i->inst.b.cond, "BRANCH_TARGET", 0, BTYPE_SIZE_BYTES);
+			break;
+		default:
+			break;
+	}
+	fprintf(f, "}\n\n");
+}
+
+int main(void)
+{
+	static struct instruction insts[1 << 16];
+	static uint16_t handler[1 << 16];
+	FILE *f = stdout;
+	uint32_t word = 0;
+
+	fprintf(f,
+		"/* Generated by emul/gen_spec. Do not edit */\n"
+		"#include <stdint.h>\n"
+		"\n"
+		"#include \"emul/emul.h\"\n"
+		"#include \"emul/emul_spec.h\"\n"
+		"\n"
+		"#define ZF (ctx->flags.res == 0)\n"
+		"#define CF (emul_cf(ctx))\n"
+		"#define IMM16 (emul_spec_fetch(ctx, ctx->pc + 2))\n"
+		"#define IMM5 (GET_NI_IMM(word))\n"
+		"/* the offset counts words from the branch, signed */\n"
+		"#define BRANCH_TARGET (ctx->pc + 2 * (((int)GET_B_OFFSET(word) ^ 0x200) - 0x200))\n"
+		"\n");
+
+	decode_lut_init();
+	for (word = 0; word < (1 << 16); word++) {
+		if (disasm_single(&insts[word], 0, word, 0) <= 0) {
+			fprintf(stderr, "Cannot decode 0x%04x\n", word);
+			return 1;
+		}
+		handler[word] = canonical(word, &insts[word]);
+		if (handler[word] == word)
+			emit_handler(f, word, &insts[word]);
+	}
+
+	fprintf(f, "const emul_spec_handler emul_spec_handlers[1 << 16] = {\n");
+	for (word = 0; word < (1 << 16); word++)
+		fprintf(f, "%sh_%04x,%s", word % 8 ? " " : "\t", handler[word], word % 8 == 7 ? "\n" : "");
+	fprintf(f, "};\n");
+
+	return ferror(f) != 0;
+}
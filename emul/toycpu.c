@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "instruction.h"
+#include "emul/emul.h"
+#include "emul/emul_ttd.h"
+#include "emul/toycpu.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * libtoycpu: a thin, stable face on emul_context for programs which link the
+ * emulator instead of running it and reading its output. Everything a guest
+ * has lives in its struct toycpu, so the library is reentrant.
+ */
+
+_Static_assert(TOYCPU_REG_COUNT == REG_COUNT, "register count");
+_Static_assert(TOYCPU_REG_H == REG_H, "register $H");
+
+struct toycpu {
+	struct emul_context ctx;
+	const struct emul_engine *engine;
+	uint64_t record_interval; /* toycpu_record()'s, 0 if not recording */
+	size_t record_max;
+	uint8_t ram[TOYCPU_RAM_SIZE];
+};
+
+static enum toycpu_exit exit_reason(enum EMUL_EXIT e)
+{
+	switch (e) {
+		case EMUL_EXIT_HALT:   return TOYCPU_EXIT_HALT;
+		case EMUL_EXIT_BUDGET: return TOYCPU_EXIT_BUDGET;
+		default:               return TOYCPU_EXIT_ERROR;
+	}
+}
+
+/**
+ * Create a guest with an empty program, to run with `engine', or the reference
+ * engine if NULL. Returns NULL if there is no such engine or no memory
+ */
+struct toycpu *toycpu_create(const char *engine)
+{
+	struct toycpu *cpu = NULL;
+	const struct emul_engine *e = emul_get_engine(engine ? engine : "ref");
+
+	if (!e) {
+		fprintf(stderr, "Unknown engine `%s'\n", engine);
+		return NULL;
+	}
+	if ((cpu = calloc(1, sizeof(*cpu))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	cpu->engine = e;
+	if (emul_init(&cpu->ctx, cpu->ram, sizeof(cpu->ram), 0)) {
+		free(cpu);
+		return NULL;
+	}
+
+	return cpu;
+}
+
+void toycpu_destroy(struct toycpu *cpu)
+{
+	if (!cpu)
+		return;
+	emul_free(&cpu->ctx);
+	free(cpu);
+}
+
+/**
+ * Load the program of `len' bytes at `image' at the start of RAM, clearing
+ * the rest, and reset the guest to run it from the start
+ */
+int toycpu_load(struct toycpu *cpu, const void *image, size_t len)
+{
+	if (len > sizeof(cpu->ram)) {
+		fprintf(stderr, "Program of %zd bytes larger than memory\n", len);
+		return 1;
+	}
+
+	emul_free(&cpu->ctx);
+	memcpy(cpu->ram, image, len);
+	memset(cpu->ram + len, 0, sizeof(cpu->ram) - len);
+	if (emul_init(&cpu->ctx, cpu->ram, sizeof(cpu->ram), len))
+		return 1;
+	return cpu->record_interval &&
+		emul_ttd_enable(&cpu->ctx, cpu->engine, cpu->record_interval, cpu->record_max);
+}
+
+/* Run at most `n' instructions */
+enum toycpu_exit toycpu_run(struct toycpu *cpu, uint64_t n)
+{
+	const struct emul_engine *e = cpu->ctx.ttd ? &emul_ttd_engine : cpu->engine;
+
+	return exit_reason(e->run(&cpu->ctx, n));
+}
+
+/* Run one instruction through the reference engine, recording it if asked */
+static enum EMUL_EXIT step(struct toycpu *cpu)
+{
+	return cpu->ctx.ttd ? emul_ttd_engine.run(&cpu->ctx, 1) : emul_run(&cpu->ctx, 1);
+}
+
+/**
+ * Run at most `n' instructions, stopping before the one at `pc'. At least one
+ * instruction is run first, so this can be called again to carry on from a
+ * breakpoint. Steps through the reference engine, whatever the guest's own
+ */
+enum toycpu_exit toycpu_run_until(struct toycpu *cpu, uint16_t pc, uint64_t n)
+{
+	enum EMUL_EXIT e = EMUL_EXIT_BUDGET;
+
+	while (n--) {
+		if ((e = step(cpu)) != EMUL_EXIT_BUDGET)
+			return exit_reason(e);
+		if (cpu->ctx.pc == pc)
+			return TOYCPU_EXIT_BREAK;
+	}
+
+	return TOYCPU_EXIT_BUDGET;
+}
+
+enum toycpu_exit toycpu_step(struct toycpu *cpu)
+{
+	return exit_reason(step(cpu));
+}
+
+const char *toycpu_exit_name(enum toycpu_exit reason)
+{
+	switch (reason) {
+		case TOYCPU_EXIT_HALT:   return "halt";
+		case TOYCPU_EXIT_BUDGET: return "budget";
+		case TOYCPU_EXIT_BREAK:  return "break";
+		case TOYCPU_EXIT_ERROR:  return "error";
+		case TOYCPU_EXIT_START:  return "start";
+		default:                 return "unknown";
+	}
+}
+
+uint16_t toycpu_get_pc(const struct toycpu *cpu)
+{
+	return cpu->ctx.pc;
+}
+
+void toycpu_set_pc(struct toycpu *cpu, uint16_t pc)
+{
+	cpu->ctx.pc = pc;
+	emul_ttd_changed(&cpu->ctx);
+}
+
+/* Register `reg', 0 for $0 to TOYCPU_REG_H for $H, or 0 if there is none */
+uint16_t toycpu_get_reg(const struct toycpu *cpu, unsigned reg)
+{
+	return reg < TOYCPU_REG_COUNT ? cpu->ctx.registers[reg] : 0;
+}
+
+/* Set register `reg'. Returns non-zero for $0, which is always zero, or none */
+int toycpu_set_reg(struct toycpu *cpu, unsigned reg, uint16_t value)
+{
+	if (reg == REG_0 || reg >= TOYCPU_REG_COUNT)
+		return 1;
+	cpu->ctx.registers[reg] = value;
+	return emul_ttd_changed(&cpu->ctx);
+}
+
+bool toycpu_get_zf(const struct toycpu *cpu)
+{
+	return emul_zf(&cpu->ctx);
+}
+
+bool toycpu_get_cf(const struct toycpu *cpu)
+{
+	return emul_cf(&cpu->ctx);
+}
+
+void toycpu_set_flags(struct toycpu *cpu, bool zf, bool cf)
+{
+	emul_set_flags(&cpu->ctx, zf, cf);
+	emul_ttd_changed(&cpu->ctx);
+}
+
+/* Instructions retired since the program was loaded */
+uint64_t toycpu_icount(const struct toycpu *cpu)
+{
+	return cpu->ctx.icount;
+}
+
+/* Copy `len' bytes of RAM from `addr'. Returns non-zero past the end of RAM */
+int toycpu_read_ram(const struct toycpu *cpu, uint16_t addr, void *buf, size_t len)
+{
+	if (len > sizeof(cpu->ram) - addr)
+		return 1;
+	memcpy(buf, cpu->ram + addr, len);
+	return 0;
+}
+
+/**
+ * Write `len' bytes of RAM at `addr', dropping whatever was decoded from
+ * them. Returns non-zero past the end of RAM
+ */
+int toycpu_write_ram(struct toycpu *cpu, uint16_t addr, const void *buf, size_t len)
+{
+	if (len > sizeof(cpu->ram) - addr)
+		return 1;
+	emul_ram_write(&cpu->ctx, addr, buf, len);
+	return emul_ttd_changed(&cpu->ctx);
+}
+
+/**
+ * Record the guest's history from here on, and on every load after, so that
+ * it can be taken back through it: a checkpoint every `interval' instructions
+ * run, at most `checkpoints' of them kept, fewer the further back. Either 0
+ * for the defaults. Returns non-zero on failure
+ */
+int toycpu_record(struct toycpu *cpu, uint64_t interval, size_t checkpoints)
+{
+	emul_ttd_free(&cpu->ctx);
+	cpu->record_interval = interval ? interval : EMUL_TTD_INTERVAL;
+	cpu->record_max = checkpoints ? checkpoints : EMUL_TTD_CHECKPOINTS;
+	if (emul_ttd_enable(&cpu->ctx, cpu->engine, cpu->record_interval, cpu->record_max)) {
+		cpu->record_interval = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Take the guest back to how it was after `icount' instructions. Returns
+ * non-zero if that is not in the history recorded
+ */
+int toycpu_goto(struct toycpu *cpu, uint64_t icount)
+{
+	return emul_ttd_goto(&cpu->ctx, icount);
+}
+
+/* Take the guest back one instruction, or return TOYCPU_EXIT_START */
+enum toycpu_exit toycpu_reverse_step(struct toycpu *cpu)
+{
+	if (!cpu->ctx.ttd)
+		return TOYCPU_EXIT_ERROR;
+	if (cpu->ctx.icount == emul_ttd_earliest(&cpu->ctx))
+		return TOYCPU_EXIT_START;
+	return emul_ttd_goto(&cpu->ctx, cpu->ctx.icount - 1) ? TOYCPU_EXIT_ERROR : TOYCPU_EXIT_BUDGET;
+}
+
+static enum toycpu_exit reverse(struct toycpu *cpu, emul_ttd_stop stop, void *arg)
+{
+	switch (emul_ttd_reverse(&cpu->ctx, stop, arg)) {
+		case 1:  return TOYCPU_EXIT_BREAK;
+		case 0:  return TOYCPU_EXIT_START;
+		default: return TOYCPU_EXIT_ERROR;
+	}
+}
+
+static bool at_pc(const struct emul_context *ctx, void *arg)
+{
+	return ctx->pc == *(const uint16_t *)arg;
+}
+
+/**
+ * Take the guest back to the last time it was about to run the instruction
+ * at `pc', or as far back as recorded
+ */
+enum toycpu_exit toycpu_reverse_continue(struct toycpu *cpu, uint16_t pc)
+{
+	return reverse(cpu, at_pc, &pc);
+}
+
+/**
+ * Take the guest back to just before the instruction which last changed
+ * register `reg', or as far back as recorded
+ */
+enum toycpu_exit toycpu_reverse_watch(struct toycpu *cpu, unsigned reg)
+{
+	struct emul_ttd_watch w = { .reg = reg };
+
+	if (reg >= TOYCPU_REG_COUNT)
+		return TOYCPU_EXIT_ERROR;
+	w.value = cpu->ctx.registers[reg];
+	return reverse(cpu, emul_ttd_reg_differs, &w);
+}
@@ -0,0 +1,58 @@
+#ifndef TOYCPU_H
+#define TOYCPU_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * libtoycpu: the emulator as a library. Each `struct toycpu' is a guest with
+ * RAM of its own, and nothing is shared between them but read-only tables,
+ * so any number may run at once on different threads.
+ */
+
+#define TOYCPU_RAM_SIZE 65536
+
+/* Registers $0 to $6, then $H */
+#define TOYCPU_REG_COUNT 8
+#define TOYCPU_REG_H 7
+
+/* Why a run returned */
+enum toycpu_exit {
+	TOYCPU_EXIT_HALT,   /* ran off the end of the program or of memory */
+	TOYCPU_EXIT_BUDGET, /* ran the number of instructions asked for */
+	TOYCPU_EXIT_BREAK,  /* reached the pc asked for */
+	TOYCPU_EXIT_ERROR,  /* undecodable instruction or internal error */
+	TOYCPU_EXIT_START,  /* went back as far as the history recorded */
+};
+
+struct toycpu;
+
+struct toycpu *toycpu_create(const char *engine);
+void toycpu_destroy(struct toycpu *cpu);
+int toycpu_load(struct toycpu *cpu, const void *image, size_t len);
+
+enum toycpu_exit toycpu_run(struct toycpu *cpu, uint64_t n);
+enum toycpu_exit toycpu_run_until(struct toycpu *cpu, uint16_t pc, uint64_t n);
+enum toycpu_exit toycpu_step(struct toycpu *cpu);
+const char *toycpu_exit_name(enum toycpu_exit reason);
+
+uint16_t toycpu_get_pc(const struct toycpu *cpu);
+void toycpu_set_pc(struct toycpu *cpu, uint16_t pc);
+uint16_t toycpu_get_reg(const struct toycpu *cpu, unsigned reg);
+int toycpu_set_reg(struct toycpu *cpu, unsigned reg, uint16_t value);
+bool toycpu_get_zf(const struct toycpu *cpu);
+bool toycpu_get_cf(const struct toycpu *cpu);
+void toycpu_set_flags(struct toycpu *cpu, bool zf, bool cf);
+uint64_t toycpu_icount(const struct toycpu *cpu);
+
+int toycpu_read_ram(const struct toycpu *cpu, uint16_t addr, void *buf, size_t len);
+int toycpu_write_ram(struct toycpu *cpu, uint16_t addr, const void *buf, size_t len);
+
+int toycpu_record(struct toycpu *cpu, uint64_t interval, size_t checkpoints);
+int toycpu_goto(struct toycpu *cpu, uint64_t icount);
+enum toycpu_exit toycpu_reverse_step(struct toycpu *cpu);
+enum toycpu_exit toycpu_reverse_continue(struct toycpu *cpu, uint16_t pc);
+enum toycpu_exit toycpu_reverse_watch(struct toycpu *cpu, unsigned reg);
+
+#endif /* TOYCPU_H */
@@ -1,293 +1,883 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
-#include <assert.h>
+#include <getopt.h>
 
-#include "lex.h"
-#include "parse.h"
 #include "instruction.h"
+#include "util.h"
+#include "parse.h"
 #include "input/input_bin.h"
+#include "output/output_asm.h"
+#include "emul/emul.h"
+#include "emul/emul_ff.h"
+#include "emul/emul_cycle.h"
+#include "emul/emul_batch.h"
+#include "emul/emul_farm.h"
+#include "emul/emul_sched.h"
+#include "emul/emul_snap.h"
+#include "emul/emul_hart.h"
+#include "emul/emul_dump.h"
+#include "emul/emul_prof.h"
+#include "emul/emul_stats.h"
+#include "emul/emul_trace.h"
+#include "emul/emul_fuzz.h"
+#include "emul/emul_ttd.h"
 
 //#define DEBUG
 #include "debug.h"
 
-/* Macro for safe wrap-around RAM access */
-#define RAM_AT(ctx, offs) (ctx->ram[offs % ctx->ram_size])
-
-
-struct emul_context {
-	uint8_t *ram;
-	size_t ram_size;
-	uint16_t pc;
-	bool zf;
-	bool cf;
-	uint16_t registers[REG_COUNT];
-};
-
-int should_jump(struct emul_context *ctx, enum JCOND cond) {
-	switch (cond) {
-		case JB_UNCOND: return 1;
-		case JB_NEVER:  return 0;
-		case JB_ZERO:   return (ctx->zf);
-		case JB_NZERO:  return !(ctx->zf);
-		case JB_CARRY:  return (ctx->cf);
-		case JB_NCARRY: return !(ctx->cf);
-		case JB_CARRYZ: return (ctx->zf || ctx->cf);
-		case JB_NCARRYZ:return (!ctx->zf && !ctx->cf);
+/* Changes to a watched register listed, the latest first */
+#define WATCH_CHANGES 10
+
+/**
+ * Run `ctx' until it halts or goes round in circles. Returns 0 once halted, or
+ * EMUL_CYCLE_EXIT_CODE with `info' describing the cycle, or 1 on error
+ */
+static int run_to_end(const struct emul_engine *engine, bool fast_forward, struct emul_context *ctx,
+	struct emul_cycle_info *info)
+{
+	switch (emul_cycle_run(ctx, engine, fast_forward, info)) {
+		case EMUL_EXIT_HALT:
+			return 0;
+		case EMUL_EXIT_BUDGET:
+			return EMUL_CYCLE_EXIT_CODE;
+		case EMUL_EXIT_ERROR:
 		default:
-			assert(0);
+			return 1;
 	}
 }
 
-int execute_r(struct emul_context *ctx, struct instruction i)
+/**
+ * Run `ctx' until it has retired `at' instructions in all, or halts first.
+ * Returns non-zero on error
+ */
+static int run_to(const struct emul_engine *engine, bool fast_forward, struct emul_context *ctx, uint64_t at)
 {
-	uint16_t res = 0;
-	uint16_t *d = &ctx->registers[i.inst.r.dest];
-	uint16_t *l = &ctx->registers[i.inst.r.left];
-	uint16_t *r = &ctx->registers[i.inst.r.right];
-
-	switch (i.inst.r.oper) {
-		case OPER_ADD:
-			res = *l + *r;
-			break;
-		case OPER_SUB:
-			res = *l - *r;
-			break;
-		case OPER_SHL:
-			res = *l << *r;
-			break;
-		case OPER_SHR:
-			res = *l >> *r;
-			break;
-		case OPER_AND:
-			res = *l & *r;
-			break;
-		case OPER_OR:
-			res = *l | *r;
-			break;
-		case OPER_XOR:
-			res = *l ^ *r;
-			break;
-		case OPER_MUL:
-			res = *l * *r;
-			break;
-		default:
-			return 1;
+	enum EMUL_EXIT status = EMUL_EXIT_BUDGET;
+
+	while (status == EMUL_EXIT_BUDGET && ctx->icount < at) {
+		if (fast_forward)
+			status = emul_run_ff(ctx, engine, at - ctx->icount);
+		else
+			status = engine->run(ctx, at - ctx->icount);
 	}
 
-	ctx->zf = (res == 0);
-	/* FIXME set cf */
+	return status == EMUL_EXIT_ERROR;
+}
+
+/**
+ * Run `ctx' to the end, then print its state as `dump', and check it against
+ * the postconditions in `posts' if not NULL
+ */
+int emulator_run(const struct emul_engine *engine, bool stats, bool fast_forward, struct emul_context *ctx,
+	enum EMUL_DUMP dump, FILE *posts)
+{
+	int ret = 0;
+	struct emul_cycle_info info;
+	uint64_t start = emul_stats_now();
 
-	if (i.inst.r.dest != REG_0 && i.inst.r.dest != REG_H) {
-		*d = res;
+	ret = run_to_end(engine, fast_forward, ctx, &info);
+	if (ret == EMUL_CYCLE_EXIT_CODE)
+		fprintf(stderr, "Entered a cycle at pc 0x%x after %llu instructions (period %llu), stop.\n",
+			info.pc, (unsigned long long)info.entry, (unsigned long long)info.period);
+
+	if (stats)
+		emul_stats_print(stderr, ctx, emul_stats_now() - start);
+	if (stats && engine->print_stats)
+		engine->print_stats(stderr, ctx);
+	if (fast_forward)
+		emul_ff_print_report(stderr, ctx);
+
+	if (ret)
+		return ret;
+
+	if (ctx->pc >= ctx->bytes_used) {
+		debug("Fell off the bottom of the given program, stopping.\n");
+	} else {
+		debug("Fell off the bottom of memory, stopping.\n");
 	}
+
+	emul_dump(stdout, ctx, dump);
+	if (posts && (ret = emul_check_posts(posts, stdout, ctx)))
+		return ret < 0 ? 1 : EMUL_POST_EXIT_CODE;
 	return 0;
 }
 
-int execute_i(struct emul_context *ctx, struct instruction i)
+/**
+ * Take `ctx' back through the history recorded for it to each of the last
+ * WATCH_CHANGES instructions to change register `reg', listing them as it
+ * goes, and the value it started with if there were fewer
+ */
+static int emulator_watch(struct emul_context *ctx, enum REG reg)
 {
-	uint16_t res = 0;
-	uint16_t *d = &ctx->registers[i.inst.i.dest];
-	uint16_t *l = &ctx->registers[i.inst.i.left];
-	uint16_t imm = i.inst.i.imm.value;
-
-	switch (i.inst.i.oper) {
-		case OPER_ADD:
-			res = *l + imm;
-			break;
-		case OPER_SUB:
-			res = *l - imm;
-			break;
-		case OPER_SHL:
-			res = *l << imm;
-			break;
-		case OPER_SHR:
-			res = *l >> imm;
-			break;
-		case OPER_AND:
-			res = *l & imm;
-			break;
-		case OPER_OR:
-			res = *l | imm;
-			break;
-		case OPER_XOR:
-			res = *l ^ imm;
-			break;
-		case OPER_MUL:
-			res = *l * imm;
-			break;
-		default:
+	struct emul_ttd_watch w = { .reg = reg };
+	struct instruction inst;
+	unsigned n = 0;
+	int found = 0;
+
+	for (n = 0; n < WATCH_CHANGES; n++) {
+		w.value = ctx->registers[reg];
+		if ((found = emul_ttd_reverse(ctx, emul_ttd_reg_differs, &w)) < 0)
 			return 1;
+		if (!found) {
+			printf("%s: 0x%x since instruction %llu\n", get_asm_from_reg(reg), w.value,
+				(unsigned long long)ctx->icount);
+			return 0;
+		}
+		printf("%s: 0x%x -> 0x%x at instruction %llu, pc 0x%04x  ", get_asm_from_reg(reg),
+			ctx->registers[reg], w.value, (unsigned long long)ctx->icount, ctx->pc);
+		disasm_single(&inst, ctx->pc, RAM_AT(ctx, ctx->pc) << 8 | RAM_AT(ctx, ctx->pc + 1),
+			RAM_AT(ctx, ctx->pc + 2) << 8 | RAM_AT(ctx, ctx->pc + 3));
+		emit_single(stdout, &inst);
 	}
+	return 0;
+}
 
-	ctx->zf = (res == 0);
-	/* FIXME set cf */
-
-	if (i.inst.r.dest != REG_0 && i.inst.r.dest != REG_H) {
-		*d = res;
+/**
+ * Apply one line of changes to a fork: `$<reg>=<value>' sets a register,
+ * `pc=<value>' the pc and `@<address>=<value>' a byte of RAM. Returns non-zero
+ * if the line is malformed
+ */
+static int apply_fork_line(struct emul_context *ctx, char *line, size_t lineno)
+{
+	char *tok = NULL;
+	char *val = NULL;
+	char *end = NULL;
+	unsigned long addr = 0;
+	unsigned long v = 0;
+	uint8_t byte = 0;
+	enum REG reg = REG_0;
+
+	for (tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+		if ((val = strchr(tok, '=')) == NULL)
+			goto bad;
+		*val++ = '\0';
+		v = strtoul(val, &end, 0);
+		if (end == val || *end || v > 0xffff)
+			goto bad;
+
+		if (!strcmp(tok, "pc")) {
+			ctx->pc = v;
+		} else if (*tok == '@') {
+			addr = strtoul(tok + 1, &end, 0);
+			if (end == tok + 1 || *end || addr >= ctx->ram_size || v > 0xff)
+				goto bad;
+			byte = v;
+			emul_ram_write(ctx, addr, &byte, 1);
+		} else if (!get_reg_from_asm(tok, &reg) && reg != REG_0) {
+			ctx->registers[reg] = v;
+		} else {
+			goto bad;
+		}
 	}
 	return 0;
+
+bad:
+	fprintf(stderr, "Fork on line %zd: cannot set `%s'\n", lineno, tok);
+	return 1;
 }
 
-int execute_jr(struct emul_context *ctx, struct instruction i)
+/**
+ * Fork a guest from `snap' for each line read from `forks', changed as the
+ * line says (see apply_fork_line()), and print the final state of each. A
+ * blank line forks an unchanged guest, and lines starting with # are skipped
+ */
+int emulator_run_forks(const struct emul_engine *engine, bool fast_forward, const struct emul_snapshot *snap,
+	FILE *forks)
 {
-	if (should_jump(ctx, i.inst.jr.cond))
-		ctx->pc = ctx->registers[i.inst.jr.reg];
-	return 0;
+	int ret = 0;
+	int status = 0;
+	char line[256];
+	char *p = NULL;
+	size_t lineno = 0;
+	size_t n = 0;
+	struct emul_context ctx;
+	struct emul_cycle_info info;
+
+	while (fgets(line, sizeof(line), forks)) {
+		lineno++;
+		p = line + strspn(line, " \t\r\n");
+		if (*p == '#')
+			continue;
+
+		if (emul_snapshot_fork(snap, &ctx))
+			return 1;
+		if (apply_fork_line(&ctx, p, lineno)) {
+			emul_snapshot_fork_free(&ctx);
+			return 1;
+		}
+
+		status = run_to_end(engine, fast_forward, &ctx, &info);
+		if (status == 0) {
+			printf("Fork %zd:\n", n);
+			emul_dump_registers(stdout, &ctx);
+		} else if (status == EMUL_CYCLE_EXIT_CODE) {
+			printf("Fork %zd: entered a cycle at pc 0x%x after %llu instructions (period %llu)\n",
+				n, info.pc, (unsigned long long)info.entry, (unsigned long long)info.period);
+			ret = EMUL_CYCLE_EXIT_CODE;
+		}
+		emul_snapshot_fork_free(&ctx);
+		if (status == 1)
+			return 1;
+		n++;
+	}
+
+	return ret;
 }
 
-int execute_ji(struct emul_context *ctx, struct instruction i)
+/**
+ * Read the initial states of a batch, one lane per line: values for $1, $2
+ * and so on, any left out being zero. Blank lines and lines starting with #
+ * are skipped. Returns the number of lanes, or zero on error
+ */
+static size_t read_lanes(FILE *f, struct emul_state **states)
 {
-	if (should_jump(ctx, i.inst.ji.cond))
-		ctx->pc = i.inst.ji.imm.value;
-	return 0;
+	char line[256];
+	char *p = NULL;
+	char *end = NULL;
+	size_t lanes = 0;
+	size_t alloc = 0;
+	size_t lineno = 0;
+	enum REG reg = REG_0;
+	struct emul_state *s = NULL;
+	struct emul_state *old = NULL;
+
+	*states = NULL;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		p = line + strspn(line, " \t\r\n");
+		if (!*p || *p == '#')
+			continue;
+
+		if (lanes == alloc) {
+			alloc = alloc ? 2 * alloc : 64;
+			old = *states;
+			if ((*states = realloc(*states, alloc * sizeof(**states))) == NULL) {
+				free(old);
+				perror("realloc");
+				return 0;
+			}
+		}
+
+		s = &(*states)[lanes++];
+		memset(s, 0, sizeof(*s));
+		s->registers[REG_H] = ~(uint16_t)0;
+		for (reg = REG_1; reg < REG_H; reg++) {
+			p += strspn(p, " \t\r\n");
+			if (!*p)
+				break;
+			s->registers[reg] = strtoul(p, &end, 0);
+			if (end == p || !strchr(" \t\r\n", *end)) {
+				fprintf(stderr, "Lane on line %zd: expected a value for %s\n", lineno, get_asm_from_reg(reg));
+				free(*states);
+				*states = NULL;
+				return 0;
+			}
+			p = end;
+		}
+	}
+
+	if (!lanes)
+		fprintf(stderr, "No lanes given\n");
+	return lanes;
 }
 
-int execute_b(struct emul_context *ctx, struct instruction i)
+/**
+ * Fuzz the program for `execs' runs, mutating the bytes in `mutate', of the
+ * form <from>:<to>, or the whole program if NULL, and saving what turns up in
+ * `dir'
+ */
+static int emulator_fuzz(const char *dir, uint64_t execs, const char *mutate, uint8_t *ram, size_t ram_size,
+	size_t bytes_used)
 {
-	if (should_jump(ctx, i.inst.b.cond))
-		ctx->pc -= (int16_t)i.inst.b.imm.value;
+	struct emul_fuzz_stats stats;
+	size_t from = 0;
+	size_t to = bytes_used;
+	char *end = NULL;
+
+	if (mutate) {
+		from = strtoul(mutate, &end, 0);
+		if (*end != ':') {
+			fprintf(stderr, "Bytes to mutate must be given as <from>:<to>\n");
+			return 1;
+		}
+		to = strtoul(end + 1, &end, 0);
+		if (*end) {
+			fprintf(stderr, "Bytes to mutate must be given as <from>:<to>\n");
+			return 1;
+		}
+	}
 
+	if (emul_fuzz(ram, ram_size, bytes_used, from, to, execs, dir, &stats))
+		return 1;
+	emul_fuzz_print_stats(stdout, &stats);
 	return 0;
 }
 
-int execute_single(struct emul_context *ctx)
+/**
+ * Run one instance of the program per lane read from `lanes', in lockstep, and
+ * print the final state of each
+ */
+int emulator_run_batch(const struct emul_engine *engine, bool stats, FILE *lanes, uint8_t *ram, size_t ram_size, size_t bytes_used)
 {
 	int ret = 0;
-	struct instruction i = { 0 };
-	int (*f)(struct emul_context*, struct instruction) = NULL;
-	ret = disasm_single(&i, ctx->pc,
-		RAM_AT(ctx, ctx->pc    ) << 8 | RAM_AT(ctx, ctx->pc + 1),
-		RAM_AT(ctx, ctx->pc + 2) << 8 | RAM_AT(ctx, ctx->pc + 3));
-	if (ret <= 0) {
-		printf("disasm_single returned %d\n", ret);
-		return ret ? ret : -1;
-	}
-
-	ctx->pc += ret;
-	switch(i.type) {
-		case INST_TYPE_R:
-			f = execute_r;
-			break;
-		case INST_TYPE_NI:
-		case INST_TYPE_WI:
-			f = execute_i;
-			break;
-		case INST_TYPE_JR:
-			f = execute_jr;
-			break;
-		case INST_TYPE_JI:
-			f = execute_ji;
+	size_t n = 0;
+	size_t lane = 0;
+	struct emul_state *states = NULL;
+	struct emul_cycle *cycles = NULL;
+	struct emul_cycle_info info;
+	struct emul_context ctx;
+	struct emul_batch b;
+
+	if ((n = read_lanes(lanes, &states)) == 0)
+		return 1;
+
+	if (emul_init(&ctx, ram, ram_size, bytes_used)) {
+		free(states);
+		return 1;
+	}
+	if (emul_batch_init(&b, n, ram, ram_size, bytes_used)) {
+		emul_free(&ctx);
+		free(states);
+		return 1;
+	}
+	if ((cycles = calloc(n, sizeof(*cycles))) == NULL) {
+		perror("calloc");
+		ret = 1;
+		goto out;
+	}
+
+	for (lane = 0; lane < n; lane++) {
+		emul_batch_set_state(&b, lane, &states[lane]);
+		emul_batch_get_context(&b, lane, &ctx);
+		if (emul_cycle_init(&cycles[lane], &ctx)) {
+			ret = 1;
+			goto out;
+		}
+	}
+
+	/* as emulator_run(), but lanes caught in a cycle drop out one by one;
+	 * in lockstep, every live lane has the same check due */
+	for (;;) {
+		for (lane = 0; lane < n && !b.live[lane]; lane++)
+			;
+		if (lane == n)
 			break;
-		case INST_TYPE_B:
-			f = execute_b;
+		emul_batch_get_context(&b, lane, &ctx);
+		if (!emul_batch_run(&b, emul_cycle_due(&cycles[lane], &ctx)))
 			break;
-		default:
-			fprintf(stderr, "Unhandled instruction '0x%x' at 0x%x (%d), stop.\n",
-				ctx->ram[ctx->pc], ctx->pc, ctx->pc);
-			return 1;
+		for (lane = 0; lane < n; lane++) {
+			if (!b.live[lane])
+				continue;
+			emul_batch_get_context(&b, lane, &ctx);
+			if (emul_cycle_check(&cycles[lane], &ctx))
+				b.live[lane] = false;
+		}
 	}
 
-	ret = f(ctx, i);
+	for (lane = 0; lane < n; lane++) {
+		emul_batch_get_context(&b, lane, &ctx);
+		if (b.exit[lane] == EMUL_EXIT_HALT) {
+			printf("Lane %zd:\n", lane);
+			emul_dump_registers(stdout, &ctx);
+			continue;
+		}
 
+		if (emul_cycle_locate(&cycles[lane], &ctx, engine, &info)) {
+			ret = 1;
+			goto out;
+		}
+		printf("Lane %zd: entered a cycle at pc 0x%x after %llu instructions (period %llu)\n",
+			lane, info.pc, (unsigned long long)info.entry, (unsigned long long)info.period);
+		ret = EMUL_CYCLE_EXIT_CODE;
+	}
+
+	if (stats)
+		emul_batch_print_stats(stderr, &b);
+
+out:
+	for (lane = 0; cycles && lane < n; lane++)
+		emul_cycle_free(&cycles[lane]);
+	free(cycles);
+	emul_batch_free(&b);
+	emul_free(&ctx);
+	free(states);
 	return ret;
 }
 
-int emulator_run(uint8_t *ram, size_t ram_size, size_t bytes_used)
+/**
+ * Run `n' harts of the program sharing its RAM, in lockstep if `lockstep' is
+ * non-zero, and print the final state of each
+ */
+int emulator_run_harts(const struct emul_engine *engine, bool stats, bool fast_forward, unsigned n,
+	uint64_t lockstep, uint8_t *ram, size_t ram_size, size_t bytes_used)
 {
 	int ret = 0;
-	struct emul_context ctx = {0};
-	ctx.ram = ram;
-	ctx.ram_size = ram_size;
-	ctx.registers[REG_H] = ~(uint16_t)0;
-
-	for (ctx.pc = 0; ctx.pc < ctx.ram_size && ctx.pc < bytes_used;) {
-		if ((ret = execute_single(&ctx))) {
-			return ret;
+	unsigned i = 0;
+	struct emul_harts h;
+	struct emul_hart *t = NULL;
+
+	if (emul_harts_init(&h, n, ram, ram_size, bytes_used))
+		return 1;
+	if (emul_harts_run(&h, engine, fast_forward, lockstep)) {
+		emul_harts_free(&h);
+		return 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		t = &h.hart[i];
+		switch (t->state) {
+			case EMUL_HART_HALTED:
+				printf("Hart %u:\n", i);
+				emul_dump_registers(stdout, &t->ctx);
+				break;
+			case EMUL_HART_CYCLED:
+				printf("Hart %u: entered a cycle at pc 0x%x after %llu instructions (period %llu)\n",
+					i, t->info.pc, (unsigned long long)t->info.entry, (unsigned long long)t->info.period);
+				if (!ret)
+					ret = EMUL_CYCLE_EXIT_CODE;
+				break;
+			default:
+				printf("Hart %u: failed at pc 0x%x\n", i, t->ctx.pc);
+				ret = 1;
+				break;
 		}
-		debug("pc:%d\n", ctx.pc);
 	}
 
-	if (ctx.pc >= bytes_used) {
-		debug("Fell off the bottom of the given program, stopping.\n");
+	if (stats)
+		fprintf(stderr, "harts: %u harts, %llu sync points, %llu instructions\n",
+			n, (unsigned long long)h.rounds, (unsigned long long)h.icount);
+
+	emul_harts_free(&h);
+	return ret;
+}
+
+/**
+ * Write the profile kept for `ctx' as folded stacks to `path', and its hot
+ * spots to stderr, naming addresses from the label map at `path_map' if not
+ * NULL. Returns non-zero on failure
+ */
+static int emulator_write_profile(const struct emul_context *ctx, const char *path, const char *path_map)
+{
+	struct emul_symbols syms = { 0 };
+	FILE *f = NULL;
+	int ret = 0;
+
+	if (path_map) {
+		if ((f = fopen(path_map, "r")) == NULL) {
+			fprintf(stderr, "Error opening %s: ", path_map);
+			perror("fopen");
+			return 1;
+		}
+		ret = emul_symbols_load(f, &syms);
+		fclose(f);
+		if (ret)
+			return 1;
+	}
+
+	if ((f = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "Error opening %s: ", path);
+		perror("fopen");
+		ret = 1;
 	} else {
-		debug("Fell off the bottom of memory, stopping.\n");
+		emul_prof_folded(f, ctx, &syms);
+		fclose(f);
 	}
+	emul_prof_hot(stderr, ctx, &syms);
 
-	printf(
-		"Registers:\n"
-		"pc: 0x%x (%d)\n"
-		"$0: 0x%x (%d)\n"
-		"$1: 0x%x (%d)\n"
-		"$2: 0x%x (%d)\n"
-		"$3: 0x%x (%d)\n"
-		"$4: 0x%x (%d)\n"
-		"$5: 0x%x (%d)\n"
-		"$6: 0x%x (%d)\n"
-		"$H: 0x%x (%d)\n",
-		ctx.pc, ctx.pc,
-		ctx.registers[REG_0], ctx.registers[REG_0],
-		ctx.registers[REG_1], ctx.registers[REG_1],
-		ctx.registers[REG_2], ctx.registers[REG_2],
-		ctx.registers[REG_3], ctx.registers[REG_3],
-		ctx.registers[REG_4], ctx.registers[REG_4],
-		ctx.registers[REG_5], ctx.registers[REG_5],
-		ctx.registers[REG_6], ctx.registers[REG_6],
-		ctx.registers[REG_H], ctx.registers[REG_H]
-	);
-	return 0;
+	emul_symbols_free(&syms);
+	return ret;
 }
 
 void print_help(const char *argv0)
 {
-	fprintf(stderr, "Syntax: %s <in.bin>\n", argv0);
+	fprintf(stderr, "Syntax: %s [-q] [-s] [-f] [-e <engine>] [-b <lanes>] <in.bin>\n", argv0);
+	fprintf(stderr, "        %s [-q] [-s] [-f] [-e <engine>] [-a <instructions>] [-w <snapshot>] [-k <forks>]\n", argv0);
+	fprintf(stderr, "            [-d {text|json|binary|none}] [-P <in.asm>] [-p <out.folded> [-I <interval>] [-m <in.map>]]\n");
+	fprintf(stderr, "            [-t <out.trace>] [-W <register>]\n");
+	fprintf(stderr, "            {<in.bin> | --restore <snapshot>}\n");
+	fprintf(stderr, "        %s [-q] [-s] [-f] [-e <engine>] [-L <instructions>] --harts <n> <in.bin>\n", argv0);
+	fprintf(stderr, "        %s [-q] [-n <executions>] [-M <from>:<to>] --fuzz <out dir> <in.bin>\n", argv0);
+	fprintf(stderr, "        %s [-f] [-e <engine>] [-j <threads>] --farm <manifest>\n", argv0);
+	fprintf(stderr, "        %s [-s] [-f] [-e <engine>] [-Q <quantum>] --sched <manifest>\n", argv0);
+	fprintf(stderr, "Engines (default ref): ");
+	emul_print_engines(stderr);
 }
 
 int main(int argc, char **argv)
 {
 	int error_ret = 1;
 	int ret = 0;
+	int opt = 0;
 	const char *path_in = NULL;
+	const char *path_lanes = NULL;
+	const char *path_manifest = NULL;
+	const char *path_save = NULL;
+	const char *path_restore = NULL;
+	const char *path_forks = NULL;
+	const char *path_posts = NULL;
+	const char *path_profile = NULL;
+	const char *path_map = NULL;
+	const char *path_trace = NULL;
+	const char *path_fuzz = NULL;
+	const char *watch = NULL;
+	enum REG watch_reg = REG_0;
+	const char *mutate = NULL;
+	uint64_t execs = 100000;
+	uint64_t interval = 1;
+	enum EMUL_DUMP dump = EMUL_DUMP_TEXT;
+	bool dump_set = false;
+	bool sched = false;
+	unsigned threads = 0;
+	uint64_t quantum = 0;
+	uint64_t at = 0;
+	unsigned harts = 0;
+	uint64_t lockstep = 0;
+	bool stats = false;
+	bool fast_forward = false;
+	bool forked = false;
+	const char *engine_name = "ref";
+	const struct emul_engine *engine = NULL;
+	struct emul_context ctx;
+	struct emul_snapshot snap;
 	FILE *fin = NULL;
+	FILE *flanes = NULL;
+	FILE *fmanifest = NULL;
+	FILE *fsnap = NULL;
+	FILE *fforks = NULL;
+	FILE *fposts = NULL;
+	FILE *ftrace = NULL;
+	static const struct option long_opts[] = {
+		{ "engine", required_argument, NULL, 'e' },
+		{ "stats",  no_argument,       NULL, 's' },
+		{ "fast-forward", no_argument, NULL, 'f' },
+		{ "batch",  required_argument, NULL, 'b' },
+		{ "farm",   required_argument, NULL, 'F' },
+		{ "jobs",   required_argument, NULL, 'j' },
+		{ "sched",  required_argument, NULL, 'S' },
+		{ "quantum", required_argument, NULL, 'Q' },
+		{ "at",     required_argument, NULL, 'a' },
+		{ "save",   required_argument, NULL, 'w' },
+		{ "restore", required_argument, NULL, 'r' },
+		{ "fork",   required_argument, NULL, 'k' },
+		{ "harts",  required_argument, NULL, 'H' },
+		{ "lockstep", required_argument, NULL, 'L' },
+		{ "dump",   required_argument, NULL, 'd' },
+		{ "check-post", required_argument, NULL, 'P' },
+		{ "profile", required_argument, NULL, 'p' },
+		{ "profile-interval", required_argument, NULL, 'I' },
+		{ "map",    required_argument, NULL, 'm' },
+		{ "trace",  required_argument, NULL, 't' },
+		{ "fuzz",   required_argument, NULL, 'z' },
+		{ "execs",  required_argument, NULL, 'n' },
+		{ "mutate", required_argument, NULL, 'M' },
+		{ "watch",  required_argument, NULL, 'W' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, "qe:sfb:F:j:S:Q:a:w:r:k:H:L:d:P:p:I:m:t:z:n:M:W:", long_opts, NULL)) != -1) {
+		switch (opt) {
+			case 'q':
+				error_ret = 0;
+				break;
+			case 'e':
+				engine_name = optarg;
+				break;
+			case 's':
+				stats = true;
+				break;
+			case 'f':
+				fast_forward = true;
+				break;
+			case 'b':
+				path_lanes = optarg;
+				break;
+			case 'F':
+				path_manifest = optarg;
+				break;
+			case 'j':
+				threads = strtoul(optarg, NULL, 0);
+				break;
+			case 'S':
+				path_manifest = optarg;
+				sched = true;
+				break;
+			case 'Q':
+				quantum = strtoull(optarg, NULL, 0);
+				break;
+			case 'a':
+				at = strtoull(optarg, NULL, 0);
+				break;
+			case 'w':
+				path_save = optarg;
+				break;
+			case 'r':
+				path_restore = optarg;
+				break;
+			case 'k':
+				path_forks = optarg;
+				break;
+			case 'H':
+				harts = strtoul(optarg, NULL, 0);
+				break;
+			case 'L':
+				lockstep = strtoull(optarg, NULL, 0);
+				break;
+			case 'd':
+				if (emul_dump_format(optarg, &dump))
+					return 1;
+				dump_set = true;
+				break;
+			case 'P':
+				path_posts = optarg;
+				break;
+			case 'p':
+				path_profile = optarg;
+				break;
+			case 'I':
+				interval = strtoull(optarg, NULL, 0);
+				break;
+			case 'm':
+				path_map = optarg;
+				break;
+			case 't':
+				path_trace = optarg;
+				break;
+			case 'z':
+				path_fuzz = optarg;
+				break;
+			case 'n':
+				execs = strtoull(optarg, NULL, 0);
+				break;
+			case 'M':
+				mutate = optarg;
+				break;
+			case 'W':
+				watch = optarg;
+				break;
+			default:
+				print_help(argv[0]);
+				return 1;
+		}
+	}
 
-	if (argc < 2) {
+	if (optind != argc - !(path_manifest || path_restore)) {
 		print_help(argv[0]);
 		return 1;
 	}
+	path_in = argv[optind];
 
-	if (strcmp(argv[1], "-q") == 0) {
-		if (argc != 4) {
-			print_help(argv[0]);
-			return 0;
-		}
-		error_ret = 0;
-		path_in = argv[2];
-	} else {
-		path_in = argv[1];
+	if ((engine = emul_get_engine(engine_name)) == NULL) {
+		fprintf(stderr, "Unknown engine `%s'\n", engine_name);
+		print_help(argv[0]);
+		return 1;
 	}
 
-	if ((fin = fopen(path_in, "r")) == NULL) {
-		fprintf(stderr, "Error opening %s: ", path_in);
-		perror("fopen");
+	if (path_profile && (fast_forward || path_lanes || path_manifest || harts || path_forks)) {
+		fprintf(stderr, "Profiling runs a single guest, and cannot fast-forward\n");
+		return error_ret;
+	}
+	if (path_trace && (path_profile || fast_forward || path_lanes || path_manifest || harts || path_forks)) {
+		fprintf(stderr, "Tracing runs a single guest, and cannot fast-forward or profile\n");
+		return error_ret;
+	}
+	if (path_fuzz && (strcmp(engine->name, "ref") || fast_forward || path_lanes || path_manifest || harts ||
+	    path_restore || path_save || path_forks || path_profile || path_trace || at)) {
+		fprintf(stderr, "Fuzzing runs the program from the start in the reference engine alone\n");
+		return error_ret;
+	}
+
+	if (watch && (get_reg_from_asm(watch, &watch_reg) || watch_reg == REG_0)) {
+		fprintf(stderr, "Cannot watch `%s'\n", watch);
+		return error_ret;
+	}
+	if (watch && (fast_forward || path_lanes || path_manifest || harts || path_forks || path_profile ||
+	    path_trace || path_fuzz)) {
+		fprintf(stderr, "Watching runs a single guest, and cannot fast-forward, profile or trace\n");
 		return error_ret;
 	}
 
+	if (path_manifest) {
+		if ((fmanifest = fopen(path_manifest, "r")) == NULL) {
+			fprintf(stderr, "Error opening %s: ", path_manifest);
+			perror("fopen");
+			return error_ret;
+		}
+		if (sched)
+			ret = emul_sched(fmanifest, stdout, engine, fast_forward, quantum, stats);
+		else
+			ret = emul_farm(fmanifest, stdout, engine, fast_forward, threads);
+		fclose(fmanifest);
+		return error_ret ? ret : 0;
+	}
+
 	uint8_t ram[65536] = { 0 };
-	uint16_t bytes_used = 0;
+	size_t bytes_used = 0;
 	size_t nread = 0;
-	while((nread = fread(ram + bytes_used, 1, 128, fin))) {
-		bytes_used += nread;
+
+	if (path_restore) {
+		/* carry on from the snapshot, in RAM of its own */
+		if ((fsnap = fopen(path_restore, "rb")) == NULL) {
+			fprintf(stderr, "Error opening %s: ", path_restore);
+			perror("fopen");
+			return error_ret;
+		}
+		ret = emul_snapshot_load(&snap, fsnap);
+		fclose(fsnap);
+		if (ret)
+			return error_ret;
+		ret = emul_snapshot_fork(&snap, &ctx);
+		emul_snapshot_free(&snap);
+		if (ret)
+			return error_ret;
+		forked = true;
+		debug("Restored %s at instruction %llu\n", path_restore, (unsigned long long)ctx.icount);
+	} else {
+		if ((fin = fopen(path_in, "r")) == NULL) {
+			fprintf(stderr, "Error opening %s: ", path_in);
+			perror("fopen");
+			return error_ret;
+		}
+
+		while((nread = fread(ram + bytes_used, 1, 128, fin))) {
+			bytes_used += nread;
+		}
+
+		if (!feof(fin)) {
+			perror("fread");
+			return error_ret;
+		}
+		fclose(fin);
+
+		debug("Read %zd bytes of program into memory\n", bytes_used);
+	}
+
+	if (path_fuzz) {
+		ret = emulator_fuzz(path_fuzz, execs, mutate, ram, sizeof(ram), bytes_used);
+		return error_ret ? ret : 0;
 	}
 
-	if (!feof(fin)) {
-		perror("fread");
+	if (path_lanes) {
+		if (fast_forward || harts || path_restore || path_save || path_forks) {
+			fprintf(stderr, "Fast-forwarding, harts and snapshots are not supported in a batch\n");
+			return error_ret;
+		}
+		if ((flanes = fopen(path_lanes, "r")) == NULL) {
+			fprintf(stderr, "Error opening %s: ", path_lanes);
+			perror("fopen");
+			return error_ret;
+		}
+		ret = emulator_run_batch(engine, stats, flanes, ram, sizeof(ram), bytes_used);
+		fclose(flanes);
+		return error_ret ? ret : 0;
+	}
+
+	if (harts) {
+		if (path_restore || path_save || path_forks) {
+			fprintf(stderr, "Snapshots are not supported with several harts\n");
+			return error_ret;
+		}
+		ret = emulator_run_harts(engine, stats, fast_forward, harts, lockstep, ram, sizeof(ram), bytes_used);
+		return error_ret ? ret : 0;
+	}
+
+	if (!forked && emul_init(&ctx, ram, sizeof(ram), bytes_used))
 		return error_ret;
+
+	if ((ret = run_to(engine, fast_forward, &ctx, at)))
+		goto out;
+
+	if (path_save || path_forks) {
+		if ((ret = emul_snapshot_take(&snap, &ctx)))
+			goto out;
+		if (path_save) {
+			if ((fsnap = fopen(path_save, "wb")) == NULL) {
+				fprintf(stderr, "Error opening %s: ", path_save);
+				perror("fopen");
+				ret = 1;
+			} else {
+				ret = emul_snapshot_save(&snap, fsnap);
+				fclose(fsnap);
+			}
+		}
+		if (!ret && path_forks) {
+			if ((fforks = fopen(path_forks, "r")) == NULL) {
+				fprintf(stderr, "Error opening %s: ", path_forks);
+				perror("fopen");
+				ret = 1;
+			} else {
+				ret = emulator_run_forks(engine, fast_forward, &snap, fforks);
+				fclose(fforks);
+			}
+		}
+		emul_snapshot_free(&snap);
+		if (ret || path_forks)
+			goto out;
 	}
-	fclose(fin);
 
-	debug("Read %d bytes of program into memory\n", bytes_used);
-	if ((ret = emulator_run(ram, sizeof(ram), bytes_used)))
-		return error_ret && ret;
+	if (path_posts && (fposts = fopen(path_posts, "r")) == NULL) {
+		fprintf(stderr, "Error opening %s: ", path_posts);
+		perror("fopen");
+		ret = 1;
+		goto out;
+	}
+	/* the checks take the place of the dump, unless asked for both */
+	if (path_posts && !dump_set)
+		dump = EMUL_DUMP_NONE;
+
+	/* profiled from here on, so --at can skip what is not of interest */
+	if (path_profile) {
+		if (emul_prof_enable(&ctx, engine, interval)) {
+			ret = 1;
+			goto out;
+		}
+		engine = &emul_prof_engine;
+	}
+	/* traced from here on, likewise */
+	if (path_trace) {
+		if ((ftrace = fopen(path_trace, "wb")) == NULL) {
+			fprintf(stderr, "Error opening %s: ", path_trace);
+			perror("fopen");
+			ret = 1;
+			goto out;
+		}
+		if (emul_trace_enable(&ctx, ftrace)) {
+			ret = 1;
+			goto out;
+		}
+		engine = &emul_trace_engine;
+	}
+	/* history recorded from here on, likewise */
+	if (watch) {
+		if (emul_ttd_enable(&ctx, engine, EMUL_TTD_INTERVAL, EMUL_TTD_CHECKPOINTS)) {
+			ret = 1;
+			goto out;
+		}
+		engine = &emul_ttd_engine;
+	}
 
-	return 0;
+	ret = emulator_run(engine, stats, fast_forward, &ctx, dump, fposts);
+	if (fposts)
+		fclose(fposts);
+	/* the guest failing its checks is what the history is for */
+	if (watch && (!ret || ret == EMUL_POST_EXIT_CODE) && emulator_watch(&ctx, watch_reg))
+		ret = 1;
+	if (path_profile && emulator_write_profile(&ctx, path_profile, path_map) && !ret)
+		ret = 1;
+
+out:
+	if (emul_trace_finish(&ctx) && !ret)
+		ret = 1;
+	if (ftrace)
+		fclose(ftrace);
+	emul_prof_free(&ctx);
+	emul_ttd_free(&ctx);
+	if (forked)
+		emul_snapshot_fork_free(&ctx);
+	else
+		emul_free(&ctx);
+
+	return error_ret ? ret : 0;
 }
@@ -1,80 +1,180 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <stdbool.h>
 
 #include "parse.h"
+#include "input/input_bin.h"
+
+/* Sign-extend the low `width' bits of `x' */
+#define SIGN_EXTEND(x, width) ((int)(((x) ^ (1u << ((width) - 1))) - (1u << ((width) - 1))))
+
+/* Decoding expansions of ISA_FORMATS: the first format whose match bits
+ * agree with `inst' picks apart its fields */
+#define DECODE_FIELD(member, field, kind, shift, width) \
+	i->inst.member.field = (inst & ISA_BITS(shift, width)) >> (shift);
+#define DECODE_WORD(member, field, kind) \
+	i->inst.member.field = extra;
+#define DECODE_OFFSET(member, field, kind, shift, width) \
+	i->inst.member.field = pc + 2 * SIGN_EXTEND((inst & ISA_BITS(shift, width)) >> (shift), width);
+#define DECODE_FORMAT(name, member, size, mask, match, syntax, fields) \
+	if ((inst & (mask)) == (match)) { \
+		memset(&i->inst, 0, sizeof(i->inst)); \
+		i->type = INST_TYPE_##name; \
+		fields \
+		/* positive return code is bytes consumed */ \
+		return size; \
+	}
 
-static void disasm_rtype(uint16_t i, uint16_t unused, struct instruction *inst)
+/**
+ * Decode the instruction `inst' at `pc', with `extra' the word after it,
+ * straight from the ISA table. Returns its size in bytes
+ */
+static size_t decode_formats(struct instruction *i, uint16_t pc, uint16_t inst, uint16_t extra)
 {
-	(void)unused;
-	inst->type = INST_TYPE_R;
-	inst->inst.r.oper = GET_OPER(i);
-	inst->inst.r.dest = GET_REG_DEST(i);
-	inst->inst.r.left = GET_REG_LEFT(i);
-	inst->inst.r.right = GET_REG_RIGHT(i);
-}
+	ISA_FORMATS(DECODE_FORMAT, DECODE_FIELD, DECODE_WORD, DECODE_OFFSET)
 
-static void disasm_nitype(uint16_t i, uint16_t unused, struct instruction *inst)
-{
-	(void)unused;
-	inst->type = INST_TYPE_NI;
-	inst->inst.i.oper = GET_OPER(i);
-	inst->inst.i.dest = GET_REG_DEST(i);
-	inst->inst.i.left = GET_REG_LEFT(i);
-	inst->inst.i.imm.value = GET_NI_IMM(i);
-	inst->inst.i.imm_is_ident = 0;
+	return -EINVAL;
 }
 
-static void disasm_witype(uint16_t i, uint16_t imm, struct instruction *inst)
+/* Unpack the fields of `i' into `d', as decode_lut holds them */
+static void unpack(struct decoded_word *d, const struct instruction *i)
 {
-	inst->type = INST_TYPE_WI;
-	inst->inst.i.oper = GET_OPER(i);
-	inst->inst.i.dest = GET_REG_DEST(i);
-	inst->inst.i.left = GET_REG_LEFT(i);
-	inst->inst.i.imm.value = imm;
-	inst->inst.i.imm_is_ident = 0;
+	d->type = i->type;
+	switch (i->type) {
+		case INST_TYPE_R:
+			d->oper = i->inst.r.oper;
+			d->dest = i->inst.r.dest;
+			d->left = i->inst.r.left;
+			d->right = i->inst.r.right;
+			break;
+		case INST_TYPE_NI:
+		case INST_TYPE_WI:
+			d->oper = i->inst.i.oper;
+			d->dest = i->inst.i.dest;
+			d->left = i->inst.i.left;
+			d->imm = i->inst.i.imm.value;
+			break;
+		case INST_TYPE_JR:
+			d->oper = i->inst.jr.cond;
+			d->left = i->inst.jr.reg;
+			break;
+		case INST_TYPE_JI:
+			d->oper = i->inst.ji.cond;
+			break;
+		case INST_TYPE_B:
+			d->oper = i->inst.b.cond;
+			d->imm = (int16_t)i->inst.b.imm.value;
+			break;
+	}
 }
 
-static void disasm_jreg(uint16_t i, uint16_t unused, struct instruction *inst)
+struct decoded_word decode_lut[1 << 16];
+
+/**
+ * Fill decode_lut, if it is not filled yet. Must be called before
+ * decode_word() and disasm_single(), from one thread at a time: threaded
+ * programs go through emul_decode_init() instead
+ */
+void decode_lut_init(void)
 {
-	(void)unused;
-	inst->type = INST_TYPE_JR;
-	inst->inst.jr.cond = GET_JB_COND(i);
-	inst->inst.jr.reg = GET_JUMP_REG(i);
+	static bool filled = false;
+	struct instruction i;
+	struct decoded_word *d = NULL;
+	uint32_t word = 0;
+
+	if (filled)
+		return;
+
+	for (word = 0; word < (1 << 16); word++) {
+		d = &decode_lut[word];
+		/* at pc 0 a branch target is the offset itself */
+		d->size = decode_formats(&i, 0, word, 0);
+		unpack(d, &i);
+	}
+	filled = true;
 }
 
-static void disasm_jimm(uint16_t i, uint16_t imm, struct instruction *inst)
+/**
+ * Unpack the instruction `i' at `pc', as parsed and with its labels resolved,
+ * into `d', exactly as decode_word() would have the word it assembles to
+ */
+void decode_parsed(struct decoded_word *d, const struct instruction *i, uint16_t pc)
 {
-	inst->type = INST_TYPE_JI;
-	inst->inst.ji.cond= GET_JB_COND(i);
-	inst->inst.ji.imm.value = imm;
-	inst->inst.ji.imm_is_ident = 0;
+	static const uint8_t sizes[] = ISA_INST_SIZES;
+	struct instruction field = *i;
+
+	/* truncated to their widths in the word, as the encoder does; a wide
+	 * immediate is in the word after */
+	if (i->type == INST_TYPE_NI)
+		field.inst.i.imm.value &= ISA_BITS(0, 5);
+	if (i->type == INST_TYPE_WI)
+		field.inst.i.imm.value = 0;
+	if (i->type == INST_TYPE_B)
+		field.inst.b.imm.value = 2 * SIGN_EXTEND((uint16_t)(i->inst.b.imm.value - pc) / 2 & ISA_BITS(0, 10), 10);
+
+	memset(d, 0, sizeof(*d));
+	unpack(d, &field);
+	d->size = sizes[i->type];
 }
 
-static void disasm_bimm(uint16_t i, uint16_t pc, struct instruction *inst)
+size_t disasm_single(struct instruction *i, uint16_t pc, uint16_t inst, uint16_t extra)
 {
-	struct { signed int s:10; } sign;
-	int offset = sign.s = GET_B_OFFSET(i);
-	inst->type = INST_TYPE_B;
-	inst->inst.b.cond = GET_JB_COND(i);
-	inst->inst.b.imm.value = pc + 2 * offset;
-	inst->inst.b.imm_is_ident = 0;
-}
+	const struct decoded_word *d = decode_word(inst);
+
+	memset(i, 0, sizeof(*i));
+	i->type = d->type;
+	switch (d->type) {
+		case INST_TYPE_R:
+			i->inst.r.oper = d->oper;
+			i->inst.r.dest = d->dest;
+			i->inst.r.left = d->left;
+			i->inst.r.right = d->right;
+			break;
+		case INST_TYPE_NI:
+		case INST_TYPE_WI:
+			i->inst.i.oper = d->oper;
+			i->inst.i.dest = d->dest;
+			i->inst.i.left = d->left;
+			i->inst.i.imm.value = d->type == INST_TYPE_WI ? extra : (uint16_t)d->imm;
+			break;
+		case INST_TYPE_JR:
+			i->inst.jr.cond = d->oper;
+			i->inst.jr.reg = d->left;
+			break;
+		case INST_TYPE_JI:
+			i->inst.ji.cond = d->oper;
+			i->inst.ji.imm.value = extra;
+			break;
+		case INST_TYPE_B:
+			i->inst.b.cond = d->oper;
+			i->inst.b.imm.value = pc + d->imm;
+			break;
+	}
 
+	/* positive return code is bytes consumed */
+	return d->size;
+}
 
 /**
  * FIXME move and factor out with parse.c */
 static struct instruction *insts = NULL;
 static size_t insts_count = 0;
+static size_t insts_alloc = 0;
 static int add_instruction(struct instruction inst)
 {
 	struct instruction *old_insts = insts;
-	insts = realloc(insts, (insts_count + 1) * sizeof(struct instruction));
-	if (!insts) {
-		free(old_insts);
-		perror("realloc");
-		return 1;
+
+	if (insts_count == insts_alloc) {
+		insts_alloc = insts_alloc ? 2 * insts_alloc : 256;
+		insts = realloc(insts, insts_alloc * sizeof(struct instruction));
+		if (!insts) {
+			free(old_insts);
+			perror("realloc");
+			return 1;
+		}
 	}
 
 	insts[insts_count] = inst;
@@ -83,112 +183,62 @@ static int add_instruction(struct instruction inst)
 	return 0;
 }
 
-size_t disasm_single(struct instruction *i, uint16_t pc, uint16_t inst, uint16_t extra)
-{
-	int ret = 0;
-	int extra_used = 0;
-	void (*disasm_inst)(uint16_t, uint16_t, struct instruction*);
-
-	switch (GET_INST_TYPE(inst)) {
-		case INST_TYPE_RTYPE:  disasm_inst = disasm_rtype;  break;
-		case INST_TYPE_NITYPE: disasm_inst = disasm_nitype; break;
-		case INST_TYPE_WITYPE:
-			disasm_inst = disasm_witype;
-			extra_used = 1;
-			break;
-		case INST_TYPE_JTYPE:
-			/* J Type can be split into three further subtypes:
-			 *  - branch (always immediate, 2 bytes)
-			 *  - jump reg (2 bytes)
-			 *  - jump immediate (4 bytes)
-			 */
-			if (inst & MASK_IS_BRANCH) {
-				disasm_inst = disasm_bimm;
-				/* hack PC into handler. It's expecting it */
-				extra = pc;
-			} else {
-				if (inst & MASK_JR) {
-					disasm_inst = disasm_jreg;
-				} else {
-					disasm_inst = disasm_jimm;
-					extra_used = 1;
-				}
-			}
-			break;
-		default:
-			ret = -EINVAL;
-			break;
-	}
-	if (!ret) {
-		disasm_inst(inst, extra, i);
-		/* positive return code is bytes consumed */
-		ret = extra_used ? 4 : 2;
-	}
-
-	return ret;
-}
-
 static int disasm_file(FILE *f)
 {
 	int ret = 0;
 	size_t offs = 0;
-	uint16_t inst = 0;
-	uint16_t extra = 0;
-	uint8_t c[4] = { 0 };
-	size_t to_read = 0;
+	size_t size = 0;
+	uint8_t *buf = NULL;
+	uint8_t *old_buf = NULL;
+	size_t len = 0;
+	size_t alloc = 0;
 	size_t nread = 0;
+	uint16_t extra = 0;
 	struct instruction i = { 0 };
 
-	/* prime the pump with two words read */
-	to_read = 4;
+	/* slurp the whole file, so every instruction and its immediate are to
+	 * hand however the reads fall */
 	do {
-		nread = fread(c, 1, to_read, f);
-		switch (nread) {
-			case 0:
-				if (to_read == 2) {
-					/* use up what's left in extra */
-				} else {
-					/* just used up 4 bytes, and couldn't read more. break out*/
-					goto read_eof;
-				}
-				/* FALLTHROUGH */
-			case 2:
-				/* have just read 2 bytes: shift down and pack new in */
-				inst = extra;
-				extra = c[0] << 8 | c[1];
-				break;
-			case 4:
-				/* have just read 4 bytes: fresh inst and extra needed */
-				inst = c[0] << 8 | c[1];
-				extra = c[2] << 8 | c[3];
-				break;
-			default:
-				fprintf(stderr, "Internal error: unexpected nread '%zd'\n", nread);
+		if (len == alloc) {
+			alloc = alloc ? 2 * alloc : 4096;
+			old_buf = buf;
+			if ((buf = realloc(buf, alloc)) == NULL) {
+				free(old_buf);
+				perror("realloc");
 				return 1;
+			}
 		}
-		ret = disasm_single(&i, offs, inst, extra);
-		if (ret <= 0) {
-			fprintf(stderr, "Error handling instruction at byte %zd\n", offs);
-			break;
-		}
+		nread = fread(buf + len, 1, alloc - len, f);
+		len += nread;
+	} while (nread);
 
-		if (add_instruction(i))
-			return 1;
+	if (!feof(f)) {
+		perror("fread");
+		free(buf);
+		return -errno;
+	}
 
-		/* return value from disasm_single is # bytes decoded. Current byte
-		 * offset is adjusted by this, and we need to read this many more bytes
-		 * next time around */
-		offs += ret;
-		to_read = ret;
-	} while (!feof(f));
-read_eof:
+	decode_lut_init();
 
+	for (offs = 0; offs + 1 < len; offs += size) {
+		extra = offs + 3 < len ? buf[offs + 2] << 8 | buf[offs + 3] : 0;
+		size = disasm_single(&i, offs, buf[offs] << 8 | buf[offs + 1], extra);
+		if (offs + size > len)
+			fprintf(stderr, "Warning: instruction at byte %zd runs past the end, its immediate is 0\n", offs);
 
-	if (!feof(f)) {
-		perror("fread");
-		ret = -errno;
+		if (add_instruction(i)) {
+			ret = 1;
+			break;
+		}
 	}
-	return ret < 0 ? ret : 0;
+
+	if (!ret && len % 2) {
+		fprintf(stderr, "Stray byte at the end, at byte %zd\n", len - 1);
+		ret = 1;
+	}
+
+	free(buf);
+	return ret;
 }
 
 int input_bin(FILE *f, struct instruction **i, size_t *i_count)
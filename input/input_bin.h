@@ -1,6 +1,35 @@
 #ifndef INPUT_BIN_H
 #define INPUT_BIN_H
 
+#include <stdio.h>
+#include <stdint.h>
+
+#include "parse.h"
+
+/**
+ * Everything the first word of an instruction encodes, already unpacked.
+ * decode_lut has one for every possible word, so decoding is a single load
+ */
+struct decoded_word {
+	uint8_t type;  /* enum INST_TYPE */
+	uint8_t size;  /* bytes: 4 if the second word is an immediate */
+	uint8_t oper;  /* enum OPER for ALU types, enum JCOND for J-types */
+	uint8_t dest;
+	uint8_t left;  /* also the target register of JR-type */
+	uint8_t right;
+	int16_t imm;   /* narrow immediate, or branch offset in bytes */
+};
+
+extern struct decoded_word decode_lut[1 << 16];
+
+void decode_lut_init(void);
+void decode_parsed(struct decoded_word *d, const struct instruction *i, uint16_t pc);
+
+static inline const struct decoded_word *decode_word(uint16_t word)
+{
+	return &decode_lut[word];
+}
+
 size_t disasm_single(struct instruction *i, uint16_t pc, uint16_t inst, uint16_t extra);
 int input_bin(FILE *f, struct instruction **i, size_t *i_count);
 
@@ -1,19 +1,6 @@
 #ifndef INSTRUCTION_H
 #define INSTRUCTION_H
 
-/**
- * Values used for software-only identification instruction types. Values not
- * tied to machine language. Guaranteed unique.
- */
-enum INST_TYPE {
-	INST_TYPE_R,
-	INST_TYPE_NI,
-	INST_TYPE_WI,
-	INST_TYPE_JR,
-	INST_TYPE_JI,
-	INST_TYPE_B
-};
-
 /**
  * Masks for all four instruction types. Not guaranteed unique
  */
@@ -38,38 +25,70 @@ enum INST_TYPE {
 #define JITYPE_SIZE_BYTES 4 /* 16-bit instruction + 16-bit immediate */
 
 /**
- * ALU operation types
- * R-type and I-type take 3-bit ALU oper as bits:
- * xx___xxx xxxxxxxx
+ * ALU operations, as a single table. The assembler and disassembler mnemonics
+ * (util.c), the interpreters (emul/emul.h, emul/emul_threaded.c,
+ * emul/emul_block.c, emul/emul_batch.c) and the C generators
+ * (emul/gen_spec.c, output/output_c.c) are each expanded from it.
+ *
+ * OPER(name, value, mnemonic, result, carry) is one operation:
+ *   name:     suffix of its OPER_*
+ *   value:    its 3-bit encoding, bits xx___xxx xxxxxxxx of R- and I-types
+ *   mnemonic: its assembly mnemonic, the I-type form taking an `i' suffix
+ *   result:   C for its result from the 16-bit operands `l' and `r'
+ *   carry:    C for its carry from `l', `r' and the 16-bit result `res'
+ *
+ * result and carry are built from C operators that work alike on scalars and
+ * on vectors of lanes, and the following, which the expanding code defines:
+ *   SHIFT(x, op, n): x shifted with op (<< or >>) by n, or 0 if n >= 16
+ *   BIT(x, n):       bit n of x, for n in 0..15
+ *   BOTH(a, b):      a and b, with b only read if a holds
+ *   MUL_HI(a, b):    high 16 bits of the 32-bit product of a and b
  */
+#define ISA_OPERS(OPER) \
+	OPER(ADD, 0, add, l + r,              res < l) \
+	OPER(SUB, 1, sub, l - r,              l < r) \
+	OPER(SHL, 2, shl, SHIFT(l, <<, r),    BOTH(BOTH(r != 0, r <= 16), BIT(l, 16 - r))) \
+	OPER(SHR, 3, shr, SHIFT(l, >>, r),    BOTH(BOTH(r != 0, r <= 16), BIT(l, r - 1))) \
+	OPER(AND, 4, and, l & r,              0) \
+	OPER(OR,  5, or,  l | r,              0) \
+	OPER(XOR, 6, xor, l ^ r,              0) \
+	OPER(MUL, 7, mul, l * r,              MUL_HI(l, r) != 0)
+
+#define ISA_OPER_ENUM(name, value, mnemonic, result, carry) \
+	OPER_##name = value,
 enum OPER {
-	OPER_ADD = 0,
-	OPER_SUB = 1,
-	OPER_SHL = 2,
-	OPER_SHR = 3,
-	OPER_AND = 4,
-	OPER_OR  = 5,
-	OPER_XOR = 6,
-	OPER_MUL = 7,
+	ISA_OPERS(ISA_OPER_ENUM)
 };
 #define OPER_SHAMT (11)
 #define MASK_OPER(x) ((x) << OPER_SHAMT)
 #define GET_OPER(x) (0x7 & ((x) >> OPER_SHAMT))
 
 /**
- * Masks for jump and branch conditions
- * J-type instructions (jump, branch) take these as follows:
- * xxx___xx xxxxxxxx
+ * Jump and branch conditions, as a single table expanded like ISA_OPERS.
+ *
+ * COND(name, value, jump, branch, test) is one condition:
+ *   name:   suffix of its JB_*
+ *   value:  its 3-bit encoding, bits xxx___xx xxxxxxxx of J-types
+ *   jump:   its mnemonic as a jump (JR and JI)
+ *   branch: its mnemonic as a branch (B)
+ *   test:   whether it holds, from the flags ZF and CF, the constant ALWAYS
+ *           and NOT(a) and EITHER(a, b), which the expanding code defines.
+ *           EITHER only reads b if a does not hold
  */
+#define ISA_CONDS(COND) \
+	COND(UNCOND,  0x0, jmp,  bra,  ALWAYS) \
+	COND(NEVER,   0x1, jn,   bn,   NOT(ALWAYS)) \
+	COND(ZERO,    0x2, jz,   bz,   ZF) \
+	COND(NZERO,   0x3, jnz,  bnz,  NOT(ZF)) \
+	COND(CARRY,   0x4, jc,   bc,   CF) \
+	COND(NCARRY,  0x5, jnc,  bnc,  NOT(CF)) \
+	COND(CARRYZ,  0x6, jcz,  bcz,  EITHER(ZF, CF)) \
+	COND(NCARRYZ, 0x7, jncz, bncz, NOT(EITHER(ZF, CF)))
+
+#define ISA_COND_ENUM(name, value, jump, branch, test) \
+	JB_##name = value,
 enum JCOND {
-	JB_UNCOND  = 0x0,
-	JB_NEVER   = 0x1,
-	JB_ZERO    = 0x2,
-	JB_NZERO   = 0x3,
-	JB_CARRY   = 0x4,
-	JB_NCARRY  = 0x5,
-	JB_CARRYZ  = 0x6,
-	JB_NCARRYZ = 0x7
+	ISA_CONDS(ISA_COND_ENUM)
 };
 #define JB_SHAMT   (10)
 #define MASK_JB_COND(x) ((x) << JB_SHAMT)
@@ -79,8 +98,9 @@ enum JCOND {
 #define MASK_IS_BRANCH (1 << 13)
 #define MASK_JI (0x0 << 8)
 #define MASK_JR (0x1 << 8)
-#define MASK_JUMP_REGISTER(x) ((x) << 5)
-#define GET_JUMP_REG(x) (0x07 & ((x) >> 5))
+#define JUMP_REG_OFFSET (5)
+#define MASK_JUMP_REGISTER(x) ((x) << JUMP_REG_OFFSET)
+#define GET_JUMP_REG(x) (0x07 & ((x) >> JUMP_REG_OFFSET))
 
 
 /**
@@ -125,4 +145,97 @@ enum REG {
 #define MASK_B_OFFSET(x) ((x) & 0x3FF)
 #define GET_B_OFFSET(x) ((x) & 0x3FF)
 
+/**
+ * The instruction formats, as a single table. The decoder (input/input_bin.c),
+ * the encoder (output/output_bin.c) and the printer (output/output_asm.c) are
+ * each expanded from it at compile time, by passing ISA_FORMATS macros which
+ * turn every row into straight-line code.
+ *
+ * FORMAT(name, member, size, mask, match, syntax, fields) is one format:
+ *   name:        suffix of its INST_TYPE_*
+ *   member:      its member of union instruction_u (parse.h)
+ *   size:        bytes, one or two 16-bit words
+ *   mask, match: a first word w is of this format if (w & mask) == match
+ *   syntax:      printf format of its disassembly, taking its fields in order
+ *   fields:      the fields below, in order
+ *
+ * A field is written to or read from `member.field' of the instruction, and
+ * `kind' (OPER, REG, JCOND, BCOND or IMM) says how it is disassembled:
+ *   FIELD(member, field, kind, shift, width): bits of the first word
+ *   WORD(member, field, kind): the whole second word
+ *   OFFSET(member, field, kind, shift, width): signed bits of the first word,
+ *     counting 16-bit words from the instruction. Decoded as a target address
+ */
+#define ISA_FORMATS(FORMAT, FIELD, WORD, OFFSET) \
+	FORMAT(R, r, RTYPE_SIZE_BYTES, \
+		MASK_INST_TYPE(0x3), MASK_INST_RTYPE, \
+		"%s  %s, %s, %s\n", \
+		FIELD(r, oper,  OPER, OPER_SHAMT, 3) \
+		FIELD(r, dest,  REG,  REG_DEST_OFFSET, 3) \
+		FIELD(r, left,  REG,  REG_LEFT_OFFSET, 3) \
+		FIELD(r, right, REG,  REG_RIGHT_OFFSET, 3)) \
+	FORMAT(NI, i, NITYPE_SIZE_BYTES, \
+		MASK_INST_TYPE(0x3), MASK_INST_NITYPE, \
+		"%si %s, %s, 0x%x\n", \
+		FIELD(i, oper,      OPER, OPER_SHAMT, 3) \
+		FIELD(i, dest,      REG,  REG_DEST_OFFSET, 3) \
+		FIELD(i, left,      REG,  REG_LEFT_OFFSET, 3) \
+		FIELD(i, imm.value, IMM,  0, 5)) \
+	FORMAT(WI, i, WITYPE_SIZE_BYTES, \
+		MASK_INST_TYPE(0x3), MASK_INST_WITYPE, \
+		"%si %s, %s, 0x%x\n", \
+		FIELD(i, oper,      OPER, OPER_SHAMT, 3) \
+		FIELD(i, dest,      REG,  REG_DEST_OFFSET, 3) \
+		FIELD(i, left,      REG,  REG_LEFT_OFFSET, 3) \
+		WORD(i, imm.value,  IMM)) \
+	FORMAT(JR, jr, JRTYPE_SIZE_BYTES, \
+		MASK_INST_TYPE(0x3) | MASK_IS_BRANCH | MASK_JR, MASK_INST_JTYPE | MASK_IS_JUMP | MASK_JR, \
+		"%s  %s\n", \
+		FIELD(jr, cond,     JCOND, JB_SHAMT, 3) \
+		FIELD(jr, reg,      REG,   JUMP_REG_OFFSET, 3)) \
+	FORMAT(JI, ji, JITYPE_SIZE_BYTES, \
+		MASK_INST_TYPE(0x3) | MASK_IS_BRANCH | MASK_JR, MASK_INST_JTYPE | MASK_IS_JUMP | MASK_JI, \
+		"%s  0x%x\n", \
+		FIELD(ji, cond,     JCOND, JB_SHAMT, 3) \
+		WORD(ji, imm.value, IMM)) \
+	FORMAT(B, b, BTYPE_SIZE_BYTES, \
+		MASK_INST_TYPE(0x3) | MASK_IS_BRANCH, MASK_INST_JTYPE | MASK_IS_BRANCH, \
+		"%s  0x%x\n", \
+		FIELD(b, cond,      BCOND, JB_SHAMT, 3) \
+		OFFSET(b, imm.value, IMM,  0, 10))
+
+/* For expanding ISA_FORMATS with only some of its parts */
+#define ISA_IGNORE(...)
+
+/* A table entry as a string literal, after expanding the macros in it */
+#define ISA_STR(...) ISA_STR_(__VA_ARGS__)
+#define ISA_STR_(...) #__VA_ARGS__
+
+/* Mask of `width' bits starting at bit `shift' */
+#define ISA_BITS(shift, width) (((1u << (width)) - 1) << (shift))
+
+/**
+ * Values used for software-only identification instruction types. Values not
+ * tied to machine language. Guaranteed unique.
+ */
+#define ISA_INST_TYPE(name, member, size, mask, match, syntax, fields) \
+	INST_TYPE_##name,
+enum INST_TYPE {
+	ISA_FORMATS(ISA_INST_TYPE, ISA_IGNORE, ISA_IGNORE, ISA_IGNORE)
+};
+
+/* Number of INST_TYPE_*, kept out of the enum so switches need not handle it */
+#define ISA_INST_ONE(name, member, size, mask, match, syntax, fields) + 1
+#define INST_TYPE_COUNT (0 ISA_FORMATS(ISA_INST_ONE, ISA_IGNORE, ISA_IGNORE, ISA_IGNORE))
+
+/* Bytes taken by each INST_TYPE_*, as an array initialiser */
+#define ISA_INST_SIZE(name, member, size, mask, match, syntax, fields) \
+	[INST_TYPE_##name] = size,
+#define ISA_INST_SIZES { ISA_FORMATS(ISA_INST_SIZE, ISA_IGNORE, ISA_IGNORE, ISA_IGNORE) }
+
+/* Name of each INST_TYPE_*, as an array initialiser */
+#define ISA_INST_NAME(name, member, size, mask, match, syntax, fields) \
+	[INST_TYPE_##name] = #name,
+#define ISA_INST_NAMES { ISA_FORMATS(ISA_INST_NAME, ISA_IGNORE, ISA_IGNORE, ISA_IGNORE) }
+
 #endif /* INSTRUCTION_H */
@@ -5,66 +5,35 @@
 #include "parse.h"
 #include "util.h"
 
-static size_t inst_sizes[] = {
-	[INST_TYPE_R] = 2,
-	[INST_TYPE_NI] = 2,
-	[INST_TYPE_WI] = 4,
-	[INST_TYPE_JR] = 2,
-	[INST_TYPE_JI] = 4,
-	[INST_TYPE_B] = 2,
-};
-
-void emit_single_r_type(FILE *f, struct r_type inst)
-{
-	const char *oper = get_asm_from_oper(inst.oper);
-	const char *dest = get_asm_from_reg(inst.dest);
-	const char *left = get_asm_from_reg(inst.left);
-	const char *right = get_asm_from_reg(inst.right);
-
-	fprintf(f, "%s  %s, %s, %s\n", oper, dest, left, right);
-}
-
-void emit_single_i_type(FILE *f, struct i_type inst)
-{
-	const char *oper = get_asm_from_oper(inst.oper);
-	const char *dest = get_asm_from_reg(inst.dest);
-	const char *left = get_asm_from_reg(inst.left);
-
-	fprintf(f, "%si %s, %s, 0x%x\n", oper, dest, left, inst.imm.value);
-}
-
-/*void emit_single_wi_type(FILE *f, struct i_type inst)
-{
-	const char *oper = get_asm_from_oper(inst.oper);
-	const char *dest = get_asm_from_oper(inst.dest);
-	const char *left = get_asm_from_oper(inst.left);
-
-	fprintf(f, "%si %s, %s, 0x%s\n", oper, dest, left, inst.imm.value);
-}*/
-
-void emit_single_ji_type(FILE *f, struct ji_type inst)
-{
-	const char *cond = get_asm_from_j(inst.cond);
-
-	fprintf(f, "%s  0x%x\n", cond, inst.imm.value);
-}
-
-void emit_single_jr_type(FILE *f, struct jr_type inst)
+static size_t inst_sizes[] = ISA_INST_SIZES;
+
+/* Printing expansions of ISA_FORMATS: each format's syntax, given its fields
+ * as text or numbers according to their kind */
+#define PRINT_OPER(x)  get_asm_from_oper(x)
+#define PRINT_REG(x)   get_asm_from_reg(x)
+#define PRINT_JCOND(x) get_asm_from_j(x)
+#define PRINT_BCOND(x) get_asm_from_b(x)
+#define PRINT_IMM(x)   (x)
+#define PRINT_FIELD(member, field, kind, shift, width) \
+	, PRINT_##kind(inst->inst.member.field)
+#define PRINT_WORD(member, field, kind) \
+	PRINT_FIELD(member, field, kind, 0, 16)
+#define PRINT_OFFSET PRINT_FIELD
+#define PRINT_FORMAT(name, member, size, mask, match, syntax, fields) \
+	case INST_TYPE_##name: \
+		fprintf(f, syntax fields); \
+		break;
+
+void emit_single(FILE *f, const struct instruction *inst)
 {
-	const char *cond = get_asm_from_j(inst.cond);
-	const char *reg = get_asm_from_reg(inst.reg);
-
-	fprintf(f, "%s  %s\n", cond, reg);
-}
-
-void emit_single_b_type(FILE *f, struct b_type inst)
-{
-	const char *cond = get_asm_from_b(inst.cond);
-
-	fprintf(f, "%s  0x%x\n", cond, inst.imm.value);
+	switch (inst->type) {
+		ISA_FORMATS(PRINT_FORMAT, PRINT_FIELD, PRINT_WORD, PRINT_OFFSET)
+		default:
+			fprintf(stderr, "Internal error: unhandled instruction type\n");
+			break;
+	}
 }
 
-
 int look_up_label(struct label *labels, size_t labels_count, uint16_t *val, const char *label)
 {
 	size_t i = 0;
@@ -84,38 +53,28 @@ int look_up_label(struct label *labels, size_t labels_count, uint16_t *val, cons
 int output_single(FILE *f, size_t *cur_byte, struct label *labels, size_t labels_count, struct instruction inst)
 {
 	switch (inst.type) {
-		case INST_TYPE_R:
-			emit_single_r_type(f, inst.inst.r);
-			break;
 		case INST_TYPE_NI:
 		case INST_TYPE_WI:
 			if (   inst.inst.i.imm_is_ident
 			    && look_up_label(labels, labels_count, &inst.inst.i.imm.value, inst.inst.i.imm.label))
 				return 1;
-
-			emit_single_i_type(f, inst.inst.i);
-			break;
-		case INST_TYPE_JR:
-			emit_single_jr_type(f, inst.inst.jr);
 			break;
 		case INST_TYPE_JI:
 			if (   inst.inst.ji.imm_is_ident
 			    && look_up_label(labels, labels_count, &inst.inst.ji.imm.value, inst.inst.ji.imm.label))
 				return 1;
-
-			emit_single_ji_type(f, inst.inst.ji);
 			break;
 		case INST_TYPE_B:
 			if (   inst.inst.b.imm_is_ident
 			    && look_up_label(labels, labels_count, &inst.inst.b.imm.value, inst.inst.b.imm.label))
 				return 1;
-			emit_single_b_type(f, inst.inst.b);
 			break;
 		default:
-			fprintf(stderr, "Internal error: unhandled instruction type\n");
 			break;
 	}
 
+	emit_single(f, &inst);
+
 	*cur_byte += inst_sizes[inst.type];
 
 	return 0;
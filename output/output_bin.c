@@ -4,99 +4,46 @@
 
 #include "parse.h"
 
-static size_t cur_byte;
-
-int generate_single_r_type(uint32_t *dest, struct r_type inst)
-{
-	uint32_t i = 0;
-
-	i |= MASK_INST_RTYPE;
-	i |= MASK_OPER(inst.oper);
-	i |= MASK_REG_DEST(inst.dest);
-	i |= MASK_REG_LEFT(inst.left);
-	i |= MASK_REG_RIGHT(inst.right);
-
-	*dest = i;
-	return 1;
-}
-int generate_single_ni_type(uint32_t *dest, struct i_type inst)
-{
-	uint32_t i = 0;
-
-	i |= MASK_INST_NITYPE;
-	i |= MASK_OPER(inst.oper);
-	i |= MASK_REG_DEST(inst.dest);
-	i |= MASK_REG_LEFT(inst.left);
-	i |= MASK_NI_IMM(inst.imm.value);
-
-	*dest = i;
-	return 1;
-}
-
-int generate_single_wi_type(uint32_t *dest, struct i_type inst)
-{
-	uint32_t i = 0;
-
-	i |= MASK_INST_WITYPE;
-	i |= MASK_OPER(inst.oper);
-	i |= MASK_REG_DEST(inst.dest);
-	i |= MASK_REG_LEFT(inst.left);
-
-	/* two-word instruction - make room for the immediate */
-	i <<= 16;
-
-	i |= inst.imm.value;
-
-	*dest = i;
-	return 2;
-}
-
-int generate_single_ji_type(uint32_t *dest, struct ji_type inst)
-{
-	uint32_t i = 0;
-
-	i |= MASK_INST_JTYPE;
-	i |= MASK_IS_JUMP;
-	i |= MASK_JB_COND(inst.cond);
-	i |= MASK_JI;
-
-	/* two-word instruction - make room for the immediate */
-	i <<= 16;
-
-	i |= inst.imm.value;
-
-	*dest = i;
-	return 2;
-}
-
-int generate_single_jr_type(uint32_t *dest, struct jr_type inst)
-{
-	uint32_t i = 0;
-
-	i |= MASK_INST_JTYPE;
-	i |= MASK_IS_JUMP;
-	i |= MASK_JB_COND(inst.cond);
-	i |= MASK_JR;
-	i |= MASK_JUMP_REGISTER(inst.reg);
+/* Write raw bytes, rather than words in text for debugging */
+#define RAW
 
-	*dest = i;
-	return 1;
-}
+static size_t cur_byte;
 
-int generate_single_b_type(uint32_t *dest, struct b_type inst)
+/* Encoding expansions of ISA_FORMATS: the match bits of the instruction's
+ * format, with each field packed in */
+#define ENCODE_FIELD(member, field, kind, shift, width) \
+	word |= ((uint32_t)inst->inst.member.field << (shift)) & ISA_BITS(shift, width);
+#define ENCODE_WORD(member, field, kind) \
+	extra = inst->inst.member.field;
+#define ENCODE_OFFSET ENCODE_FIELD
+#define ENCODE_FORMAT(name, member, size, mask, match, syntax, fields) \
+	case INST_TYPE_##name: \
+		word = (match); \
+		fields \
+		len = (size) / 2; \
+		break;
+
+/**
+ * Encode `inst' into *dest, as one word or as two with the first in the high
+ * half. Returns the number of words
+ */
+int generate_single(uint32_t *dest, const struct instruction *inst)
 {
-	uint32_t i = 0;
+	uint32_t word = 0;
+	uint16_t extra = 0;
+	int len = 0;
 
-	i |= MASK_INST_JTYPE;
-	i |= MASK_IS_BRANCH;
-	i |= MASK_JB_COND(inst.cond);
-	i |= MASK_B_OFFSET(inst.imm.value);
+	switch (inst->type) {
+		ISA_FORMATS(ENCODE_FORMAT, ENCODE_FIELD, ENCODE_WORD, ENCODE_OFFSET)
+		default:
+			fprintf(stderr, "Internal error: unhandled instruction type\n");
+			return 0;
+	}
 
-	*dest = i;
-	return 1;
+	*dest = len == 2 ? word << 16 | extra : word;
+	return len;
 }
 
-
 int look_up_label(struct label *labels, size_t labels_count, uint16_t *val, const char *label)
 {
 	size_t i = 0;
@@ -113,73 +60,85 @@ int look_up_label(struct label *labels, size_t labels_count, uint16_t *val, cons
 	return 1;
 }
 
-int output_single(FILE *f, struct label *labels, size_t labels_count, struct instruction inst)
+/**
+ * Replace the label references of `inst' with the labels' values. Branch
+ * targets stay absolute. Returns non-zero if a label is undefined
+ */
+int output_resolve(struct label *labels, size_t labels_count, struct instruction *inst)
 {
-	int len = 0;
-	uint32_t i = 0;
-
-	switch (inst.type) {
-		case INST_TYPE_R:
-			len = generate_single_r_type(&i, inst.inst.r);
-			break;
+	switch (inst->type) {
 		case INST_TYPE_NI:
-			if (   inst.inst.i.imm_is_ident
-			    && look_up_label(labels, labels_count, &inst.inst.i.imm.value, inst.inst.i.imm.label))
-				return 1;
-
-			len = generate_single_ni_type(&i, inst.inst.i);
-			break;
 		case INST_TYPE_WI:
-			if (   inst.inst.i.imm_is_ident
-			    && look_up_label(labels, labels_count, &inst.inst.i.imm.value, inst.inst.i.imm.label))
+			if (   inst->inst.i.imm_is_ident
+			    && look_up_label(labels, labels_count, &inst->inst.i.imm.value, inst->inst.i.imm.label))
 				return 1;
-
-			len = generate_single_wi_type(&i, inst.inst.i);
-			break;
-		case INST_TYPE_JR:
-			len = generate_single_jr_type(&i, inst.inst.jr);
+			inst->inst.i.imm_is_ident = false;
 			break;
 		case INST_TYPE_JI:
-			if (   inst.inst.ji.imm_is_ident
-			    && look_up_label(labels, labels_count, &inst.inst.ji.imm.value, inst.inst.ji.imm.label))
+			if (   inst->inst.ji.imm_is_ident
+			    && look_up_label(labels, labels_count, &inst->inst.ji.imm.value, inst->inst.ji.imm.label))
 				return 1;
-
-			len = generate_single_ji_type(&i, inst.inst.ji);
+			inst->inst.ji.imm_is_ident = false;
 			break;
 		case INST_TYPE_B:
-			if (   inst.inst.b.imm_is_ident
-			    && look_up_label(labels, labels_count, &inst.inst.b.imm.value, inst.inst.b.imm.label))
+			if (   inst->inst.b.imm_is_ident
+			    && look_up_label(labels, labels_count, &inst->inst.b.imm.value, inst->inst.b.imm.label))
 				return 1;
-			inst.inst.b.imm.value -= cur_byte;
-			if (inst.inst.b.imm.value % 2 != 0) {
-				fprintf(stderr, "Internal error: branch offset %d not a multiple of 2\n", inst.inst.b.imm.value);
-			}
-			inst.inst.b.imm.value /= 2;
-
-			len = generate_single_b_type(&i, inst.inst.b);
+			inst->inst.b.imm_is_ident = false;
 			break;
 		default:
-			fprintf(stderr, "Internal error: unhandled instruction type\n");
 			break;
 	}
 
-	if (len == 2) {
-#define RAW
-#ifdef RAW
-		fputc(0xFF & (i >> 24), f);
-		fputc(0xFF & (i >> 16), f);
-#else
-		fprintf(f, "%04x ", i >> 16);
-#endif
+	return 0;
+}
+
+/**
+ * Encode `inst', the instruction at cur_byte, into `bytes'. Returns the
+ * number of bytes, or zero on error
+ */
+static int encode_single(uint8_t *bytes, struct label *labels, size_t labels_count, struct instruction inst)
+{
+	int len = 0;
+	uint32_t i = 0;
+
+	if (output_resolve(labels, labels_count, &inst))
+		return 0;
+	if (inst.type == INST_TYPE_B) {
+		inst.inst.b.imm.value -= cur_byte;
+		if (inst.inst.b.imm.value % 2 != 0) {
+			fprintf(stderr, "Internal error: branch offset %d not a multiple of 2\n", inst.inst.b.imm.value);
+		}
+		inst.inst.b.imm.value /= 2;
+	}
+
+	if ((len = generate_single(&i, &inst)) == 2) {
+		*bytes++ = 0xFF & (i >> 24);
+		*bytes++ = 0xFF & (i >> 16);
 	}
+	*bytes++ = 0xFF & (i >> 8);
+	*bytes++ = 0xFF & (i >> 0);
+
+	cur_byte += 2 * len;
+	return 2 * len;
+}
+
+int output_single(FILE *f, struct label *labels, size_t labels_count, struct instruction inst)
+{
+	uint8_t bytes[4];
+	int len = 0;
+
+	if ((len = encode_single(bytes, labels, labels_count, inst)) == 0)
+		return 1;
+
 #ifdef RAW
-	fputc(0xFF & (i >> 8), f);
-	fputc(0xFF & (i >> 0), f);
+	fwrite(bytes, 1, len, f);
 #else
-	fprintf(f, "%04x ", 0xFFFF & i);
+	if (len == 4)
+		fprintf(f, "%04x ", bytes[0] << 8 | bytes[1]);
+	fprintf(f, "%04x ", bytes[len - 2] << 8 | bytes[len - 1]);
 #endif
 
-	cur_byte += 2 * len;
 	return 0;
 }
 
@@ -198,3 +157,29 @@ int output_bin(FILE *fout, struct label *labels, size_t label_count, struct inst
 
 	return 0;
 }
+
+/**
+ * As output_bin(), into the `size' bytes at `buf' instead of a file, with the
+ * number of bytes written in *used. Returns non-zero if they do not fit
+ */
+int output_bin_mem(uint8_t *buf, size_t size, size_t *used, struct label *labels, size_t label_count,
+	struct instruction *insts, size_t insts_count)
+{
+	uint8_t bytes[4];
+	size_t i = 0;
+	int len = 0;
+	cur_byte = 0;
+
+	for (i = 0; i < insts_count; i++) {
+		if ((len = encode_single(bytes, labels, label_count, insts[i])) == 0)
+			return 1;
+		if (cur_byte > size) {
+			fprintf(stderr, "Program larger than %zd bytes of memory\n", size);
+			return 1;
+		}
+		memcpy(buf + cur_byte - len, bytes, len);
+	}
+
+	*used = cur_byte;
+	return 0;
+}
@@ -1,6 +1,14 @@
 #ifndef OUTPUT_H
 #define OUTPUT_H
 
+#include <stdio.h>
+#include <stdint.h>
+
+#include "parse.h"
+
+int output_resolve(struct label *labels, size_t labels_count, struct instruction *inst);
 int output_bin(FILE *fout, struct label *labels, size_t label_count, struct instruction *insts, size_t insts_count);
+int output_bin_mem(uint8_t *buf, size_t size, size_t *used, struct label *labels, size_t label_count,
+	struct instruction *insts, size_t insts_count);
 
 #endif /* OUTPUT_H */
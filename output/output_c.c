@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "parse.h"
+#include "util.h"
+
+/**
+ * Static translation of a decoded program into a C translation unit which,
+ * when compiled and run, prints the same register dump as the emulator.
+ *
+ * Every guest basic block becomes a labelled run of C statements, with direct
+ * jumps and branches turned into gotos. Jumps through registers go via a
+ * dispatch switch over every instruction address in the program. A jump which
+ * lands inside an instruction falls back to decoding and running the stream
+ * there from a copy of the image, one instruction at a time, until it lands
+ * back on an instruction the translation knows.
+ */
+
+static size_t inst_sizes[] = ISA_INST_SIZES;
+
+/* ISA_OPERS and ISA_CONDS as C over the generated program's variables */
+#define SHIFT(x, op, n) ((n) < 16 ? (x) op (n) : 0)
+#define BIT(x, n) (((x) >> (n)) & 1)
+#define BOTH(a, b) ((a) && (b))
+#define MUL_HI(a, b) ((uint32_t)(a) * (b) >> 16)
+#define ALWAYS 1
+#define NOT(a) !(a)
+#define EITHER(a, b) (a) || (b)
+#define ZF zf
+#define CF cf
+
+/* Each ALU operation on `l' and `r', and its carry, as the emulator defines
+ * them. Flags are computed after every operation and left to the C compiler
+ * to drop where nothing reads them */
+#define C_RESULT(name, value, mnemonic, result, carry) \
+	[OPER_##name] = ISA_STR(result),
+static const char *c_results[] = {
+	ISA_OPERS(C_RESULT)
+};
+
+#define C_CARRY(name, value, mnemonic, result, carry) \
+	[OPER_##name] = ISA_STR(carry),
+static const char *c_carries[] = {
+	ISA_OPERS(C_CARRY)
+};
+
+#define C_COND(name, value, jump, branch, test) \
+	[JB_##name] = ISA_STR(test),
+static const char *c_conds[] = {
+	ISA_CONDS(C_COND)
+};
+
+/* Index of the instruction starting at byte `pc', or -1 if there is none */
+static long inst_at(const size_t *offsets, size_t insts_count, uint16_t pc)
+{
+	size_t lo = 0;
+	size_t hi = insts_count;
+	size_t mid = 0;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (offsets[mid] == pc)
+			return mid;
+		if (offsets[mid] < pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+/**
+ * goto the block at `target', or leave the program if that is past the end.
+ * A target inside an instruction goes through the dispatcher, which runs the
+ * stream there interpreted
+ */
+static void emit_goto(FILE *f, const size_t *offsets, size_t insts_count, size_t end, uint16_t target)
+{
+	if (target >= end)
+		fprintf(f, "{ pc = 0x%x; goto halt; }\n", target);
+	else if (inst_at(offsets, insts_count, target) < 0)
+		fprintf(f, "{ pc = 0x%x; goto dispatch; }\n", target);
+	else
+		fprintf(f, "goto L_%04x;\n", target);
+}
+
+static void emit_alu(FILE *f, enum OPER oper, enum REG dest, enum REG left, const char *right)
+{
+	fprintf(f, "\tl = r%d;\n", left);
+	fprintf(f, "\tr = %s;\n", right);
+	fprintf(f, "\tres = %s;\n", c_results[oper]);
+	fprintf(f, "\tzf = (res == 0);\n");
+	fprintf(f, "\tcf = %s;\n", c_carries[oper]);
+	if (dest != REG_0 && dest != REG_H)
+		fprintf(f, "\tr%d = res;\n", dest);
+}
+
+static int emit_single(FILE *f, const size_t *offsets, size_t insts_count, size_t end, struct instruction inst)
+{
+	char right[16];
+
+	switch (inst.type) {
+		case INST_TYPE_R:
+			fprintf(f, "\t/* %s %s, %s, %s */\n",
+				get_asm_from_oper(inst.inst.r.oper),
+				get_asm_from_reg(inst.inst.r.dest),
+				get_asm_from_reg(inst.inst.r.left),
+				get_asm_from_reg(inst.inst.r.right));
+			snprintf(right, sizeof(right), "r%d", inst.inst.r.right);
+			emit_alu(f, inst.inst.r.oper, inst.inst.r.dest, inst.inst.r.left, right);
+			break;
+		case INST_TYPE_NI:
+		case INST_TYPE_WI:
+			fprintf(f, "\t/* %si %s, %s, 0x%x */\n",
+				get_asm_from_oper(inst.inst.i.oper),
+				get_asm_from_reg(inst.inst.i.dest),
+				get_asm_from_reg(inst.inst.i.left),
+				inst.inst.i.imm.value);
+			snprintf(right, sizeof(right), "0x%x", inst.inst.i.imm.value);
+			emit_alu(f, inst.inst.i.oper, inst.inst.i.dest, inst.inst.i.left, right);
+			break;
+		case INST_TYPE_JR:
+			fprintf(f, "\t/* %s %s */\n",
+				get_asm_from_j(inst.inst.jr.cond),
+				get_asm_from_reg(inst.inst.jr.reg));
+			fprintf(f, "\tif (%s) { pc = r%d; goto dispatch; }\n",
+				c_conds[inst.inst.jr.cond], inst.inst.jr.reg);
+			break;
+		case INST_TYPE_JI:
+			fprintf(f, "\t/* %s 0x%x */\n",
+				get_asm_from_j(inst.inst.ji.cond), inst.inst.ji.imm.value);
+			fprintf(f, "\tif (%s) ", c_conds[inst.inst.ji.cond]);
+			emit_goto(f, offsets, insts_count, end, inst.inst.ji.imm.value);
+			break;
+		case INST_TYPE_B:
+			fprintf(f, "\t/* %s 0x%x */\n",
+				get_asm_from_b(inst.inst.b.cond), inst.inst.b.imm.value);
+			fprintf(f, "\tif (%s) ", c_conds[inst.inst.b.cond]);
+			emit_goto(f, offsets, insts_count, end, inst.inst.b.imm.value);
+			break;
+		default:
+			fprintf(stderr, "Internal error: unhandled instruction type\n");
+			return 1;
+	}
+
+	return 0;
+}
+
+static int is_jump(const struct instruction *inst)
+{
+	return inst->type == INST_TYPE_JR
+	    || inst->type == INST_TYPE_JI
+	    || inst->type == INST_TYPE_B;
+}
+
+/**
+ * Mark every instruction which starts a basic block: the first instruction,
+ * every direct jump target, and every instruction following a jump. Direct
+ * jump targets are also marked as needing a label. Returns whether any direct
+ * jump lands inside the program but not on an instruction
+ */
+static bool find_leaders(bool *leader, bool *labelled, const size_t *offsets, struct instruction *insts, size_t insts_count,
+	size_t end)
+{
+	size_t i = 0;
+	long t = 0;
+	uint16_t target = 0;
+	bool stray = false;
+
+	if (insts_count)
+		leader[0] = true;
+
+	for (i = 0; i < insts_count; i++) {
+		if (!is_jump(&insts[i]))
+			continue;
+
+		if (i + 1 < insts_count)
+			leader[i + 1] = true;
+
+		if (insts[i].type == INST_TYPE_JI)
+			target = insts[i].inst.ji.imm.value;
+		else if (insts[i].type == INST_TYPE_B)
+			target = insts[i].inst.b.imm.value;
+		else
+			continue;
+
+		if ((t = inst_at(offsets, insts_count, target)) >= 0)
+			leader[t] = labelled[t] = true;
+		else if (target < end)
+			stray = true;
+	}
+
+	return stray;
+}
+
+/* The operands of an instruction of format `type', from its first word `w'
+ * and the word after it `x' */
+static void emit_operands(FILE *f, enum INST_TYPE type)
+{
+	switch (type) {
+		case INST_TYPE_R:
+			fprintf(f, "\t\tr = REG(w >> %d & 7);\n", REG_RIGHT_OFFSET);
+			break;
+		case INST_TYPE_NI:
+			fprintf(f, "\t\tr = w & 0x%x;\n", ISA_BITS(0, 5));
+			break;
+		case INST_TYPE_WI:
+			fprintf(f, "\t\tr = x;\n");
+			break;
+		case INST_TYPE_JR:
+			fprintf(f, "\t\tx = REG(w >> %d & 7);\n", JUMP_REG_OFFSET);
+			break;
+		case INST_TYPE_JI:
+			break;
+		case INST_TYPE_B:
+			/* a signed 10-bit count of 16-bit words */
+			fprintf(f, "\t\tx = pc + 2 * ((w & 0x3ff) ^ 0x200) - 0x400;\n");
+			break;
+	}
+}
+
+#define EMIT_STEP(name, member, size, mask, match, syntax, fields) \
+	fprintf(f, "\tif ((w & 0x%x) == 0x%x) {\n", (mask), (match)); \
+	emit_operands(f, INST_TYPE_##name); \
+	fprintf(f, "\t\tpc += %d;\n", (size)); \
+	fprintf(f, "\t\tgoto %s;\n\t}\n", \
+		INST_TYPE_##name == INST_TYPE_R || INST_TYPE_##name == INST_TYPE_NI || INST_TYPE_##name == INST_TYPE_WI \
+		? "step_alu" : "step_jump");
+
+/**
+ * The fallback of the dispatcher, for a pc inside an instruction of the
+ * translation: decode and run the instruction there as the emulator would, and
+ * dispatch again, until the stream lands back on a translated instruction
+ */
+static void emit_interpreter(FILE *f)
+{
+	size_t i = 0;
+
+	fprintf(f, "\tw = AT(pc) << 8 | AT(pc + 1);\n");
+	fprintf(f, "\tx = AT(pc + 2) << 8 | AT(pc + 3);\n");
+	ISA_FORMATS(EMIT_STEP, ISA_IGNORE, ISA_IGNORE, ISA_IGNORE)
+	fprintf(f, "\treturn 1;\n");
+
+	fprintf(f, "step_alu:\n");
+	fprintf(f, "\tl = REG(w >> %d & 7);\n", REG_LEFT_OFFSET);
+	fprintf(f, "\tswitch (w >> %d & 7) {\n", OPER_SHAMT);
+	for (i = 0; i < sizeof(c_results) / sizeof(*c_results); i++)
+		fprintf(f, "\t\tcase %zd: res = %s; cf = %s; break;\n", i, c_results[i], c_carries[i]);
+	fprintf(f, "\t}\n");
+	fprintf(f, "\tzf = (res == 0);\n");
+	fprintf(f, "\tswitch (w >> %d & 7) {\n", REG_DEST_OFFSET);
+	for (i = REG_1; i < REG_H; i++)
+		fprintf(f, "\t\tcase %zd: r%zd = res; break;\n", i, i);
+	fprintf(f, "\t}\n");
+	fprintf(f, "\tgoto dispatch;\n");
+
+	fprintf(f, "step_jump:\n");
+	fprintf(f, "\tswitch (w >> %d & 7) {\n", JB_SHAMT);
+	for (i = 0; i < sizeof(c_conds) / sizeof(*c_conds); i++)
+		fprintf(f, "\t\tcase %zd: if (%s) pc = x; break;\n", i, c_conds[i]);
+	fprintf(f, "\t}\n");
+	fprintf(f, "\tgoto dispatch;\n");
+}
+
+/* The guest image as an array, and its registers by number, for the fallback
+ * of the dispatcher */
+static void emit_image(FILE *f, const uint8_t *image, size_t image_size)
+{
+	size_t i = 0;
+
+	fprintf(f, "static const uint8_t image[%zd] = {", image_size ? image_size : 1);
+	for (i = 0; i < image_size; i++)
+		fprintf(f, "%s0x%02x,", i % 12 ? " " : "\n\t", image[i]);
+	fprintf(f, "\n};\n\n");
+	fprintf(f, "#define AT(a) ((uint16_t)(a) < %zd ? image[(uint16_t)(a)] : 0)\n", image_size);
+	fprintf(f, "#define REG(n) ((n) == 0 ? r0 : (n) == 1 ? r1 : (n) == 2 ? r2 : (n) == 3 ? r3 : \\\n"
+		"\t(n) == 4 ? r4 : (n) == 5 ? r5 : (n) == 6 ? r6 : r7)\n\n");
+}
+
+int output_c(FILE *fout, struct label *labels, size_t label_count, struct instruction *insts, size_t insts_count,
+	const uint8_t *image, size_t image_size)
+{
+	int ret = 1;
+	size_t i = 0;
+	size_t end = 0;
+	size_t *offsets = NULL;
+	bool *leader = NULL;
+	bool *labelled = NULL;
+	bool dispatch = false;
+
+	(void)labels;
+	(void)label_count;
+
+	offsets = calloc(insts_count + 1, sizeof(*offsets));
+	leader = calloc(insts_count + 1, sizeof(*leader));
+	labelled = calloc(insts_count + 1, sizeof(*labelled));
+	if (!offsets || !leader || !labelled) {
+		perror("calloc");
+		goto out;
+	}
+
+	for (i = 0; i < insts_count; i++) {
+		offsets[i] = end;
+		end += inst_sizes[insts[i].type];
+		dispatch |= (insts[i].type == INST_TYPE_JR);
+	}
+
+	/* register jumps, and direct jumps into instructions, go via a dispatcher */
+	dispatch |= find_leaders(leader, labelled, offsets, insts, insts_count, end);
+
+	fprintf(fout,
+		"/* Generated by bin2c. Guest program of %zd bytes, %zd instructions */\n"
+		"#include <stdio.h>\n"
+		"#include <stdint.h>\n"
+		"\n",
+		end, insts_count);
+	if (dispatch)
+		emit_image(fout, image, image_size);
+	fprintf(fout,
+		"int main(void)\n"
+		"{\n"
+		"\tuint16_t r0 = 0, r1 = 0, r2 = 0, r3 = 0, r4 = 0, r5 = 0, r6 = 0, r7 = 0xffff;\n"
+		"\tuint16_t l = 0, r = 0, res = 0;\n"
+		"\tuint16_t pc = 0;\n"
+		"\tint zf = 0;\n"
+		"\tint cf = 0;\n"
+		"\n"
+		"\t(void)l;\n"
+		"\t(void)r;\n"
+		"\t(void)res;\n"
+		"\t(void)zf;\n"
+		"\t(void)cf;\n");
+	if (dispatch)
+		fprintf(fout, "\tuint16_t w = 0, x = 0;\n");
+
+	for (i = 0; i < insts_count; i++) {
+		if (leader[i])
+			fprintf(fout, "\n/* block 0x%04zx */\n", offsets[i]);
+		/* any instruction may be the target of a register jump, or where
+		 * an interpreted stream lands */
+		if (labelled[i] || dispatch)
+			fprintf(fout, "L_%04zx:\n", offsets[i]);
+		if (emit_single(fout, offsets, insts_count, end, insts[i]))
+			goto out;
+	}
+	fprintf(fout, "\tpc = 0x%zx;\n\tgoto halt;\n", end);
+
+	if (dispatch) {
+		fprintf(fout, "\ndispatch:\n");
+		fprintf(fout, "\tif (pc >= 0x%zx)\n\t\tgoto halt;\n", end);
+		fprintf(fout, "\tswitch (pc) {\n");
+		for (i = 0; i < insts_count; i++)
+			fprintf(fout, "\t\tcase 0x%zx: goto L_%04zx;\n", offsets[i], offsets[i]);
+		fprintf(fout, "\t}\n");
+		emit_interpreter(fout);
+	}
+
+	fprintf(fout,
+		"\nhalt:\n"
+		"\tprintf(\n"
+		"\t\t\"Registers:\\n\"\n"
+		"\t\t\"pc: 0x%%x (%%d)\\n\"\n"
+		"\t\t\"$0: 0x%%x (%%d)\\n\"\n"
+		"\t\t\"$1: 0x%%x (%%d)\\n\"\n"
+		"\t\t\"$2: 0x%%x (%%d)\\n\"\n"
+		"\t\t\"$3: 0x%%x (%%d)\\n\"\n"
+		"\t\t\"$4: 0x%%x (%%d)\\n\"\n"
+		"\t\t\"$5: 0x%%x (%%d)\\n\"\n"
+		"\t\t\"$6: 0x%%x (%%d)\\n\"\n"
+		"\t\t\"$H: 0x%%x (%%d)\\n\",\n"
+		"\t\tpc, pc, r0, r0, r1, r1, r2, r2, r3, r3, r4, r4, r5, r5, r6, r6, r7, r7);\n"
+		"\treturn 0;\n"
+		"}\n");
+
+	ret = 0;
+out:
+	free(offsets);
+	free(leader);
+	free(labelled);
+	return ret;
+}
@@ -0,0 +1,7 @@
+#ifndef OUTPUT_C_H
+#define OUTPUT_C_H
+
+int output_c(FILE *fout, struct label *labels, size_t label_count, struct instruction *insts, size_t insts_count,
+	const uint8_t *image, size_t image_size);
+
+#endif /* OUTPUT_C_H */
@@ -0,0 +1,22 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "parse.h"
+#include "output/output_map.h"
+
+/**
+ * Write the label map: one `<address> <label>' line per label, in the order
+ * they were defined, for tools which name addresses in a binary
+ */
+int output_map(FILE *fout, const struct label *labels, size_t label_count)
+{
+	size_t i = 0;
+
+	for (i = 0; i < label_count; i++)
+		if (fprintf(fout, "0x%04zx %s\n", labels[i].byte_offset, labels[i].name) < 0) {
+			perror("fprintf");
+			return 1;
+		}
+
+	return 0;
+}
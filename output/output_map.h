@@ -0,0 +1,10 @@
+#ifndef OUTPUT_MAP_H
+#define OUTPUT_MAP_H
+
+#include <stdio.h>
+
+#include "parse.h"
+
+int output_map(FILE *fout, const struct label *labels, size_t label_count);
+
+#endif /* OUTPUT_MAP_H */
@@ -0,0 +1,78 @@
+#!/bin/bash -e
+
+#
+# Script for running all of the automated tests that involve the static
+# binary translator.
+# Each emulator test program is translated to C, compiled, and run. The
+# native program must print exactly the same register dump as the emulator.
+#
+
+fail() {
+	echo -e '[\e[1;31mFAIL\e[0m] '"$1:" "$2"
+	has_failure=1
+}
+
+pass() {
+	echo -e '[\e[1;32mPASS\e[0m] '"$1"
+}
+
+clean() {
+	echo "Removing work dir $WORK"
+	rm -r "$WORK"
+}
+
+if [ "$1" == "noclean" ]; then
+	NO_CLEAN=1
+else
+	NO_CLEAN=0
+fi
+WORK=$(mktemp -d)
+pushd $(dirname "$0") >/dev/null
+source ../valgrind.sh
+export ASM="$PWD/../../assembler"
+export EMUL="$PWD/../../emulator"
+export BIN2C="$PWD/../../bin2c"
+CC="${CC:-cc}"
+has_failure=0
+
+for asmfile in ../emul/*.asm ; do
+	t=$(basename "$asmfile" .asm)
+	binfile="$WORK/${t}.bin"
+	cfile="$WORK/${t}.c"
+	exe="$WORK/${t}"
+
+	# The translation of a guest which never halts would never finish either
+	if grep -q '^;\s\+EXIT\s\+' "$asmfile" ; then
+		continue
+	fi
+
+	if ! "$ASM" "$asmfile" "$binfile" ; then
+		fail "$t" "test assembly failed"
+		continue
+	fi
+
+	if ! $VALGRIND $VALGRIND_OPTS "$BIN2C" "$binfile" "$cfile" ; then
+		fail "$t" "translation failed"
+		continue
+	fi
+
+	if ! $CC -O2 -Wall -Werror -o "$exe" "$cfile" ; then
+		fail "$t" "compiling translation failed"
+		continue
+	fi
+
+	if diff <("$EMUL" "$binfile") <("$exe") >/dev/null ; then
+		pass "$t"
+	else
+		fail "$t" "register dump mismatch"
+	fi
+done
+popd >/dev/null
+
+if [[ "$failure" != "0" && "$NO_CLEAN" == "1"  ]] ; then
+	echo "Warning: Leaving work dir $WORK in place. Please remove this yourself"
+else
+	clean
+fi
+
+exit "$has_failure"
@@ -0,0 +1,9 @@
+; Branch target must not depend on where the branch itself sits
+; POST $1 = 0x0
+; POST $2 = 0x3
+ldi $1, 3
+ldi $2, 0
+loop:
+	addi $2, $2, 1
+	subi $1, $1, 1
+	bnz loop
@@ -0,0 +1,18 @@
+; Jumps through registers and to immediates, taken and not taken
+; POST $1 = 0xa
+; POST $2 = 0x5
+; POST $3 = 0x1
+; POST $4 = 0x0
+ldi $1, skip
+ldi $2, 5
+jmp $1
+ldi $2, 7
+skip:
+ldi $3, 1
+subi $0, $3, 1
+jnz fail
+jz done
+fail:
+ldi $4, 1
+done:
+ldi $1, 10
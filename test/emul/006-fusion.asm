@@ -0,0 +1,21 @@
+; Idioms the threaded engine fuses, including jumps into the middle of them
+; POST $1 = 0x0
+; POST $2 = 0x6
+; POST $3 = 0xf
+; POST $4 = 0x3
+; POST $5 = 0x1
+ldi $1, 3
+ldi $0, 9
+add $2, $2, $0
+loop:
+	addi $4, $4, 1
+	ldi $5, 5
+	add $3, $3, $5
+	subi $1, $1, 1
+	bnz loop
+ldi $2, 6
+sub $0, $2, $2
+jz mid
+ldi $5, 9
+mid:
+ldi $5, 1
@@ -0,0 +1,104 @@
+; Carry out of add, sub, shl, shr and mul. Each check shifts a bit into $6,
+; set if its condition holds; 32-bit add of 0x0001fff0 + 0x00000011 in $2:$1
+; POST $1 = 0x1
+; POST $2 = 0x2
+; POST $4 = 0x0
+; POST $6 = 0x1763
+subi $1, $H, 15
+ldi $2, 1
+addi $1, $1, 0x11
+bnc nocarry
+addi $2, $2, 1
+nocarry:
+; 1 - 2 borrows
+ldi $3, 1
+subi $0, $3, 2
+bnc l1
+ori $6, $6, 1
+l1:
+; 2 - 1 does not
+shli $6, $6, 1
+ldi $3, 2
+subi $0, $3, 1
+bnc l2
+ori $6, $6, 1
+l2:
+; 0x8001 << 1 shifts out a one ...
+shli $6, $6, 1
+ldi $3, 1
+shli $3, $3, 15
+ori $3, $3, 1
+shli $0, $3, 1
+bnc l3
+ori $6, $6, 1
+l3:
+; ... as does 0x8001 >> 1 ...
+shli $6, $6, 1
+shri $0, $3, 1
+bnc l4
+ori $6, $6, 1
+l4:
+; ... and 0x8001 >> 16
+shli $6, $6, 1
+ldi $5, 16
+shr $4, $3, $5
+bnc l5
+ori $6, $6, 1
+l5:
+; shifting by 17 leaves no carry
+shli $6, $6, 1
+ldi $5, 17
+shl $4, $3, $5
+bnc l6
+ori $6, $6, 1
+l6:
+; shifting by 32 shifts everything out
+shli $6, $6, 1
+ldi $5, 16
+add $5, $5, $5
+shl $0, $3, $5
+bnz l7
+ori $6, $6, 1
+l7:
+; 0x100 * 0x100 overflows
+shli $6, $6, 1
+ldi $3, 1
+shli $3, $3, 8
+mul $0, $3, $3
+bnc l8
+ori $6, $6, 1
+l8:
+; 0xff * 0xff does not
+shli $6, $6, 1
+shri $3, $H, 8
+mul $0, $3, $3
+bnc l9
+ori $6, $6, 1
+l9:
+; bitwise operations clear the carry
+shli $6, $6, 1
+addi $0, $H, 1
+andi $0, $3, 1
+bnc l10
+ori $6, $6, 1
+l10:
+; jcz family: neither flag ...
+shli $6, $6, 1
+addi $0, $3, 0
+jncz l11
+ori $6, $6, 1
+l11:
+; ... and zero
+shli $6, $6, 1
+xor $0, $3, $3
+jncz l12
+ori $6, $6, 1
+l12:
+; the carry survives a taken branch
+shli $6, $6, 1
+addi $0, $H, 1
+bra l13
+l13:
+bnc l14
+ori $6, $6, 1
+l14:
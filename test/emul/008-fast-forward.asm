@@ -0,0 +1,25 @@
+; Long counted loops, which --fast-forward skips in closed form
+; FAST-FORWARD 0x0006-0x000c 3
+; FAST-FORWARD 0x0014-0x0018 1
+; POST $1 = 0x0
+; POST $2 = 0xfff7
+; POST $3 = 0x0
+; POST $4 = 0x7fd8
+; POST $5 = 0x7
+; POST $6 = 0x0
+ldi $6, 3
+outer:
+	ldi $1, 0
+	subi $1, $1, 1
+inner:
+	addi $2, $2, 3
+	ldi $5, 7
+	subi $1, $1, 1
+	bnz inner
+	subi $6, $6, 1
+	bnz outer
+ldi $3, 16
+up:
+	addi $4, $4, 5
+	addi $3, $3, 2
+	bnz up
@@ -0,0 +1,11 @@
+; A guest which never halts, once its counter wraps round
+; EXIT 2
+ldi $1, 3
+warm:
+	addi $2, $2, 1
+	subi $1, $1, 1
+	bnz warm
+top:
+	addi $3, $3, 1
+	xori $4, $3, 5
+	bra top
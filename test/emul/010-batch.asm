@@ -0,0 +1,40 @@
+; Lanes of a batch take different paths through the same program: $3 adds 3
+; on each of $1 trips round the loop, $4 is set if $1 is odd, and $6 if adding
+; $H to $5 carries
+; POST $3 = 0x0
+; POST $4 = 0x0
+; POST $6 = 0x0
+; LANE 0
+; LANE 5
+; LANE 4 0 0 0 9
+; LANE 31 3
+; LANE-POST 0 $3 = 0x0
+; LANE-POST 0 $4 = 0x0
+; LANE-POST 0 $6 = 0x0
+; LANE-POST 1 $2 = 0x0
+; LANE-POST 1 $3 = 0xf
+; LANE-POST 1 $4 = 0x1
+; LANE-POST 1 $6 = 0x0
+; LANE-POST 2 $3 = 0xc
+; LANE-POST 2 $4 = 0x0
+; LANE-POST 2 $5 = 0x9
+; LANE-POST 2 $6 = 0x1
+; LANE-POST 3 $1 = 0x1f
+; LANE-POST 3 $2 = 0x0
+; LANE-POST 3 $3 = 0x5d
+; LANE-POST 3 $4 = 0x1
+add $2, $1, $0
+bz done
+loop:
+	addi $3, $3, 3
+	subi $2, $2, 1
+	bnz loop
+done:
+andi $0, $1, 1
+bz even
+ori $4, $4, 1
+even:
+add $0, $5, $H
+bnc nocarry
+ldi $6, 1
+nocarry:
@@ -0,0 +1,10 @@
+; A guest which never halts, going round a cycle of odd period 131073: with
+; the state compared only a slice apart, it would take 2^29 instructions to find
+; EXIT 2
+top:
+	ldi $1, 0
+	subi $1, $1, 1
+inner:
+	subi $1, $1, 1
+	bnz inner
+	bra top
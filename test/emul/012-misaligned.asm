@@ -0,0 +1,16 @@
+; Jumps into the middle of an instruction: the second word of `jn' is run as
+; the instruction it encodes, `addi $2, $2, 7' (0x4247), first through a
+; register and then directly, before the stream lands back on `addi $3'
+; POST $1 = 0x6
+; POST $2 = 0xe
+; POST $3 = 0x2
+; POST $4 = 0x1
+ldi $1, 6
+jmp $1
+jn 0x4247
+addi $3, $3, 1
+subi $0, $3, 2
+jz done
+jmp 6
+done:
+ldi $4, 1
@@ -5,7 +5,9 @@
 # and emulator.
 # These tests are assembly files with postconditions for registers specified
 # in special syntax within comments. They contain code to run, and the post-
-# conditions are checked in order to determine the test result.
+# conditions are checked in order to determine the test result. Runs which
+# fast-forward must also report skipping each loop a FAST-FORWARD line gives,
+# as many times as it says the loop is entered.
 #
 
 fail() {
@@ -16,6 +18,168 @@ pass() {
 	echo -e '[\e[1;32mPASS\e[0m] '"$1"
 }
 
+# Check postconditions read from stdin against the registers dumped in $2
+check_posts() {
+	(echo '; POST $0 = 0' ;
+	 echo '; POST $H = 0xFFFF' ;
+	 cat ) | while read line ; do
+		reg=$(awk -F= '{print $1}' <<< "$line" | awk '{print $(NF)}')
+		val=$(awk -F= '{print $2}' <<< "$line"| awk '{print $1}')
+		subtest="$1:${reg}"
+		# Scrape output of emulator for register value
+		actual=$(grep "$reg" "$2" | awk '{print $2}')
+		if [[ "$actual" -eq "$val" ]]; then
+			pass "$subtest"
+		else
+			fail "$subtest" "postcondition (expect $val, got $actual)"
+			has_failure=1
+		fi
+	done
+}
+
+# Run the test in the batch engine, or as $1 is fork, as forks of a snapshot.
+# Its lanes are the test's LANE lines, of initial values for $1, $2 and so on,
+# each checked against its LANE-POST lines; or else three lanes checked against
+# the postconditions, forked unchanged a few instructions in
+run_lanes() {
+	local run="$1"
+	local lanes="$WORK/$(sed -e "s/\.asm$/.$run.lanes/" <<< "$asmfile")"
+	local outfile="$WORK/$(sed -e "s/\.asm$/.$run.out/" <<< "$asmfile")"
+	local label="Lane"
+	local opts="--batch"
+	local actual_exit=0
+	local lane=0
+
+	if grep -q '^;\s\+LANE\s\+' "$asmfile" ; then
+		grep '^;\s\+LANE\s\+' "$asmfile" | sed -e 's/^;\s\+LANE\s\+//' > "$lanes"
+	else
+		printf '0\n0\n0\n' > "$lanes"
+	fi
+	if [[ "$run" == "fork" ]] ; then
+		label="Fork"
+		if grep -q '^;\s\+LANE\s\+' "$asmfile" ; then
+			opts="--fork"
+			awk '{ for (i = 1; i <= NF; i++) printf "$%d=%s ", i, $i; print "" }' "$lanes" > "$lanes.forks"
+		else
+			opts="--at 3 --fork"
+			sed -e 's/.*//' "$lanes" > "$lanes.forks"
+		fi
+		lanes="$lanes.forks"
+	fi
+
+	$VALGRIND $VALGRIND_OPTS "$EMUL" $opts "$lanes" "$binfile" > "$outfile" 2>&1 || actual_exit=$?
+	if [[ -n "$expect_exit" ]] ; then
+		if [[ "$actual_exit" -eq "$expect_exit" ]]; then
+			pass "${asmfile}[$run]:exit"
+		else
+			fail "${asmfile}[$run]:exit" "exit code (expect $expect_exit, got $actual_exit)"
+			has_failure=1
+		fi
+		return
+	fi
+	if [[ "$actual_exit" -ne 0 ]] ; then
+		fail "${asmfile}[$run]" "non-zero exit code"
+		has_failure=1
+		return
+	fi
+
+	for ((lane = 0; lane < $(wc -l < "$lanes"); lane++)); do
+		awk -v lane="$label $lane:" '$0 == lane { f = 1; next } /^(Lane|Fork) / { f = 0 } f' "$outfile" > "$outfile.$lane"
+		if grep -q '^;\s\+LANE\s\+' "$asmfile" ; then
+			grep "^;\s\+LANE-POST\s\+$lane\s\+" "$asmfile" | sed -e 's/LANE-POST\s\+[0-9]\+/POST/'
+		else
+			grep '^;\s\+POST\s\+' "$asmfile"
+		fi | check_posts "${asmfile}[${run}:${lane}]" "$outfile.$lane"
+	done
+}
+
+# Run the test on four harts sharing its RAM, freely and then in lockstep.
+# Every hart but the first starts with its index in $1, so only the first is
+# checked against the postconditions
+run_harts() {
+	local outfile=""
+	local actual_exit=0
+	local mode=""
+
+	for mode in free lockstep ; do
+		outfile="$WORK/$(sed -e "s/\.asm$/.harts-$mode.out/" <<< "$asmfile")"
+		actual_exit=0
+		if [[ "$mode" == "lockstep" ]] ; then
+			$VALGRIND $VALGRIND_OPTS "$EMUL" --harts 4 --lockstep 7 "$binfile" > "$outfile" 2>&1 || actual_exit=$?
+		else
+			$VALGRIND $VALGRIND_OPTS "$EMUL" --harts 4 "$binfile" > "$outfile" 2>&1 || actual_exit=$?
+		fi
+		if [[ -n "$expect_exit" ]] ; then
+			if [[ "$actual_exit" -eq "$expect_exit" ]]; then
+				pass "${asmfile}[harts:$mode]:exit"
+			else
+				fail "${asmfile}[harts:$mode]:exit" "exit code (expect $expect_exit, got $actual_exit)"
+				has_failure=1
+			fi
+			continue
+		fi
+		if [[ "$actual_exit" -ne 0 ]] ; then
+			fail "${asmfile}[harts:$mode]" "non-zero exit code"
+			has_failure=1
+			continue
+		fi
+		awk '$0 == "Hart 0:" { f = 1; next } /^Hart / { f = 0 } f' "$outfile" > "$outfile.0"
+		grep '^;\s\+POST\s\+' "$asmfile" | check_posts "${asmfile}[harts:$mode]" "$outfile.0"
+	done
+}
+
+# Run every test listed in $WORK/manifest at once, in the emulation farm or
+# the scheduler as given by $1 and the options following it, each checked
+# against its postconditions, or for a cycle if it never halts
+run_manifest() {
+	local run="$1"
+	local outfile="$WORK/$run.out"
+	local binfile=""
+	local line=""
+
+	shift
+	if ! $VALGRIND $VALGRIND_OPTS "$EMUL" "$@" "$WORK/manifest" > "$outfile" ; then
+		fail "$run" "non-zero exit code"
+		has_failure=1
+		return
+	fi
+
+	while read binfile ; do
+		asmfile="$(basename "$binfile" .bin).asm"
+		line=$(grep -F "\"program\": \"$binfile\"" "$outfile")
+		status=$(sed -e 's/.*"status": "\([a-z]*\)".*/\1/' <<< "$line")
+		if grep -q '^;\s\+EXIT\s\+2' "$asmfile" ; then
+			if [[ "$status" == "cycle" ]]; then
+				pass "${asmfile}[${run}]:cycle"
+			else
+				fail "${asmfile}[${run}]:cycle" "status (expect cycle, got $status)"
+				has_failure=1
+				continue
+			fi
+			# found within a few times the instructions before the cycle and
+			# its period, plus a slice or so, whatever the period
+			count=$(sed -e 's/.*"instructions": \([0-9]*\).*/\1/' <<< "$line")
+			bound=$(sed -e 's/.*"entry": \([0-9]*\), "period": \([0-9]*\).*/4 * (\1 + \2 + 4096)/' <<< "$line")
+			if (( count <= bound )) ; then
+				pass "${asmfile}[${run}]:found"
+			else
+				fail "${asmfile}[${run}]:found" "cycle found late ($count instructions, expect at most $((bound)))"
+				has_failure=1
+			fi
+			continue
+		fi
+		if [[ "$status" != "halt" ]]; then
+			fail "${asmfile}[${run}]" "status (expect halt, got $status)"
+			has_failure=1
+			continue
+		fi
+		# registers in the form of the emulator's dump
+		sed -e 's/.*"registers": \[\([^]]*\)\].*/\1/' <<< "$line" | tr ',' '\n' |
+			awk '{ printf "$%s: %s\n", NR == 8 ? "H" : NR - 1, $1 }' > "$WORK/$asmfile.$run.out"
+		grep '^;\s\+POST\s\+' "$asmfile" | check_posts "${asmfile}[${run}]" "$WORK/$asmfile.$run.out"
+	done < "$WORK/manifest"
+}
+
 clean() {
 	echo "Removing work dir $WORK"
 	rm -r "$WORK"
@@ -26,37 +190,129 @@ pushd $(dirname "$0") >/dev/null
 source ../valgrind.sh
 export ASM="$PWD/../../assembler"
 export EMUL="$PWD/../../emulator"
+export ASMRUN="$PWD/../../asmrun"
+# Each entry is an engine name, optionally followed by colon-separated options,
+# batch for several lanes at once in the batch engine, fork for them as forks
+# of a snapshot, restore for a run carried on from a snapshot, harts for
+# several harts sharing its RAM, asmrun for the source assembled and run in one
+# go, or farm or sched for all the tests at once in the emulation farm or the
+# scheduler. By default, every engine the emulator lists as built, the
+# reference and JIT engines fast-forwarding too, and then each of the others
+if [[ -z "$ENGINES" ]] ; then
+	ENGINES=$("$EMUL" 2>&1 | sed -n -e 's/^Engines (default ref): //p' | sed -e 's/,//g')
+	for engine in ref jit ; do
+		if grep -qw "$engine" <<< "$ENGINES" ; then
+			ENGINES="$ENGINES $engine:--fast-forward"
+		fi
+	done
+	ENGINES="$ENGINES batch fork restore harts asmrun farm sched"
+fi
 has_failure=0
 
 for asmfile in *.asm ; do
 	binfile="$WORK/$(sed -e 's/\.asm$/.bin/' <<< "$asmfile")"
-	outfile="$WORK/$(sed -e 's/\.asm$/.out/' <<< "$asmfile")"
 	# Assemble test code
 	if ! "$ASM" "$asmfile" "$binfile" ; then
 		fail "$asmfile" "test assembly failed"
 		continue
 	fi
 
-	if $VALGRIND $VALGRIND_OPTS "$EMUL" "$binfile" > "$outfile" ; then
-		# Each postcondition line must hold true, and forms a separate test to
-		# help track down failures
-		(echo '; POST $0 = 0' ;
-		 echo '; POST $H = 0xFFFF' ;
-		 grep '^;\s\+POST\s\+' "$asmfile" ) | while read line ; do
-			reg=$(awk -F= '{print $1}' <<< "$line" | awk '{print $(NF)}')
-			val=$(awk -F= '{print $2}' <<< "$line"| awk '{print $1}')
-			subtest="${asmfile}:${reg}"
-			# Scrape output of emulator for register value
-			actual=$(grep "$reg" "$outfile" | awk '{print $2}')
-			if [[ "$actual" -eq "$val" ]]; then
-				pass "$subtest"
+	echo "$binfile" >> "$WORK/manifest"
+
+	# Tests of guests which never halt give the expected exit code instead of
+	# postconditions
+	expect_exit=$(grep '^;\s\+EXIT\s\+' "$asmfile" | awk '{print $3}')
+
+	postfile="$WORK/$(sed -e 's/\.asm$/.post/' <<< "$asmfile")"
+	(echo '; POST $0 = 0' ;
+	 echo '; POST $H = 0xFFFF' ;
+	 grep '^;\s\+POST\s\+' "$asmfile" || true) > "$postfile"
+
+	# Every engine must agree with the postconditions
+	for run in $ENGINES ; do
+		if [[ "$run" == "batch" || "$run" == "fork" ]] ; then
+			run_lanes "$run"
+			continue
+		fi
+		if [[ "$run" == "harts" ]] ; then
+			run_harts
+			continue
+		fi
+		if [[ "$run" == "farm" || "$run" == "sched" ]] ; then
+			continue
+		fi
+		engine="${run%%:*}"
+		opts=$(sed -e 's/^[^:]*:\?//' -e 's/:/ /g' <<< "$run")
+		outfile="$WORK/$(sed -e "s/\.asm$/.${run}.out/" <<< "$asmfile")"
+		input="$binfile"
+		prog="$EMUL"
+		if [[ "$run" == "asmrun" ]] ; then
+			# assembled and run in one go, decoded straight from the parse
+			prog="$ASMRUN"
+			engine=threaded
+			input="$asmfile"
+			opts="--from-parse"
+		fi
+		if [[ "$run" == "restore" ]] ; then
+			# snapshot a few instructions in, then carry on from there
+			engine=ref
+			input="$WORK/$(sed -e 's/\.asm$/.snap/' <<< "$asmfile")"
+			"$EMUL" --at 5 --save "$input" "$binfile" > /dev/null 2>&1 || true
+			opts="--restore"
+		fi
+		if [[ -n "$expect_exit" ]] ; then
+			actual_exit=0
+			$VALGRIND $VALGRIND_OPTS "$prog" -e "$engine" $opts "$input" > "$outfile" 2>&1 || actual_exit=$?
+			if [[ "$actual_exit" -eq "$expect_exit" ]]; then
+				pass "${asmfile}[${run}]:exit"
 			else
-				fail "$subtest" "postcondition (expect $val, got $actual)"
+				fail "${asmfile}[${run}]:exit" "exit code (expect $expect_exit, got $actual_exit)"
 				has_failure=1
 			fi
-		done
-	else
-		fail "$asmfile" "non-zero exit code"
+			continue
+		fi
+		# The emulator checks the postconditions itself, each a separate test to
+		# help track down failures; exit code 3 is only some of them failing
+		actual_exit=0
+		errfile="$WORK/$(sed -e "s/\.asm$/.${run}.err/" <<< "$asmfile")"
+		$VALGRIND $VALGRIND_OPTS "$prog" -e "$engine" --check-post "$postfile" $opts "$input" > "$outfile" \
+			2> "$errfile" || actual_exit=$?
+		cat "$errfile" >&2
+		if [[ "$actual_exit" -ne 0 && "$actual_exit" -ne 3 ]] ; then
+			fail "${asmfile}[${run}]" "non-zero exit code"
+			has_failure=1
+			continue
+		fi
+		# The final state is the same whether loops are skipped or not, so each
+		# loop a FAST-FORWARD line gives must be reported skipped as well, once
+		# for every time it is entered
+		if [[ "$opts" == *--fast-forward* ]] ; then
+			while read loop times ; do
+				if grep -q "^fast-forwarded loop $loop: $times times," "$errfile" ; then
+					pass "${asmfile}[${run}]:$loop"
+				else
+					fail "${asmfile}[${run}]:$loop" "loop not fast-forwarded $times times"
+					has_failure=1
+				fi
+			done < <(grep '^;\s\+FAST-FORWARD\s\+' "$asmfile" | awk '{print $3, $4}')
+		fi
+		while read verdict reg rest ; do
+			if [[ "$verdict" == "PASS" ]] ; then
+				pass "${asmfile}[${run}]:$reg"
+			else
+				fail "${asmfile}[${run}]:$reg" "postcondition ($rest)"
+				has_failure=1
+			fi
+		done < "$outfile"
+	done
+done
+
+for run in $ENGINES ; do
+	if [[ "$run" == "farm" ]] ; then
+		run_manifest farm -j 4 --farm
+	elif [[ "$run" == "sched" ]] ; then
+		# a short quantum, to switch often
+		run_manifest sched --quantum 7 --sched
 	fi
 done
 popd >/dev/null
@@ -0,0 +1,12 @@
+; A maze for the fuzzer: past two gates on the initial $1 and $2 the guest
+; goes round in circles, and otherwise it halts
+; HANGS 1
+	subi $0, $1, 3
+	bnz out
+	subi $0, $2, 5
+	bnz out
+stuck:
+	addi $3, $3, 1
+	bra stuck
+out:
+	addi $4, $4, 1
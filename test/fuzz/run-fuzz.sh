@@ -0,0 +1,117 @@
+#!/bin/bash -e
+
+#
+# Script for running all of the automated tests that involve the fuzzer.
+# Each test program here is fuzzed on its registers alone, and then on its
+# image bytes too. Every input kept must halt when restored, every hang found
+# on the registers must go round in circles, and with a HANGS line giving
+# the number of hangs expected, the fuzzer must find that many.
+#
+
+fail() {
+	echo -e '[\e[1;31mFAIL\e[0m] '"$1:" "$2"
+	has_failure=1
+}
+
+pass() {
+	echo -e '[\e[1;32mPASS\e[0m] '"$1"
+}
+
+clean() {
+	echo "Removing work dir $WORK"
+	rm -r "$WORK"
+}
+
+# Check that every snapshot in $2 of the kind $3 exits with code $4 restored
+check_restored() {
+	local snap=""
+	local actual_exit=0
+
+	for snap in "$2"/"$3"-*.snap ; do
+		actual_exit=0
+		"$EMUL" --restore "$snap" -d none >/dev/null 2>&1 || actual_exit=$?
+		if [[ "$actual_exit" -ne "$4" ]] ; then
+			fail "$1:$(basename "$snap")" "exit code (expect $4, got $actual_exit)"
+			return
+		fi
+	done
+	pass "$1:$3"
+}
+
+if [ "$1" == "noclean" ]; then
+	NO_CLEAN=1
+else
+	NO_CLEAN=0
+fi
+WORK=$(mktemp -d)
+pushd $(dirname "$0") >/dev/null
+source ../valgrind.sh
+export ASM="$PWD/../../assembler"
+export EMUL="$PWD/../../emulator"
+has_failure=0
+
+# Runs on the registers alone, and with the image bytes too: the latter keep
+# far more inputs, each saved with the whole of RAM
+REGISTER_EXECS=20000
+IMAGE_EXECS=2000
+
+for asmfile in *.asm ; do
+	t=$(basename "$asmfile" .asm)
+	binfile="$WORK/${t}.bin"
+
+	if ! "$ASM" "$asmfile" "$binfile" ; then
+		fail "$t" "test assembly failed"
+		continue
+	fi
+	expect_hangs=$(grep '^;\s\+HANGS\s\+' "$asmfile" | awk '{print $3}')
+
+	for run in registers image ; do
+		dir="$WORK/${t}.${run}"
+		opts=""
+		execs="$IMAGE_EXECS"
+		if [[ "$run" == "registers" ]] ; then
+			opts="--mutate 0:0"
+			execs="$REGISTER_EXECS"
+		fi
+		if ! $VALGRIND $VALGRIND_OPTS "$EMUL" --fuzz "$dir" --execs "$execs" $opts "$binfile" > "$dir.out" ; then
+			fail "${t}[${run}]" "non-zero exit code"
+			continue
+		fi
+		if ! grep -q "^executions: $execs\$" "$dir.out" ; then
+			fail "${t}[${run}]" "executions (expect $execs)"
+			continue
+		fi
+		pass "${t}[${run}]"
+
+		# runs are repeatable, the mutations being pseudo-random
+		"$EMUL" --fuzz "$dir.again" --execs "$execs" $opts "$binfile" > "$dir.again.out"
+		if diff <(grep -v 'per second' "$dir.out") <(grep -v 'per second' "$dir.again.out") >/dev/null &&
+		   diff -r "$dir" "$dir.again" >/dev/null ; then
+			pass "${t}[${run}]:repeat"
+		else
+			fail "${t}[${run}]:repeat" "second run differs"
+		fi
+
+		check_restored "${t}[${run}]" "$dir" queue 0
+		if [[ "$run" == "registers" ]] ; then
+			if compgen -G "$dir/hang-*.snap" >/dev/null ; then
+				check_restored "${t}[${run}]" "$dir" hang 2
+			fi
+			hangs=$(awk '/^unique hangs:/ { print $3 }' "$dir.out")
+			if [[ -n "$expect_hangs" && "$hangs" -ne "$expect_hangs" ]] ; then
+				fail "${t}[${run}]:hangs" "unique hangs (expect $expect_hangs, got $hangs)"
+			elif [[ -n "$expect_hangs" ]] ; then
+				pass "${t}[${run}]:hangs"
+			fi
+		fi
+	done
+done
+popd >/dev/null
+
+if [[ "$failure" != "0" && "$NO_CLEAN" == "1"  ]] ; then
+	echo "Warning: Leaving work dir $WORK in place. Please remove this yourself"
+else
+	clean
+fi
+
+exit "$has_failure"
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emul/toycpu.h"
+
+/**
+ * Run a program through libtoycpu and print its registers as the emulator
+ * does. As `run', in slices of the engine's; as `step', one instruction at a
+ * time; as `until', from one breakpoint at the final pc to the next; as
+ * `rewind', as `run' recording its history, then going back through it and
+ * forward again in various ways, each of which must end as the run did
+ */
+
+static const char *names[TOYCPU_REG_COUNT] = { "$0", "$1", "$2", "$3", "$4", "$5", "$6", "$H" };
+
+/* Run to the end again, which must be `end' instructions in */
+static int run_to(struct toycpu *cpu, uint64_t end, const char *how)
+{
+	enum toycpu_exit e = TOYCPU_EXIT_BUDGET;
+
+	while ((e = toycpu_run(cpu, 1000)) == TOYCPU_EXIT_BUDGET)
+		;
+	if (e != TOYCPU_EXIT_HALT || toycpu_icount(cpu) != end) {
+		fprintf(stderr, "Rewind: %s, then %s after %llu instructions\n", how, toycpu_exit_name(e),
+			(unsigned long long)toycpu_icount(cpu));
+		return 1;
+	}
+	return 0;
+}
+
+/* Go back from the end of a recorded run in every way there is */
+static int go_back(struct toycpu *cpu)
+{
+	uint64_t end = toycpu_icount(cpu);
+	enum toycpu_exit e = TOYCPU_EXIT_BUDGET;
+	uint16_t value = 0;
+	unsigned reg = 0;
+
+	e = toycpu_reverse_step(cpu);
+	if (e != (end ? TOYCPU_EXIT_BUDGET : TOYCPU_EXIT_START) || toycpu_icount(cpu) != (end ? end - 1 : 0)) {
+		fprintf(stderr, "Rewind: reverse step from %llu: %s\n", (unsigned long long)end, toycpu_exit_name(e));
+		return 1;
+	}
+	if (run_to(cpu, end, "reverse step"))
+		return 1;
+
+	/* back to where each register was last set, which one step must set */
+	for (reg = 1; reg < TOYCPU_REG_H; reg++) {
+		value = toycpu_get_reg(cpu, reg);
+		e = toycpu_reverse_watch(cpu, reg);
+		if (e == TOYCPU_EXIT_BREAK && (toycpu_get_reg(cpu, reg) == value ||
+		    toycpu_step(cpu) == TOYCPU_EXIT_ERROR || toycpu_get_reg(cpu, reg) != value)) {
+			fprintf(stderr, "Rewind: %s not set at %llu\n", names[reg], (unsigned long long)toycpu_icount(cpu));
+			return 1;
+		}
+		if ((e != TOYCPU_EXIT_BREAK && e != TOYCPU_EXIT_START) || run_to(cpu, end, "reverse watch"))
+			return 1;
+	}
+
+	e = toycpu_reverse_continue(cpu, 0);
+	if ((e != TOYCPU_EXIT_BREAK || toycpu_get_pc(cpu) != 0) && e != TOYCPU_EXIT_START) {
+		fprintf(stderr, "Rewind: reverse continue to 0: %s at 0x%x\n", toycpu_exit_name(e), toycpu_get_pc(cpu));
+		return 1;
+	}
+	if (run_to(cpu, end, "reverse continue"))
+		return 1;
+
+	if (toycpu_goto(cpu, end / 2) || toycpu_icount(cpu) != end / 2) {
+		fprintf(stderr, "Rewind: cannot go to %llu\n", (unsigned long long)end / 2);
+		return 1;
+	}
+	return run_to(cpu, end, "goto");
+}
+
+int main(int argc, char **argv)
+{
+	static unsigned char image[TOYCPU_RAM_SIZE];
+	struct toycpu *cpu = NULL;
+	enum toycpu_exit e = TOYCPU_EXIT_BUDGET;
+	FILE *f = NULL;
+	size_t len = 0;
+	unsigned reg = 0;
+	uint16_t end = 0;
+
+	if (argc != 4) {
+		fprintf(stderr, "Syntax: %s <engine> {run|step|until|rewind} <in.bin>\n", argv[0]);
+		return 1;
+	}
+	if ((f = fopen(argv[3], "rb")) == NULL) {
+		perror("fopen");
+		return 1;
+	}
+	len = fread(image, 1, sizeof(image), f);
+	fclose(f);
+
+	if ((cpu = toycpu_create(argv[1])) == NULL)
+		return 1;
+	/* checkpoints close enough together to be thinned out */
+	if (!strcmp(argv[2], "rewind") && toycpu_record(cpu, 3, 4))
+		return 1;
+	if (toycpu_load(cpu, image, len))
+		return 1;
+
+	if (!strcmp(argv[2], "step")) {
+		while ((e = toycpu_step(cpu)) == TOYCPU_EXIT_BUDGET)
+			;
+	} else if (!strcmp(argv[2], "until")) {
+		/* programs end by running off the end, one byte past their last */
+		end = len;
+		while ((e = toycpu_run_until(cpu, end, 1000)) == TOYCPU_EXIT_BUDGET)
+			;
+		if (e == TOYCPU_EXIT_BREAK)
+			e = toycpu_run(cpu, 1);
+	} else {
+		while ((e = toycpu_run(cpu, 1000)) == TOYCPU_EXIT_BUDGET)
+			;
+		if (e == TOYCPU_EXIT_HALT && !strcmp(argv[2], "rewind") && go_back(cpu))
+			return 1;
+	}
+	if (e != TOYCPU_EXIT_HALT) {
+		fprintf(stderr, "Stopped: %s\n", toycpu_exit_name(e));
+		return 1;
+	}
+
+	printf("Registers:\n");
+	printf("pc: 0x%x (%d)\n", toycpu_get_pc(cpu), toycpu_get_pc(cpu));
+	for (reg = 0; reg < TOYCPU_REG_COUNT; reg++)
+		printf("%s: 0x%x (%d)\n", names[reg], toycpu_get_reg(cpu, reg), toycpu_get_reg(cpu, reg));
+
+	toycpu_destroy(cpu);
+	return 0;
+}
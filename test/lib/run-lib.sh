@@ -0,0 +1,79 @@
+#!/bin/bash -e
+
+#
+# Script for running all of the automated tests that involve the emulator
+# library.
+# A small program linked against libtoycpu runs each emulator test program
+# through the library's API. It must print exactly the same register dump as
+# the emulator, whether linked statically or dynamically, and after going back
+# through its recorded history and forward again.
+#
+
+fail() {
+	echo -e '[\e[1;31mFAIL\e[0m] '"$1:" "$2"
+	has_failure=1
+}
+
+pass() {
+	echo -e '[\e[1;32mPASS\e[0m] '"$1"
+}
+
+clean() {
+	echo "Removing work dir $WORK"
+	rm -r "$WORK"
+}
+
+if [ "$1" == "noclean" ]; then
+	NO_CLEAN=1
+else
+	NO_CLEAN=0
+fi
+WORK=$(mktemp -d)
+pushd $(dirname "$0") >/dev/null
+source ../valgrind.sh
+export ASM="$PWD/../../assembler"
+export EMUL="$PWD/../../emulator"
+TOP="$PWD/../.."
+CC="${CC:-cc}"
+has_failure=0
+
+if ! $CC -I"$TOP" -Wall -Werror -o "$WORK/lib-dump-static" lib-dump.c "$TOP/libtoycpu.a" -pthread ||
+   ! $CC -I"$TOP" -Wall -Werror -o "$WORK/lib-dump-shared" lib-dump.c -L"$TOP" -ltoycpu -pthread ; then
+	fail "lib-dump" "compiling against the library failed"
+	exit 1
+fi
+export LD_LIBRARY_PATH="$TOP${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}"
+
+for asmfile in ../emul/*.asm ; do
+	t=$(basename "$asmfile" .asm)
+	binfile="$WORK/${t}.bin"
+
+	# Guests which never halt are left to the emulator's own tests
+	if grep -q '^;\s\+EXIT\s\+' "$asmfile" ; then
+		continue
+	fi
+
+	if ! "$ASM" "$asmfile" "$binfile" ; then
+		fail "$t" "test assembly failed"
+		continue
+	fi
+	"$EMUL" "$binfile" > "$WORK/${t}.out"
+
+	for run in static:ref:run shared:jit:run shared:block:step static:threaded:until static:ref:rewind shared:jit:rewind ; do
+		IFS=: read link engine mode <<< "$run"
+		if diff "$WORK/${t}.out" <($VALGRIND $VALGRIND_OPTS "$WORK/lib-dump-$link" "$engine" "$mode" "$binfile") >/dev/null ; then
+			pass "${t}[${run}]"
+		else
+			fail "${t}[${run}]" "register dump mismatch"
+		fi
+	done
+done
+popd >/dev/null
+
+if [[ "$failure" != "0" && "$NO_CLEAN" == "1"  ]] ; then
+	echo "Warning: Leaving work dir $WORK in place. Please remove this yourself"
+else
+	clean
+fi
+
+exit "$has_failure"
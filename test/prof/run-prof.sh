@@ -0,0 +1,104 @@
+#!/bin/bash -e
+
+#
+# Script for running all of the automated tests that involve the profiler.
+# Each emulator test program is assembled with its label map and run with a
+# profile kept, exactly and sampled. The guest must end as it does without
+# one, and the folded stacks must account for the instructions it ran: all
+# of them when exact, and all but those after the last sample when sampled.
+#
+
+fail() {
+	echo -e '[\e[1;31mFAIL\e[0m] '"$1:" "$2"
+	has_failure=1
+}
+
+pass() {
+	echo -e '[\e[1;32mPASS\e[0m] '"$1"
+}
+
+clean() {
+	echo "Removing work dir $WORK"
+	rm -r "$WORK"
+}
+
+if [ "$1" == "noclean" ]; then
+	NO_CLEAN=1
+else
+	NO_CLEAN=0
+fi
+WORK=$(mktemp -d)
+pushd $(dirname "$0") >/dev/null
+source ../valgrind.sh
+export ASM="$PWD/../../assembler"
+export EMUL="$PWD/../../emulator"
+has_failure=0
+
+# Sample interval, and the most instructions after the last sample: samples
+# are between half and one and a half intervals apart
+INTERVAL=7
+SLACK=11
+
+for asmfile in ../emul/*.asm ; do
+	t=$(basename "$asmfile" .asm)
+	binfile="$WORK/${t}.bin"
+	mapfile="$WORK/${t}.map"
+
+	if ! "$ASM" --map "$mapfile" "$asmfile" "$binfile" ; then
+		fail "$t" "test assembly failed"
+		continue
+	fi
+
+	# Guests which never halt are profiled until found going round in circles
+	expect_exit=0
+	if grep -q '^;\s\+EXIT\s\+' "$asmfile" ; then
+		expect_exit=$(grep '^;\s\+EXIT\s\+' "$asmfile" | awk '{print $3}')
+	fi
+	actual_exit=0
+	"$EMUL" -d json "$binfile" > "$WORK/${t}.out" 2>/dev/null || actual_exit=$?
+	if [[ "$actual_exit" -ne "$expect_exit" ]] ; then
+		fail "$t" "exit code without a profile (expect $expect_exit, got $actual_exit)"
+		continue
+	fi
+	icount=$(sed -e 's/.*"instructions": \([0-9]*\).*/\1/' "$WORK/${t}.out")
+
+	for run in ref:1 jit:$INTERVAL block:$INTERVAL ; do
+		IFS=: read engine interval <<< "$run"
+		folded="$WORK/${t}.${engine}.folded"
+		actual_exit=0
+		$VALGRIND $VALGRIND_OPTS "$EMUL" -e "$engine" -d json -p "$folded" -I "$interval" -m "$mapfile" \
+			"$binfile" > "$WORK/${t}.${engine}.out" 2>/dev/null || actual_exit=$?
+		if [[ "$actual_exit" -ne "$expect_exit" ]] ; then
+			fail "${t}[${run}]" "exit code (expect $expect_exit, got $actual_exit)"
+			continue
+		fi
+		if [[ "$expect_exit" -eq 0 ]] && ! diff "$WORK/${t}.out" "$WORK/${t}.${engine}.out" >/dev/null ; then
+			fail "${t}[${run}]" "state mismatch"
+			continue
+		fi
+		if [[ "$expect_exit" -ne 0 ]] ; then
+			pass "${t}[${run}]"
+			continue
+		fi
+
+		counted=$(awk '{ n += $NF } END { print n + 0 }' "$folded")
+		if [[ "$interval" -eq 1 && "$counted" -ne "$icount" ]] ; then
+			fail "${t}[${run}]" "profile of $counted instructions, ran $icount"
+		elif [[ "$counted" -gt "$icount" || "$counted" -lt $((icount - SLACK)) ]] ; then
+			fail "${t}[${run}]" "profile of $counted instructions, ran $icount"
+		elif grep -v '^[^ ;]\+;0x[0-9a-f]\{4\} [0-9]\+$' "$folded" >/dev/null ; then
+			fail "${t}[${run}]" "malformed folded stack"
+		else
+			pass "${t}[${run}]"
+		fi
+	done
+done
+popd >/dev/null
+
+if [[ "$failure" != "0" && "$NO_CLEAN" == "1"  ]] ; then
+	echo "Warning: Leaving work dir $WORK in place. Please remove this yourself"
+else
+	clean
+fi
+
+exit "$has_failure"
@@ -0,0 +1,84 @@
+#!/bin/bash -e
+
+#
+# Script for running all of the automated tests that involve the runtime
+# counters. Each emulator test program is run with --stats in every engine,
+# and with fast-forwarding. The instruction mix must account for every
+# instruction retired, and every engine must count the same mix as the
+# reference interpreter. A guest which never halts is stopped once it is
+# found going round in circles, which with fast-forwarding may be elsewhere
+# in the cycle, so then only its mix must add up.
+#
+
+fail() {
+	echo -e '[\e[1;31mFAIL\e[0m] '"$1:" "$2"
+	has_failure=1
+}
+
+pass() {
+	echo -e '[\e[1;32mPASS\e[0m] '"$1"
+}
+
+clean() {
+	echo "Removing work dir $WORK"
+	rm -r "$WORK"
+}
+
+# The counters in the stats on stderr, without the host timings or the
+# engine's own stats
+counters() {
+	sed -n -e '/^instructions retired:/,/^jumps not taken:/p' "$1"
+}
+
+if [ "$1" == "noclean" ]; then
+	NO_CLEAN=1
+else
+	NO_CLEAN=0
+fi
+WORK=$(mktemp -d)
+pushd $(dirname "$0") >/dev/null
+source ../valgrind.sh
+export ASM="$PWD/../../assembler"
+export EMUL="$PWD/../../emulator"
+has_failure=0
+
+for asmfile in ../emul/*.asm ; do
+	t=$(basename "$asmfile" .asm)
+	binfile="$WORK/${t}.bin"
+
+	if ! "$ASM" "$asmfile" "$binfile" ; then
+		fail "$t" "test assembly failed"
+		continue
+	fi
+
+	for run in ref threaded jit block spec ref:--fast-forward jit:--fast-forward ; do
+		engine="${run%%:*}"
+		opts=$(sed -e 's/^[^:]*:\?//' <<< "$run")
+		stats="$WORK/${t}.${run}.stats"
+		$VALGRIND $VALGRIND_OPTS "$EMUL" -e "$engine" -s -d none $opts "$binfile" 2> "$stats" >/dev/null || true
+		counters "$stats" > "$stats.counters"
+
+		icount=$(awk '/^instructions retired:/ { print $3 }' "$stats.counters")
+		counted=$(awk '/-type:/ { n += $2 } END { print n + 0 }' "$stats.counters")
+		if [[ -z "$icount" ]] ; then
+			fail "${t}[${run}]" "no stats"
+		elif [[ "$counted" -ne "$icount" ]] ; then
+			fail "${t}[${run}]" "mix of $counted instructions, ran $icount"
+		elif [[ "$opts" == *--fast-forward* ]] && grep -q '^;\s\+EXIT\s\+2' "$asmfile" ; then
+			pass "${t}[${run}]"
+		elif ! diff "$WORK/${t}.ref.stats.counters" "$stats.counters" >/dev/null ; then
+			fail "${t}[${run}]" "mix differs from the reference interpreter's"
+		else
+			pass "${t}[${run}]"
+		fi
+	done
+done
+popd >/dev/null
+
+if [[ "$failure" != "0" && "$NO_CLEAN" == "1"  ]] ; then
+	echo "Warning: Leaving work dir $WORK in place. Please remove this yourself"
+else
+	clean
+fi
+
+exit "$has_failure"
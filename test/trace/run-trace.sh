@@ -0,0 +1,103 @@
+#!/bin/bash -e
+
+#
+# Script for running all of the automated tests that involve execution
+# traces. Each emulator test program is run with a trace kept, which must
+# leave the guest as it is without one, replay from end to end, and take the
+# guest to the same state as running it does at a few instructions along.
+#
+
+fail() {
+	echo -e '[\e[1;31mFAIL\e[0m] '"$1:" "$2"
+	has_failure=1
+}
+
+pass() {
+	echo -e '[\e[1;32mPASS\e[0m] '"$1"
+}
+
+clean() {
+	echo "Removing work dir $WORK"
+	rm -r "$WORK"
+}
+
+if [ "$1" == "noclean" ]; then
+	NO_CLEAN=1
+else
+	NO_CLEAN=0
+fi
+WORK=$(mktemp -d)
+pushd $(dirname "$0") >/dev/null
+source ../valgrind.sh
+export ASM="$PWD/../../assembler"
+export EMUL="$PWD/../../emulator"
+export TRACECAT="$PWD/../../tracecat"
+has_failure=0
+
+for asmfile in ../emul/*.asm ; do
+	t=$(basename "$asmfile" .asm)
+	binfile="$WORK/${t}.bin"
+	tracefile="$WORK/${t}.trace"
+
+	if ! "$ASM" "$asmfile" "$binfile" ; then
+		fail "$t" "test assembly failed"
+		continue
+	fi
+
+	# Guests which never halt are traced until found going round in circles
+	expect_exit=0
+	if grep -q '^;\s\+EXIT\s\+' "$asmfile" ; then
+		expect_exit=$(grep '^;\s\+EXIT\s\+' "$asmfile" | awk '{print $3}')
+	fi
+	actual_exit=0
+	"$EMUL" -d json "$binfile" > "$WORK/${t}.out" 2>/dev/null || actual_exit=$?
+	if [[ "$actual_exit" -ne "$expect_exit" ]] ; then
+		fail "$t" "exit code without a trace (expect $expect_exit, got $actual_exit)"
+		continue
+	fi
+
+	actual_exit=0
+	$VALGRIND $VALGRIND_OPTS "$EMUL" -d json --trace "$tracefile" "$binfile" > "$WORK/${t}.traced.out" 2>/dev/null ||
+		actual_exit=$?
+	if [[ "$actual_exit" -ne "$expect_exit" ]] ; then
+		fail "${t}[trace]" "exit code (expect $expect_exit, got $actual_exit)"
+		continue
+	fi
+	if ! diff "$WORK/${t}.out" "$WORK/${t}.traced.out" >/dev/null ; then
+		fail "${t}[trace]" "state mismatch"
+		continue
+	fi
+	pass "${t}[trace]"
+
+	if $VALGRIND $VALGRIND_OPTS "$TRACECAT" "$tracefile" > "$WORK/${t}.replay" ; then
+		pass "${t}[replay]"
+	else
+		fail "${t}[replay]" "replay failed"
+	fi
+
+	# the state at the start, the end and a few points between, as a snapshot
+	if [[ "$expect_exit" -ne 0 ]] ; then
+		continue
+	fi
+	icount=$(sed -e 's/.*"instructions": \([0-9]*\).*/\1/' "$WORK/${t}.out")
+	for at in 0 $((icount / 3)) $(((icount + 1) / 2)) $icount ; do
+		"$EMUL" --at "$at" --save "$WORK/${t}.${at}.snap" -d none "$binfile" >/dev/null 2>&1 || true
+		if ! $VALGRIND $VALGRIND_OPTS "$TRACECAT" --at "$at" -d none --save "$WORK/${t}.${at}.traced.snap" \
+			"$tracefile" ; then
+			fail "${t}[seek:$at]" "seek failed"
+		elif ! cmp -s "$WORK/${t}.${at}.snap" "$WORK/${t}.${at}.traced.snap" ; then
+			fail "${t}[seek:$at]" "state mismatch"
+		else
+			pass "${t}[seek:$at]"
+		fi
+	done
+done
+popd >/dev/null
+
+if [[ "$failure" != "0" && "$NO_CLEAN" == "1"  ]] ; then
+	echo "Warning: Leaving work dir $WORK in place. Please remove this yourself"
+else
+	clean
+fi
+
+exit "$has_failure"
@@ -0,0 +1,19 @@
+; A register set at the start and overwritten at the end of a long run, the
+; best part of a million instructions and many checkpoints apart
+; WATCH $4
+; OUT $4: 0x5 -> 0x0 at instruction 589829, pc 0x0012  subi $4, $4, 0x5
+; OUT $4: 0x0 -> 0x5 at instruction 0, pc 0x0000  addi $4, $0, 0x5
+; OUT $4: 0x0 since instruction 0
+ldi $4, 5
+ldi $6, 3
+outer:
+	ldi $1, 0
+	subi $1, $1, 1
+inner:
+	addi $2, $2, 3
+	subi $1, $1, 1
+	bnz inner
+	subi $6, $6, 1
+	bnz outer
+subi $4, $4, 5
+addi $3, $3, 1
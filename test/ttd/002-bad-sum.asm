@@ -0,0 +1,21 @@
+; A sum which comes out wrong, its last changes listed when the check fails
+; WATCH $3
+; OUT $3: 0x26 -> 0x28 at instruction 60, pc 0x0006  add  $3, $3, $1
+; OUT $3: 0x24 -> 0x26 at instruction 57, pc 0x0006  add  $3, $3, $1
+; OUT $3: 0x22 -> 0x24 at instruction 54, pc 0x0006  add  $3, $3, $1
+; OUT $3: 0x20 -> 0x22 at instruction 51, pc 0x0006  add  $3, $3, $1
+; OUT $3: 0x1e -> 0x20 at instruction 48, pc 0x0006  add  $3, $3, $1
+; OUT $3: 0x1c -> 0x1e at instruction 45, pc 0x0006  add  $3, $3, $1
+; OUT $3: 0x1a -> 0x1c at instruction 42, pc 0x0006  add  $3, $3, $1
+; OUT $3: 0x18 -> 0x1a at instruction 39, pc 0x0006  add  $3, $3, $1
+; OUT $3: 0x16 -> 0x18 at instruction 36, pc 0x0006  add  $3, $3, $1
+; OUT $3: 0x14 -> 0x16 at instruction 33, pc 0x0006  add  $3, $3, $1
+; EXIT 3
+; POST $3 = 0x30
+ldi $1, 2
+ldi $2, 20
+ldi $3, 0
+loop:
+	add $3, $3, $1
+	subi $2, $2, 1
+	bnz loop
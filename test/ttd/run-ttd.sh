@@ -0,0 +1,73 @@
+#!/bin/bash -e
+
+#
+# Script for running all of the automated tests that involve going back
+# through a guest's history.
+# Each test program here is run with its WATCH line's register watched, by
+# each of a few engines, and must list the changes to it given by its OUT
+# lines, and exit with the code given by its EXIT line, or 0.
+#
+
+fail() {
+	echo -e '[\e[1;31mFAIL\e[0m] '"$1:" "$2"
+	has_failure=1
+}
+
+pass() {
+	echo -e '[\e[1;32mPASS\e[0m] '"$1"
+}
+
+clean() {
+	echo "Removing work dir $WORK"
+	rm -r "$WORK"
+}
+
+if [ "$1" == "noclean" ]; then
+	NO_CLEAN=1
+else
+	NO_CLEAN=0
+fi
+WORK=$(mktemp -d)
+pushd $(dirname "$0") >/dev/null
+source ../valgrind.sh
+export ASM="$PWD/../../assembler"
+export EMUL="$PWD/../../emulator"
+has_failure=0
+
+for asmfile in *.asm ; do
+	t=$(basename "$asmfile" .asm)
+	binfile="$WORK/${t}.bin"
+
+	if ! "$ASM" "$asmfile" "$binfile" ; then
+		fail "$t" "test assembly failed"
+		continue
+	fi
+	reg=$(grep '^;\s\+WATCH\s\+' "$asmfile" | awk '{print $3}')
+	sed -n -e 's/^;\s\+OUT\s\+//p' "$asmfile" > "$WORK/${t}.expected"
+	expect_exit=0
+	if grep -q '^;\s\+EXIT\s\+' "$asmfile" ; then
+		expect_exit=$(grep '^;\s\+EXIT\s\+' "$asmfile" | awk '{print $3}')
+	fi
+
+	for engine in ref jit block ; do
+		actual_exit=0
+		$VALGRIND $VALGRIND_OPTS "$EMUL" -e "$engine" -d none -P "$asmfile" --watch "$reg" "$binfile" \
+			> "$WORK/${t}.${engine}.out" || actual_exit=$?
+		if [[ "$actual_exit" -ne "$expect_exit" ]] ; then
+			fail "${t}[${engine}]" "exit code (expect $expect_exit, got $actual_exit)"
+		elif ! diff "$WORK/${t}.expected" <(grep "^${reg/\$/\\\$}:" "$WORK/${t}.${engine}.out") >/dev/null ; then
+			fail "${t}[${engine}]" "changes to $reg mismatch"
+		else
+			pass "${t}[${engine}]"
+		fi
+	done
+done
+popd >/dev/null
+
+if [[ "$failure" != "0" && "$NO_CLEAN" == "1"  ]] ; then
+	echo "Warning: Leaving work dir $WORK in place. Please remove this yourself"
+else
+	clean
+fi
+
+exit "$has_failure"
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+
+#include "emul/emul.h"
+#include "emul/emul_dump.h"
+#include "emul/emul_snap.h"
+#include "emul/emul_trace.h"
+
+//#define DEBUG
+#include "debug.h"
+
+/**
+ * Read an execution trace written by `emulator --trace': replay it, listing
+ * every jump taken, or go to any instruction in it and print the guest's
+ * state there, or save it as a snapshot to carry on from
+ */
+
+/* Print the state after `at' instructions as `dump', saving it to `path_save'
+ * if not NULL */
+static int tracecat_at(const struct emul_trace *t, uint64_t at, enum EMUL_DUMP dump, const char *path_save)
+{
+	struct emul_context ctx;
+	struct emul_snapshot snap;
+	FILE *fsnap = NULL;
+	int ret = 0;
+
+	if (emul_trace_seek(t, at, &ctx))
+		return 1;
+	emul_dump(stdout, &ctx, dump);
+
+	if (path_save) {
+		if ((ret = emul_snapshot_take(&snap, &ctx)))
+			goto out;
+		if ((fsnap = fopen(path_save, "wb")) == NULL) {
+			fprintf(stderr, "Error opening %s: ", path_save);
+			perror("fopen");
+			ret = 1;
+		} else {
+			ret = emul_snapshot_save(&snap, fsnap);
+			fclose(fsnap);
+		}
+		emul_snapshot_free(&snap);
+	}
+
+out:
+	emul_free(&ctx);
+	return ret;
+}
+
+void print_help(const char *argv0)
+{
+	fprintf(stderr, "Syntax: %s [-q] <in.trace>\n", argv0);
+	fprintf(stderr, "        %s [-q] -a <instructions> [-d {text|json|binary|none}] [-w <snapshot>] <in.trace>\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+	int error_ret = 1;
+	int ret = 0;
+	int opt = 0;
+	const char *path_in = NULL;
+	const char *path_save = NULL;
+	bool seek = false;
+	uint64_t at = 0;
+	enum EMUL_DUMP dump = EMUL_DUMP_TEXT;
+	struct emul_trace t;
+	FILE *fin = NULL;
+	static const struct option long_opts[] = {
+		{ "at",     required_argument, NULL, 'a' },
+		{ "dump",   required_argument, NULL, 'd' },
+		{ "save",   required_argument, NULL, 'w' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, "qa:d:w:", long_opts, NULL)) != -1) {
+		switch (opt) {
+			case 'q':
+				error_ret = 0;
+				break;
+			case 'a':
+				at = strtoull(optarg, NULL, 0);
+				seek = true;
+				break;
+			case 'd':
+				if (emul_dump_format(optarg, &dump))
+					return 1;
+				break;
+			case 'w':
+				path_save = optarg;
+				break;
+			default:
+				print_help(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind != argc - 1 || (path_save && !seek)) {
+		print_help(argv[0]);
+		return 1;
+	}
+	path_in = argv[optind];
+
+	if ((fin = fopen(path_in, "rb")) == NULL) {
+		fprintf(stderr, "Error opening %s: ", path_in);
+		perror("fopen");
+		return error_ret;
+	}
+	if (emul_trace_open(&t, fin)) {
+		fclose(fin);
+		return error_ret;
+	}
+	debug("%zu chunks, instructions %llu to %llu\n", t.chunks,
+		(unsigned long long)t.index[0], (unsigned long long)t.end.icount);
+
+	if (seek)
+		ret = tracecat_at(&t, at, dump, path_save);
+	else
+		ret = emul_trace_replay(&t, stdout);
+
+	emul_trace_free(&t);
+	fclose(fin);
+	return error_ret ? ret : 0;
+}
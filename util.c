@@ -1,8 +1,10 @@
+#include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 
 #include "instruction.h"
 #include "lex.h"
+#include "util.h"
 
 /**
  * Keywords
@@ -43,54 +45,39 @@ static struct {
 /**
  * ALU operation to assembly instruction
  */
+#define OPER_TO_ASM(name, value, mnemonic, result, carry) \
+	{ .look = OPER_##name, .str = #mnemonic },
 static struct {
 	enum OPER look;
 	const char *str;
 } oper_to_asm[] = {
-	{ .look = OPER_ADD, .str = "add" },
-	{ .look = OPER_SUB, .str = "sub" },
-	{ .look = OPER_SHL, .str = "shl" },
-	{ .look = OPER_SHR, .str = "shr" },
-	{ .look = OPER_AND, .str = "and" },
-	{ .look = OPER_OR , .str = "or"  },
-	{ .look = OPER_XOR, .str = "xor" },
-	{ .look = OPER_MUL, .str = "mul" },
+	ISA_OPERS(OPER_TO_ASM)
 	{ .str = NULL },
 };
 
 /**
  * Jump condition to jump assembly instruction
  */
+#define J_TO_ASM(name, value, jump, branch, test) \
+	{ .look = JB_##name, .str = #jump },
 static struct {
 	enum JCOND look;
 	const char *str;
 } j_to_asm[] = {
-	{ .look = JB_UNCOND , .str = "jmp"  },
-	{ .look = JB_NEVER  , .str = "jn"   },
-	{ .look = JB_ZERO   , .str = "jz"   },
-	{ .look = JB_NZERO  , .str = "jnz"  },
-	{ .look = JB_CARRY  , .str = "jc"   },
-	{ .look = JB_NCARRY , .str = "jnc"  },
-	{ .look = JB_CARRYZ , .str = "jcz"  },
-	{ .look = JB_NCARRYZ, .str = "jncz" },
+	ISA_CONDS(J_TO_ASM)
 	{ .str = NULL },
 };
 
 /**
  * Jump condition to branch assembly instruction
  */
+#define B_TO_ASM(name, value, jump, branch, test) \
+	{ .look = JB_##name, .str = #branch },
 static struct {
 	enum JCOND look;
 	const char *str;
 } b_to_asm[] = {
-	{ .look = JB_UNCOND , .str = "bra"  },
-	{ .look = JB_NEVER  , .str = "bn"   },
-	{ .look = JB_ZERO   , .str = "bz"   },
-	{ .look = JB_NZERO  , .str = "bnz"  },
-	{ .look = JB_CARRY  , .str = "bc"   },
-	{ .look = JB_NCARRY , .str = "bnc"  },
-	{ .look = JB_CARRYZ , .str = "bcz"  },
-	{ .look = JB_NCARRYZ, .str = "bncz" },
+	ISA_CONDS(B_TO_ASM)
 	{ .str = NULL },
 };
 
@@ -209,3 +196,21 @@ void indicate_file_area(FILE* fd, size_t line, size_t column, size_t span)
 	}
 	fputc('\n', stderr);
 }
+
+/* Write the low `bytes' bytes of `val' at `p', big-endian. Returns the byte
+ * after them */
+uint8_t *put_be(uint8_t *p, uint64_t val, int bytes)
+{
+	while (bytes--)
+		*p++ = 0xFF & (val >> (8 * bytes));
+	return p;
+}
+
+/* Inverse of put_be() */
+const uint8_t *get_be(const uint8_t *p, uint64_t *val, int bytes)
+{
+	*val = 0;
+	while (bytes--)
+		*val = *val << 8 | *p++;
+	return p;
+}
@@ -1,6 +1,8 @@
 #ifndef TOK_UTIL
 #define TOK_UTIL
 
+#include <stdint.h>
+
 #include "instruction.h"
 #include "lex.h"
 
@@ -25,4 +27,7 @@ GENERATE_PROTO_NUM_LOOKUP_FUNC(get_reg_from_asm, enum REG)
 const char * get_token_description(enum TOKEN_TYPE t);
 void indicate_file_area(FILE* fd, size_t line, size_t column, size_t span);
 
+uint8_t *put_be(uint8_t *p, uint64_t val, int bytes);
+const uint8_t *get_be(const uint8_t *p, uint64_t *val, int bytes);
+
 #endif /* TOK_UTIL */